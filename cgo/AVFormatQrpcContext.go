@@ -1,13 +1,16 @@
 package cgo
 
 import (
+	"bytes"
 	"errors"
 	"fmt"
 	"io"
 	"os"
 	"reflect"
+	rtcgo "runtime/cgo"
 	"sync"
 	"sync/atomic"
+	"time"
 	"unsafe"
 
 	"github.com/zhiqiangxu/qrpc"
@@ -40,34 +43,199 @@ const (
 // AVFormatQrpcContext wrapper for go
 type AVFormatQrpcContext struct {
 	sequence uint64
-	// guards following two maps
-	lock    sync.Mutex
-	s2w     map[uint64]io.Writer
-	w2s     map[io.Writer]uint64
-	fmt     string
-	frameCh <-chan *qrpc.Frame
-	payload []byte
-	offset  int
-	p       C.AVFormatContextPtr
+	// updated atomically, kept at the top for 64-bit alignment
+	ingestStats IngestStats
+	fmt         string
+	frameCh     <-chan *qrpc.Frame
+	payload     []byte
+	offset      int
+	p           C.AVFormatContextPtr
+	// publisher currently read from, nil for the one the context was created with, ingest only
+	binding *binding
+	// the publisher ended its stream, so there's no waiting for it to come back, ingest only
+	ended bool
+	// how long a lost publisher is waited for, see SetReconnectGrace
+	grace time.Duration
+	// guards waiting, rebindCh has room for one
+	block    sync.Mutex
+	waiting  bool
+	rebindCh chan *binding
 	// guards freed
 	flock  sync.Mutex
 	freed  bool
 	doneCh chan struct{}
+	// guards snapshots
+	slock     sync.Mutex
+	snapshots map[snapshotKey]*snapshotEntry
+	epoch     int64
+	// guards subs, the subscriptions not done yet by seq
+	sublock sync.Mutex
+	subs    map[uint64]*Subscription
 }
 
 var (
 	// ErrPublisherDone when done publishing
 	ErrPublisherDone = errors.New("publisher already done")
+	// ErrNoVideoFrame when there is no decoded video frame yet
+	ErrNoVideoFrame = errors.New("no video frame")
+	// ErrNotWaiting when rebinding to a context that is not waiting for its publisher
+	ErrNotWaiting = errors.New("publisher not waited for")
+)
+
+// binding of a reconnected publisher to the context of the lost one
+type binding struct {
+	frameCh <-chan *qrpc.Frame
+	// closed once frameCh is no longer read
+	done chan struct{}
+}
+
+// DecoderThreadType is how a video decoder spreads its work over threads
+type DecoderThreadType int
+
+const (
+	// DecoderThreadFrame decodes several frames at once, which delays output by threads-1 frames
+	DecoderThreadFrame DecoderThreadType = C.FF_THREAD_FRAME
+	// DecoderThreadSlice decodes the slices of a frame at once, which adds no delay but only
+	// helps when the publisher encodes several slices per frame
+	DecoderThreadSlice DecoderThreadType = C.FF_THREAD_SLICE
 )
 
-// NewAVFormatQrpcContext creates an AVFormatQrpcContext
-func NewAVFormatQrpcContext(fmt string, frameCh <-chan *qrpc.Frame) *AVFormatQrpcContext {
-	ctx := &AVFormatQrpcContext{fmt: fmt, frameCh: frameCh, s2w: make(map[uint64]io.Writer), w2s: make(map[io.Writer]uint64), doneCh: make(chan struct{})}
+// InputOptions for NewAVFormatQrpcContext, zero values take defaults
+type InputOptions struct {
+	// DecoderThreads of the video decoder, 0 for a fair share of the budget set by SetDecoderThreads
+	DecoderThreads int `json:"decoder_threads"`
+	// DecoderThreadType can be combined, 0 for both
+	DecoderThreadType DecoderThreadType `json:"decoder_thread_type"`
+	// ProbeSize in bytes the demuxer may read to find the streams, 0 for ffmpeg's default
+	ProbeSize int64 `json:"probesize"`
+	// AnalyzeDurationMs of input probed for codec parameters, 0 for ffmpeg's default
+	AnalyzeDurationMs int `json:"analyze_duration_ms"`
+	// Streams the publisher sends, in order, so probing for codec parameters can be skipped.
+	// Ignored when the demuxer finds different ones.
+	Streams []StreamParams `json:"streams"`
+	// ConnectTime of the publisher, where startup latencies count from, zero for now
+	ConnectTime time.Time `json:"-"`
+}
+
+// StreamParams are the codec parameters of an input stream, with the names ffmpeg uses,
+// zero values are unknown and left to the demuxer
+type StreamParams struct {
+	// Type is video or audio
+	Type  string `json:"type"`
+	Codec string `json:"codec"`
+	// Format is the pixel or sample format, eg yuv420p or fltp
+	Format        string `json:"format"`
+	Width         int    `json:"width"`
+	Height        int    `json:"height"`
+	FrameRateNum  int    `json:"frame_rate_num"`
+	FrameRateDen  int    `json:"frame_rate_den"`
+	SampleRate    int    `json:"sample_rate"`
+	Channels      int    `json:"channels"`
+	ChannelLayout uint64 `json:"channel_layout"`
+	Bitrate       int64  `json:"bitrate"`
+}
+
+func (p *StreamParams) toC(params *C.AVFormatQrpcStreamParams) {
+	copyCString(params._type[:], p.Type)
+	copyCString(params.codec[:], p.Codec)
+	copyCString(params.format[:], p.Format)
+	params.width = C.int(p.Width)
+	params.height = C.int(p.Height)
+	params.frame_rate_num = C.int(p.FrameRateNum)
+	params.frame_rate_den = C.int(p.FrameRateDen)
+	params.sample_rate = C.int(p.SampleRate)
+	params.channels = C.int(p.Channels)
+	params.channel_layout = C.uint64_t(p.ChannelLayout)
+	params.bit_rate = C.int64_t(p.Bitrate)
+}
+
+func (p *StreamParams) fromC(params *C.AVFormatQrpcStreamParams) {
+	p.Type = C.GoString(&params._type[0])
+	p.Codec = C.GoString(&params.codec[0])
+	p.Format = C.GoString(&params.format[0])
+	p.Width = int(params.width)
+	p.Height = int(params.height)
+	p.FrameRateNum = int(params.frame_rate_num)
+	p.FrameRateDen = int(params.frame_rate_den)
+	p.SampleRate = int(params.sample_rate)
+	p.Channels = int(params.channels)
+	p.ChannelLayout = uint64(params.channel_layout)
+	p.Bitrate = int64(params.bit_rate)
+}
+
+// NewAVFormatQrpcContext creates an AVFormatQrpcContext, opts can be nil.
+// It fails when the input can't be opened, eg the publisher went away or sent no streams,
+// there's nothing to Free then.
+func NewAVFormatQrpcContext(fmt string, frameCh <-chan *qrpc.Frame, opts *InputOptions) (*AVFormatQrpcContext, error) {
+	ctx := &AVFormatQrpcContext{fmt: fmt, frameCh: frameCh, doneCh: make(chan struct{}), rebindCh: make(chan *binding, 1),
+		snapshots: make(map[snapshotKey]*snapshotEntry), epoch: time.Now().UnixNano(), subs: make(map[uint64]*Subscription)}
+	var config C.AVFormatQrpcInputConfig
+	if opts != nil {
+		config.decoder_threads = C.int(opts.DecoderThreads)
+		config.decoder_thread_type = C.int(opts.DecoderThreadType)
+		config.probesize = C.int64_t(opts.ProbeSize)
+		config.analyze_duration_ms = C.int64_t(opts.AnalyzeDurationMs)
+		if len(opts.Streams) <= C.QRPC_MAX_STREAM_PARAMS {
+			for i := range opts.Streams {
+				opts.Streams[i].toC(&config.streams[i])
+			}
+			config.nb_streams = C.int(len(opts.Streams))
+		}
+		if !opts.ConnectTime.IsZero() {
+			// av_gettime is the wall clock in microseconds too
+			config.connect_time = C.int64_t(opts.ConnectTime.UnixNano() / 1000)
+		}
+	}
 	fmtCStr := C.CString(fmt)
-	ctx.p = C.AVFormat_Open(fmtCStr, C.uintptr_t(uintptr(unsafe.Pointer(ctx))))
+	var ret C.int
+	ctx.p = C.AVFormat_Open(fmtCStr, C.uintptr_t(uintptr(unsafe.Pointer(ctx))), &config, &ret)
 	C.free(unsafe.Pointer(fmtCStr))
+	if ctx.p == nil {
+		return nil, avError(int(ret))
+	}
+
+	return ctx, nil
+}
+
+// SetDecoderThreads bounds the threads of all video decoders in the process together,
+// decoders being fed share it evenly and pick up a new share at their next keyframe.
+// n <= 0 for the number of cpus, which is the default.
+func SetDecoderThreads(n int) {
+	C.AVFormat_SetDecoderThreads(C.int(n))
+}
 
-	return ctx
+// SetAVIOBufferSize sets the AVIO buffer sizes of contexts and subscriptions created from now on, <= 0 keeps the current one
+func SetAVIOBufferSize(ingest, subscriber int) {
+	C.AVFormat_SetAVIOBufferSize(C.int(ingest), C.int(subscriber))
+}
+
+// SetGOPCacheSize bounds in bytes the GOP each rendition keeps for joining subscribers, 0 disables it
+func SetGOPCacheSize(bytes int) {
+	C.AVFormat_SetGOPCacheSize(C.int(bytes))
+}
+
+// PoolStats counts the objects the ingest and delivery paths took from their pools and the ones
+// they had to allocate, allocations stop growing once streaming is steady
+type PoolStats struct {
+	PacketAllocs, PacketReuses             uint64
+	FrameAllocs, FrameReuses               uint64
+	JobAllocs, JobReuses                   uint64
+	ScaledBufferAllocs, ScaledBufferReuses uint64
+}
+
+// ReadPoolStats of the process
+func ReadPoolStats() PoolStats {
+	var stats C.AVFormatQrpcPoolStats
+	C.AVFormat_PoolStats(&stats)
+	return PoolStats{
+		PacketAllocs:       uint64(stats.packet_allocs),
+		PacketReuses:       uint64(stats.packet_reuses),
+		FrameAllocs:        uint64(stats.frame_allocs),
+		FrameReuses:        uint64(stats.frame_reuses),
+		JobAllocs:          uint64(stats.job_allocs),
+		JobReuses:          uint64(stats.job_reuses),
+		ScaledBufferAllocs: uint64(stats.scaled_buffer_allocs),
+		ScaledBufferReuses: uint64(stats.scaled_buffer_reuses)}
 }
 
 // Free the AVFormatQrpcContext
@@ -78,6 +246,73 @@ func (ctx *AVFormatQrpcContext) Free() {
 	ctx.freed = true
 	C.AVFormat_Free(ctx.p)
 	close(ctx.doneCh)
+	if ctx.binding != nil {
+		close(ctx.binding.done)
+		ctx.binding = nil
+	}
+}
+
+// SetReconnectGrace is how long ReadFrame waits for the publisher to come back when its
+// stream is lost without being ended, subscribers see a stall instead of a disconnect.
+// 0, the default, disables it. Call it before ReadFrame.
+func (ctx *AVFormatQrpcContext) SetReconnectGrace(d time.Duration) {
+	ctx.grace = d
+}
+
+// Rebind a reconnected publisher to the context while it is waiting for the lost one,
+// the returned channel is closed once frameCh is no longer read
+func (ctx *AVFormatQrpcContext) Rebind(frameCh <-chan *qrpc.Frame) (<-chan struct{}, error) {
+	ctx.block.Lock()
+	defer ctx.block.Unlock()
+	if !ctx.waiting {
+		return nil, ErrNotWaiting
+	}
+	ctx.waiting = false
+	b := &binding{frameCh: frameCh, done: make(chan struct{})}
+	ctx.rebindCh <- b
+	return b.done, nil
+}
+
+// waitRebind for up to the grace period after the publisher was lost, true once another one took over
+func (ctx *AVFormatQrpcContext) waitRebind() bool {
+	if ctx.binding != nil {
+		close(ctx.binding.done)
+		ctx.binding = nil
+	}
+	if ctx.grace <= 0 || ctx.ended || ctx.p == nil {
+		return false
+	}
+
+	ctx.block.Lock()
+	ctx.waiting = true
+	ctx.block.Unlock()
+
+	timer := time.NewTimer(ctx.grace)
+	var b *binding
+	select {
+	case b = <-ctx.rebindCh:
+	case <-timer.C:
+		ctx.block.Lock()
+		ctx.waiting = false
+		// Rebind may have got in first
+		select {
+		case b = <-ctx.rebindCh:
+		default:
+		}
+		ctx.block.Unlock()
+	}
+	timer.Stop()
+	if b == nil {
+		return false
+	}
+
+	ctx.binding = b
+	ctx.frameCh = b.frameCh
+	ctx.payload = nil
+	ctx.offset = 0
+	atomic.AddUint64(&ctx.ingestStats.Rebinds, 1)
+	C.AVFormat_Rebind(ctx.p)
+	return true
 }
 
 // Done for wait publisher done
@@ -97,180 +332,309 @@ func (ctx *AVFormatQrpcContext) ReadFrame() error {
 	return fmt.Errorf("%s", errBuf)
 }
 
-// ReadLatestVideoFrame for snapshot
-func (ctx *AVFormatQrpcContext) ReadLatestVideoFrame(ofmt string, w io.Writer) error {
-	seq := atomic.AddUint64(&ctx.sequence, 1)
-	ctx.lock.Lock()
-	ctx.s2w[seq] = w
-	ctx.lock.Unlock()
+// ReadLatestVideoFrame for snapshot, width and height <= 0 keep the original size,
+// returns the generation of the encoded frame
+func (ctx *AVFormatQrpcContext) ReadLatestVideoFrame(ofmt string, width, height int, w io.Writer) (uint64, error) {
+	if _, err := ctx.waitLatestVideoFrame(); err != nil {
+		return 0, err
+	}
 
-	fmtCStr := C.CString(ofmt)
+	return ctx.readLatestVideoFrame(ofmt, width, height, w)
+}
+
+// waitLatestVideoFrame without flock, the wait can take SNAPSHOT_WAIT_TIMEOUT,
+// Free wakes it and waits for it to return instead
+func (ctx *AVFormatQrpcContext) waitLatestVideoFrame() (uint64, error) {
 	ctx.flock.Lock()
 	if ctx.freed {
 		ctx.flock.Unlock()
-		return ErrPublisherDone
+		return 0, ErrPublisherDone
 	}
-	ret := int(C.AVFormat_ReadLatestVideoFrame(ctx.p, fmtCStr, C.uint64_t(seq)))
+	C.AVFormat_AddSnapshotWaiter(ctx.p)
 	ctx.flock.Unlock()
-	C.free(unsafe.Pointer(fmtCStr))
 
-	ctx.lock.Lock()
-	delete(ctx.s2w, seq)
-	ctx.lock.Unlock()
-	if ret == 0 {
-		return nil
+	return uint64(C.AVFormat_WaitLatestVideoFrame(ctx.p)), nil
+}
+
+func (ctx *AVFormatQrpcContext) readLatestVideoFrame(ofmt string, width, height int, w io.Writer) (uint64, error) {
+	handle := rtcgo.NewHandle(w)
+	defer handle.Delete()
+
+	var generation C.uint64_t
+	fmtCStr := C.CString(ofmt)
+	ctx.flock.Lock()
+	ret := int(C.GOAVERROR_EOF)
+	if !ctx.freed {
+		ret = int(C.AVFormat_ReadLatestVideoFrame(ctx.p, fmtCStr, C.uintptr_t(handle), C.int(width), C.int(height), &generation))
 	}
+	ctx.flock.Unlock()
+	C.free(unsafe.Pointer(fmtCStr))
 
-	errBuf := make([]byte, maxErrSize)
-	C.AV_STRERROR(C.int(ret), (*C.char)(unsafe.Pointer(&errBuf[0])), C.int(len(errBuf)))
-	return fmt.Errorf("%s", errBuf)
+	if ret == int(C.GOAVERROR_EOF) {
+		return 0, ErrPublisherDone
+	}
+	if ret == int(C.GOAVERROR_EAGAIN) {
+		return 0, ErrNoVideoFrame
+	}
+	if ret != 0 {
+		return 0, avError(ret)
+	}
 
+	return uint64(generation), nil
 }
 
-// SubcribeAVFrame for video
-func (ctx *AVFormatQrpcContext) SubcribeAVFrame(ofmt string, w io.Writer) error {
+// SubcribeAVFrame for video, opts can be nil for defaults
+func (ctx *AVFormatQrpcContext) SubcribeAVFrame(ofmt string, w io.Writer, opts *SubscribeOptions) (*Subscription, error) {
 	seq := atomic.AddUint64(&ctx.sequence, 1)
-	ctx.lock.Lock()
-	ctx.s2w[seq] = w
-	ctx.w2s[w] = seq
-	ctx.lock.Unlock()
+	// C writes to w through the handle, so no lookup happens per write
+	writer := rtcgo.NewHandle(w)
+
+	var subscribeConfig C.AVFormatQrpcSubscribeConfig
+	if opts != nil {
+		subscribeConfig.max_packets = C.int(opts.MaxQueuePackets)
+		subscribeConfig.policy = C.int(opts.QueuePolicy)
+		subscribeConfig.max_lag_ms = C.int(opts.MaxLag / time.Millisecond)
+		subscribeConfig.flush_interval_ms = C.int(opts.FlushInterval / time.Millisecond)
+		subscribeConfig.rung = C.int(opts.Rung)
+		if opts.Encoder != nil {
+			opts.Encoder.toC(&subscribeConfig.encoder)
+		}
+	}
+	if _, ok := w.(Marker); ok {
+		subscribeConfig.marks = 1
+	}
 
+	var handle unsafe.Pointer
 	fmtCStr := C.CString(ofmt)
 	ctx.flock.Lock()
 	if ctx.freed {
 		ctx.flock.Unlock()
-		return ErrPublisherDone
+		C.free(unsafe.Pointer(fmtCStr))
+		writer.Delete()
+		return nil, ErrPublisherDone
 	}
-	ret := int(C.AVFormat_SubcribeAVFrame(ctx.p, fmtCStr, C.uint64_t(seq)))
+	ret := int(C.AVFormat_SubcribeAVFrame(ctx.p, fmtCStr, C.uint64_t(seq), C.uintptr_t(writer), &subscribeConfig, &handle))
 	ctx.flock.Unlock()
 	C.free(unsafe.Pointer(fmtCStr))
 
 	if ret == 0 {
-		return nil
+		s := &Subscription{ctx: ctx, seq: seq, writer: writer, handle: handle, doneCh: make(chan struct{})}
+		ctx.sublock.Lock()
+		ctx.subs[seq] = s
+		ctx.sublock.Unlock()
+		go s.deliver()
+		return s, nil
 	}
 
-	ctx.lock.Lock()
-	delete(ctx.s2w, seq)
-	delete(ctx.w2s, w)
-	ctx.lock.Unlock()
+	writer.Delete()
 
-	errBuf := make([]byte, maxErrSize)
-	C.AV_STRERROR(C.int(ret), (*C.char)(unsafe.Pointer(&errBuf[0])), C.int(len(errBuf)))
-	return fmt.Errorf("%s", errBuf)
+	return nil, avError(ret)
 }
 
-// UnsubcribeAVFrame for stop watch
-func (ctx *AVFormatQrpcContext) UnsubcribeAVFrame(w io.Writer) {
-	ctx.lock.Lock()
-	seq, ok := ctx.w2s[w]
-	if ok {
-		delete(ctx.s2w, seq)
-		delete(ctx.w2s, w)
-	}
-	ctx.lock.Unlock()
-	if !ok {
+// UnsubcribeAVFrame for stop watch, handle is from AVFormat_SubcribeAVFrame
+func (ctx *AVFormatQrpcContext) UnsubcribeAVFrame(handle unsafe.Pointer) {
+	ctx.flock.Lock()
+	defer ctx.flock.Unlock()
+	if ctx.freed {
 		return
 	}
+	C.AVFormat_UnsubcribeAVFrame(ctx.p, handle)
+}
 
+// switchSubscriber moves a subscription to the rung its deliverer asks for
+func (ctx *AVFormatQrpcContext) switchSubscriber(handle unsafe.Pointer) {
 	ctx.flock.Lock()
+	defer ctx.flock.Unlock()
 	if ctx.freed {
-		ctx.flock.Unlock()
+		return
 	}
-	C.AVFormat_UnsubcribeAVFrame(ctx.p, C.uint64_t(seq))
-	ctx.flock.Unlock()
+	C.AVFormat_SwitchSubscriber(ctx.p, handle)
 }
 
-//export read_packet_seq_callback
-func read_packet_seq_callback(ioctx unsafe.Pointer, seq C.uint64_t, buf *C.char, bufSize C.int) C.int {
-	slice := &reflect.SliceHeader{Data: uintptr(unsafe.Pointer(buf)), Len: int(bufSize), Cap: int(bufSize)}
+// Rung of an adaptive bitrate ladder
+type Rung struct {
+	// a zero Width or Height keeps the aspect ratio of the publisher
+	Width  int `json:"width"`
+	Height int `json:"height"`
+	// Bitrate in bits per second, 0 leaves it to the encoder
+	Bitrate int64 `json:"bitrate"`
+}
 
-	goseq := uint64(seq)
-	ctx := (*AVFormatQrpcContext)(ioctx)
-	ctx.lock.Lock()
-	w := ctx.s2w[goseq]
-	ctx.lock.Unlock()
-	if w == nil {
-		fmt.Fprintf(os.Stderr, "no writer for seq:%d", goseq)
-		return C.int(-1)
+// SetLadder of renditions subscribers can pick from, ordered from the highest to the lowest,
+// each rung is scaled and encoded once for all of its subscribers
+func (ctx *AVFormatQrpcContext) SetLadder(rungs []Rung) error {
+	if len(rungs) > C.QRPC_MAX_RUNGS {
+		return fmt.Errorf("at most %d rungs", C.QRPC_MAX_RUNGS)
 	}
-	_, err := w.Write(*(*[]byte)(unsafe.Pointer(slice)))
-	if err != nil {
-		return -1
+	var crungs [C.QRPC_MAX_RUNGS]C.AVFormatQrpcRung
+	for i, rung := range rungs {
+		crungs[i] = C.AVFormatQrpcRung{width: C.int(rung.Width), height: C.int(rung.Height), bit_rate: C.int64_t(rung.Bitrate)}
 	}
-	return C.int(0)
+
+	ctx.flock.Lock()
+	defer ctx.flock.Unlock()
+	if ctx.freed || ctx.p == nil {
+		return ErrPublisherDone
+	}
+	ret := int(C.AVFormat_SetLadder(ctx.p, &crungs[0], C.int(len(rungs))))
+	if ret < 0 {
+		return avError(ret)
+	}
+	return nil
 }
 
-//export write_packet_seq_callback
-func write_packet_seq_callback(ioctx unsafe.Pointer, seq C.uint64_t, buf *C.char, bufSize C.int) (ret C.int) {
+func avError(ret int) error {
+	errBuf := make([]byte, maxErrSize)
+	C.AV_STRERROR(C.int(ret), (*C.char)(unsafe.Pointer(&errBuf[0])), C.int(len(errBuf)))
+	return fmt.Errorf("%s", bytes.TrimRight(errBuf, "\x00"))
+}
 
-	goseq := uint64(seq)
-	ctx := (*AVFormatQrpcContext)(ioctx)
-	ctx.lock.Lock()
-	w, ok := ctx.s2w[goseq]
-	if !ok {
-		ctx.lock.Unlock()
-		fmt.Println("no w for seq", goseq)
-		return C.int(-1)
-	}
-	ctx.lock.Unlock()
+//export write_handle_callback
+func write_handle_callback(handle C.uintptr_t, buf *C.char, bufSize C.int) C.int {
+	w := rtcgo.Handle(handle).Value().(io.Writer)
 
 	slice := &reflect.SliceHeader{Data: uintptr(unsafe.Pointer(buf)), Len: int(bufSize), Cap: int(bufSize)}
 	_, err := w.Write(*(*[]byte)(unsafe.Pointer(slice)))
 	if err != nil {
-		fmt.Println("Write err", err)
 		return C.int(-1)
 	}
 
 	return C.int(0)
 }
 
+//export mark_handle_callback
+func mark_handle_callback(handle C.uintptr_t, pts C.int64_t, keyframe C.int) {
+	m := rtcgo.Handle(handle).Value().(Marker)
+	m.Mark(time.Duration(pts)*time.Microsecond, keyframe != 0)
+}
+
 //export read_packet_callback
 func read_packet_callback(ioctx unsafe.Pointer, buf *C.char, bufSize C.int) C.int {
 
 	slice := &reflect.SliceHeader{Data: uintptr(unsafe.Pointer(buf)), Len: int(bufSize), Cap: int(bufSize)}
 
-	// fmt.Println("bufSize", int(bufSize))
 	ctx := (*AVFormatQrpcContext)(ioctx)
 
 	return C.int(ctx.fillSlice(*(*[]byte)(unsafe.Pointer(slice))))
 }
 
+// fillSlice copies queued payloads straight into the demuxer's buffer,
+// it only blocks for the first one so a callback drains whatever is already there
 func (ctx *AVFormatQrpcContext) fillSlice(buf []byte) int {
-	// fmt.Println("fillSlice buf size =", len(buf))
-
-	size := len(buf)
-
-	if ctx.payload != nil {
-		if size < len(ctx.payload)-ctx.offset {
-			copy(buf, ctx.payload[ctx.offset:ctx.offset+size])
-			ctx.offset += size
-			return size
+	atomic.AddUint64(&ctx.ingestStats.Callbacks, 1)
+
+	n := 0
+	for n < len(buf) {
+		if ctx.payload == nil {
+			var frame *qrpc.Frame
+			if n == 0 {
+				frame = <-ctx.frameCh
+			} else {
+				select {
+				case frame = <-ctx.frameCh:
+				default:
+				}
+			}
+			if frame == nil {
+				if n == 0 {
+					if ctx.waitRebind() {
+						continue
+					}
+					return int(C.GOAVERROR_EOF)
+				}
+				break
+			}
+			if len(frame.Payload) == 0 && frame.Flags&qrpc.StreamEndFlag != 0 {
+				// the publisher ended the stream on purpose, frameCh closes next
+				ctx.ended = true
+				continue
+			}
+			if len(frame.Payload) == 0 {
+				fmt.Fprintln(os.Stderr, "found empty frame")
+				if n == 0 {
+					return int(C.GOAVERROR_EINVAL)
+				}
+				break
+			}
+			atomic.AddUint64(&ctx.ingestStats.Frames, 1)
+			ctx.payload = frame.Payload
+			ctx.offset = 0
 		}
 
-		copy(buf, ctx.payload[ctx.offset:])
-		copied := len(ctx.payload) - ctx.offset
-		ctx.payload = nil
-		ctx.offset = 0
-		return copied
+		copied := copy(buf[n:], ctx.payload[ctx.offset:])
+		n += copied
+		ctx.offset += copied
+		if ctx.offset == len(ctx.payload) {
+			ctx.payload = nil
+			ctx.offset = 0
+		}
 	}
 
-	frame := <-ctx.frameCh
-	if frame == nil {
-		return int(C.GOAVERROR_EOF)
-	}
-	if size < len(frame.Payload) {
-		copy(buf, frame.Payload[0:size])
-		ctx.payload = frame.Payload
-		ctx.offset = size
-		return size
-	}
+	atomic.AddUint64(&ctx.ingestStats.Bytes, uint64(n))
+	return n
+}
 
-	if len(frame.Payload) == 0 {
-		fmt.Fprintln(os.Stderr, "found empty frame")
-		return int(C.GOAVERROR_EINVAL)
-	}
+// IngestStats of the publisher side
+type IngestStats struct {
+	// read callbacks from the demuxer, each is a go<->c transition
+	Callbacks uint64
+	// qrpc frames consumed
+	Frames uint64
+	// bytes copied into the demuxer
+	Bytes uint64
+	// Rebinds of reconnected publishers within the grace period
+	Rebinds uint64
+	// DecodedFrames of video
+	DecodedFrames uint64
+	// DecodeLag of video decoding behind the wall clock, 0 while nothing needs decoding
+	DecodeLag time.Duration
+	// DecoderThreads of the video decoders being fed
+	DecoderThreads int
+	// OpenLatency from connect until the streams were known and subscribers could come
+	OpenLatency time.Duration
+	// FirstFrameLatency from connect until the first video frame was decoded, 0 until then.
+	// Video is only decoded once something needs it.
+	FirstFrameLatency time.Duration
+	// StreamInfoSkipped when InputOptions.Streams were used instead of probing
+	StreamInfoSkipped bool
+}
 
-	copy(buf, frame.Payload)
-	return len(frame.Payload)
+// IngestStats returns counters of the ingest path since the context was created
+func (ctx *AVFormatQrpcContext) IngestStats() IngestStats {
+	stats := IngestStats{
+		Callbacks: atomic.LoadUint64(&ctx.ingestStats.Callbacks),
+		Frames:    atomic.LoadUint64(&ctx.ingestStats.Frames),
+		Bytes:     atomic.LoadUint64(&ctx.ingestStats.Bytes),
+		Rebinds:   atomic.LoadUint64(&ctx.ingestStats.Rebinds)}
 
+	ctx.flock.Lock()
+	defer ctx.flock.Unlock()
+	if ctx.freed || ctx.p == nil {
+		return stats
+	}
+	var cstats C.AVFormatQrpcIngestStats
+	C.AVFormat_IngestStats(ctx.p, &cstats)
+	stats.DecodedFrames = uint64(cstats.decoded_frames)
+	stats.DecodeLag = time.Duration(cstats.decode_lag_ms) * time.Millisecond
+	stats.DecoderThreads = int(cstats.decoder_threads)
+	stats.OpenLatency = time.Duration(cstats.open_ms) * time.Millisecond
+	stats.FirstFrameLatency = time.Duration(cstats.first_frame_ms) * time.Millisecond
+	stats.StreamInfoSkipped = cstats.stream_info_skipped != 0
+	return stats
+}
+
+// StreamParams of the publisher, for InputOptions.Streams when it publishes again
+func (ctx *AVFormatQrpcContext) StreamParams() []StreamParams {
+	ctx.flock.Lock()
+	defer ctx.flock.Unlock()
+	if ctx.freed || ctx.p == nil {
+		return nil
+	}
+	var cparams [C.QRPC_MAX_STREAM_PARAMS]C.AVFormatQrpcStreamParams
+	n := int(C.AVFormat_StreamParams(ctx.p, &cparams[0], C.QRPC_MAX_STREAM_PARAMS))
+	params := make([]StreamParams, n)
+	for i := range params {
+		params[i].fromC(&cparams[i])
+	}
+	return params
 }
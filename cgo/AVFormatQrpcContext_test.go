@@ -0,0 +1,226 @@
+package cgo
+
+import (
+	"fmt"
+	"math/rand"
+	"sync/atomic"
+	"testing"
+	"time"
+
+	"github.com/zhiqiangxu/qrpc"
+)
+
+// payload sizes publishers typically send: a flushed audio packet, a P frame,
+// a keyframe slice and a full default avio buffer, all in mpegts packets
+var fillSlicePayloads = []int{2 * 188, 8 * 188, 64 * 188, 32 << 10}
+
+// payloads already queued when the demuxer asks for more, as after a network burst
+const fillSliceBacklog = 32
+
+// BenchmarkFillSlice compares the old 4KB ingest buffer with the 64KB one,
+// an op drains one backlog into the demuxer
+//
+//	go test -run XXX -bench FillSlice ./cgo/
+func BenchmarkFillSlice(b *testing.B) {
+	for _, bufSize := range []int{4 << 10, 64 << 10} {
+		for _, payloadSize := range fillSlicePayloads {
+			b.Run(fmt.Sprintf("buf=%d/payload=%d", bufSize, payloadSize), func(b *testing.B) {
+				benchmarkFillSlice(b, bufSize, payloadSize)
+			})
+		}
+	}
+}
+
+func benchmarkFillSlice(b *testing.B, bufSize, payloadSize int) {
+	frameCh := make(chan *qrpc.Frame, fillSliceBacklog)
+	ctx := &AVFormatQrpcContext{frameCh: frameCh}
+	frame := &qrpc.Frame{Payload: make([]byte, payloadSize)}
+	buf := make([]byte, bufSize)
+	total := fillSliceBacklog * payloadSize
+
+	b.SetBytes(int64(total))
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		for j := 0; j < fillSliceBacklog; j++ {
+			frameCh <- frame
+		}
+		for n := 0; n < total; {
+			read := ctx.fillSlice(buf)
+			if read <= 0 {
+				b.Fatalf("fillSlice: %d", read)
+			}
+			n += read
+		}
+	}
+	b.StopTimer()
+
+	b.ReportMetric(float64(atomic.LoadUint64(&ctx.ingestStats.Callbacks))/float64(b.N), "callbacks/op")
+	b.ReportMetric(float64(atomic.LoadUint64(&ctx.ingestStats.Bytes))/float64(b.N), "copied-B/op")
+}
+
+// the first publisher of clip is lost halfway, a reconnect before the context noticed has to
+// retry the way PlayCmd.rebind does, the second half then comes from the reconnected one
+func TestRebindRetriesUntilWaiting(t *testing.T) {
+	const seconds = 4
+	clip := testClip(t, seconds)
+	half := len(clip) / 2 / 188 * 188
+	lost := make(chan *qrpc.Frame, 16)
+	go func() {
+		defer close(lost)
+		sendClip(clip[:half], seconds/2, lost)
+	}()
+
+	ctx, err := NewAVFormatQrpcContext("mpegts", lost, nil)
+	if err != nil {
+		t.Fatalf("can't open the clip: %v", err)
+	}
+	defer ctx.Free()
+	ctx.SetReconnectGrace(2 * time.Second)
+	read := make(chan error, 1)
+	go func() {
+		for {
+			if err := ctx.ReadFrame(); err != nil {
+				read <- err
+				return
+			}
+		}
+	}()
+
+	back := make(chan *qrpc.Frame, 16)
+	done, err := ctx.Rebind(back)
+	if err != ErrNotWaiting {
+		t.Fatalf("rebind while the lost publisher is still read: %v", err)
+	}
+	deadline := time.Now().Add(seconds * time.Second)
+	for err == ErrNotWaiting && time.Now().Before(deadline) {
+		time.Sleep(20 * time.Millisecond)
+		done, err = ctx.Rebind(back)
+	}
+	if err != nil {
+		t.Fatalf("rebind once the publisher was lost: %v", err)
+	}
+	go publishClip(clip[half:], seconds/2, back)
+
+	select {
+	case <-done:
+		t.Fatal("binding released while the reconnected publisher is read")
+	case <-read:
+		t.Fatal("ingest ended with a reconnected publisher")
+	case <-time.After(time.Second):
+	}
+	select {
+	case <-read:
+	case <-time.After(seconds * time.Second):
+		t.Fatal("ingest didn't end with the reconnected publisher")
+	}
+	select {
+	case <-done:
+	default:
+		t.Fatal("binding not released once its publisher ended")
+	}
+	if n := ctx.IngestStats().Rebinds; n != 1 {
+		t.Fatalf("%d rebinds", n)
+	}
+}
+
+// lostContext opens a context on a clip whose publisher is lost right away,
+// the test then stands in for the ingest goroutine and calls waitRebind itself
+func lostContext(t *testing.T) *AVFormatQrpcContext {
+	clip := testClip(t, 1)
+	frameCh := make(chan *qrpc.Frame, len(clip)/(7*188)+1)
+	sendClip(clip, 0, frameCh)
+	close(frameCh)
+
+	ctx, err := NewAVFormatQrpcContext("mpegts", frameCh, nil)
+	if err != nil {
+		t.Fatalf("can't open the clip: %v", err)
+	}
+	return ctx
+}
+
+// rebindUntil calls Rebind until it gets through or stop is closed, then sends
+// the binding's done channel, nil if it didn't get through
+func rebindUntil(ctx *AVFormatQrpcContext, delay time.Duration, stop <-chan struct{}) <-chan (<-chan struct{}) {
+	result := make(chan (<-chan struct{}), 1)
+	go func() {
+		time.Sleep(delay)
+		for {
+			done, err := ctx.Rebind(make(chan *qrpc.Frame))
+			if err == nil {
+				result <- done
+				return
+			}
+			select {
+			case <-stop:
+				result <- nil
+				return
+			default:
+			}
+		}
+	}()
+	return result
+}
+
+// Rebind racing the grace timer either gets its publisher read or is told the context
+// wasn't waiting, a binding is never accepted and then dropped
+func TestRebindRacesGraceTimer(t *testing.T) {
+	ctx := lostContext(t)
+	defer ctx.Free()
+
+	r := rand.New(rand.NewSource(1))
+	var rebound, expired uint64
+	var last <-chan struct{}
+	for i := 0; i < 500; i++ {
+		ctx.SetReconnectGrace(time.Duration(50+r.Intn(1000)) * time.Microsecond)
+		stop := make(chan struct{})
+		result := rebindUntil(ctx, time.Duration(r.Intn(1500))*time.Microsecond, stop)
+		ok := ctx.waitRebind()
+		close(stop)
+		done := <-result
+
+		if last != nil {
+			select {
+			case <-last:
+			default:
+				t.Fatalf("iteration %d: the binding before wasn't released", i)
+			}
+		}
+		switch {
+		case ok && done != nil:
+			rebound++
+		case !ok && done == nil:
+			expired++
+		default:
+			t.Fatalf("iteration %d: waitRebind %v, Rebind got through %v", i, ok, done != nil)
+		}
+		last = done
+	}
+	if rebound == 0 || expired == 0 {
+		t.Fatalf("%d rebound, %d expired, the race wasn't hit from both sides", rebound, expired)
+	}
+	if n := ctx.IngestStats().Rebinds; n != rebound {
+		t.Fatalf("%d rebinds counted, %d rebound", n, rebound)
+	}
+}
+
+func TestFreeReleasesBinding(t *testing.T) {
+	ctx := lostContext(t)
+	ctx.SetReconnectGrace(time.Second)
+	result := rebindUntil(ctx, 0, nil)
+	if !ctx.waitRebind() {
+		t.Fatal("rebind didn't get through")
+	}
+	done := <-result
+
+	select {
+	case <-done:
+		t.Fatal("binding released while it is read")
+	default:
+	}
+	ctx.Free()
+	select {
+	case <-done:
+	default:
+		t.Fatal("Free didn't release the binding")
+	}
+}
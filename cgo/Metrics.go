@@ -0,0 +1,152 @@
+package cgo
+
+import (
+	"fmt"
+	"hash/fnv"
+	"sort"
+	"time"
+)
+
+// #include "utils.h"
+import "C"
+
+// HistogramBuckets of a Histogram
+const HistogramBuckets = C.QRPC_HISTOGRAM_BUCKETS
+
+// Histogram of latencies, Buckets[i] counts the ones up to HistogramBound(i) and the last bucket
+// the ones above, buckets are not cumulative
+type Histogram struct {
+	Count   uint64
+	Sum     time.Duration
+	Buckets [HistogramBuckets]uint64
+}
+
+// HistogramBound is the upper bound of bucket i, the last bucket has none
+func HistogramBound(i int) time.Duration {
+	return time.Duration(1<<uint(i)) * time.Microsecond
+}
+
+func (h *Histogram) fromC(c *C.AVFormatQrpcHistogram) {
+	h.Count = uint64(c.count)
+	h.Sum = time.Duration(c.sum_us) * time.Microsecond
+	for i := range h.Buckets {
+		h.Buckets[i] = uint64(c.buckets[i])
+	}
+}
+
+// stages of the media pipeline, see the QRPC_STAGE_* values in utils.h for what each times
+var stageNames = [C.QRPC_NB_STAGES]string{
+	C.QRPC_STAGE_DEMUX:       "demux",
+	C.QRPC_STAGE_DECODE:      "decode",
+	C.QRPC_STAGE_ENCODE:      "encode",
+	C.QRPC_STAGE_MUX:         "mux",
+	C.QRPC_STAGE_WRITE:       "write",
+	C.QRPC_STAGE_INGEST_LOCK: "ingest_lock",
+	C.QRPC_STAGE_FANOUT_LOCK: "fanout_lock",
+}
+
+// StageMetrics of a stage of the media pipeline, process wide
+type StageMetrics struct {
+	Stage   string
+	Latency Histogram
+	Errors  uint64
+}
+
+// ReadStageMetrics sums the counters every thread keeps of each stage,
+// the threads don't synchronize to update them so this is the only place they meet
+func ReadStageMetrics() []StageMetrics {
+	var stages [C.QRPC_NB_STAGES]C.AVFormatQrpcHistogram
+	var errors [C.QRPC_NB_STAGES]C.uint64_t
+	C.AVFormat_StageMetrics(&stages[0], &errors[0])
+
+	metrics := make([]StageMetrics, len(stages))
+	for i := range metrics {
+		metrics[i].Stage = stageNames[i]
+		metrics[i].Latency.fromC(&stages[i])
+		metrics[i].Errors = uint64(errors[i])
+	}
+	return metrics
+}
+
+// renditions of a context reported at most
+const maxRenditionMetrics = 32
+
+// RenditionMetrics of a rendition of a publisher
+type RenditionMetrics struct {
+	// Name tells the format, size, bitrate and codec and ends with a hash of the whole encoder config,
+	// eg mpegts/640x360/800k/libx264/1a2b3c4d, or mpegts/passthrough for a remux.
+	// It is unique among the renditions of a context.
+	Name    string
+	Members int
+	// Encode latency of its video, empty for a remux
+	Encode Histogram
+}
+
+// RenditionMetrics of the renditions subscribers are getting, sorted by name
+func (ctx *AVFormatQrpcContext) RenditionMetrics() []RenditionMetrics {
+	ctx.flock.Lock()
+	defer ctx.flock.Unlock()
+	if ctx.freed || ctx.p == nil {
+		return nil
+	}
+
+	var cmetrics [maxRenditionMetrics]C.AVFormatQrpcRenditionMetrics
+	n := int(C.AVFormat_RenditionMetrics(ctx.p, &cmetrics[0], maxRenditionMetrics))
+	if n > maxRenditionMetrics {
+		n = maxRenditionMetrics
+	}
+	metrics := make([]RenditionMetrics, n)
+	for i := range metrics {
+		c := &cmetrics[i]
+		metrics[i].Name = renditionName(c)
+		metrics[i].Members = int(c.members)
+		metrics[i].Encode.fromC(&c.encode)
+	}
+	sort.Slice(metrics, func(i, j int) bool { return metrics[i].Name < metrics[j].Name })
+	// in case of a hash collision
+	for i := 1; i < len(metrics); i++ {
+		if metrics[i].Name == metrics[i-1].Name {
+			metrics[i].Name += fmt.Sprintf("#%d", i)
+		}
+	}
+	return metrics
+}
+
+func renditionName(c *C.AVFormatQrpcRenditionMetrics) string {
+	name := C.GoString(&c.fmt[0])
+	if c.passthrough != 0 {
+		return name + "/passthrough"
+	}
+	if c.width > 0 || c.height > 0 {
+		name += fmt.Sprintf("/%dx%d", int(c.width), int(c.height))
+	}
+	e := &c.encoder
+	bitrate := int64(c.bit_rate)
+	if bitrate <= 0 {
+		bitrate = int64(e.bit_rate)
+	}
+	if bitrate > 0 {
+		name += fmt.Sprintf("/%dk", bitrate/1000)
+	}
+	codec := C.GoString(&e.codec[0])
+	if codec != "" {
+		name += "/" + codec
+	}
+	// renditions are keyed on the whole config, ones differing in preset, gop or VBV only get their own series too
+	h := fnv.New32a()
+	fmt.Fprintf(h, "%s|%s|%s|%d|%d|%d|%d|%d|%d", codec, C.GoString(&e.preset[0]), C.GoString(&e.tune[0]), int64(e.bit_rate),
+		int64(e.max_rate), int(e.buffer_size), int(e.gop_size), int(e.threads), int(e.slice_threads))
+	return name + fmt.Sprintf("/%08x", h.Sum32())
+}
+
+// Subscriptions not done yet, sorted by Seq
+func (ctx *AVFormatQrpcContext) Subscriptions() []*Subscription {
+	ctx.sublock.Lock()
+	subs := make([]*Subscription, 0, len(ctx.subs))
+	for _, s := range ctx.subs {
+		subs = append(subs, s)
+	}
+	ctx.sublock.Unlock()
+	sort.Slice(subs, func(i, j int) bool { return subs[i].seq < subs[j].seq })
+	return subs
+}
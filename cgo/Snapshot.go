@@ -0,0 +1,93 @@
+package cgo
+
+import (
+	"bytes"
+	"fmt"
+)
+
+const (
+	maxSnapshotKeys = 16
+)
+
+// Snapshot is an encoded video frame, shared by all readers so Data must not be modified
+type Snapshot struct {
+	Data       []byte
+	Generation uint64
+	// ETag changes whenever the publisher produces a new frame
+	ETag string
+}
+
+type snapshotKey struct {
+	fmt    string
+	width  int
+	height int
+}
+
+type snapshotEntry struct {
+	snapshot *Snapshot
+	// in flight encoding, nil if none
+	call *snapshotCall
+}
+
+type snapshotCall struct {
+	done     chan struct{}
+	snapshot *Snapshot
+	err      error
+}
+
+// ReadSnapshot returns the latest video frame encoded with ofmt, scaled to width x height if any is positive.
+// Each new frame is encoded at most once per (ofmt, width, height), concurrent readers share the encoding.
+func (ctx *AVFormatQrpcContext) ReadSnapshot(ofmt string, width, height int) (*Snapshot, error) {
+	generation, err := ctx.waitLatestVideoFrame()
+	if err != nil {
+		return nil, err
+	}
+
+	key := snapshotKey{fmt: ofmt, width: width, height: height}
+	ctx.slock.Lock()
+	e := ctx.snapshots[key]
+	if e == nil {
+		// sizes come from requests, don't let them grow the cache without bound
+		if len(ctx.snapshots) >= maxSnapshotKeys {
+			for k, v := range ctx.snapshots {
+				if v.call == nil {
+					delete(ctx.snapshots, k)
+					break
+				}
+			}
+		}
+		e = &snapshotEntry{}
+		ctx.snapshots[key] = e
+	}
+	if e.snapshot != nil && e.snapshot.Generation >= generation {
+		ctx.slock.Unlock()
+		return e.snapshot, nil
+	}
+	if c := e.call; c != nil {
+		ctx.slock.Unlock()
+		<-c.done
+		return c.snapshot, c.err
+	}
+	c := &snapshotCall{done: make(chan struct{})}
+	e.call = c
+	ctx.slock.Unlock()
+
+	buf := &bytes.Buffer{}
+	generation, c.err = ctx.readLatestVideoFrame(ofmt, width, height, buf)
+	if c.err == nil {
+		c.snapshot = &Snapshot{
+			Data:       buf.Bytes(),
+			Generation: generation,
+			ETag:       fmt.Sprintf(`"%x-%d-%dx%d"`, ctx.epoch, generation, width, height)}
+	}
+
+	ctx.slock.Lock()
+	e.call = nil
+	if c.snapshot != nil && (e.snapshot == nil || c.snapshot.Generation > e.snapshot.Generation) {
+		e.snapshot = c.snapshot
+	}
+	ctx.slock.Unlock()
+	close(c.done)
+
+	return c.snapshot, c.err
+}
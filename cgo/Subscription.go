@@ -0,0 +1,240 @@
+package cgo
+
+import (
+	rtcgo "runtime/cgo"
+	"sync"
+	"time"
+	"unsafe"
+)
+
+// #include "utils.h"
+import "C"
+
+// QueuePolicy decides what happens when a subscriber can't keep up
+type QueuePolicy int
+
+const (
+	// QueueDropGOP drops packets until the next keyframe
+	QueueDropGOP QueuePolicy = C.QRPC_QUEUE_DROP_GOP
+	// QueueSkipToLive discards the backlog and resumes from the next keyframe
+	QueueSkipToLive QueuePolicy = C.QRPC_QUEUE_SKIP_TO_LIVE
+	// QueueDisconnect closes the subscription when the queue is full or lags more than MaxLag
+	QueueDisconnect QueuePolicy = C.QRPC_QUEUE_DISCONNECT
+)
+
+const (
+	deliverTimeoutMS = 100
+)
+
+const (
+	// RungSource is the publisher's own resolution
+	RungSource = 0
+	// RungAuto starts low on the ladder and moves between rungs depending on how fast the subscriber is
+	RungAuto = C.QRPC_RUNG_AUTO
+)
+
+// SubscribeOptions for SubcribeAVFrame
+type SubscribeOptions struct {
+	// MaxQueuePackets bounds the send queue, 0 for default
+	MaxQueuePackets int
+	QueuePolicy     QueuePolicy
+	// MaxLag only for QueueDisconnect, 0 to disable
+	MaxLag time.Duration
+	// FlushInterval holds muxed output up to this long so it is written in fewer, larger chunks,
+	// 0 writes at the end of every batch of queued packets
+	FlushInterval time.Duration
+	// Rung of the publisher's ladder, numbered from 1, or RungSource or RungAuto
+	Rung int
+	// Encoder of the rendition, nil for the publisher's codec at encoder defaults
+	Encoder *EncoderConfig
+}
+
+// EncoderConfig of the rendition a subscription gets, zero values leave the encoder defaults.
+// Subscriptions with equal config share the rendition.
+type EncoderConfig struct {
+	// Codec is the video encoder, eg libx264, empty for the publisher's codec
+	Codec  string `json:"codec"`
+	Preset string `json:"preset"`
+	Tune   string `json:"tune"`
+	// Bitrate in bits per second, rungs of the ladder use their own if they have one
+	Bitrate int64 `json:"bitrate"`
+	// MaxRate and BufferSize (in bits) configure the VBV
+	MaxRate    int64 `json:"max_rate"`
+	BufferSize int   `json:"buffer_size"`
+	// GOPSize in frames between keyframes
+	GOPSize int `json:"gop_size"`
+	// Threads of the encoder, 0 for a default share of the budget set by SetEncoderThreads
+	Threads int `json:"threads"`
+	// SliceThreads threads over slices instead of frames, which adds no delay
+	SliceThreads bool `json:"slice_threads"`
+}
+
+// LowLatencyH264 encodes with x264 tuned for live, bitrate 0 leaves rate control to x264
+func LowLatencyH264(bitrate int64) *EncoderConfig {
+	return &EncoderConfig{
+		Codec:        "libx264",
+		Preset:       "veryfast",
+		Tune:         "zerolatency",
+		Bitrate:      bitrate,
+		MaxRate:      bitrate,
+		BufferSize:   int(bitrate),
+		GOPSize:      50,
+		SliceThreads: true,
+	}
+}
+
+// SetEncoderThreads bounds the threads of all video encoders in the process together,
+// encoders opened from then on get their share of it and at least one thread each.
+// n <= 0 for the number of cpus, which is the default.
+func SetEncoderThreads(n int) {
+	C.AVFormat_SetEncoderThreads(C.int(n))
+}
+
+// SetMaxEncodedRenditions bounds the renditions each publisher encodes at once, ladder rungs included,
+// subscribing to another one fails. n <= 0 for no limit, the default is QRPC_MAX_RUNGS + 4.
+func SetMaxEncodedRenditions(n int) {
+	C.AVFormat_SetMaxEncodedRenditions(C.int(n))
+}
+
+func (e *EncoderConfig) toC(config *C.AVFormatQrpcEncoderConfig) {
+	copyCString(config.codec[:], e.Codec)
+	copyCString(config.preset[:], e.Preset)
+	copyCString(config.tune[:], e.Tune)
+	config.bit_rate = C.int64_t(e.Bitrate)
+	config.max_rate = C.int64_t(e.MaxRate)
+	config.buffer_size = C.int(e.BufferSize)
+	config.gop_size = C.int(e.GOPSize)
+	config.threads = C.int(e.Threads)
+	if e.SliceThreads {
+		config.slice_threads = 1
+	}
+}
+
+// copyCString into a fixed size C array, truncated if it doesn't fit
+func copyCString(dst []C.char, s string) {
+	n := len(s)
+	if n > len(dst)-1 {
+		n = len(dst) - 1
+	}
+	for i := 0; i < n; i++ {
+		dst[i] = C.char(s[i])
+	}
+	dst[n] = 0
+}
+
+// Marker is implemented by writers that need to know where the muxed stream can be cut,
+// eg, to package it into segments. Mark is called with keyframe set right before a video
+// keyframe is written, and without right after buffered output has been written.
+type Marker interface {
+	Mark(pts time.Duration, keyframe bool)
+}
+
+// SubscriberStats of a Subscription
+type SubscriberStats struct {
+	QueueDepth       int
+	Lag              time.Duration
+	DeliveredPackets uint64
+	DroppedPackets   uint64
+	Skips            uint64
+	Flushes          uint64
+	Rung             int
+	Switches         uint64
+}
+
+// Subscription is a subscriber of AVFormatQrpcContext,
+// packets are muxed and written to w by its own goroutine
+type Subscription struct {
+	ctx    *AVFormatQrpcContext
+	seq    uint64
+	writer rtcgo.Handle
+	doneCh chan struct{}
+	err    error
+	// guards handle and stats
+	lock   sync.Mutex
+	handle unsafe.Pointer
+	stats  SubscriberStats
+}
+
+// Done is closed when the subscription ends,
+// either by Close, the publisher or the queue policy
+func (s *Subscription) Done() <-chan struct{} {
+	return s.doneCh
+}
+
+// Err tells why the subscription ended, valid after Done
+func (s *Subscription) Err() error {
+	return s.err
+}
+
+// Seq numbers the subscriptions of a context in the order they were made
+func (s *Subscription) Seq() uint64 {
+	return s.seq
+}
+
+// Close stops the subscription
+func (s *Subscription) Close() {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+
+	if s.handle != nil {
+		s.ctx.UnsubcribeAVFrame(s.handle)
+	}
+}
+
+// Stats of the send queue
+func (s *Subscription) Stats() SubscriberStats {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+
+	if s.handle != nil {
+		s.readStats()
+	}
+	return s.stats
+}
+
+// caller must hold s.lock
+func (s *Subscription) readStats() {
+	var stats C.AVFormatQrpcSubscriberStats
+	C.AVFormat_SubscriberStats(s.handle, &stats)
+	s.stats = SubscriberStats{
+		QueueDepth:       int(stats.queue_depth),
+		Lag:              time.Duration(stats.lag_ms) * time.Millisecond,
+		DeliveredPackets: uint64(stats.delivered_packets),
+		DroppedPackets:   uint64(stats.dropped_packets),
+		Skips:            uint64(stats.skips),
+		Flushes:          uint64(stats.flushes),
+		Rung:             int(stats.rung),
+		Switches:         uint64(stats.switches),
+	}
+}
+
+func (s *Subscription) deliver() {
+	var ret int
+	for {
+		ret = int(C.AVFormat_DeliverSubscriber(s.handle, deliverTimeoutMS))
+		if ret == C.QRPC_DELIVER_SWITCH {
+			s.ctx.switchSubscriber(s.handle)
+			continue
+		}
+		if ret < 0 && ret != int(C.GOAVERROR_EAGAIN) {
+			break
+		}
+	}
+	if ret != int(C.GOAVERROR_EOF) {
+		s.err = avError(ret)
+	}
+
+	s.lock.Lock()
+	s.ctx.UnsubcribeAVFrame(s.handle)
+	s.readStats()
+	C.AVFormat_SubscriberUnref(s.handle)
+	s.handle = nil
+	s.lock.Unlock()
+	// nothing writes to the subscriber once it is released
+	s.writer.Delete()
+
+	s.ctx.sublock.Lock()
+	delete(s.ctx.subs, s.seq)
+	s.ctx.sublock.Unlock()
+	close(s.doneCh)
+}
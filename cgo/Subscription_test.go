@@ -0,0 +1,420 @@
+package cgo
+
+import (
+	"errors"
+	"fmt"
+	"io/ioutil"
+	"math/rand"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+
+	"github.com/zhiqiangxu/qrpc"
+)
+
+// The churn test hammers the member slots of renditions: add_member/release_member, the retired
+// and switched_out lists and the chunk walk of process_rendition, while a publisher is ingested.
+// Go's race detector doesn't see the C side, build it with TSan for that:
+//
+//	go test -race -run TestSubscribeChurn ./cgo/
+//	CGO_CFLAGS="-fsanitize=thread -g -O1" CGO_LDFLAGS="-fsanitize=thread" go test -run TestSubscribeChurn ./cgo/
+
+const (
+	churnClipSeconds = 10
+	churnWorkers     = 64
+	// join/leave operations the test must get through while the publisher is ingested
+	churnMinOps = 2000
+)
+
+var errTestWriter = errors.New("test writer failed")
+
+// testClip encodes a test pattern with audio to mpegts with the ffmpeg command line,
+// the package itself only links the libraries
+func testClip(t *testing.T, seconds int) []byte {
+	ffmpeg, err := exec.LookPath("ffmpeg")
+	if err != nil {
+		t.Skip("ffmpeg not found")
+	}
+	dir, err := ioutil.TempDir("", "avflow")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+
+	path := filepath.Join(dir, "clip.ts")
+	cmd := exec.Command(ffmpeg, "-hide_banner", "-loglevel", "error", "-y",
+		"-f", "lavfi", "-i", "testsrc2=size=320x240:rate=25",
+		"-f", "lavfi", "-i", "sine=frequency=440:sample_rate=48000",
+		"-t", fmt.Sprint(seconds),
+		"-c:v", "libx264", "-preset", "ultrafast", "-g", "25", "-bf", "0", "-pix_fmt", "yuv420p",
+		"-c:a", "aac", "-f", "mpegts", path)
+	cmd.Stderr = os.Stderr
+	if err := cmd.Run(); err != nil {
+		t.Fatalf("%s: %v", ffmpeg, err)
+	}
+	clip, err := ioutil.ReadFile(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	return clip
+}
+
+// ingest opens a context on clip, published in real time, and reads it on its own goroutine,
+// the returned channel gets what ReadFrame failed with once the clip ended
+func ingest(t *testing.T, clip []byte, seconds int) (*AVFormatQrpcContext, <-chan error) {
+	frameCh := make(chan *qrpc.Frame, 16)
+	go publishClip(clip, seconds, frameCh)
+
+	ctx, err := NewAVFormatQrpcContext("mpegts", frameCh, nil)
+	if err != nil {
+		t.Fatalf("can't open the clip: %v", err)
+	}
+	done := make(chan error, 1)
+	go func() {
+		for {
+			if err := ctx.ReadFrame(); err != nil {
+				done <- err
+				return
+			}
+		}
+	}()
+	return ctx, done
+}
+
+// publishClip sends clip, then ends the stream
+func publishClip(clip []byte, seconds int, frameCh chan<- *qrpc.Frame) {
+	defer close(frameCh)
+
+	sendClip(clip, seconds, frameCh)
+	frameCh <- &qrpc.Frame{Flags: qrpc.StreamEndFlag}
+}
+
+// sendClip sends clip in qrpc frames of whole mpegts packets, spread over seconds
+func sendClip(clip []byte, seconds int, frameCh chan<- *qrpc.Frame) {
+	const chunk = 7 * 188
+	start := time.Now()
+	for off := 0; off < len(clip); off += chunk {
+		end := off + chunk
+		if end > len(clip) {
+			end = len(clip)
+		}
+		frameCh <- &qrpc.Frame{Payload: clip[off:end]}
+		time.Sleep(time.Until(start.Add(time.Duration(int64(seconds) * int64(time.Second) * int64(end) / int64(len(clip))))))
+	}
+}
+
+// churnWriter counts what it gets, and fails once it got failAfter writes if that is positive
+type churnWriter struct {
+	writes    int64
+	failAfter int64
+	total     *int64
+}
+
+func (w *churnWriter) Write(b []byte) (int, error) {
+	if n := atomic.AddInt64(&w.writes, 1); w.failAfter > 0 && n > w.failAfter {
+		return 0, errTestWriter
+	}
+	atomic.AddInt64(w.total, int64(len(b)))
+	return len(b), nil
+}
+
+// churnOptions picks the kind of subscription a join makes, so joins and leaves hit passthrough,
+// encoded and ladder renditions, and subscribers that fail or get switched between rungs
+func churnOptions(r *rand.Rand) (*SubscribeOptions, int64) {
+	switch r.Intn(6) {
+	case 0:
+		return &SubscribeOptions{MaxQueuePackets: 4, QueuePolicy: QueueDisconnect}, 0
+	case 1:
+		return &SubscribeOptions{Encoder: LowLatencyH264(300000)}, 0
+	case 2:
+		return &SubscribeOptions{Rung: RungAuto}, 0
+	case 3:
+		return &SubscribeOptions{Rung: 2, FlushInterval: 20 * time.Millisecond}, 0
+	case 4:
+		return nil, 1 + int64(r.Intn(8))
+	default:
+		return nil, 0
+	}
+}
+
+func TestSubscribeChurn(t *testing.T) {
+	if testing.Short() {
+		t.Skip("takes the length of the clip")
+	}
+	clip := testClip(t, churnClipSeconds)
+
+	ctx, ingestDone := ingest(t, clip, churnClipSeconds)
+	if err := ctx.SetLadder([]Rung{{Width: 240, Bitrate: 400000}, {Width: 160, Bitrate: 150000}}); err != nil {
+		t.Fatal(err)
+	}
+
+	stop := make(chan struct{})
+	ingestErr := make(chan error, 1)
+	go func() {
+		err := <-ingestDone
+		close(stop)
+		ingestErr <- err
+	}()
+
+	var (
+		ops, delivered int64
+		wg             sync.WaitGroup
+		lock           sync.Mutex
+		// left open for Free to end
+		open []*Subscription
+	)
+	for i := 0; i < churnWorkers; i++ {
+		wg.Add(1)
+		go func(seed int64) {
+			defer wg.Done()
+			r := rand.New(rand.NewSource(seed))
+			for {
+				select {
+				case <-stop:
+					return
+				default:
+				}
+
+				opts, failAfter := churnOptions(r)
+				sub, err := ctx.SubcribeAVFrame("mpegts", &churnWriter{failAfter: failAfter, total: &delivered}, opts)
+				if err != nil {
+					t.Errorf("subscribe: %v", err)
+					return
+				}
+				atomic.AddInt64(&ops, 1)
+				time.Sleep(time.Duration(r.Intn(3000)) * time.Microsecond)
+				sub.Stats()
+				if r.Intn(50) == 0 {
+					lock.Lock()
+					open = append(open, sub)
+					lock.Unlock()
+					continue
+				}
+				sub.Close()
+				select {
+				case <-sub.Done():
+				case <-time.After(10 * time.Second):
+					t.Errorf("subscription %d not done after Close", sub.Seq())
+					return
+				}
+			}
+		}(int64(i))
+	}
+
+	wg.Wait()
+	err := <-ingestErr
+	t.Logf("ReadFrame: %v, %d joins and leaves, %d bytes delivered, %d left to Free", err, atomic.LoadInt64(&ops),
+		atomic.LoadInt64(&delivered), len(open))
+	if n := atomic.LoadInt64(&ops); n < churnMinOps {
+		t.Errorf("only %d joins and leaves while ingesting, want %d", n, churnMinOps)
+	}
+	if atomic.LoadInt64(&delivered) == 0 {
+		t.Error("nothing delivered")
+	}
+
+	ctx.Free()
+	for _, sub := range open {
+		select {
+		case <-sub.Done():
+		case <-time.After(10 * time.Second):
+			t.Fatalf("subscription %d not done after Free", sub.Seq())
+		}
+	}
+	if subs := ctx.Subscriptions(); len(subs) > 0 {
+		t.Errorf("%d subscriptions left after Free", len(subs))
+	}
+}
+
+const (
+	policyClipSeconds = 8
+	// small enough to fill up within the block
+	policyQueuePackets = 16
+	policyMaxLag       = 300 * time.Millisecond
+	// writers block from policyBlockAt on for policyBlockFor
+	policyBlockAt  = 1500 * time.Millisecond
+	policyBlockFor = 2 * time.Second
+	// mpegts pid the muxer gives the first stream, the video of testClip
+	tsVideoPID = 0x100
+	// between video frames of testClip, at 25 fps in the 90kHz mpegts clock
+	tsFrameDuration = 3600
+)
+
+// blockingWriter keeps what it gets, its writes block between block and release
+type blockingWriter struct {
+	lock sync.Mutex
+	gate chan struct{} // nil unless blocked
+	data []byte
+}
+
+func (w *blockingWriter) Write(b []byte) (int, error) {
+	w.lock.Lock()
+	gate := w.gate
+	w.lock.Unlock()
+	if gate != nil {
+		<-gate
+	}
+
+	w.lock.Lock()
+	w.data = append(w.data, b...)
+	w.lock.Unlock()
+	return len(b), nil
+}
+
+func (w *blockingWriter) block() {
+	w.lock.Lock()
+	w.gate = make(chan struct{})
+	w.lock.Unlock()
+}
+
+func (w *blockingWriter) release() {
+	w.lock.Lock()
+	if w.gate != nil {
+		close(w.gate)
+		w.gate = nil
+	}
+	w.lock.Unlock()
+}
+
+func (w *blockingWriter) bytes() []byte {
+	w.lock.Lock()
+	defer w.lock.Unlock()
+	return append([]byte(nil), w.data...)
+}
+
+type tsFrame struct {
+	pts int64
+	key bool
+}
+
+// tsVideoFrames are the pts and random access indicators of the video PES packets in data
+func tsVideoFrames(data []byte) []tsFrame {
+	var frames []tsFrame
+	for off := 0; off+188 <= len(data); off += 188 {
+		p := data[off : off+188]
+		pid := int(p[1]&0x1f)<<8 | int(p[2])
+		// only where a PES packet starts
+		if p[0] != 0x47 || p[1]&0x40 == 0 || pid != tsVideoPID {
+			continue
+		}
+		control := p[3] >> 4 & 3
+		start, key := 4, false
+		if control&2 != 0 {
+			if p[4] > 0 {
+				key = p[5]&0x40 != 0
+			}
+			start = 5 + int(p[4])
+		}
+		if control&1 == 0 || start+14 > len(p) {
+			continue
+		}
+		pes := p[start:]
+		if pes[0] != 0 || pes[1] != 0 || pes[2] != 1 || pes[7]&0x80 == 0 {
+			continue
+		}
+		b := pes[9:14]
+		pts := int64(b[0]>>1&7)<<30 | int64(b[1])<<22 | int64(b[2]>>1)<<15 | int64(b[3])<<7 | int64(b[4]>>1)
+		frames = append(frames, tsFrame{pts: pts, key: key})
+	}
+	return frames
+}
+
+// checkResumesOnKeyframes fails unless frames have a gap, where packets were dropped,
+// and go on after each gap from a keyframe
+func checkResumesOnKeyframes(t *testing.T, name string, frames []tsFrame) {
+	gaps := 0
+	for i := 1; i < len(frames); i++ {
+		if frames[i].pts-frames[i-1].pts <= 2*tsFrameDuration {
+			continue
+		}
+		gaps++
+		if !frames[i].key {
+			t.Errorf("%s: resumed at pts %d after %d without a keyframe", name, frames[i].pts, frames[i-1].pts)
+		}
+		if i == len(frames)-1 {
+			t.Errorf("%s: nothing delivered after the gap at pts %d", name, frames[i-1].pts)
+		}
+	}
+	if gaps == 0 {
+		t.Errorf("%s: no frames dropped in %d frames", name, len(frames))
+	}
+}
+
+func TestQueuePolicies(t *testing.T) {
+	if testing.Short() {
+		t.Skip("takes the length of the clip")
+	}
+	clip := testClip(t, policyClipSeconds)
+	ctx, ingestDone := ingest(t, clip, policyClipSeconds)
+	defer ctx.Free()
+
+	policies := []struct {
+		name string
+		opts SubscribeOptions
+	}{
+		{"drop gop", SubscribeOptions{MaxQueuePackets: policyQueuePackets, QueuePolicy: QueueDropGOP}},
+		{"skip to live", SubscribeOptions{MaxQueuePackets: policyQueuePackets, QueuePolicy: QueueSkipToLive}},
+		{"disconnect", SubscribeOptions{MaxQueuePackets: policyQueuePackets, QueuePolicy: QueueDisconnect, MaxLag: policyMaxLag}},
+	}
+	writers := make([]*blockingWriter, len(policies))
+	subs := make([]*Subscription, len(policies))
+	for i := range policies {
+		writers[i] = &blockingWriter{}
+		// the publisher's own format, all of them share the passthrough rendition
+		sub, err := ctx.SubcribeAVFrame("mpegts", writers[i], &policies[i].opts)
+		if err != nil {
+			t.Fatalf("%s: %v", policies[i].name, err)
+		}
+		defer sub.Close()
+		subs[i] = sub
+	}
+
+	time.Sleep(policyBlockAt)
+	for _, w := range writers {
+		w.block()
+	}
+	time.Sleep(policyBlockFor)
+	blocked := make([]SubscriberStats, len(subs))
+	for i, sub := range subs {
+		blocked[i] = sub.Stats()
+	}
+	for _, w := range writers {
+		w.release()
+	}
+
+	drop, skip, disconnect := blocked[0], blocked[1], blocked[2]
+	t.Logf("blocked: drop gop %+v, skip to live %+v, disconnect %+v", drop, skip, disconnect)
+	// what is queued is kept and goes stale
+	if drop.DroppedPackets == 0 || drop.Skips != 0 || drop.Lag < policyBlockFor/2 {
+		t.Errorf("drop gop: %+v", drop)
+	}
+	// the backlog is thrown away
+	if skip.Skips == 0 || skip.DroppedPackets < policyQueuePackets {
+		t.Errorf("skip to live: %+v", skip)
+	}
+	if disconnect.Lag <= policyMaxLag || disconnect.Skips != 0 {
+		t.Errorf("disconnect: %+v", disconnect)
+	}
+	select {
+	case <-subs[2].Done():
+	case <-time.After(time.Second):
+		t.Error("disconnect: still subscribed after lagging")
+	}
+
+	if err := <-ingestDone; err == nil {
+		t.Fatal("ReadFrame ended without error")
+	}
+	// what is still queued
+	time.Sleep(500 * time.Millisecond)
+	for i := 0; i < 2; i++ {
+		select {
+		case <-subs[i].Done():
+			t.Errorf("%s: done before Close: %v", policies[i].name, subs[i].Err())
+		default:
+		}
+		checkResumesOnKeyframes(t, policies[i].name, tsVideoFrames(writers[i].bytes()))
+	}
+}
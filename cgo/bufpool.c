@@ -0,0 +1,136 @@
+#include "bufpool.h"
+#include "libavutil/mem.h"
+#include <pthread.h>
+
+// buffers kept at most, the rest is freed
+#define BUFPOOL_SIZE 64
+
+typedef struct QrpcAVIOBuffer {
+    uint8_t *buf;
+    int size;
+} QrpcAVIOBuffer;
+
+typedef struct QrpcBufPool {
+    pthread_mutex_t mutex;
+    QrpcAVIOBuffer free[BUFPOOL_SIZE];
+    int n;
+} QrpcBufPool;
+
+static QrpcBufPool pool = {PTHREAD_MUTEX_INITIALIZER};
+
+uint8_t *qrpc_avio_buffer_get(int size)
+{
+    uint8_t *buf = NULL;
+
+    pthread_mutex_lock(&pool.mutex);
+    for (int i = pool.n - 1; i >= 0; i--) {
+        if (pool.free[i].size == size) {
+            buf = pool.free[i].buf;
+            pool.free[i] = pool.free[--pool.n];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    if (!buf) buf = av_malloc(size);
+    return buf;
+}
+
+void qrpc_avio_context_free(AVIOContext **pb)
+{
+    if (!*pb) return;
+
+    // the internal buffer could have been replaced by avio, only one still at its original size is reusable
+    uint8_t *buf = (*pb)->buffer;
+    int size = (*pb)->orig_buffer_size;
+    if (buf && (*pb)->buffer_size == size) {
+        pthread_mutex_lock(&pool.mutex);
+        if (pool.n < BUFPOOL_SIZE) {
+            pool.free[pool.n].buf = buf;
+            pool.free[pool.n].size = size;
+            pool.n ++;
+            buf = NULL;
+        }
+        pthread_mutex_unlock(&pool.mutex);
+    }
+    av_free(buf);
+
+    (*pb)->buffer = NULL;
+    avio_context_free(pb);
+}
+
+QrpcObjPool qrpc_packet_pool = QRPC_OBJPOOL_INITIALIZER;
+QrpcObjPool qrpc_frame_pool = QRPC_OBJPOOL_INITIALIZER;
+
+void *qrpc_objpool_get(QrpcObjPool *pool)
+{
+    void *obj = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->n) obj = pool->free[--pool->n];
+    pthread_mutex_unlock(&pool->mutex);
+
+    atomic_fetch_add(obj ? &pool->reuses : &pool->allocs, 1);
+    return obj;
+}
+
+bool qrpc_objpool_put(QrpcObjPool *pool, void *obj)
+{
+    bool ok = false;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->n < OBJPOOL_SIZE) {
+        pool->free[pool->n++] = obj;
+        ok = true;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return ok;
+}
+
+AVPacket *qrpc_packet_clone(const AVPacket *src)
+{
+    AVPacket *pkt = qrpc_objpool_get(&qrpc_packet_pool);
+    if (!pkt && !(pkt = av_packet_alloc())) return NULL;
+
+    if (av_packet_ref(pkt, src) < 0) {
+        qrpc_packet_free(&pkt);
+        return NULL;
+    }
+    return pkt;
+}
+
+void qrpc_packet_free(AVPacket **pkt)
+{
+    if (!*pkt) return;
+
+    av_packet_unref(*pkt);
+    if (!qrpc_objpool_put(&qrpc_packet_pool, *pkt)) av_packet_free(pkt);
+    *pkt = NULL;
+}
+
+AVFrame *qrpc_frame_alloc(void)
+{
+    AVFrame *frame = qrpc_objpool_get(&qrpc_frame_pool);
+    return frame ? frame : av_frame_alloc();
+}
+
+AVFrame *qrpc_frame_clone(const AVFrame *src)
+{
+    AVFrame *frame = qrpc_frame_alloc();
+    if (!frame) return NULL;
+
+    if (av_frame_ref(frame, src) < 0) {
+        qrpc_frame_free(&frame);
+        return NULL;
+    }
+    return frame;
+}
+
+void qrpc_frame_free(AVFrame **frame)
+{
+    if (!*frame) return;
+
+    av_frame_unref(*frame);
+    if (!qrpc_objpool_put(&qrpc_frame_pool, *frame)) av_frame_free(frame);
+    *frame = NULL;
+}
@@ -0,0 +1,50 @@
+#ifndef CGO_BUFPOOL_H
+#define CGO_BUFPOOL_H
+
+#include "libavformat/avio.h"
+#include "libavutil/frame.h"
+#include "libavcodec/avcodec.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// get an AVIO buffer of size bytes, reusing one freed by another context when possible
+uint8_t *qrpc_avio_buffer_get(int size);
+
+// free *pb and give its buffer back to the pool, *pb is set to NULL
+void qrpc_avio_context_free(AVIOContext **pb);
+
+// objects kept at most by an object pool, the rest is freed
+#define OBJPOOL_SIZE 4096
+
+// a bounded free list of objects of one kind, shared by all threads
+typedef struct QrpcObjPool {
+    pthread_mutex_t mutex;
+    void *free[OBJPOOL_SIZE];
+    int n;
+    atomic_uint_fast64_t allocs; // gets the pool could not serve
+    atomic_uint_fast64_t reuses;
+} QrpcObjPool;
+
+#define QRPC_OBJPOOL_INITIALIZER {PTHREAD_MUTEX_INITIALIZER}
+
+// an object from pool, NULL if it is empty and the caller has to allocate one
+void *qrpc_objpool_get(QrpcObjPool *pool);
+
+// give obj back to pool, returns false if it is full and the caller has to free obj
+bool qrpc_objpool_put(QrpcObjPool *pool, void *obj);
+
+// unreferenced AVPacket and AVFrame structs, getting one only takes a reference of the data
+extern QrpcObjPool qrpc_packet_pool;
+extern QrpcObjPool qrpc_frame_pool;
+
+// like av_packet_clone and av_packet_free, but the AVPacket structs are pooled
+AVPacket *qrpc_packet_clone(const AVPacket *src);
+void qrpc_packet_free(AVPacket **pkt);
+
+// like av_frame_alloc, av_frame_clone and av_frame_free, but the AVFrame structs are pooled
+AVFrame *qrpc_frame_alloc(void);
+AVFrame *qrpc_frame_clone(const AVFrame *src);
+void qrpc_frame_free(AVFrame **frame);
+
+#endif
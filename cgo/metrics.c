@@ -0,0 +1,112 @@
+#include "metrics.h"
+#include "libavutil/mem.h"
+#include "libavutil/time.h"
+#include <stdbool.h>
+#include <string.h>
+
+// counters of one thread, only it writes them and scrapes sum all shards
+// shards are never freed, the shard of a thread that exited goes to the next new thread
+typedef struct QrpcMetricsShard {
+    QrpcHistogramCells stages[QRPC_NB_STAGES];
+    atomic_uint_fast64_t errors[QRPC_NB_STAGES];
+    atomic_bool owned;
+    struct QrpcMetricsShard *next; // set before the shard is published
+} QrpcMetricsShard;
+
+static _Atomic(QrpcMetricsShard *) shards;
+static pthread_key_t shard_key;
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+static _Thread_local QrpcMetricsShard *local_shard;
+
+_Thread_local int64_t qrpc_callback_us;
+
+static void release_shard(void *shard)
+{
+    atomic_store(&((QrpcMetricsShard *)shard)->owned, false);
+}
+
+static void create_shard_key(void)
+{
+    pthread_key_create(&shard_key, release_shard);
+}
+
+static QrpcMetricsShard *get_shard(void)
+{
+    if (local_shard) return local_shard;
+
+    pthread_once(&shard_once, create_shard_key);
+    QrpcMetricsShard *shard;
+    for (shard = atomic_load(&shards); shard; shard = shard->next) {
+        bool owned = false;
+        if (!atomic_load(&shard->owned) && atomic_compare_exchange_strong(&shard->owned, &owned, true)) break;
+    }
+    if (!shard) {
+        if (!(shard = av_mallocz(sizeof(*shard)))) return NULL;
+        atomic_init(&shard->owned, true);
+        shard->next = atomic_load(&shards);
+        while (!atomic_compare_exchange_weak(&shards, &shard->next, shard));
+    }
+    // the destructor gives the shard up when the thread exits
+    pthread_setspecific(shard_key, shard);
+    local_shard = shard;
+    return shard;
+}
+
+// single writer, a plain load and store is enough
+static inline void cell_add(atomic_uint_fast64_t *cell, uint64_t v)
+{
+    atomic_store_explicit(cell, atomic_load_explicit(cell, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+void qrpc_histogram_observe(QrpcHistogramCells *h, int64_t us)
+{
+    if (us < 0) us = 0;
+    int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (bucket >= QRPC_HISTOGRAM_BUCKETS) bucket = QRPC_HISTOGRAM_BUCKETS - 1;
+    cell_add(&h->count, 1);
+    cell_add(&h->sum_us, us);
+    cell_add(&h->buckets[bucket], 1);
+}
+
+void qrpc_histogram_read(QrpcHistogramCells *h, AVFormatQrpcHistogram *dst)
+{
+    dst->count += atomic_load_explicit(&h->count, memory_order_relaxed);
+    dst->sum_us += atomic_load_explicit(&h->sum_us, memory_order_relaxed);
+    for (int i = 0; i < QRPC_HISTOGRAM_BUCKETS; i++)
+        dst->buckets[i] += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+}
+
+void qrpc_metrics_observe(int stage, int64_t us)
+{
+    QrpcMetricsShard *shard = get_shard();
+    if (shard) qrpc_histogram_observe(&shard->stages[stage], us);
+}
+
+void qrpc_metrics_error(int stage)
+{
+    QrpcMetricsShard *shard = get_shard();
+    if (shard) cell_add(&shard->errors[stage], 1);
+}
+
+void qrpc_metrics_lock(pthread_mutex_t *mutex, int stage)
+{
+    if (!pthread_mutex_trylock(mutex)) {
+        qrpc_metrics_observe(stage, 0);
+        return;
+    }
+    int64_t start = av_gettime_relative();
+    pthread_mutex_lock(mutex);
+    qrpc_metrics_observe(stage, av_gettime_relative() - start);
+}
+
+void qrpc_metrics_read(AVFormatQrpcHistogram *stages, uint64_t *errors)
+{
+    memset(stages, 0, QRPC_NB_STAGES * sizeof(*stages));
+    memset(errors, 0, QRPC_NB_STAGES * sizeof(*errors));
+    for (QrpcMetricsShard *shard = atomic_load(&shards); shard; shard = shard->next) {
+        for (int i = 0; i < QRPC_NB_STAGES; i++) {
+            qrpc_histogram_read(&shard->stages[i], &stages[i]);
+            errors[i] += atomic_load_explicit(&shard->errors[i], memory_order_relaxed);
+        }
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef CGO_METRICS_H
+#define CGO_METRICS_H
+
+#include "utils.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+// histogram written by one thread at a time, its observations need no atomic read-modify-write
+typedef struct QrpcHistogramCells {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum_us;
+    atomic_uint_fast64_t buckets[QRPC_HISTOGRAM_BUCKETS];
+} QrpcHistogramCells;
+
+// time the calling thread spent in go callbacks, so stages that call back into go can leave it out
+extern _Thread_local int64_t qrpc_callback_us;
+
+// observe us into h, callers must not observe into the same h concurrently
+void qrpc_histogram_observe(QrpcHistogramCells *h, int64_t us);
+
+// add the counts of h to dst
+void qrpc_histogram_read(QrpcHistogramCells *h, AVFormatQrpcHistogram *dst);
+
+// record a latency of stage in the calling thread's counters, aggregated by qrpc_metrics_read
+void qrpc_metrics_observe(int stage, int64_t us);
+
+// count an error of stage
+void qrpc_metrics_error(int stage);
+
+// lock mutex and record how long that waited as a latency of stage, an uncontended lock reads no clock
+void qrpc_metrics_lock(pthread_mutex_t *mutex, int stage);
+
+// sum of the counters of all threads, stages and errors have QRPC_NB_STAGES entries
+void qrpc_metrics_read(AVFormatQrpcHistogram *stages, uint64_t *errors);
+
+#endif
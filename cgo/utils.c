@@ -1,58 +1,411 @@
 #include "utils.h"
+#include "workers.h"
+#include "bufpool.h"
+#include "metrics.h"
+#include "libavutil/audio_fifo.h"
+#include "libavutil/avstring.h"
+#include "libavutil/channel_layout.h"
+#include "libavutil/cpu.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/opt.h"
+#include "libavutil/pixdesc.h"
+#include "libavutil/time.h"
+#include "libswresample/swresample.h"
+#include "libswscale/swscale.h"
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <inttypes.h>
 
-#define SEQ_ALL UINT64_MAX
+typedef struct AVFormatQrpcRendition AVFormatQrpcRendition;
+typedef struct AVFormatQrpcContext AVFormatQrpcContext;
+
+typedef struct AVFormatQrpcQueueEntry {
+    AVPacket *pkt; // ts are in the output stream time_base
+    int64_t enqueued; // av_gettime_relative
+} AVFormatQrpcQueueEntry;
 
 typedef struct AVFormatQrpcContextSubscriber {
-    AVCodecContext **enc_ctx;
     AVFormatContext *sctx;
     uint64_t seq;
-    struct AVFormatQrpcContextSubscriber *next;
+    uintptr_t writer; // runtime/cgo handle of the go io.Writer
+    AVFormatQrpcRendition *rendition; // NULL once unlinked, guarded by qrpcCtx->mutex
+    int slot; // index in rendition's member slots, guarded by qrpcCtx->mutex
+    // also a member of switch_to until it takes over at a keyframe, written with qrpcCtx->mutex held
+    _Atomic(AVFormatQrpcRendition *) switch_to;
+    int switch_slot; // guarded by qrpcCtx->mutex
+    int switch_rung;
+    _Atomic(AVFormatQrpcRendition *) feeding; // whose packets are queued, changed with lock held
+    atomic_int rung; // of rendition
+    atomic_int want_rung; // decided by the deliverer
+    atomic_int refs; // memberships and the go side handle
+    bool wait_keyframe; // drop packets until the rendition produces a keyframe, written with lock held once linked
+    bool rendition_has_video; // keyframes gate the queue only when there is video
+    bool burst; // just joined, replay the rendition's GOP cache first, worker only
+    int64_t last_flush; // av_gettime_relative of the last avio_flush, deliverer only
+    int64_t last_pts; // of the last packet written, in AV_TIME_BASE, deliverer only
+    // adaptive rung selection, deliverer only
+    bool auto_rung;
+    int nb_rungs;
+    int64_t rung_bit_rate[QRPC_MAX_RUNGS];
+    int abr_rung; // rung when rung_since was taken
+    int64_t rung_since;
+    int64_t abr_eval_at;
+    uint64_t abr_dropped; // stats.dropped_packets at the last evaluation
+    int64_t write_bytes; // written since the last evaluation
+    int64_t write_us; // spent writing them
+    AVFormatQrpcSubscribeConfig config;
+
+    // outbound queue, filled by the rendition worker and drained by AVFormat_DeliverSubscriber
+    pthread_mutex_t lock; // guards everything below
+    pthread_cond_t cond; // signaled when queue gets an entry or closed is set
+    AVFormatQrpcQueueEntry *queue;
+    int queue_head;
+    int nb_queue;
+    bool closed; // no more packets will be queued
+    bool failed; // closed because of a write error or the queue policy
+    int64_t *last_dts; // per output stream, in its time_base
+    int64_t dts_guard_until; // packets going back from last_dts are dropped until then, set by switches
+    AVFormatQrpcSubscriberStats stats;
+
+    struct AVFormatQrpcContextSubscriber *retired_next; // in rendition->retired
+    struct AVFormatQrpcContextSubscriber *switched_next; // in rendition->switched_out
+    atomic_bool on_switched_out; // a rendition still has to drop the membership it switched away from
 } AVFormatQrpcContextSubscriber;
 
-typedef struct AVFormatQrpcContextSubscriberList {
-    AVFormatQrpcContextSubscriber *first;
-    AVFormatQrpcContextSubscriber *last;
-    int n;
-} AVFormatQrpcContextSubscriberList;
-
-typedef struct AVFormatQrpcContext {
+#define MEMBER_CHUNK_SIZE 64
+#define MAX_MEMBER_CHUNKS 1024
+
+// chunks are never freed before their rendition, so the worker can walk the slots without locking
+typedef struct AVFormatQrpcMemberChunk {
+    _Atomic(AVFormatQrpcContextSubscriber *) slots[MEMBER_CHUNK_SIZE];
+} AVFormatQrpcMemberChunk;
+
+// subscribers with equal config share one rendition
+typedef struct AVFormatQrpcRenditionConfig {
+    char fmt[32];
+    bool passthrough; // remux demuxed packets, nothing is decoded or encoded
+    // video size and bit rate of a ladder rung, 0 for those of the publisher
+    int width;
+    int height;
+    int64_t bit_rate;
+    AVFormatQrpcEncoderConfig encoder;
+} AVFormatQrpcRenditionConfig;
+
+// scales decoded video to one size for all renditions of that size
+// scalers live as long as their context, there is at most one per ladder rung
+typedef struct AVFormatQrpcScaler {
+    int width;
+    int height;
+    struct AVFormatQrpcScaler *next; // guarded by qrpcCtx->mutex
+    pthread_mutex_t lock; // guards everything below
+    struct SwsContext *sws;
+    AVBufferPool *pool; // buffers of scaled frames, sized for pool_format
+    int pool_format;
+    AVFrame *frame; // the last scaled frame
+    uint64_t seq; // of the job frame was scaled from
+} AVFormatQrpcScaler;
+
+// decoded audio of a stream is resampled and encoded once for all renditions that encode,
+// their audio doesn't depend on the rendition config, renditions only differ in whether
+// their format wants a global header
+// created with qrpcCtx->mutex held, then only used by the audio task of its stream
+typedef struct AVFormatQrpcAudioEncoder {
+    AVCodecContext *enc_ctx;
+    AVCodecParameters *codecpar;
+    struct SwrContext *swr; // NULL while decoded frames are what enc_ctx takes
+    // of the frames swr was set up for
+    int in_format;
+    int in_sample_rate;
+    uint64_t in_channel_layout;
+    AVAudioFifo *fifo; // resampled samples not encoded yet, rebuffered to enc_ctx->frame_size
+    AVFrame *resampled;
+    AVFrame *frame; // what is sent to enc_ctx
+    int64_t next_pts; // of the first sample in fifo, in enc_ctx->time_base, AV_NOPTS_VALUE after a reset
+    bool failed; // the encoder failed, its renditions go without audio
+} AVFormatQrpcAudioEncoder;
+
+// a decoded frame or demuxed packet, shared by every rendition it is dispatched to
+typedef struct AVFormatQrpcJob {
+    atomic_int refs;
+    uint64_t seq; // of frame jobs, tells scalers which frame they have already scaled
+    int stream_index;
+    AVFrame *frame;
+    AVPacket *pkt;
+    // of audio frame jobs, the renditions the encoded packets go to, referenced
+    AVFormatQrpcRendition **renditions;
+    int nb_renditions;
+} AVFormatQrpcJob;
+
+#define RENDITION_QUEUE_SIZE 64
+
+// resamples and encodes the decoded audio of an input stream on the worker pool, by at most
+// one worker at a time, so the shared encoders of the stream need no locking
+typedef struct AVFormatQrpcAudioTask {
+    AVFormatQrpcContext *qrpcCtx;
+    int stream_index;
+    AVRational time_base; // of the input stream, frame and packet ts are in it
+    AVFormatQrpcAudioEncoder *audio[2]; // without and with a global header, created with qrpcCtx->mutex held
+
+    pthread_mutex_t lock; // guards the job queue
+    AVFormatQrpcJob *jobs[RENDITION_QUEUE_SIZE];
+    int jobs_head;
+    int nb_jobs;
+    atomic_int scheduled;
+} AVFormatQrpcAudioTask;
+// decoded audio further than this from where the samples buffered for encoding end restarts them
+#define AUDIO_RESYNC_THRESHOLD (AV_TIME_BASE / 10)
+#define DEFAULT_GOP_CACHE_SIZE (4 << 20)
+
+// AVIO buffer sizes of contexts opened from now on
+static atomic_int ingest_avio_buffer_size = 64 << 10;
+static atomic_int subscriber_avio_buffer_size = 64 << 10;
+
+// upper bound in bytes of the packets each rendition keeps since its last keyframe, <= 0 disables
+static atomic_int gop_cache_size = DEFAULT_GOP_CACHE_SIZE;
+
+// encoder threads all renditions of the process share, <= 0 for the number of cpus
+static atomic_int encoder_thread_budget;
+static atomic_int encoder_threads_used;
+// what a video encoder asks for when its config doesn't say
+#define DEFAULT_ENCODER_THREADS 4
+// renditions a publisher encodes at once, <= 0 for no limit, subscribing to another one fails with EBUSY
+static atomic_int max_encoded_renditions = QRPC_MAX_RUNGS + 4;
+
+// AVFormatQrpcJob structs, jobs are made for every packet
+static QrpcObjPool job_pool = QRPC_OBJPOOL_INITIALIZER;
+// buffers scalers allocated and took from their pools, the rest of the gets were reuses
+static atomic_uint_fast64_t scaled_buffer_allocs;
+static atomic_uint_fast64_t scaled_buffer_gets;
+
+// decoder threads all publishers share, <= 0 for the number of cpus
+static atomic_int decoder_thread_budget;
+// video decoders being fed process wide, each gets an even share of the budget
+static atomic_int active_decoders;
+// what a video decoder asks for when its publisher doesn't say, more frame threads delay more frames
+#define DEFAULT_DECODER_THREADS 4
+
+typedef struct AVFormatQrpcCachedPacket {
+    AVPacket *pkt;
+    AVRational time_base;
+} AVFormatQrpcCachedPacket;
+// default bound of a subscriber send queue, in packets
+#define SUBSCRIBER_QUEUE_SIZE 256
+
+// how often the deliverer of a QRPC_RUNG_AUTO subscriber reconsiders its rung
+#define ABR_EVAL_INTERVAL (2 * AV_TIME_BASE)
+// queue lag that moves a subscriber one rung down
+#define ABR_DOWN_LAG AV_TIME_BASE
+// a subscriber stays on a rung at least this long and lags less than ABR_UP_LAG before it moves up
+#define ABR_UP_HOLD (6 * AV_TIME_BASE)
+#define ABR_UP_LAG (AV_TIME_BASE / 5)
+// write throughput needed for the next rung up, relative to its bit rate
+#define ABR_UP_HEADROOM 1.5
+// how long after a switch the renditions involved may still overlap in time
+#define SWITCH_DTS_GUARD (5 * AV_TIME_BASE)
+
+// a rendition encodes each decoded frame once, all members mux the same packets
+// jobs are processed on the worker pool, by at most one worker at a time
+struct AVFormatQrpcRendition {
+    AVFormatQrpcRenditionConfig config;
+    AVFormatQrpcContext *qrpcCtx;
+    AVCodecContext **enc_ctx; // all NULL for passthrough
+    AVFormatQrpcAudioEncoder **audio; // shared encoders of audio streams, owned by their audio task, all NULL for passthrough
+    AVCodecParameters **codecpar; // what members' output streams carry, NULL if not written
+    AVRational *in_time_base; // time_base of input streams, frame and packet ts are in it
+    int64_t *last_pts; // last pts sent to enc_ctx, in enc_ctx->time_base
+    int nb_streams;
+    bool has_video;
+    atomic_int refs; // qrpcCtx->renditions, ingest snapshots and the scheduled task
+    bool linked; // in qrpcCtx->renditions, guarded by qrpcCtx->mutex
+    struct AVFormatQrpcRendition *next; // guarded by qrpcCtx->mutex
+
+    // members, written with qrpcCtx->mutex held and read lock free by the worker
+    _Atomic(AVFormatQrpcMemberChunk *) member_chunks[MAX_MEMBER_CHUNKS];
+    atomic_int nb_member_chunks;
+    atomic_int nb_members;
+    int *free_slots; // guarded by qrpcCtx->mutex
+    int nb_free_slots;
+    int free_slots_size;
+    atomic_int in_pass; // the worker is walking the slots
+    _Atomic(AVFormatQrpcContextSubscriber *) retired; // unlinked during a pass, unreferenced once it ends
+    _Atomic(AVFormatQrpcContextSubscriber *) switched_out; // likewise, for members that switched to another rendition
+
+    pthread_mutex_t lock; // guards the job queue
+    AVFormatQrpcJob *jobs[RENDITION_QUEUE_SIZE];
+    int jobs_head;
+    int nb_jobs;
+    bool jobs_dropped; // the queue overflowed since the worker last looked
+    atomic_int scheduled;
+
+    // worker only
+    AVFrame *enc_frame; // reference of the job frame with pts in enc_ctx->time_base
+    AVFormatQrpcScaler *scaler; // for video when the rung size differs from the publisher's
+    int enc_threads; // taken from encoder_thread_budget
+    bool members_failed; // some member failed during this pass
+    bool members_switched; // some member switched over from another rendition during this pass
+    AVFormatQrpcCachedPacket *gop; // packets since the last video keyframe, for joining members
+    int nb_gop;
+    int gop_size;
+    int64_t gop_bytes;
+    bool gop_valid; // gop starts with a keyframe and has no holes
+    QrpcHistogramCells encode; // encode latency, see QRPC_STAGE_ENCODE
+};
+
+struct AVFormatQrpcContext {
+    AVFormatQrpcInputConfig config;
     AVCodecContext **dec_ctx;// for decode input
+    int *dec_threads; // what dec_ctx[i] was opened with, ingest only
     int nb_streams;
-    AVFrame **latest; // store latest frame
+    AVFrame **latest; // reference of the latest decoded video frame, guarded by latest_lock
+    uint64_t *latest_frame_generation; // latest_generation when latest[i] was published, guarded by latest_lock
+    pthread_mutex_t latest_lock; // only held to swap or reference latest[i]
+    AVFrame *latest_spare; // swapped with latest[i], ingest only
+    AVFrame *dec_frame; // what decoders output into, ingest only
     void* goctx; // reference to go
     pthread_mutex_t mutex;
-    AVFormatQrpcContextSubscriberList *subscribers;
-} AVFormatQrpcContext;
+    AVFormatQrpcRendition *renditions; // guarded by mutex
+    bool *decoding; // whether dec_ctx[i] is being fed, guarded by mutex
+    int64_t snapshot_deadline; // keep decoding video until then for snapshots, guarded by mutex
+    pthread_cond_t latest_cond; // signaled with mutex when latest_generation changes
+    atomic_uint_fast64_t latest_generation;
+    atomic_int snapshot_waiters; // decremented with mutex, see AVFormat_AddSnapshotWaiter
+    bool closing; // free_qrpc_context is waiting for snapshot waiters, guarded by mutex
+    atomic_int pending_tasks; // rendition and audio tasks on the worker pool
+    pthread_cond_t idle_cond; // signaled with mutex when pending_tasks drops to 0
+    AVFormatQrpcRung ladder[QRPC_MAX_RUNGS]; // guarded by mutex
+    int nb_rungs;
+    AVFormatQrpcScaler *scalers; // guarded by mutex
+    AVFormatQrpcAudioTask **audio_tasks; // per stream, created with its first audio encoder, guarded by mutex
+    uint64_t job_seq; // ingest only
+    atomic_int decoder_threads; // of video decoders being fed
+    atomic_uint_fast64_t decoded_frames; // video
+
+    // startup, in AV_TIME_BASE from connect_time
+    int64_t connect_time;
+    int64_t open_latency;
+    atomic_int_fast64_t first_frame_latency; // 0 until the first video frame is decoded
+    bool stream_info_skipped;
+
+    // a publisher rebound within the reconnect grace window, see AVFormat_Rebind
+    atomic_bool rebound; // timestamps are expected to jump
+    int64_t ts_offset; // AV_TIME_BASE, added to the timestamps of every packet, ingest only
+    int64_t last_dts; // AV_TIME_BASE, the latest after ts_offset, AV_NOPTS_VALUE until the first, ingest only
+
+    // decode lag of lag_stream, the first video stream
+    int lag_stream;
+    int64_t lag_base_pts; // AV_TIME_BASE, AV_NOPTS_VALUE until the first frame after a resume, ingest only
+    int64_t lag_base_wall; // av_gettime_relative when lag_base_pts was decoded, ingest only
+    atomic_int_fast64_t decode_lag; // in AV_TIME_BASE
+
+    // renditions snapshot of the packet being ingested, ingest only
+    AVFormatQrpcRendition **dispatch;
+    int nb_dispatch;
+    int dispatch_size;
+};
+
+// how long video keeps being decoded after a snapshot request when no rendition needs it
+#define SNAPSHOT_DECODE_WINDOW (10 * AV_TIME_BASE)
+// how long a snapshot request waits for a fresh frame when the decoder was idle
+#define SNAPSHOT_WAIT_TIMEOUT (5 * AV_TIME_BASE)
 
-typedef struct IOSeqContext {
-    void *goctx;
-    uint64_t seq;
-} IOSeqContext;
 
 
 extern int read_packet_callback(void *goctx, uint8_t *buf, int buf_size);
-extern int read_packet_seq_callback(void *goctx, uint64_t seq, uint8_t *buf, int buf_size);
-extern int write_packet_seq_callback(void *goctx, uint64_t seq, uint8_t *buf, int bufSize);
-
-static int open_codec_context(int stream_idx, AVCodecContext **dec_ctx, AVFormatContext *fmt_ctx);
+static int read_packet_timed(void *goctx, uint8_t *buf, int buf_size);
+extern int write_handle_callback(uintptr_t writer, uint8_t *buf, int buf_size);
+// pts in AV_TIME_BASE, keyframe marks come before the keyframe is written and others right after a flush
+extern void mark_handle_callback(uintptr_t writer, int64_t pts, int keyframe);
+
+static int open_codec_context(int stream_idx, AVCodecContext **dec_ctx, AVFormatContext *fmt_ctx, int threads, int thread_type);
+static int decoder_thread_grant(int want);
+static void start_video_decoder(AVFormatQrpcContext *qrpcCtx, int idx);
+static void stop_video_decoder(AVFormatQrpcContext *qrpcCtx, int idx);
+static void rebalance_decoder(AVFormatContext *ctx, int idx, int nb_dispatch, bool encode);
+static int decode_packet(AVFormatContext *ctx, int idx, AVPacket *pkt, int nb_dispatch, bool encode);
+static void update_decode_lag(AVFormatQrpcContext *qrpcCtx, int64_t pts);
+static bool apply_stream_params(AVFormatContext *ctx, const AVFormatQrpcInputConfig *config);
+static void rebind_timestamps(AVFormatContext *ctx, AVPacket *pkt);
+static void restart_decoders(AVFormatContext *ctx);
+static int init_qrpc_context_sync(AVFormatQrpcContext *qrpcCtx);
 static void free_qrpc_context(AVFormatQrpcContext *qrpcCtx);
-static void write_subscribers(AVFormatQrpcContext *qrpcCtx, int stream_index, AVFrame *frame);
-static AVFormatQrpcContextSubscriber* new_subscriber(AVFormatContext *oc, uint64_t seq);
-static void add_subscriber(AVFormatQrpcContext *qrpcCtx, AVFormatQrpcContextSubscriber *subscriber);
-static void del_subscriber(AVFormatQrpcContext* qrpcCtx, uint64_t seq, bool locked);
+static int snapshot_renditions(AVFormatQrpcContext *qrpcCtx);
+static void release_renditions(AVFormatQrpcContext *qrpcCtx);
+static AVFormatQrpcJob* new_job(int stream_index);
+static void unref_job(AVFormatQrpcJob *job);
+static void dispatch_job(AVFormatQrpcRendition *rendition, AVFormatQrpcJob *job);
+static void schedule_rendition(AVFormatQrpcRendition *rendition);
+static void process_rendition(void *arg);
+static void task_done(AVFormatQrpcContext *qrpcCtx);
+static void encode_rendition_frame(AVFormatQrpcRendition *rendition, AVFormatQrpcJob *job);
+static bool need_decode(AVFormatQrpcContext *qrpcCtx, int stream_index);
+static uint64_t wait_latest_frame(AVFormatQrpcContext *qrpcCtx);
+static void publish_latest_frame(AVFormatQrpcContext *qrpcCtx, int idx, AVFrame *frame);
+static bool ref_latest_frame(AVFormatQrpcContext *qrpcCtx, int idx, AVFrame *dst, uint64_t *generation);
+static int scale_snapshot_frame(AVFrame *frame, int width, int height, AVFrame **scaled);
+static void fit_size(int src_width, int src_height, int *width, int *height);
+static AVFormatQrpcScaler* find_or_new_scaler(AVFormatQrpcContext *qrpcCtx, int width, int height);
+static int scale_job_frame(AVFormatQrpcScaler *scaler, AVFormatQrpcJob *job, AVFrame *dst);
+static AVBufferRef* alloc_scaled_buffer(int size);
+static AVFormatQrpcAudioEncoder* find_or_new_audio_encoder(AVFormatContext *ifc, int idx, bool global_header, int *ret);
+static void free_audio_encoder(AVFormatQrpcAudioEncoder **paudio);
+static AVFormatQrpcAudioTask* find_or_new_audio_task(AVFormatContext *ifc, int idx);
+static void free_audio_task(AVFormatQrpcAudioTask **ptask);
+static void queue_audio_frame(AVFormatQrpcContext *qrpcCtx, int idx, AVFrame *frame, int nb_dispatch);
+static void schedule_audio_task(AVFormatQrpcAudioTask *task);
+static void process_audio_task(void *arg);
+static void encode_audio(AVFormatQrpcAudioTask *task, AVFormatQrpcJob *job);
+static int encode_audio_frame(AVFormatQrpcAudioTask *task, AVFormatQrpcAudioEncoder *audio, AVFormatQrpcJob *job);
+static int resample_audio_frame(AVFormatQrpcAudioEncoder *audio, AVFrame *frame, AVRational time_base);
+static int on_audio_pkt(void *opaque, AVPacket *pkt);
+static void free_scalers(AVFormatQrpcContext *qrpcCtx);
+static void subscribe_rendition_config(AVFormatContext *ctx, const AVOutputFormat *ofmt, const char *fmt, const AVFormatQrpcEncoderConfig *encoder, AVFormatQrpcRenditionConfig *config);
+static int rung_config(AVFormatQrpcContext *qrpcCtx, int rung, AVFormatQrpcRenditionConfig *config);
+static int member_slots(AVFormatQrpcRendition *rendition);
+static AVFormatQrpcContextSubscriber* member_at(AVFormatQrpcRendition *rendition, int slot);
+static void begin_member_pass(AVFormatQrpcRendition *rendition);
+static void end_member_pass(AVFormatQrpcRendition *rendition);
+static void reclaim_members(AVFormatQrpcRendition *rendition);
+static void unlink_failed_members(AVFormatQrpcRendition *rendition);
+static void unlink_all_members(AVFormatQrpcContext *qrpcCtx, AVFormatQrpcRendition *rendition);
+static void unlink_empty_renditions(AVFormatQrpcContext *qrpcCtx);
+static bool take_over_subscriber(AVFormatQrpcRendition *rendition, AVFormatQrpcContextSubscriber *subscriber, AVPacket *pkt, AVRational time_base);
+static void finish_switches(AVFormatQrpcRendition *rendition);
+static void cancel_switch(AVFormatQrpcContextSubscriber *subscriber);
+static bool evaluate_rung(AVFormatQrpcContextSubscriber *subscriber, int64_t now);
+static void write_rendition_members(AVFormatQrpcRendition *rendition, AVPacket *pkt, AVRational time_base, bool keyframe);
+static void cache_gop_packet(AVFormatQrpcRendition *rendition, AVPacket *pkt, AVRational time_base, bool keyframe);
+static void reset_gop_cache(AVFormatQrpcRendition *rendition, bool valid);
+static bool burst_gop_cache(AVFormatQrpcRendition *rendition, AVFormatQrpcContextSubscriber *subscriber);
+static AVFormatQrpcRendition* find_or_new_rendition(AVFormatContext *ifc, const AVFormatQrpcRenditionConfig *config, int *ret);
+static void unlink_rendition(AVFormatQrpcContext *qrpcCtx, AVFormatQrpcRendition *rendition);
+static void unref_rendition(AVFormatQrpcRendition *rendition);
+static void free_rendition(AVFormatQrpcRendition *rendition);
+static bool rendition_config_equal(const AVFormatQrpcRenditionConfig *a, const AVFormatQrpcRenditionConfig *b);
+static bool encoder_config_equal(const AVFormatQrpcEncoderConfig *a, const AVFormatQrpcEncoderConfig *b);
+static int acquire_encoder_threads(int want);
+static int open_video_encoder(AVFormatQrpcRendition *rendition, AVCodecContext *enc_ctx, AVCodec *encoder);
+static AVFormatQrpcContextSubscriber* new_subscriber(AVFormatContext *oc, uint64_t seq, uintptr_t writer, const AVFormatQrpcSubscribeConfig *subscribe_config);
+static bool enqueue_subscriber(AVFormatQrpcRendition *rendition, AVFormatQrpcContextSubscriber *subscriber, AVPacket *pkt, AVRational time_base, bool keyframe);
+static void close_subscriber(AVFormatQrpcContextSubscriber *subscriber, bool failed);
+static int flush_subscriber(AVFormatQrpcContextSubscriber *subscriber);
+static int mark_keyframe(AVFormatQrpcContextSubscriber *subscriber, AVPacket *pkt);
+static int add_subscriber(AVFormatQrpcContext *qrpcCtx, AVFormatQrpcContextSubscriber *subscriber);
+static int add_member(AVFormatQrpcRendition *rendition, AVFormatQrpcContextSubscriber *subscriber);
+static void release_member(AVFormatQrpcRendition *rendition, int slot, AVFormatQrpcContextSubscriber *subscriber, bool switched);
+static void del_all_subscribers(AVFormatQrpcContext* qrpcCtx);
+static void unlink_subscriber(AVFormatQrpcContext* qrpcCtx, AVFormatQrpcContextSubscriber *subscriber);
+static void unref_subscriber(AVFormatQrpcContextSubscriber* sub);
 static void free_subscriber(AVFormatQrpcContextSubscriber* sub);
 static int write_subscriber_callback(void* sub, uint8_t *buf, int buf_size);
-static int prepare_avformatcontext_for_output(AVFormatContext *ifc, AVFormatQrpcContextSubscriber *subscriber);
+static int open_rendition_encoders(AVFormatContext *ifc, AVFormatQrpcRendition *rendition);
+static int prepare_avformatcontext_for_output(AVFormatQrpcRendition *rendition, AVFormatQrpcContextSubscriber *subscriber);
 static int encode_avframe(AVFrame *frame, AVCodecContext *enc_ctx, void *opaque, int(*on_pkt)(void *, AVPacket *));
-static int on_ioseq_pkt(void *opaque, AVPacket *pkt);
-static int on_subscriber_pkt(void *opaque, AVPacket *pkt);
+static int on_writer_pkt(void *opaque, AVPacket *pkt);
+static int on_rendition_pkt(void *opaque, AVPacket *pkt);
     
 
 
-int avformat_open_qrpc_input(AVFormatContext **ppctx, const char *fmt, void* goctx)
+int avformat_open_qrpc_input(AVFormatContext **ppctx, const char *fmt, void* goctx, const AVFormatQrpcInputConfig *config)
 {
     AVIOContext *avio_ctx = NULL;
     AVFormatQrpcContext* qrpcCtx = NULL;
@@ -63,19 +416,25 @@ int avformat_open_qrpc_input(AVFormatContext **ppctx, const char *fmt, void* goc
         return AVERROR(EINVAL);
     }
 
+    int64_t connect_time = config && config->connect_time ? config->connect_time : av_gettime();
     if (!(*ppctx = avformat_alloc_context())) return AVERROR(ENOMEM);
     (*ppctx)->opaque = NULL;
+    // viewers wait for as long as the input is probed
+    if (config && config->probesize > 0) (*ppctx)->probesize = FFMAX(config->probesize, 32);
+    if (config && config->analyze_duration_ms > 0) (*ppctx)->max_analyze_duration = config->analyze_duration_ms * 1000;
 
     int ret;
-    size_t avio_ctx_buffer_size = 4096;
-    uint8_t *avio_ctx_buffer = av_malloc(avio_ctx_buffer_size);
+    // large enough for a whole qrpc frame, so a payload usually takes a single callback
+    int avio_ctx_buffer_size = atomic_load(&ingest_avio_buffer_size);
+    uint8_t *avio_ctx_buffer = qrpc_avio_buffer_get(avio_ctx_buffer_size);
     if (!avio_ctx_buffer) {
         ret = AVERROR(ENOMEM);
         goto end;
     }
     avio_ctx = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size,
-                                  0, goctx, &read_packet_callback, NULL, NULL);
+                                  0, goctx, &read_packet_timed, NULL, NULL);
     if (!avio_ctx) {
+        av_free(avio_ctx_buffer);
         ret = AVERROR(ENOMEM);
         goto end;
     }
@@ -87,46 +446,67 @@ int avformat_open_qrpc_input(AVFormatContext **ppctx, const char *fmt, void* goc
         goto end;
     }
 
-    if ((ret = avformat_find_stream_info(*ppctx, NULL)) < 0) {
+    bool stream_info_skipped = config && apply_stream_params(*ppctx, config);
+    if (!stream_info_skipped && (ret = avformat_find_stream_info(*ppctx, NULL)) < 0) {
         fprintf(stderr, "Could not find stream information\n");
         goto end;
     }
 
     printf("nstreams:%d\n", (*ppctx)->nb_streams);
 
-    qrpcCtx = av_malloc(sizeof(AVFormatQrpcContext));
+    qrpcCtx = av_mallocz(sizeof(AVFormatQrpcContext));
     if (!qrpcCtx) {
         ret = AVERROR(ENOMEM);
         goto end;
     }
+    if ((ret = init_qrpc_context_sync(qrpcCtx)) < 0) {
+        // free_qrpc_context expects all of them
+        av_freep(&qrpcCtx);
+        goto end;
+    }
     qrpcCtx->goctx = goctx;
+    if (config) qrpcCtx->config = *config;
+    if (!qrpcCtx->config.decoder_thread_type) qrpcCtx->config.decoder_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
     qrpcCtx->nb_streams = (*ppctx)->nb_streams;
+    qrpcCtx->connect_time = connect_time;
+    qrpcCtx->stream_info_skipped = stream_info_skipped;
+    qrpcCtx->lag_stream = -1;
+    qrpcCtx->lag_base_pts = AV_NOPTS_VALUE;
+    qrpcCtx->last_dts = AV_NOPTS_VALUE;
     qrpcCtx->dec_ctx = av_mallocz_array(qrpcCtx->nb_streams, sizeof(AVCodecContext*));
-    if (!qrpcCtx->dec_ctx) {
+    qrpcCtx->dec_threads = av_mallocz_array(qrpcCtx->nb_streams, sizeof(int));
+    if (!qrpcCtx->dec_ctx || !qrpcCtx->dec_threads) {
         ret = AVERROR(ENOMEM);
         goto end;
     }
     qrpcCtx->latest = av_mallocz_array(qrpcCtx->nb_streams, sizeof(AVFrame*));
-    if (!qrpcCtx->latest) {
+    qrpcCtx->latest_frame_generation = av_mallocz_array(qrpcCtx->nb_streams, sizeof(uint64_t));
+    qrpcCtx->latest_spare = av_frame_alloc();
+    qrpcCtx->dec_frame = av_frame_alloc();
+    if (!qrpcCtx->latest || !qrpcCtx->latest_frame_generation || !qrpcCtx->latest_spare || !qrpcCtx->dec_frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    qrpcCtx->decoding = av_mallocz_array(qrpcCtx->nb_streams, sizeof(bool));
+    qrpcCtx->audio_tasks = av_mallocz_array(qrpcCtx->nb_streams, sizeof(AVFormatQrpcAudioTask *));
+    if (!qrpcCtx->decoding || !qrpcCtx->audio_tasks) {
         ret = AVERROR(ENOMEM);
         goto end;
     }
     for (int i = 0; i < qrpcCtx->nb_streams; i++) {
-        ret = open_codec_context(i, &qrpcCtx->dec_ctx[i], *ppctx);
+        // nothing is decoded yet, video decoders get their threads once they are fed
+        ret = open_codec_context(i, &qrpcCtx->dec_ctx[i], *ppctx, 1, qrpcCtx->config.decoder_thread_type);
         if (ret < 0) goto end;
+        qrpcCtx->dec_threads[i] = 1;
+        if (qrpcCtx->lag_stream < 0 && qrpcCtx->dec_ctx[i]->codec_type == AVMEDIA_TYPE_VIDEO) qrpcCtx->lag_stream = i;
     }
-    
-    if ((ret = pthread_mutex_init(&qrpcCtx->mutex, NULL)) < 0) goto end;
-    qrpcCtx->subscribers = NULL;
+    qrpcCtx->renditions = NULL;
+    qrpcCtx->open_latency = av_gettime() - connect_time;
 
 end:
     if (ret < 0) {
         avformat_close_input(ppctx);
-        /* note: the internal buffer could have changed, and be != avio_ctx_buffer */
-        if (avio_ctx) {
-            av_freep(&avio_ctx->buffer);
-            av_freep(&avio_ctx);
-        }
+        qrpc_avio_context_free(&avio_ctx);
         free_qrpc_context(qrpcCtx);
         return ret;
     } else {
@@ -137,9 +517,37 @@ end:
 }
 
 
-AVFormatContext* AVFormat_Open(const char *fmt, uintptr_t goctx) {
+// the locks and conditions of qrpcCtx, all or none of them are initialized
+int init_qrpc_context_sync(AVFormatQrpcContext *qrpcCtx)
+{
+    if (pthread_mutex_init(&qrpcCtx->mutex, NULL)) goto fail;
+    if (pthread_mutex_init(&qrpcCtx->latest_lock, NULL)) goto destroy_mutex;
+    if (pthread_cond_init(&qrpcCtx->latest_cond, NULL)) goto destroy_latest_lock;
+    if (pthread_cond_init(&qrpcCtx->idle_cond, NULL)) goto destroy_latest_cond;
+    return 0;
+
+destroy_latest_cond:
+    pthread_cond_destroy(&qrpcCtx->latest_cond);
+destroy_latest_lock:
+    pthread_mutex_destroy(&qrpcCtx->latest_lock);
+destroy_mutex:
+    pthread_mutex_destroy(&qrpcCtx->mutex);
+fail:
+    return AVERROR(ENOMEM);
+}
+
+// av_read_frame blocks in the go callback while it waits for the publisher, which isn't demuxing
+int read_packet_timed(void *goctx, uint8_t *buf, int buf_size)
+{
+    int64_t start = av_gettime_relative();
+    int ret = read_packet_callback(goctx, buf, buf_size);
+    qrpc_callback_us += av_gettime_relative() - start;
+    return ret;
+}
+
+AVFormatContext* AVFormat_Open(const char *fmt, uintptr_t goctx, const AVFormatQrpcInputConfig *config, int *ret) {
     AVFormatContext* ctx;
-    if (avformat_open_qrpc_input(&ctx, fmt, (void*)goctx) < 0) {
+    if ((*ret = avformat_open_qrpc_input(&ctx, fmt, (void*)goctx, config)) < 0) {
         printf("avformat_open_qrpc_input fail\n");
         return NULL;
     }
@@ -152,47 +560,434 @@ int AVFormat_ReadFrame(AVFormatContext* ctx)
     AVPacket pkt;
     av_init_packet(&pkt);
     
+    int64_t start = av_gettime_relative(), callback_us = qrpc_callback_us;
     int ret = av_read_frame(ctx, &pkt);
+    qrpc_metrics_observe(QRPC_STAGE_DEMUX, av_gettime_relative() - start - (qrpc_callback_us - callback_us));
     if (ret < 0) {
-        fprintf(stderr, "av_read_frame ng:%d\n", ret);
+        if (ret != AVERROR_EOF) qrpc_metrics_error(QRPC_STAGE_DEMUX);
         return ret;
     }
     
     AVFormatQrpcContext *qrpcCtx = ctx->opaque;
+    int idx = pkt.stream_index;
+    // streams showing up after avformat_find_stream_info are not handled
+    if (idx >= qrpcCtx->nb_streams) goto end;
+    rebind_timestamps(ctx, &pkt);
+
+    // the mutex only guards the snapshot, encoding and muxing happen on the worker pool
+    qrpc_metrics_lock(&qrpcCtx->mutex, QRPC_STAGE_INGEST_LOCK);
+    int nb_dispatch = snapshot_renditions(qrpcCtx);
+    bool decode = need_decode(qrpcCtx, idx);
+    bool resume = decode && !qrpcCtx->decoding[idx];
+    AVCodecContext *dec_ctx = qrpcCtx->dec_ctx[idx];
+    // a resumed video decoder can only start from a keyframe
+    if (resume && dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && !(pkt.flags & AV_PKT_FLAG_KEY)) decode = false;
+    bool suspend = !decode && qrpcCtx->decoding[idx];
+    qrpcCtx->decoding[idx] = decode;
+    pthread_mutex_unlock(&qrpcCtx->mutex);
+
+    bool passthrough = false, encode = false;
+    for (int i = 0; i < nb_dispatch; i++) {
+        if (qrpcCtx->dispatch[i]->config.passthrough) passthrough = true;
+        else if (qrpcCtx->dispatch[i]->enc_ctx[idx] || qrpcCtx->dispatch[i]->audio[idx]) encode = true;
+    }
+
+    if (passthrough) {
+        AVFormatQrpcJob *job = new_job(idx);
+        if (job && (job->pkt = qrpc_packet_clone(&pkt))) {
+            for (int i = 0; i < nb_dispatch; i++) {
+                if (qrpcCtx->dispatch[i]->config.passthrough) dispatch_job(qrpcCtx->dispatch[i], job);
+            }
+        }
+        if (job) unref_job(job);
+    }
+
+    bool video = dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO;
+    if (suspend) {
+        avcodec_flush_buffers(dec_ctx);
+        if (video) stop_video_decoder(qrpcCtx, idx);
+    }
+    if (!decode) goto end;
+
+    if (video) {
+        if (resume) start_video_decoder(qrpcCtx, idx);
+        // publishers came or went since the decoder was opened, a keyframe is where it can be swapped
+        if ((pkt.flags & AV_PKT_FLAG_KEY) && decoder_thread_grant(qrpcCtx->config.decoder_threads) != qrpcCtx->dec_threads[idx])
+            rebalance_decoder(ctx, idx, nb_dispatch, encode);
+    }
 
-    AVCodecContext *dec_ctx = qrpcCtx->dec_ctx[pkt.stream_index];
-    ret = avcodec_send_packet(dec_ctx, &pkt);
+    ret = decode_packet(ctx, idx, &pkt, nb_dispatch, encode);
+
+end:
+    release_renditions(qrpcCtx);
+    av_packet_unref(&pkt);
+
+
+    return ret;
+}
+
+// send pkt to the decoder of stream idx and dispatch what it outputs, pkt NULL drains it
+int decode_packet(AVFormatContext *ctx, int idx, AVPacket *pkt, int nb_dispatch, bool encode)
+{
+    AVFormatQrpcContext *qrpcCtx = ctx->opaque;
+    AVCodecContext *dec_ctx = qrpcCtx->dec_ctx[idx];
+    AVFrame *frame = qrpcCtx->dec_frame;
+    // only the time in the decoder, not dispatching what it outputs
+    int64_t start = av_gettime_relative();
+    int ret = avcodec_send_packet(dec_ctx, pkt);
+    int64_t decode_us = av_gettime_relative() - start;
+    if (ret < 0 && ret != AVERROR_EOF) qrpc_metrics_error(QRPC_STAGE_DECODE);
 
-    AVFrame *frame = av_frame_alloc();
     while (ret >= 0) {
+        start = av_gettime_relative();
         ret = avcodec_receive_frame(dec_ctx, frame);
+        decode_us += av_gettime_relative() - start;
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
             break;
         if (ret < 0) {
-            fprintf(stderr, "Error while receiving a frame from the decoder\n");
+            qrpc_metrics_error(QRPC_STAGE_DECODE);
             break;
         }
 
+        frame->pts = frame->best_effort_timestamp;
+        if (encode && dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
+            queue_audio_frame(qrpcCtx, idx, frame, nb_dispatch);
+        } else if (encode) {
+            AVFormatQrpcJob *job = new_job(idx);
+            if (job) job->seq = ++qrpcCtx->job_seq;
+            if (job && (job->frame = qrpc_frame_clone(frame))) {
+                for (int i = 0; i < nb_dispatch; i++) {
+                    if (qrpcCtx->dispatch[i]->enc_ctx[idx]) dispatch_job(qrpcCtx->dispatch[i], job);
+                }
+            }
+            if (job) unref_job(job);
+        }
+
+        if (dec_ctx->codec_type != AVMEDIA_TYPE_VIDEO) continue;
+        if (!atomic_fetch_add(&qrpcCtx->decoded_frames, 1))
+            atomic_store(&qrpcCtx->first_frame_latency, FFMAX(1, av_gettime() - qrpcCtx->connect_time));
+        if (idx == qrpcCtx->lag_stream && frame->pts != AV_NOPTS_VALUE)
+            update_decode_lag(qrpcCtx, av_rescale_q(frame->pts, ctx->streams[idx]->time_base, AV_TIME_BASE_Q));
+        publish_latest_frame(qrpcCtx, idx, frame);
+        if (atomic_load(&qrpcCtx->snapshot_waiters)) {
+            pthread_mutex_lock(&qrpcCtx->mutex);
+            pthread_cond_broadcast(&qrpcCtx->latest_cond);
+            pthread_mutex_unlock(&qrpcCtx->mutex);
+        }
+    }
+
+    if (pkt) qrpc_metrics_observe(QRPC_STAGE_DECODE, decode_us);
+    av_frame_unref(frame);
+    return ret;
+}
+
+// threads a video decoder wanting want gets now, an even share of the budget among the decoders being fed
+int decoder_thread_grant(int want)
+{
+    int budget = atomic_load(&decoder_thread_budget);
+    if (budget <= 0) budget = av_cpu_count();
+    if (want <= 0) want = DEFAULT_DECODER_THREADS;
+    int share = budget / FFMAX(1, atomic_load(&active_decoders));
+    return FFMAX(1, FFMIN(want, share));
+}
+
+// the video decoder of stream idx starts being fed
+void start_video_decoder(AVFormatQrpcContext *qrpcCtx, int idx)
+{
+    atomic_fetch_add(&active_decoders, 1);
+    atomic_fetch_add(&qrpcCtx->decoder_threads, qrpcCtx->dec_threads[idx]);
+    // the gap while suspended is not lag
+    if (idx == qrpcCtx->lag_stream) qrpcCtx->lag_base_pts = AV_NOPTS_VALUE;
+}
+
+void stop_video_decoder(AVFormatQrpcContext *qrpcCtx, int idx)
+{
+    atomic_fetch_sub(&active_decoders, 1);
+    atomic_fetch_sub(&qrpcCtx->decoder_threads, qrpcCtx->dec_threads[idx]);
+    if (idx == qrpcCtx->lag_stream) atomic_store(&qrpcCtx->decode_lag, 0);
+}
+
+// called at a keyframe, replaces the decoder of stream idx with one opened with its current share of threads
+// frames the old one still holds are drained and dispatched first, so none are lost
+void rebalance_decoder(AVFormatContext *ctx, int idx, int nb_dispatch, bool encode)
+{
+    AVFormatQrpcContext *qrpcCtx = ctx->opaque;
+    int threads = decoder_thread_grant(qrpcCtx->config.decoder_threads);
+    AVCodecContext *dec_ctx = NULL;
+    // keep the old decoder if this fails, the next keyframe tries again
+    if (open_codec_context(idx, &dec_ctx, ctx, threads, qrpcCtx->config.decoder_thread_type) < 0) return;
+
+    decode_packet(ctx, idx, NULL, nb_dispatch, encode);
+    avcodec_free_context(&qrpcCtx->dec_ctx[idx]);
+    qrpcCtx->dec_ctx[idx] = dec_ctx;
+    atomic_fetch_add(&qrpcCtx->decoder_threads, threads - qrpcCtx->dec_threads[idx]);
+    qrpcCtx->dec_threads[idx] = threads;
+}
+
+// lag is the wall clock elapsed since a base frame was decoded minus the pts elapsed since that frame
+// the base moves up whenever decoding catches up, so buffered bursts don't hide later lag
+void update_decode_lag(AVFormatQrpcContext *qrpcCtx, int64_t pts)
+{
+    int64_t now = av_gettime_relative();
+    int64_t lag = 0;
+    if (qrpcCtx->lag_base_pts != AV_NOPTS_VALUE && pts >= qrpcCtx->lag_base_pts)
+        lag = (now - qrpcCtx->lag_base_wall) - (pts - qrpcCtx->lag_base_pts);
+    if (lag <= 0) {
+        // first frame, caught up or the publisher's timestamps went back
+        qrpcCtx->lag_base_pts = pts;
+        qrpcCtx->lag_base_wall = now;
+        lag = 0;
+    }
+    atomic_store(&qrpcCtx->decode_lag, lag);
+}
+
+void AVFormat_IngestStats(AVFormatContext* ctx, AVFormatQrpcIngestStats *stats)
+{
+    AVFormatQrpcContext *qrpcCtx = ctx->opaque;
+    stats->decoded_frames = atomic_load(&qrpcCtx->decoded_frames);
+    stats->decode_lag_ms = atomic_load(&qrpcCtx->decode_lag) / 1000;
+    stats->decoder_threads = atomic_load(&qrpcCtx->decoder_threads);
+    stats->open_ms = qrpcCtx->open_latency / 1000;
+    stats->first_frame_ms = atomic_load(&qrpcCtx->first_frame_latency) / 1000;
+    stats->stream_info_skipped = qrpcCtx->stream_info_skipped;
+}
+
+// a publisher that reconnected restarts its timestamps, or libavformat wraps them, and this could
+// only be told from the first packet of the new publisher, as the demuxer may still hold packets of the old one
+#define REBIND_MAX_GAP (30 * AV_TIME_BASE)
+// between the last packet of the old publisher and the first of the new one
+#define REBIND_TS_STEP (AV_TIME_BASE / 25)
+
+// shift timestamps so subscribers see them carry on across a rebind
+void rebind_timestamps(AVFormatContext *ctx, AVPacket *pkt)
+{
+    AVFormatQrpcContext *qrpcCtx = ctx->opaque;
+    AVRational time_base = ctx->streams[pkt->stream_index]->time_base;
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    if (ts == AV_NOPTS_VALUE) return;
+
+    int64_t dts = av_rescale_q(ts, time_base, AV_TIME_BASE_Q) + qrpcCtx->ts_offset;
+    if (qrpcCtx->last_dts != AV_NOPTS_VALUE && atomic_load(&qrpcCtx->rebound) &&
+        (dts < qrpcCtx->last_dts - AV_TIME_BASE || dts > qrpcCtx->last_dts + REBIND_MAX_GAP)) {
+        atomic_store(&qrpcCtx->rebound, false);
+        qrpcCtx->ts_offset += qrpcCtx->last_dts + REBIND_TS_STEP - dts;
+        dts = qrpcCtx->last_dts + REBIND_TS_STEP;
+        restart_decoders(ctx);
+    }
+
+    if (qrpcCtx->ts_offset) {
+        int64_t offset = av_rescale_q(qrpcCtx->ts_offset, AV_TIME_BASE_Q, time_base);
+        if (pkt->pts != AV_NOPTS_VALUE) pkt->pts += offset;
+        if (pkt->dts != AV_NOPTS_VALUE) pkt->dts += offset;
+    }
+    if (qrpcCtx->last_dts == AV_NOPTS_VALUE || dts > qrpcCtx->last_dts) qrpcCtx->last_dts = dts;
+}
+
+// the new publisher's packets don't follow on from what the decoders hold,
+// suspend them all so they resume at its first keyframe
+void restart_decoders(AVFormatContext *ctx)
+{
+    AVFormatQrpcContext *qrpcCtx = ctx->opaque;
+    pthread_mutex_lock(&qrpcCtx->mutex);
+    for (int i = 0; i < qrpcCtx->nb_streams; i++) {
+        if (!qrpcCtx->decoding[i]) continue;
+        qrpcCtx->decoding[i] = false;
+        avcodec_flush_buffers(qrpcCtx->dec_ctx[i]);
+        if (qrpcCtx->dec_ctx[i]->codec_type == AVMEDIA_TYPE_VIDEO) stop_video_decoder(qrpcCtx, i);
+    }
+    pthread_mutex_unlock(&qrpcCtx->mutex);
+}
+
+// a new publisher took over the input, called from the read callback
+void AVFormat_Rebind(AVFormatContext* ctx)
+{
+    AVFormatQrpcContext *qrpcCtx = ctx->opaque;
+    atomic_store(&qrpcCtx->rebound, true);
+}
 
-        write_subscribers(qrpcCtx, pkt.stream_index, frame);
+// fill the codec parameters of the streams the demuxer found from config->streams instead of probing
+// returns false, touching nothing, unless they are the same streams in the same order
+bool apply_stream_params(AVFormatContext *ctx, const AVFormatQrpcInputConfig *config)
+{
+    if (!config->nb_streams || config->nb_streams != ctx->nb_streams) return false;
+
+    for (int i = 0; i < config->nb_streams; i++) {
+        const AVFormatQrpcStreamParams *params = &config->streams[i];
+        AVCodecParameters *par = ctx->streams[i]->codecpar;
+        const char *type = av_get_media_type_string(par->codec_type);
+        if (!type || strcmp(type, params->type)) return false;
+        if (par->codec_type != AVMEDIA_TYPE_VIDEO && par->codec_type != AVMEDIA_TYPE_AUDIO) return false;
+        if (par->codec_id == AV_CODEC_ID_NONE || (params->codec[0] && strcmp(avcodec_get_name(par->codec_id), params->codec)))
+            return false;
+    }
 
-        if (!qrpcCtx->latest[pkt.stream_index]) {
-            AVFrame *latest = av_frame_clone(frame);
-            qrpcCtx->latest[pkt.stream_index] = latest;
+    for (int i = 0; i < config->nb_streams; i++) {
+        const AVFormatQrpcStreamParams *params = &config->streams[i];
+        AVStream *st = ctx->streams[i];
+        AVCodecParameters *par = st->codecpar;
+        if (params->bit_rate > 0) par->bit_rate = params->bit_rate;
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+            if (params->width > 0 && params->height > 0) {
+                par->width = params->width;
+                par->height = params->height;
+            }
+            if (params->format[0]) par->format = av_get_pix_fmt(params->format);
+            if (params->frame_rate_num > 0 && params->frame_rate_den > 0)
+                st->avg_frame_rate = st->r_frame_rate = (AVRational){params->frame_rate_num, params->frame_rate_den};
         } else {
-            av_frame_copy(qrpcCtx->latest[pkt.stream_index], frame);
+            if (params->format[0]) par->format = av_get_sample_fmt(params->format);
+            if (params->sample_rate > 0) par->sample_rate = params->sample_rate;
+            if (params->channels > 0) par->channels = params->channels;
+            if (params->channel_layout) par->channel_layout = params->channel_layout;
+        }
+    }
+    return true;
+}
+
+// codec parameters of the streams, as config->streams of a later AVFormat_Open of the same publisher
+int AVFormat_StreamParams(AVFormatContext* ctx, AVFormatQrpcStreamParams *params, int max)
+{
+    int n = FFMIN(ctx->nb_streams, max);
+    for (int i = 0; i < n; i++) {
+        AVStream *st = ctx->streams[i];
+        AVCodecParameters *par = st->codecpar;
+        AVFormatQrpcStreamParams *p = &params[i];
+        memset(p, 0, sizeof(*p));
+        const char *type = av_get_media_type_string(par->codec_type);
+        av_strlcpy(p->type, type ? type : "", sizeof(p->type));
+        av_strlcpy(p->codec, avcodec_get_name(par->codec_id), sizeof(p->codec));
+        p->bit_rate = par->bit_rate;
+        const char *format = NULL;
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+            format = av_get_pix_fmt_name(par->format);
+            p->width = par->width;
+            p->height = par->height;
+            p->frame_rate_num = st->avg_frame_rate.num;
+            p->frame_rate_den = st->avg_frame_rate.den;
+        } else if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
+            format = av_get_sample_fmt_name(par->format);
+            p->sample_rate = par->sample_rate;
+            p->channels = par->channels;
+            p->channel_layout = par->channel_layout;
         }
+        av_strlcpy(p->format, format ? format : "", sizeof(p->format));
     }
+    return n;
+}
 
-end:
-    av_frame_free(&frame);
-    av_packet_unref(&pkt);
+// take a reference of every rendition into qrpcCtx->dispatch
+// caller must hold qrpcCtx->mutex
+int snapshot_renditions(AVFormatQrpcContext *qrpcCtx)
+{
+    int n = 0;
+    for (AVFormatQrpcRendition *rendition = qrpcCtx->renditions; rendition; rendition = rendition->next) n++;
+
+    if (n > qrpcCtx->dispatch_size) {
+        AVFormatQrpcRendition **dispatch = av_realloc_array(qrpcCtx->dispatch, n, sizeof(AVFormatQrpcRendition *));
+        if (!dispatch) return 0;
+        qrpcCtx->dispatch = dispatch;
+        qrpcCtx->dispatch_size = n;
+    }
 
+    n = 0;
+    for (AVFormatQrpcRendition *rendition = qrpcCtx->renditions; rendition; rendition = rendition->next) {
+        atomic_fetch_add(&rendition->refs, 1);
+        qrpcCtx->dispatch[n++] = rendition;
+    }
+    qrpcCtx->nb_dispatch = n;
+    return n;
+}
 
-    return ret;
+void release_renditions(AVFormatQrpcContext *qrpcCtx)
+{
+    for (int i = 0; i < qrpcCtx->nb_dispatch; i++) {
+        unref_rendition(qrpcCtx->dispatch[i]);
+    }
+    qrpcCtx->nb_dispatch = 0;
+}
+
+AVFormatQrpcJob* new_job(int stream_index)
+{
+    AVFormatQrpcJob *job = qrpc_objpool_get(&job_pool);
+    if (!job && !(job = av_malloc(sizeof(AVFormatQrpcJob)))) return NULL;
+
+    memset(job, 0, sizeof(*job));
+    atomic_init(&job->refs, 1);
+    job->stream_index = stream_index;
+    return job;
+}
+
+void unref_job(AVFormatQrpcJob *job)
+{
+    if (atomic_fetch_sub(&job->refs, 1) > 1) return;
+
+    qrpc_frame_free(&job->frame);
+    qrpc_packet_free(&job->pkt);
+    for (int i = 0; i < job->nb_renditions; i++) {
+        unref_rendition(job->renditions[i]);
+    }
+    av_freep(&job->renditions);
+    if (!qrpc_objpool_put(&job_pool, job)) av_free(job);
+}
+
+// queue job for rendition, the oldest job is dropped when the queue is full
+void dispatch_job(AVFormatQrpcRendition *rendition, AVFormatQrpcJob *job)
+{
+    AVFormatQrpcJob *dropped = NULL;
+
+    atomic_fetch_add(&job->refs, 1);
+    pthread_mutex_lock(&rendition->lock);
+    if (rendition->nb_jobs == RENDITION_QUEUE_SIZE) {
+        dropped = rendition->jobs[rendition->jobs_head];
+        rendition->jobs_head = (rendition->jobs_head + 1) % RENDITION_QUEUE_SIZE;
+        rendition->nb_jobs --;
+        rendition->jobs_dropped = true;
+    }
+    rendition->jobs[(rendition->jobs_head + rendition->nb_jobs) % RENDITION_QUEUE_SIZE] = job;
+    rendition->nb_jobs ++;
+    pthread_mutex_unlock(&rendition->lock);
+
+    if (dropped) unref_job(dropped);
+    schedule_rendition(rendition);
+}
+
+// make sure a worker will look at the job queue of rendition
+void schedule_rendition(AVFormatQrpcRendition *rendition)
+{
+    if (atomic_exchange(&rendition->scheduled, 1)) return;
+
+    AVFormatQrpcContext *qrpcCtx = rendition->qrpcCtx;
+    atomic_fetch_add(&rendition->refs, 1);
+    atomic_fetch_add(&qrpcCtx->pending_tasks, 1);
+    if (qrpc_workers_submit(process_rendition, rendition) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Failed to schedule rendition %s\n", rendition->config.fmt);
+        atomic_store(&rendition->scheduled, 0);
+        unref_rendition(rendition);
+        task_done(qrpcCtx);
+    }
 }
 
-int AVFormat_ReadLatestVideoFrame(AVFormatContext* ctx, const char *fmt, uint64_t seq)
+// register a snapshot waiter, called while the context can't be freed,
+// AVFormat_WaitLatestVideoFrame must follow and may run while it is being freed
+void AVFormat_AddSnapshotWaiter(AVFormatContext* ctx)
+{
+    AVFormatQrpcContext *qrpcCtx = ctx->opaque;
+    if (qrpcCtx) atomic_fetch_add(&qrpcCtx->snapshot_waiters, 1);
+}
+
+// keep video decoded and return the generation of the latest video frame once there is a fresh one,
+// or the context is being freed, which waits for it to return
+uint64_t AVFormat_WaitLatestVideoFrame(AVFormatContext* ctx)
+{
+    AVFormatQrpcContext *qrpcCtx = ctx->opaque;
+    if (!qrpcCtx) return 0;
+
+    return wait_latest_frame(qrpcCtx);
+}
+
+// encode the latest video frame, scaled to width x height if any of them is positive,
+// *generation is set to the generation of the encoded frame
+int AVFormat_ReadLatestVideoFrame(AVFormatContext* ctx, const char *fmt, uintptr_t writer, int width, int height, uint64_t *generation)
 {
     AVCodec *enc = avcodec_find_encoder_by_name(fmt);
     if (!enc) {
@@ -207,7 +1002,13 @@ int AVFormat_ReadLatestVideoFrame(AVFormatContext* ctx, const char *fmt, uint64_
     }
     encctx->time_base = (AVRational){1, 25};
 
-    int ret = 0;
+    int ret = AVERROR(EAGAIN);
+    AVFrame *scaled = NULL;
+    AVFrame *latest = av_frame_alloc();
+    if (!latest) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
     AVFormatQrpcContext *qrpcCtx = ctx->opaque;
     if (!qrpcCtx) {
         fprintf(stderr, "qrpcCtx not found\n");
@@ -218,34 +1019,282 @@ int AVFormat_ReadLatestVideoFrame(AVFormatContext* ctx, const char *fmt, uint64_
         AVCodecContext *cctx = qrpcCtx->dec_ctx[i];
         if (!cctx) continue;
         if (cctx->codec->type != AVMEDIA_TYPE_VIDEO) continue;
-        if (!qrpcCtx->latest[i]) continue;
-        
-        encctx->pix_fmt = cctx->pix_fmt;
-        encctx->width = qrpcCtx->latest[i]->width;
-        encctx->height = qrpcCtx->latest[i]->height;
-        if ((ret = avcodec_open2(encctx, enc, NULL)) < 0) goto end;
+        if (!ref_latest_frame(qrpcCtx, i, latest, generation)) continue;
 
-    
-        IOSeqContext ioseq = {qrpcCtx->goctx, seq};
-        int ret = encode_avframe(qrpcCtx->latest[i], encctx, &ioseq, on_ioseq_pkt);
-        if (ret < 0) {
-            fprintf(stderr, "encode_avframe err:%d", ret);
-            goto endloop;
-        }
+        AVFrame *frame = latest;
+        if ((ret = scale_snapshot_frame(frame, width, height, &scaled)) < 0) goto end;
+        if (scaled) frame = scaled;
+
+        // the decoder context belongs to the ingest thread, the frame carries its own format
+        encctx->pix_fmt = frame->format;
+        encctx->width = frame->width;
+        encctx->height = frame->height;
+        if ((ret = avcodec_open2(encctx, enc, NULL)) < 0) goto end;
 
-        endloop:
+        ret = encode_avframe(frame, encctx, &writer, on_writer_pkt);
+        // the encoder just wants more input
+        if (ret == AVERROR(EAGAIN)) ret = 0;
+        if (ret < 0) fprintf(stderr, "encode_avframe err:%d", ret);
         break;
     }
 
 end:
+    av_frame_free(&scaled);
+    av_frame_free(&latest);
     avcodec_free_context(&encctx);
     return ret;
 }
 
-int on_ioseq_pkt(void *opaque, AVPacket *pkt)
+// *scaled is left NULL when frame already has the requested size,
+// a non-positive width or height keeps the aspect ratio of frame
+int scale_snapshot_frame(AVFrame *frame, int width, int height, AVFrame **scaled)
+{
+    if (width <= 0 && height <= 0) return 0;
+    fit_size(frame->width, frame->height, &width, &height);
+    if (width == frame->width && height == frame->height) return 0;
+
+    int ret;
+    AVFrame *dst = av_frame_alloc();
+    if (!dst) return AVERROR(ENOMEM);
+    dst->format = frame->format;
+    dst->width = width;
+    dst->height = height;
+    if ((ret = av_frame_get_buffer(dst, 32)) < 0) goto fail;
+
+    struct SwsContext *sws = sws_getContext(frame->width, frame->height, frame->format,
+                                            width, height, frame->format, SWS_BICUBIC, NULL, NULL, NULL);
+    if (!sws) {
+        ret = AVERROR(EINVAL);
+        goto fail;
+    }
+    sws_scale(sws, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height, dst->data, dst->linesize);
+    sws_freeContext(sws);
+
+    av_frame_copy_props(dst, frame);
+    *scaled = dst;
+    return 0;
+fail:
+    av_frame_free(&dst);
+    return ret;
+}
+
+// a non-positive width or height is derived from the other keeping the aspect ratio, both are made even
+void fit_size(int src_width, int src_height, int *width, int *height)
+{
+    if (*width <= 0 && *height <= 0) {
+        *width = src_width;
+        *height = src_height;
+    }
+    if (*width <= 0) *width = av_rescale(src_width, *height, src_height);
+    if (*height <= 0) *height = av_rescale(src_height, *width, src_width);
+    // most chroma subsampled formats want even sizes
+    *width = FFMAX(2, *width & ~1);
+    *height = FFMAX(2, *height & ~1);
+}
+
+// caller must hold qrpcCtx->mutex
+AVFormatQrpcScaler* find_or_new_scaler(AVFormatQrpcContext *qrpcCtx, int width, int height)
+{
+    for (AVFormatQrpcScaler *scaler = qrpcCtx->scalers; scaler; scaler = scaler->next) {
+        if (scaler->width == width && scaler->height == height) return scaler;
+    }
+
+    AVFormatQrpcScaler *scaler = av_mallocz(sizeof(AVFormatQrpcScaler));
+    if (!scaler) return NULL;
+    if (pthread_mutex_init(&scaler->lock, NULL)) {
+        av_free(scaler);
+        return NULL;
+    }
+    scaler->width = width;
+    scaler->height = height;
+    scaler->next = qrpcCtx->scalers;
+    qrpcCtx->scalers = scaler;
+    return scaler;
+}
+
+// reference into dst the job frame scaled to the scaler's size
+// each job is scaled once however many renditions of that size ask, called by rendition workers
+int scale_job_frame(AVFormatQrpcScaler *scaler, AVFormatQrpcJob *job, AVFrame *dst)
+{
+    AVFrame *src = job->frame;
+    int ret = AVERROR(ENOMEM);
+
+    pthread_mutex_lock(&scaler->lock);
+    if (!scaler->frame || scaler->seq != job->seq) {
+        qrpc_frame_free(&scaler->frame);
+        scaler->sws = sws_getCachedContext(scaler->sws, src->width, src->height, src->format,
+                                           scaler->width, scaler->height, src->format, SWS_BICUBIC, NULL, NULL, NULL);
+        if (!scaler->sws) goto end;
+
+        if (!scaler->pool || scaler->pool_format != src->format) {
+            av_buffer_pool_uninit(&scaler->pool);
+            int size = av_image_get_buffer_size(src->format, scaler->width, scaler->height, 32);
+            if (size < 0 || !(scaler->pool = av_buffer_pool_init(size, alloc_scaled_buffer))) goto end;
+            scaler->pool_format = src->format;
+        }
+
+        // renditions hold references of earlier frames, each job gets its own buffer from the pool
+        AVFrame *scaled = qrpc_frame_alloc();
+        if (!scaled) goto end;
+        scaled->format = src->format;
+        scaled->width = scaler->width;
+        scaled->height = scaler->height;
+        if (!(scaled->buf[0] = av_buffer_pool_get(scaler->pool)) ||
+            av_image_fill_arrays(scaled->data, scaled->linesize, scaled->buf[0]->data, src->format, scaler->width, scaler->height, 32) < 0) {
+            qrpc_frame_free(&scaled);
+            goto end;
+        }
+        atomic_fetch_add(&scaled_buffer_gets, 1);
+        sws_scale(scaler->sws, (const uint8_t * const *)src->data, src->linesize, 0, src->height, scaled->data, scaled->linesize);
+        av_frame_copy_props(scaled, src);
+        scaler->frame = scaled;
+        scaler->seq = job->seq;
+    }
+    ret = av_frame_ref(dst, scaler->frame);
+end:
+    pthread_mutex_unlock(&scaler->lock);
+    return ret;
+}
+
+AVBufferRef* alloc_scaled_buffer(int size)
+{
+    atomic_fetch_add(&scaled_buffer_allocs, 1);
+    return av_buffer_alloc(size);
+}
+
+void free_scalers(AVFormatQrpcContext *qrpcCtx)
+{
+    while (qrpcCtx->scalers) {
+        AVFormatQrpcScaler *scaler = qrpcCtx->scalers;
+        qrpcCtx->scalers = scaler->next;
+        sws_freeContext(scaler->sws);
+        qrpc_frame_free(&scaler->frame);
+        // buffers still referenced keep the pool alive until they are unreferenced
+        av_buffer_pool_uninit(&scaler->pool);
+        pthread_mutex_destroy(&scaler->lock);
+        av_free(scaler);
+    }
+}
+
+// replace the ladder, renditions already running keep their size
+int AVFormat_SetLadder(AVFormatContext* ctx, const AVFormatQrpcRung *rungs, int nb_rungs)
+{
+    AVFormatQrpcContext *qrpcCtx = ctx->opaque;
+    if (!qrpcCtx || nb_rungs < 0 || nb_rungs > QRPC_MAX_RUNGS) return AVERROR(EINVAL);
+
+    pthread_mutex_lock(&qrpcCtx->mutex);
+    memcpy(qrpcCtx->ladder, rungs, nb_rungs * sizeof(AVFormatQrpcRung));
+    qrpcCtx->nb_rungs = nb_rungs;
+    pthread_mutex_unlock(&qrpcCtx->mutex);
+    return 0;
+}
+
+// the config a subscriber asks for at the publisher's own resolution, see rung_config for the others
+void subscribe_rendition_config(AVFormatContext *ctx, const AVOutputFormat *ofmt, const char *fmt, const AVFormatQrpcEncoderConfig *encoder, AVFormatQrpcRenditionConfig *config)
+{
+    memset(config, 0, sizeof(*config));
+    av_strlcpy(config->fmt, fmt, sizeof(config->fmt));
+    config->encoder = *encoder;
+    config->encoder.codec[sizeof(config->encoder.codec) - 1] = 0;
+    config->encoder.preset[sizeof(config->encoder.preset) - 1] = 0;
+    config->encoder.tune[sizeof(config->encoder.tune) - 1] = 0;
+    // same container as the publisher and encoders would pick the input codecs, just remux
+    config->passthrough = !strcmp(ofmt->name, ctx->iformat->name) && !config->encoder.codec[0];
+}
+
+// fill in the size and bit rate of rung, 0 being the publisher's own
+// caller must hold qrpcCtx->mutex
+int rung_config(AVFormatQrpcContext *qrpcCtx, int rung, AVFormatQrpcRenditionConfig *config)
+{
+    if (rung < 0 || rung > qrpcCtx->nb_rungs) return AVERROR(EINVAL);
+
+    config->width = config->height = 0;
+    config->bit_rate = 0;
+    if (rung > 0) {
+        const AVFormatQrpcRung *r = &qrpcCtx->ladder[rung - 1];
+        config->width = r->width;
+        config->height = r->height;
+        config->bit_rate = FFMAX(0, r->bit_rate);
+        config->passthrough = false;
+    }
+    return 0;
+}
+
+// decoding is lazy, keep video decoded for a while and wait for a fresh frame if it was not,
+// the caller was added to snapshot_waiters, qrpcCtx may be freed once it is removed
+uint64_t wait_latest_frame(AVFormatQrpcContext *qrpcCtx)
+{
+    pthread_mutex_lock(&qrpcCtx->mutex);
+    qrpcCtx->snapshot_deadline = av_gettime_relative() + SNAPSHOT_DECODE_WINDOW;
+
+    bool fresh = false;
+    for (int i = 0; i < qrpcCtx->nb_streams; i++) {
+        if (qrpcCtx->dec_ctx[i]->codec_type == AVMEDIA_TYPE_VIDEO && qrpcCtx->decoding[i]) {
+            pthread_mutex_lock(&qrpcCtx->latest_lock);
+            fresh = qrpcCtx->latest[i] != NULL;
+            pthread_mutex_unlock(&qrpcCtx->latest_lock);
+            if (fresh) break;
+        }
+    }
+    if (!fresh) {
+        uint64_t generation = atomic_load(&qrpcCtx->latest_generation);
+        int64_t deadline = av_gettime() + SNAPSHOT_WAIT_TIMEOUT;
+        struct timespec ts = {deadline / AV_TIME_BASE, (deadline % AV_TIME_BASE) * 1000};
+        while (generation == atomic_load(&qrpcCtx->latest_generation) && !qrpcCtx->closing) {
+            if (pthread_cond_timedwait(&qrpcCtx->latest_cond, &qrpcCtx->mutex, &ts) == ETIMEDOUT) break;
+        }
+    }
+
+    uint64_t latest_generation = atomic_load(&qrpcCtx->latest_generation);
+    if (atomic_fetch_sub(&qrpcCtx->snapshot_waiters, 1) == 1 && qrpcCtx->closing) {
+        pthread_cond_broadcast(&qrpcCtx->idle_cond);
+    }
+    pthread_mutex_unlock(&qrpcCtx->mutex);
+    return latest_generation;
+}
+
+// make frame the latest of stream idx without copying its data, called by ingest only
+void publish_latest_frame(AVFormatQrpcContext *qrpcCtx, int idx, AVFrame *frame)
+{
+    AVFrame *spare = qrpcCtx->latest_spare;
+    if (!spare) {
+        if (!(spare = av_frame_alloc())) return;
+    }
+    if (av_frame_ref(spare, frame) < 0) {
+        qrpcCtx->latest_spare = spare;
+        return;
+    }
+
+    uint64_t generation = atomic_fetch_add(&qrpcCtx->latest_generation, 1) + 1;
+    pthread_mutex_lock(&qrpcCtx->latest_lock);
+    qrpcCtx->latest_spare = qrpcCtx->latest[idx];
+    qrpcCtx->latest[idx] = spare;
+    qrpcCtx->latest_frame_generation[idx] = generation;
+    pthread_mutex_unlock(&qrpcCtx->latest_lock);
+
+    // the previous frame is released outside the lock, readers may still hold their own reference
+    if (qrpcCtx->latest_spare) av_frame_unref(qrpcCtx->latest_spare);
+}
+
+// take a reference of the latest frame of stream idx into dst, false if there is none
+bool ref_latest_frame(AVFormatQrpcContext *qrpcCtx, int idx, AVFrame *dst, uint64_t *generation)
+{
+    bool ok = false;
+    pthread_mutex_lock(&qrpcCtx->latest_lock);
+    if (qrpcCtx->latest[idx] && av_frame_ref(dst, qrpcCtx->latest[idx]) >= 0) {
+        *generation = qrpcCtx->latest_frame_generation[idx];
+        ok = true;
+    }
+    pthread_mutex_unlock(&qrpcCtx->latest_lock);
+    return ok;
+}
+
+int on_writer_pkt(void *opaque, AVPacket *pkt)
 {
-    IOSeqContext *ioseq = (IOSeqContext *)opaque;
-    return read_packet_seq_callback(ioseq->goctx, ioseq->seq, pkt->data, pkt->size);
+    uintptr_t *writer = opaque;
+    int ret = write_handle_callback(*writer, pkt->data, pkt->size);
+    av_packet_unref(pkt);
+    return ret;
 }
 
 int encode_avframe(AVFrame *frame, AVCodecContext *enc_ctx, void *opaque, int(*on_pkt)(void *, AVPacket *))
@@ -268,7 +1317,7 @@ end:
     return ret;
 }
 
-int AVFormat_SubcribeAVFrame(AVFormatContext* ctx, const char *fmt, uint64_t seq)
+int AVFormat_SubcribeAVFrame(AVFormatContext* ctx, const char *fmt, uint64_t seq, uintptr_t writer, const AVFormatQrpcSubscribeConfig *subscribe_config, void **handle)
 {
     AVFormatQrpcContext *qrpcCtx = ctx->opaque;
     if (!qrpcCtx) return AVERROR(EINVAL);
@@ -276,204 +1325,1436 @@ int AVFormat_SubcribeAVFrame(AVFormatContext* ctx, const char *fmt, uint64_t seq
     AVOutputFormat *ofmt = av_guess_format(fmt, NULL, NULL);
     if (!ofmt) return AVERROR(EINVAL);
 
+    AVFormatQrpcRenditionConfig config;
+    subscribe_rendition_config(ctx, ofmt, fmt, &subscribe_config->encoder, &config);
+
     AVFormatContext *oc;
     int ret;
     if ((ret = avformat_alloc_output_context2(&oc, ofmt, NULL, NULL)) < 0) return ret;
-    oc->opaque = qrpcCtx->goctx;
+    // the deliverer flushes at the end of its batches instead of after every packet
+    oc->flush_packets = 0;
 
-    size_t avio_ctx_buffer_size = 4096;
-    uint8_t *avio_ctx_buffer = av_malloc(avio_ctx_buffer_size);
+    AVFormatQrpcContextSubscriber *subscriber = new_subscriber(oc, seq, writer, subscribe_config);
+    if (!subscriber) {
+        avformat_free_context(oc);
+        return AVERROR(ENOMEM);
+    }
+
+    int avio_ctx_buffer_size = atomic_load(&subscriber_avio_buffer_size);
+    uint8_t *avio_ctx_buffer = qrpc_avio_buffer_get(avio_ctx_buffer_size);
     if (!avio_ctx_buffer) {
         ret = AVERROR(ENOMEM);
         goto end;
     }
 
-    AVFormatQrpcContextSubscriber *subscriber = new_subscriber(oc, seq);
-    AVIOContext *avio_ctx = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size,
+    oc->pb = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size,
                                   AVIO_FLAG_WRITE, subscriber, NULL, &write_subscriber_callback, NULL);
-    if (!avio_ctx) {
+    if (!oc->pb) {
+        av_free(avio_ctx_buffer);
         ret = AVERROR(ENOMEM);
         goto end;
     }
 
-    oc->pb = avio_ctx;
-    if ((ret = prepare_avformatcontext_for_output(ctx, subscriber)) < 0) goto end;
-    
-    add_subscriber(qrpcCtx, subscriber);
+    pthread_mutex_lock(&qrpcCtx->mutex);
+    int rung = subscribe_config->rung;
+    // switching rungs keeps the muxer, which only works when codec parameters are not in a global header
+    if (rung == QRPC_RUNG_AUTO) {
+        subscriber->auto_rung = qrpcCtx->nb_rungs > 1 && !(ofmt->flags & AVFMT_GLOBALHEADER);
+        // start low, the deliverer moves up once the subscriber proves fast enough
+        rung = qrpcCtx->nb_rungs;
+        subscriber->nb_rungs = qrpcCtx->nb_rungs;
+        for (int i = 0; i < qrpcCtx->nb_rungs; i++) {
+            subscriber->rung_bit_rate[i] = qrpcCtx->ladder[i].bit_rate;
+        }
+    }
+    AVFormatQrpcRendition *rendition = NULL;
+    if ((ret = rung_config(qrpcCtx, rung, &config)) >= 0) rendition = find_or_new_rendition(ctx, &config, &ret);
+    if (rendition) {
+        atomic_store(&subscriber->rung, rung);
+        atomic_store(&subscriber->want_rung, rung);
+        subscriber->abr_rung = rung;
+        subscriber->rung_since = av_gettime_relative();
+        subscriber->abr_eval_at = subscriber->rung_since + ABR_EVAL_INTERVAL;
+        if ((ret = prepare_avformatcontext_for_output(rendition, subscriber)) >= 0) {
+            subscriber->rendition = rendition;
+            // one reference for the membership, one for the handle
+            atomic_fetch_add(&subscriber->refs, 1);
+            if ((ret = add_subscriber(qrpcCtx, subscriber)) < 0) {
+                subscriber->rendition = NULL;
+                atomic_fetch_sub(&subscriber->refs, 1);
+            }
+        }
+        if (ret < 0 && !atomic_load(&rendition->nb_members)) {
+            unlink_rendition(qrpcCtx, rendition);
+        }
+    }
+    pthread_mutex_unlock(&qrpcCtx->mutex);
 
  end:
     if (ret < 0) {
-        if (subscriber) free_subscriber(subscriber);
-        else avformat_free_context(oc);
-
-        if (avio_ctx) {
-            av_freep(&avio_ctx->buffer);
-            av_freep(&avio_ctx);
-        }
-
+        unref_subscriber(subscriber);
         return ret;
     }
 
+    *handle = subscriber;
     return 0;
 }
 
-void AVFormat_UnsubcribeAVFrame(AVFormatContext* ctx, uint64_t seq)
-{
-    AVFormatQrpcContext *qrpcCtx = ctx->opaque;
-    if (!qrpcCtx) return;
-
-    del_subscriber(qrpcCtx, seq, false);
-}
-
-void write_subscribers(AVFormatQrpcContext *qrpcCtx, int stream_index, AVFrame *frame)
+// mux and write what is queued for the subscriber, waiting up to timeout_ms for something to arrive
+// returns AVERROR(EAGAIN) on timeout, AVERROR_EOF once the subscriber is closed
+// and QRPC_DELIVER_SWITCH when it should move to another rung
+int AVFormat_DeliverSubscriber(void *handle, int timeout_ms)
 {
-    pthread_mutex_lock(&qrpcCtx->mutex);
-    if (qrpcCtx->subscribers) {
-        int ret;
-        AVFormatQrpcContextSubscriber *subscriber = qrpcCtx->subscribers->first;
-        while (subscriber) {
-            AVFormatQrpcContextSubscriber *next = subscriber->next;
-            if (!subscriber->enc_ctx[stream_index]) {
-                subscriber = next;
-                continue;
-            }
-            
-            ret = encode_avframe(frame, subscriber->enc_ctx[stream_index], subscriber->sctx, on_subscriber_pkt);
-            
-            if (ret < 0 && ret != AVERROR(EAGAIN)) {
-                del_subscriber(qrpcCtx, subscriber->seq, true);
+    AVFormatQrpcContextSubscriber *subscriber = handle;
+    if (subscriber->auto_rung) {
+        int64_t now = av_gettime_relative();
+        if (now >= subscriber->abr_eval_at && evaluate_rung(subscriber, now)) return QRPC_DELIVER_SWITCH;
+    }
 
-                char errStr[30];
-                av_strerror(ret, errStr, sizeof(errStr));
-                av_log(NULL, AV_LOG_ERROR, "Failed encode_avframe:%s\n", errStr);
-            }
-            subscriber = next;
+    AVIOContext *pb = subscriber->sctx->pb;
+    // muxed output is held in pb until flush_at, so it goes out in as few writes as possible
+    int64_t flush_at = subscriber->last_flush + subscriber->config.flush_interval_ms * 1000LL;
+    bool unflushed = pb->buf_ptr > pb->buffer;
+
+    pthread_mutex_lock(&subscriber->lock);
+    if (!subscriber->nb_queue && !subscriber->closed) {
+        int64_t wait = timeout_ms * 1000LL;
+        if (unflushed) wait = FFMAX(0, FFMIN(wait, flush_at - av_gettime_relative()));
+        int64_t deadline = av_gettime() + wait;
+        struct timespec ts = {deadline / AV_TIME_BASE, (deadline % AV_TIME_BASE) * 1000};
+        while (!subscriber->nb_queue && !subscriber->closed) {
+            if (pthread_cond_timedwait(&subscriber->cond, &subscriber->lock, &ts) == ETIMEDOUT) break;
         }
     }
-    pthread_mutex_unlock(&qrpcCtx->mutex);
+    int n = subscriber->nb_queue;
+    bool closed = subscriber->closed;
+    pthread_mutex_unlock(&subscriber->lock);
+
+    if (closed) return AVERROR_EOF;
+    if (!n) return unflushed ? flush_subscriber(subscriber) : AVERROR(EAGAIN);
+
+    // only what was there at first, a fast publisher must not keep us here forever
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_lock(&subscriber->lock);
+        if (!subscriber->nb_queue) {
+            pthread_mutex_unlock(&subscriber->lock);
+            break;
+        }
+        AVFormatQrpcQueueEntry entry = subscriber->queue[subscriber->queue_head];
+        subscriber->queue_head = (subscriber->queue_head + 1) % subscriber->config.max_packets;
+        subscriber->nb_queue --;
+        pthread_mutex_unlock(&subscriber->lock);
+
+        int ret = 0;
+        if (subscriber->config.marks) ret = mark_keyframe(subscriber, entry.pkt);
+        if (ret >= 0) {
+            int64_t start = av_gettime_relative(), callback_us = qrpc_callback_us;
+            ret = av_interleaved_write_frame(subscriber->sctx, entry.pkt);
+            qrpc_metrics_observe(QRPC_STAGE_MUX, av_gettime_relative() - start - (qrpc_callback_us - callback_us));
+        }
+        qrpc_packet_free(&entry.pkt);
+        if (ret < 0) {
+            qrpc_metrics_error(QRPC_STAGE_MUX);
+            char errStr[30];
+            av_strerror(ret, errStr, sizeof(errStr));
+            av_log(NULL, AV_LOG_ERROR, "Failed writing subscriber %" PRIu64 ":%s\n", subscriber->seq, errStr);
+            // the rendition worker unlinks failed members
+            close_subscriber(subscriber, true);
+            return ret;
+        }
+
+        pthread_mutex_lock(&subscriber->lock);
+        subscriber->stats.delivered_packets ++;
+        pthread_mutex_unlock(&subscriber->lock);
+    }
+
+    if (av_gettime_relative() >= flush_at) return flush_subscriber(subscriber);
+    return 0;
+}
+
+// decide the rung the subscriber should be on from its lag, drops and write throughput,
+// returns whether that is not the current one, called by the deliverer only
+bool evaluate_rung(AVFormatQrpcContextSubscriber *subscriber, int64_t now)
+{
+    subscriber->abr_eval_at = now + ABR_EVAL_INTERVAL;
+
+    pthread_mutex_lock(&subscriber->lock);
+    int64_t lag = subscriber->nb_queue ? now - subscriber->queue[subscriber->queue_head].enqueued : 0;
+    uint64_t dropped = subscriber->stats.dropped_packets;
+    pthread_mutex_unlock(&subscriber->lock);
+
+    // writes that don't block tell nothing about the link, count it as fast
+    int64_t bps = subscriber->write_us > 0 ? subscriber->write_bytes * 8 * AV_TIME_BASE / subscriber->write_us : INT64_MAX;
+    subscriber->write_bytes = subscriber->write_us = 0;
+    bool congested = lag > ABR_DOWN_LAG || dropped > subscriber->abr_dropped;
+    subscriber->abr_dropped = dropped;
+
+    int rung = atomic_load(&subscriber->rung);
+    if (rung != subscriber->abr_rung) {
+        subscriber->abr_rung = rung;
+        subscriber->rung_since = now;
+    }
+
+    int want = rung;
+    if (congested) {
+        want = FFMIN(rung + 1, subscriber->nb_rungs);
+    } else if (rung > 1 && lag < ABR_UP_LAG && now - subscriber->rung_since >= ABR_UP_HOLD) {
+        int64_t next = subscriber->rung_bit_rate[rung - 2];
+        if (next <= 0 || bps > next * ABR_UP_HEADROOM) want = rung - 1;
+    }
+    atomic_store(&subscriber->want_rung, want);
+    return want != rung;
 }
 
-int on_subscriber_pkt(void *opaque, AVPacket *pkt)
+// start moving subscriber to the rung its deliverer wants, it is fed by the new rendition
+// from that rendition's next keyframe on, see take_over_subscriber
+int AVFormat_SwitchSubscriber(AVFormatContext* ctx, void *handle)
 {
-    AVFormatContext *ofc = opaque;
-    int ret = av_interleaved_write_frame(ofc, pkt);
+    AVFormatQrpcContext *qrpcCtx = ctx->opaque;
+    if (!qrpcCtx) return AVERROR(EINVAL);
+
+    AVFormatQrpcContextSubscriber *subscriber = handle;
+    int ret = 0;
+    pthread_mutex_lock(&qrpcCtx->mutex);
+    int rung = atomic_load(&subscriber->want_rung);
+    AVFormatQrpcRendition *current = subscriber->rendition;
+    // one switch at a time, and not before the one before has been reclaimed
+    if (!current || atomic_load(&subscriber->switch_to) || atomic_load(&subscriber->on_switched_out) ||
+        rung == atomic_load(&subscriber->rung)) goto end;
+
+    // start over from what the subscriber asked for, a rung > 0 never remuxes but rung 0 may
+    AVFormatQrpcRenditionConfig config;
+    subscribe_rendition_config(ctx, subscriber->sctx->oformat, current->config.fmt, &subscriber->config.encoder, &config);
+    if ((ret = rung_config(qrpcCtx, rung, &config)) < 0) goto end;
+    AVFormatQrpcRendition *rendition = find_or_new_rendition(ctx, &config, &ret);
+    if (!rendition || rendition == current) goto end;
+
+    atomic_fetch_add(&subscriber->refs, 1);
+    atomic_store(&subscriber->switch_to, rendition);
+    int slot = add_member(rendition, subscriber);
+    if (slot < 0) {
+        ret = slot;
+        atomic_store(&subscriber->switch_to, NULL);
+        atomic_fetch_sub(&subscriber->refs, 1);
+        unlink_empty_renditions(qrpcCtx);
+        goto end;
+    }
+    subscriber->switch_slot = slot;
+    subscriber->switch_rung = rung;
+end:
+    pthread_mutex_unlock(&qrpcCtx->mutex);
     return ret;
 }
 
-AVFormatQrpcContextSubscriber* new_subscriber(AVFormatContext *oc, uint64_t seq)
+// write out what the muxer left in pb, called by the deliverer only
+int flush_subscriber(AVFormatQrpcContextSubscriber *subscriber)
 {
-    AVFormatQrpcContextSubscriber *subscriber = av_malloc(sizeof(AVFormatQrpcContextSubscriber));
-    
-    subscriber->sctx = oc;
-    subscriber->seq = seq;
-    subscriber->next = NULL;
-    subscriber->enc_ctx = NULL;
-    return subscriber;
+    AVIOContext *pb = subscriber->sctx->pb;
+    avio_flush(pb);
+    subscriber->last_flush = av_gettime_relative();
+    if (pb->error < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Failed flushing subscriber %" PRIu64 "\n", subscriber->seq);
+        close_subscriber(subscriber, true);
+        return pb->error;
+    }
+
+    pthread_mutex_lock(&subscriber->lock);
+    subscriber->stats.flushes ++;
+    pthread_mutex_unlock(&subscriber->lock);
+
+    if (subscriber->config.marks && subscriber->last_pts != AV_NOPTS_VALUE) {
+        mark_handle_callback(subscriber->writer, subscriber->last_pts, 0);
+    }
+    return 0;
+}
+
+// before a video keyframe, flush so it starts a new write and tell the writer,
+// which can then cut a segment there
+int mark_keyframe(AVFormatQrpcContextSubscriber *subscriber, AVPacket *pkt)
+{
+    AVStream *st = subscriber->sctx->streams[pkt->stream_index];
+    int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    if (ts != AV_NOPTS_VALUE) ts = av_rescale_q(ts, st->time_base, AV_TIME_BASE_Q);
+    if (st->codecpar->codec_type != AVMEDIA_TYPE_VIDEO || !(pkt->flags & AV_PKT_FLAG_KEY)) {
+        if (ts != AV_NOPTS_VALUE) subscriber->last_pts = ts;
+        return 0;
+    }
+
+    AVIOContext *pb = subscriber->sctx->pb;
+    if (pb->buf_ptr > pb->buffer) {
+        int ret = flush_subscriber(subscriber);
+        if (ret < 0) return ret;
+    }
+    if (ts != AV_NOPTS_VALUE) subscriber->last_pts = ts;
+    if (subscriber->last_pts != AV_NOPTS_VALUE) {
+        mark_handle_callback(subscriber->writer, subscriber->last_pts, 1);
+    }
+    // a segment has to be decodable on its own, have mpegts repeat PAT/PMT before the keyframe
+    if (!strcmp(subscriber->sctx->oformat->name, "mpegts")) {
+        av_opt_set(subscriber->sctx->priv_data, "mpegts_flags", "+resend_headers", 0);
+    }
+    return 0;
+}
+
+void AVFormat_SubscriberStats(void *handle, AVFormatQrpcSubscriberStats *stats)
+{
+    AVFormatQrpcContextSubscriber *subscriber = handle;
+
+    pthread_mutex_lock(&subscriber->lock);
+    *stats = subscriber->stats;
+    stats->rung = atomic_load(&subscriber->rung);
+    stats->queue_depth = subscriber->nb_queue;
+    stats->lag_ms = subscriber->nb_queue ?
+        (av_gettime_relative() - subscriber->queue[subscriber->queue_head].enqueued) / 1000 : 0;
+    pthread_mutex_unlock(&subscriber->lock);
+}
+
+void AVFormat_SubscriberUnref(void *handle)
+{
+    unref_subscriber(handle);
+}
+
+void AVFormat_SetAVIOBufferSize(int ingest, int subscriber)
+{
+    if (ingest > 0) atomic_store(&ingest_avio_buffer_size, ingest);
+    if (subscriber > 0) atomic_store(&subscriber_avio_buffer_size, subscriber);
 }
 
-void add_subscriber(AVFormatQrpcContext* qrpcCtx, AVFormatQrpcContextSubscriber *subscriber)
+// bound the threads of all video encoders together, encoders opened from now on get at least one
+void AVFormat_SetEncoderThreads(int budget)
 {
+    atomic_store(&encoder_thread_budget, budget);
+}
+
+void AVFormat_PoolStats(AVFormatQrpcPoolStats *stats)
+{
+    stats->packet_allocs = atomic_load(&qrpc_packet_pool.allocs);
+    stats->packet_reuses = atomic_load(&qrpc_packet_pool.reuses);
+    stats->frame_allocs = atomic_load(&qrpc_frame_pool.allocs);
+    stats->frame_reuses = atomic_load(&qrpc_frame_pool.reuses);
+    stats->job_allocs = atomic_load(&job_pool.allocs);
+    stats->job_reuses = atomic_load(&job_pool.reuses);
+    stats->scaled_buffer_allocs = atomic_load(&scaled_buffer_allocs);
+    uint64_t gets = atomic_load(&scaled_buffer_gets);
+    stats->scaled_buffer_reuses = gets > stats->scaled_buffer_allocs ? gets - stats->scaled_buffer_allocs : 0;
+}
+
+void AVFormat_StageMetrics(AVFormatQrpcHistogram *stages, uint64_t *errors)
+{
+    qrpc_metrics_read(stages, errors);
+}
+
+// metrics of up to max renditions of ctx, returns how many there are
+int AVFormat_RenditionMetrics(AVFormatContext* ctx, AVFormatQrpcRenditionMetrics *metrics, int max)
+{
+    AVFormatQrpcContext *qrpcCtx = ctx->opaque;
+    if (!qrpcCtx) return 0;
+
+    int n = 0;
     pthread_mutex_lock(&qrpcCtx->mutex);
-    if (!qrpcCtx->subscribers) {
-        AVFormatQrpcContextSubscriberList *subscribers = av_malloc(sizeof(AVFormatQrpcContextSubscriberList));
-        subscribers->first = subscribers->last = subscriber;
-        subscribers->n = 1;
-        qrpcCtx->subscribers = subscribers;
-    } else {
-        if (!qrpcCtx->subscribers->last) {
-            qrpcCtx->subscribers->first = qrpcCtx->subscribers->last = subscriber;
+    for (AVFormatQrpcRendition *rendition = qrpcCtx->renditions; rendition; rendition = rendition->next, n++) {
+        if (n >= max) continue;
+        AVFormatQrpcRenditionMetrics *m = &metrics[n];
+        memset(m, 0, sizeof(*m));
+        av_strlcpy(m->fmt, rendition->config.fmt, sizeof(m->fmt));
+        m->passthrough = rendition->config.passthrough;
+        m->width = rendition->config.width;
+        m->height = rendition->config.height;
+        m->bit_rate = rendition->config.bit_rate;
+        m->encoder = rendition->config.encoder;
+        m->members = atomic_load(&rendition->nb_members);
+        qrpc_histogram_read(&rendition->encode, &m->encode);
+    }
+    pthread_mutex_unlock(&qrpcCtx->mutex);
+    return n;
+}
+
+// bound the threads of all video decoders together, decoders pick up a new share at their next keyframe
+void AVFormat_SetDecoderThreads(int budget)
+{
+    atomic_store(&decoder_thread_budget, budget);
+}
+
+void AVFormat_SetGOPCacheSize(int bytes)
+{
+    atomic_store(&gop_cache_size, bytes);
+}
+
+void AVFormat_SetMaxEncodedRenditions(int n)
+{
+    atomic_store(&max_encoded_renditions, n);
+}
+
+void AVFormat_UnsubcribeAVFrame(AVFormatContext* ctx, void *handle)
+{
+    AVFormatQrpcContext *qrpcCtx = ctx->opaque;
+    if (!qrpcCtx) return;
+
+    AVFormatQrpcContextSubscriber *subscriber = handle;
+    pthread_mutex_lock(&qrpcCtx->mutex);
+    AVFormatQrpcRendition *rendition = subscriber->rendition;
+    if (rendition) {
+        unlink_subscriber(qrpcCtx, subscriber);
+        unlink_empty_renditions(qrpcCtx);
+    }
+    pthread_mutex_unlock(&qrpcCtx->mutex);
+}
+
+// called on the worker pool, drains the job queue of rendition
+void process_rendition(void *arg)
+{
+    AVFormatQrpcRendition *rendition = arg;
+    AVFormatQrpcContext *qrpcCtx = rendition->qrpcCtx;
+
+    for (;;) {
+        AVFormatQrpcJob *job = NULL;
+        pthread_mutex_lock(&rendition->lock);
+        bool dropped = rendition->jobs_dropped;
+        rendition->jobs_dropped = false;
+        if (rendition->nb_jobs) {
+            job = rendition->jobs[rendition->jobs_head];
+            rendition->jobs_head = (rendition->jobs_head + 1) % RENDITION_QUEUE_SIZE;
+            rendition->nb_jobs --;
         }
-        else {
-            qrpcCtx->subscribers->last->next = subscriber;
-            qrpcCtx->subscribers->last = subscriber;
+        pthread_mutex_unlock(&rendition->lock);
+        if (!job) break;
+
+        if (atomic_load(&rendition->nb_members) > 0) {
+            begin_member_pass(rendition);
+            // a passthrough member that lost packets can only continue from a keyframe
+            if (dropped && rendition->config.passthrough) {
+                reset_gop_cache(rendition, false);
+                int n = member_slots(rendition);
+                for (int i = 0; i < n; i++) {
+                    AVFormatQrpcContextSubscriber *sub = member_at(rendition, i);
+                    if (!sub) continue;
+                    // members switching to or away from rendition are fed by the other one
+                    pthread_mutex_lock(&sub->lock);
+                    if (atomic_load(&sub->feeding) == rendition) sub->wait_keyframe = rendition->has_video;
+                    pthread_mutex_unlock(&sub->lock);
+                }
+            }
+
+            if (job->pkt) {
+                AVPacket *pkt = job->pkt;
+                bool keyframe = rendition->codecpar[pkt->stream_index] &&
+                    rendition->codecpar[pkt->stream_index]->codec_type == AVMEDIA_TYPE_VIDEO && (pkt->flags & AV_PKT_FLAG_KEY);
+                write_rendition_members(rendition, pkt, rendition->in_time_base[pkt->stream_index], keyframe);
+            } else if (job->frame) {
+                encode_rendition_frame(rendition, job);
+            }
+            if (rendition->members_failed) unlink_failed_members(rendition);
+            if (rendition->members_switched) finish_switches(rendition);
+            end_member_pass(rendition);
         }
-        qrpcCtx->subscribers->n ++;
+        unref_job(job);
+    }
+
+    atomic_store(&rendition->scheduled, 0);
+    // a job may have been queued after the queue was found empty
+    pthread_mutex_lock(&rendition->lock);
+    bool more = rendition->nb_jobs > 0;
+    pthread_mutex_unlock(&rendition->lock);
+    if (more) schedule_rendition(rendition);
+
+    unref_rendition(rendition);
+    task_done(qrpcCtx);
+}
+
+void task_done(AVFormatQrpcContext *qrpcCtx)
+{
+    // decrement with the mutex held so free_qrpc_context can't free qrpcCtx under us
+    pthread_mutex_lock(&qrpcCtx->mutex);
+    if (atomic_fetch_sub(&qrpcCtx->pending_tasks, 1) == 1) {
+        pthread_cond_broadcast(&qrpcCtx->idle_cond);
     }
     pthread_mutex_unlock(&qrpcCtx->mutex);
 }
 
-static void del_subscriber(AVFormatQrpcContext* qrpcCtx, uint64_t seq, bool locked)
+typedef struct RenditionPktContext {
+    AVFormatQrpcRendition *rendition;
+    int stream_index;
+    int64_t fanout_us; // spent writing packets to members
+} RenditionPktContext;
+
+// called by the rendition worker
+void encode_rendition_frame(AVFormatQrpcRendition *rendition, AVFormatQrpcJob *job)
 {
-    if (!locked) {
+    int stream_index = job->stream_index;
+    AVFrame *frame = job->frame;
+    AVCodecContext *enc_ctx = rendition->enc_ctx[stream_index];
+    if (!enc_ctx) return;
+
+    // frame is shared with other renditions, which may be encoding it right now
+    int64_t pts = frame->pts;
+    if (pts != AV_NOPTS_VALUE) {
+        pts = av_rescale_q(pts, rendition->in_time_base[stream_index], enc_ctx->time_base);
+        /* encoders reject non increasing pts, happens when input rate exceeds enc_ctx->time_base */
+        if (rendition->last_pts[stream_index] != AV_NOPTS_VALUE && pts <= rendition->last_pts[stream_index]) return;
+        rendition->last_pts[stream_index] = pts;
+    }
+    int ret;
+    if (rendition->scaler && enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+        // renditions of the same size share what the scaler produced for this job
+        if (scale_job_frame(rendition->scaler, job, rendition->enc_frame) < 0) return;
+    } else if ((ret = av_frame_ref(rendition->enc_frame, frame)) < 0) {
+        return;
+    }
+    rendition->enc_frame->pts = pts;
+
+    // encode once, members are written in on_rendition_pkt
+    RenditionPktContext rctx = {rendition, stream_index};
+    int64_t start = av_gettime_relative();
+    ret = encode_avframe(rendition->enc_frame, enc_ctx, &rctx, on_rendition_pkt);
+    int64_t encode_us = av_gettime_relative() - start - rctx.fanout_us;
+    qrpc_metrics_observe(QRPC_STAGE_ENCODE, encode_us);
+    qrpc_histogram_observe(&rendition->encode, encode_us);
+    av_frame_unref(rendition->enc_frame);
+
+    if (ret < 0 && ret != AVERROR(EAGAIN)) {
+        qrpc_metrics_error(QRPC_STAGE_ENCODE);
+        char errStr[30];
+        av_strerror(ret, errStr, sizeof(errStr));
+        av_log(NULL, AV_LOG_ERROR, "Failed encode_avframe:%s\n", errStr);
+
+        // encoder is broken, drop the whole rendition
+        AVFormatQrpcContext *qrpcCtx = rendition->qrpcCtx;
         pthread_mutex_lock(&qrpcCtx->mutex);
+        unlink_all_members(qrpcCtx, rendition);
+        if (rendition->linked) unlink_rendition(qrpcCtx, rendition);
+        unlink_empty_renditions(qrpcCtx);
+        pthread_mutex_unlock(&qrpcCtx->mutex);
     }
-    if (qrpcCtx->subscribers) {
-        AVFormatQrpcContextSubscriber* prev = NULL;
-        AVFormatQrpcContextSubscriber* sub = qrpcCtx->subscribers->first;
+}
 
-        // delete all
-        if (seq == SEQ_ALL) {
-            while (sub) {
-                AVFormatQrpcContextSubscriber *next = sub->next;
-                free_subscriber(sub);
-                sub = next;
-            }
-            av_free(qrpcCtx->subscribers);
-            qrpcCtx->subscribers = NULL;
+int on_rendition_pkt(void *opaque, AVPacket *pkt)
+{
+    RenditionPktContext *rctx = opaque;
+    AVFormatQrpcRendition *rendition = rctx->rendition;
+    AVCodecContext *enc_ctx = rendition->enc_ctx[rctx->stream_index];
+    bool keyframe = enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO && (pkt->flags & AV_PKT_FLAG_KEY);
+
+    pkt->stream_index = rctx->stream_index;
+    int64_t start = av_gettime_relative();
+    write_rendition_members(rendition, pkt, enc_ctx->time_base, keyframe);
+    rctx->fanout_us += av_gettime_relative() - start;
+    av_packet_unref(pkt);
+
+    return 0;
+}
+
+typedef struct AudioPktContext {
+    AVFormatQrpcAudioTask *task;
+    AVFormatQrpcAudioEncoder *audio;
+    AVFormatQrpcJob *job; // of the frame being encoded
+    int64_t fanout_us; // spent dispatching packets to renditions
+} AudioPktContext;
+
+// hand a decoded audio frame to the task of its stream along with the renditions being
+// dispatched to that encode it, resampling and encoding happen on the worker pool, ingest only
+void queue_audio_frame(AVFormatQrpcContext *qrpcCtx, int idx, AVFrame *frame, int nb_dispatch)
+{
+    AVFormatQrpcAudioTask *task = qrpcCtx->audio_tasks[idx];
+    if (!task) return;
+
+    AVFormatQrpcJob *job = new_job(idx);
+    if (!job) return;
+    if (!(job->frame = qrpc_frame_clone(frame)) ||
+        !(job->renditions = av_malloc_array(nb_dispatch, sizeof(AVFormatQrpcRendition *)))) {
+        unref_job(job);
+        return;
+    }
+    for (int i = 0; i < nb_dispatch; i++) {
+        AVFormatQrpcRendition *rendition = qrpcCtx->dispatch[i];
+        if (!rendition->audio[idx]) continue;
+        atomic_fetch_add(&rendition->refs, 1);
+        job->renditions[job->nb_renditions++] = rendition;
+    }
+    if (!job->nb_renditions) {
+        unref_job(job);
+        return;
+    }
+
+    // the oldest frame is dropped when the queue is full, the fifo restarts at the gap
+    AVFormatQrpcJob *dropped = NULL;
+    pthread_mutex_lock(&task->lock);
+    if (task->nb_jobs == RENDITION_QUEUE_SIZE) {
+        dropped = task->jobs[task->jobs_head];
+        task->jobs_head = (task->jobs_head + 1) % RENDITION_QUEUE_SIZE;
+        task->nb_jobs --;
+    }
+    task->jobs[(task->jobs_head + task->nb_jobs) % RENDITION_QUEUE_SIZE] = job;
+    task->nb_jobs ++;
+    pthread_mutex_unlock(&task->lock);
+
+    if (dropped) unref_job(dropped);
+    schedule_audio_task(task);
+}
+
+// make sure a worker will look at the job queue of task
+void schedule_audio_task(AVFormatQrpcAudioTask *task)
+{
+    if (atomic_exchange(&task->scheduled, 1)) return;
+
+    AVFormatQrpcContext *qrpcCtx = task->qrpcCtx;
+    atomic_fetch_add(&qrpcCtx->pending_tasks, 1);
+    if (qrpc_workers_submit(process_audio_task, task) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Failed to schedule audio of stream #%u\n", task->stream_index);
+        atomic_store(&task->scheduled, 0);
+        task_done(qrpcCtx);
+    }
+}
+
+// called on the worker pool, drains the job queue of task, tasks live as long as their context
+void process_audio_task(void *arg)
+{
+    AVFormatQrpcAudioTask *task = arg;
+    AVFormatQrpcContext *qrpcCtx = task->qrpcCtx;
+
+    for (;;) {
+        AVFormatQrpcJob *job = NULL;
+        pthread_mutex_lock(&task->lock);
+        if (task->nb_jobs) {
+            job = task->jobs[task->jobs_head];
+            task->jobs_head = (task->jobs_head + 1) % RENDITION_QUEUE_SIZE;
+            task->nb_jobs --;
+        }
+        pthread_mutex_unlock(&task->lock);
+        if (!job) break;
+
+        encode_audio(task, job);
+        unref_job(job);
+    }
+
+    atomic_store(&task->scheduled, 0);
+    // a job may have been queued after the queue was found empty
+    pthread_mutex_lock(&task->lock);
+    bool more = task->nb_jobs > 0;
+    pthread_mutex_unlock(&task->lock);
+    if (more) schedule_audio_task(task);
+
+    task_done(qrpcCtx);
+}
+
+// feed the frame of job to the shared encoders of its renditions, called by the audio task
+void encode_audio(AVFormatQrpcAudioTask *task, AVFormatQrpcJob *job)
+{
+    // one per global header mode at most, see AVFormatQrpcAudioEncoder
+    AVFormatQrpcAudioEncoder *fed[2] = {NULL, NULL};
+    int nb_fed = 0;
+    for (int i = 0; i < job->nb_renditions && nb_fed < 2; i++) {
+        AVFormatQrpcAudioEncoder *audio = job->renditions[i]->audio[task->stream_index];
+        if (!audio || audio == fed[0] || audio->failed) continue;
+        fed[nb_fed++] = audio;
+
+        int ret = encode_audio_frame(task, audio, job);
+        if (ret < 0) {
+            qrpc_metrics_error(QRPC_STAGE_ENCODE);
+            char errStr[30];
+            av_strerror(ret, errStr, sizeof(errStr));
+            av_log(NULL, AV_LOG_ERROR, "Failed to encode audio of stream #%u:%s\n", task->stream_index, errStr);
+            // a broken encoder only costs its renditions their audio
+            audio->failed = true;
+        }
+    }
+}
+
+// resample the frame of job into the fifo of audio and encode it frame_size samples at a time
+int encode_audio_frame(AVFormatQrpcAudioTask *task, AVFormatQrpcAudioEncoder *audio, AVFormatQrpcJob *job)
+{
+    AVCodecContext *enc_ctx = audio->enc_ctx;
+    AudioPktContext actx = {task, audio, job};
+    int64_t start = av_gettime_relative();
+    int ret = resample_audio_frame(audio, job->frame, task->time_base);
+    // encoders without a fixed frame size take whatever there is
+    int frame_size = enc_ctx->frame_size > 0 ? enc_ctx->frame_size : av_audio_fifo_size(audio->fifo);
+    while (ret >= 0 && frame_size > 0 && av_audio_fifo_size(audio->fifo) >= frame_size) {
+        AVFrame *out = audio->frame;
+        av_frame_unref(out);
+        out->nb_samples = frame_size;
+        out->format = enc_ctx->sample_fmt;
+        out->channel_layout = enc_ctx->channel_layout;
+        out->sample_rate = enc_ctx->sample_rate;
+        // a new buffer each time, the encoder may keep a reference of the last one
+        if ((ret = av_frame_get_buffer(out, 0)) < 0) break;
+        if ((ret = av_audio_fifo_read(audio->fifo, (void **)out->extended_data, frame_size)) < 0) break;
+        out->pts = audio->next_pts;
+        audio->next_pts += frame_size;
+
+        ret = encode_avframe(out, enc_ctx, &actx, on_audio_pkt);
+        if (ret == AVERROR(EAGAIN)) ret = 0;
+    }
+    av_frame_unref(audio->frame);
+    qrpc_metrics_observe(QRPC_STAGE_ENCODE, av_gettime_relative() - start - actx.fanout_us);
+    return ret;
+}
+
+// convert frame to what the encoder of audio takes and append it to the fifo, a frame that
+// doesn't follow on from the samples buffered, after a suspend or a rebind, restarts the fifo at its pts
+int resample_audio_frame(AVFormatQrpcAudioEncoder *audio, AVFrame *frame, AVRational time_base)
+{
+    AVCodecContext *enc_ctx = audio->enc_ctx;
+    uint64_t layout = frame->channel_layout ? frame->channel_layout : av_get_default_channel_layout(frame->channels);
+    bool convert = frame->format != enc_ctx->sample_fmt || frame->sample_rate != enc_ctx->sample_rate ||
+        layout != enc_ctx->channel_layout;
+    int ret;
+    if (!convert) {
+        if (audio->swr) {
+            swr_free(&audio->swr);
+            audio->next_pts = AV_NOPTS_VALUE;
+        }
+    } else if (!audio->swr || frame->format != audio->in_format || frame->sample_rate != audio->in_sample_rate ||
+               layout != audio->in_channel_layout) {
+        // the decoder output changed, what the old one buffered is lost
+        swr_free(&audio->swr);
+        audio->swr = swr_alloc_set_opts(NULL, enc_ctx->channel_layout, enc_ctx->sample_fmt, enc_ctx->sample_rate,
+                                        layout, frame->format, frame->sample_rate, 0, NULL);
+        if (!audio->swr) return AVERROR(ENOMEM);
+        if ((ret = swr_init(audio->swr)) < 0) {
+            swr_free(&audio->swr);
+            return ret;
+        }
+        audio->in_format = frame->format;
+        audio->in_sample_rate = frame->sample_rate;
+        audio->in_channel_layout = layout;
+        audio->next_pts = AV_NOPTS_VALUE;
+    }
+
+    // where the first sample of frame lands, behind what fifo and swr hold
+    int64_t pts = AV_NOPTS_VALUE;
+    if (frame->pts != AV_NOPTS_VALUE) pts = av_rescale_q(frame->pts, time_base, enc_ctx->time_base);
+    int64_t buffered = av_audio_fifo_size(audio->fifo) + (audio->swr ? swr_get_delay(audio->swr, enc_ctx->sample_rate) : 0);
+    if (audio->next_pts == AV_NOPTS_VALUE || (pts != AV_NOPTS_VALUE &&
+            FFABS(pts - (audio->next_pts + buffered)) > av_rescale(AUDIO_RESYNC_THRESHOLD, enc_ctx->sample_rate, AV_TIME_BASE))) {
+        av_audio_fifo_reset(audio->fifo);
+        if (audio->swr && (ret = swr_init(audio->swr)) < 0) return ret;
+        audio->next_pts = pts != AV_NOPTS_VALUE ? pts : 0;
+    }
+
+    AVFrame *src = frame;
+    if (audio->swr) {
+        src = audio->resampled;
+        av_frame_unref(src);
+        src->format = enc_ctx->sample_fmt;
+        src->channel_layout = enc_ctx->channel_layout;
+        src->sample_rate = enc_ctx->sample_rate;
+        src->nb_samples = swr_get_out_samples(audio->swr, frame->nb_samples);
+        if ((ret = av_frame_get_buffer(src, 0)) < 0) return ret;
+        if ((ret = swr_convert(audio->swr, src->extended_data, src->nb_samples,
+                               (const uint8_t **)frame->extended_data, frame->nb_samples)) < 0) return ret;
+        src->nb_samples = ret;
+    }
+    ret = av_audio_fifo_write(audio->fifo, (void **)src->extended_data, src->nb_samples);
+    av_frame_unref(audio->resampled);
+    return ret < 0 ? ret : 0;
+}
+
+// packets of a shared audio encoder go to every rendition of the frame job sharing it,
+// as packets of the input stream, the same way passthrough packets are dispatched
+int on_audio_pkt(void *opaque, AVPacket *pkt)
+{
+    AudioPktContext *actx = opaque;
+    int idx = actx->task->stream_index;
+    int64_t start = av_gettime_relative();
+
+    pkt->stream_index = idx;
+    av_packet_rescale_ts(pkt, actx->audio->enc_ctx->time_base, actx->task->time_base);
+    AVFormatQrpcJob *job = new_job(idx);
+    if (job && (job->pkt = qrpc_packet_clone(pkt))) {
+        for (int i = 0; i < actx->job->nb_renditions; i++) {
+            AVFormatQrpcRendition *rendition = actx->job->renditions[i];
+            if (rendition->audio[idx] == actx->audio) dispatch_job(rendition, job);
+        }
+    }
+    if (job) unref_job(job);
+    av_packet_unref(pkt);
+    actx->fanout_us += av_gettime_relative() - start;
+
+    return 0;
+}
+
+// whether some rendition or a recent snapshot request needs decoded frames of stream_index
+// caller must hold qrpcCtx->mutex
+bool need_decode(AVFormatQrpcContext *qrpcCtx, int stream_index)
+{
+    for (AVFormatQrpcRendition *rendition = qrpcCtx->renditions; rendition; rendition = rendition->next) {
+        if (rendition->enc_ctx[stream_index] || rendition->audio[stream_index]) return true;
+    }
+
+    return qrpcCtx->dec_ctx[stream_index]->codec_type == AVMEDIA_TYPE_VIDEO &&
+        qrpcCtx->snapshot_deadline > av_gettime_relative();
+}
+
+int member_slots(AVFormatQrpcRendition *rendition)
+{
+    return atomic_load(&rendition->nb_member_chunks) * MEMBER_CHUNK_SIZE;
+}
+
+AVFormatQrpcContextSubscriber* member_at(AVFormatQrpcRendition *rendition, int slot)
+{
+    AVFormatQrpcMemberChunk *chunk = atomic_load(&rendition->member_chunks[slot / MEMBER_CHUNK_SIZE]);
+    return chunk ? atomic_load(&chunk->slots[slot % MEMBER_CHUNK_SIZE]) : NULL;
+}
+
+// members read between begin_member_pass and end_member_pass stay valid even if they are unlinked meanwhile
+// only called by the rendition worker
+void begin_member_pass(AVFormatQrpcRendition *rendition)
+{
+    atomic_store(&rendition->in_pass, 1);
+}
+
+void end_member_pass(AVFormatQrpcRendition *rendition)
+{
+    atomic_store(&rendition->in_pass, 0);
+    rendition->members_failed = false;
+    reclaim_members(rendition);
+}
+
+// drop the membership references of subscribers unlinked while a pass was running
+void reclaim_members(AVFormatQrpcRendition *rendition)
+{
+    AVFormatQrpcContextSubscriber *sub = atomic_exchange(&rendition->retired, NULL);
+    while (sub) {
+        AVFormatQrpcContextSubscriber *next = sub->retired_next;
+        unref_subscriber(sub);
+        sub = next;
+    }
+
+    sub = atomic_exchange(&rendition->switched_out, NULL);
+    while (sub) {
+        AVFormatQrpcContextSubscriber *next = sub->switched_next;
+        atomic_store(&sub->on_switched_out, false);
+        unref_subscriber(sub);
+        sub = next;
+    }
+}
+
+// unlink members whose writes failed or that the queue policy disconnected, called within a pass
+void unlink_failed_members(AVFormatQrpcRendition *rendition)
+{
+    AVFormatQrpcContext *qrpcCtx = rendition->qrpcCtx;
+
+    pthread_mutex_lock(&qrpcCtx->mutex);
+    int n = member_slots(rendition);
+    for (int i = 0; i < n; i++) {
+        AVFormatQrpcContextSubscriber *sub = member_at(rendition, i);
+        if (!sub) continue;
+        pthread_mutex_lock(&sub->lock);
+        bool failed = sub->failed;
+        pthread_mutex_unlock(&sub->lock);
+        if (failed && sub->rendition) unlink_subscriber(qrpcCtx, sub);
+    }
+    unlink_empty_renditions(qrpcCtx);
+    pthread_mutex_unlock(&qrpcCtx->mutex);
+}
+
+// a member only switching to rendition just stays where it is
+// caller must hold qrpcCtx->mutex
+void unlink_all_members(AVFormatQrpcContext *qrpcCtx, AVFormatQrpcRendition *rendition)
+{
+    int n = member_slots(rendition);
+    for (int i = 0; i < n && atomic_load(&rendition->nb_members); i++) {
+        AVFormatQrpcContextSubscriber *sub = member_at(rendition, i);
+        if (!sub) continue;
+        if (sub->rendition != rendition) cancel_switch(sub);
+        else unlink_subscriber(qrpcCtx, sub);
+    }
+}
+
+// renditions are only empty for a moment while subscribing, or after members left
+// caller must hold qrpcCtx->mutex
+void unlink_empty_renditions(AVFormatQrpcContext *qrpcCtx)
+{
+    AVFormatQrpcRendition *rendition = qrpcCtx->renditions;
+    while (rendition) {
+        AVFormatQrpcRendition *next = rendition->next;
+        if (!atomic_load(&rendition->nb_members)) unlink_rendition(qrpcCtx, rendition);
+        rendition = next;
+    }
+}
+
+// rendition's keyframe pkt lets subscriber, which is switching to rendition, take over from its
+// current rendition, unless it would go back in time. called by the rendition worker within a pass
+bool take_over_subscriber(AVFormatQrpcRendition *rendition, AVFormatQrpcContextSubscriber *subscriber, AVPacket *pkt, AVRational time_base)
+{
+    if (atomic_load(&subscriber->switch_to) != rendition) return false;
+
+    AVRational out_time_base = subscriber->sctx->streams[pkt->stream_index]->time_base;
+    int64_t dts = pkt->dts != AV_NOPTS_VALUE ? av_rescale_q(pkt->dts, time_base, out_time_base) : AV_NOPTS_VALUE;
+
+    pthread_mutex_lock(&subscriber->lock);
+    int64_t last_dts = subscriber->last_dts[pkt->stream_index];
+    bool ok = !subscriber->closed && (dts == AV_NOPTS_VALUE || last_dts == AV_NOPTS_VALUE || dts > last_dts);
+    if (ok) {
+        // the old rendition's worker checks feeding with lock held, nothing of it is queued after this
+        atomic_store(&subscriber->feeding, rendition);
+        subscriber->wait_keyframe = false;
+        subscriber->burst = false;
+        subscriber->dts_guard_until = av_gettime_relative() + SWITCH_DTS_GUARD;
+        subscriber->stats.switches ++;
+    }
+    pthread_mutex_unlock(&subscriber->lock);
+    return ok;
+}
+
+// drop the old membership of members that switched to rendition during this pass
+// called by the rendition worker within a pass
+void finish_switches(AVFormatQrpcRendition *rendition)
+{
+    AVFormatQrpcContext *qrpcCtx = rendition->qrpcCtx;
+
+    pthread_mutex_lock(&qrpcCtx->mutex);
+    int n = member_slots(rendition);
+    for (int i = 0; i < n; i++) {
+        AVFormatQrpcContextSubscriber *sub = member_at(rendition, i);
+        if (!sub || atomic_load(&sub->switch_to) != rendition || atomic_load(&sub->feeding) != rendition) continue;
+
+        release_member(sub->rendition, sub->slot, sub, true);
+        sub->rendition = rendition;
+        sub->slot = sub->switch_slot;
+        atomic_store(&sub->rung, sub->switch_rung);
+        atomic_store(&sub->switch_to, NULL);
+    }
+    rendition->members_switched = false;
+    unlink_empty_renditions(qrpcCtx);
+    pthread_mutex_unlock(&qrpcCtx->mutex);
+}
+
+// give up a switch that has not taken over yet, empty renditions are left for the caller to unlink
+// caller must hold qrpcCtx->mutex
+void cancel_switch(AVFormatQrpcContextSubscriber *subscriber)
+{
+    AVFormatQrpcRendition *rendition = atomic_load(&subscriber->switch_to);
+    if (!rendition) return;
+
+    atomic_store(&subscriber->switch_to, NULL);
+    pthread_mutex_lock(&subscriber->lock);
+    if (atomic_load(&subscriber->feeding) == rendition) {
+        // it already took over, go back to the current rendition from its next keyframe
+        atomic_store(&subscriber->feeding, subscriber->rendition);
+        subscriber->wait_keyframe = subscriber->rendition_has_video;
+        subscriber->dts_guard_until = av_gettime_relative() + SWITCH_DTS_GUARD;
+    }
+    pthread_mutex_unlock(&subscriber->lock);
+    release_member(rendition, subscriber->switch_slot, subscriber, true);
+}
+
+// queue a reference of pkt to every member, pkt ts are in time_base
+// called by the rendition worker within a pass, muxing and writing is left to the subscriber's deliverer
+void write_rendition_members(AVFormatQrpcRendition *rendition, AVPacket *pkt, AVRational time_base, bool keyframe)
+{
+    cache_gop_packet(rendition, pkt, time_base, keyframe);
+
+    int n = member_slots(rendition);
+    for (int i = 0; i < n; i++) {
+        AVFormatQrpcContextSubscriber *subscriber = member_at(rendition, i);
+        if (!subscriber) continue;
+        if (atomic_load(&subscriber->feeding) != rendition) {
+            if (!keyframe || !take_over_subscriber(rendition, subscriber, pkt, time_base)) continue;
+            rendition->members_switched = true;
+        }
+        if (subscriber->burst) {
+            subscriber->burst = false;
+            // the cache ends with pkt
+            if (burst_gop_cache(rendition, subscriber)) continue;
+        }
+        if (!enqueue_subscriber(rendition, subscriber, pkt, time_base, keyframe)) rendition->members_failed = true;
+    }
+}
+
+// keep pkt if it belongs to the GOP being cached, a GOP over gop_cache_size is not cached
+void cache_gop_packet(AVFormatQrpcRendition *rendition, AVPacket *pkt, AVRational time_base, bool keyframe)
+{
+    int max_bytes = atomic_load(&gop_cache_size);
+    if (!rendition->has_video || max_bytes <= 0) {
+        if (rendition->nb_gop) reset_gop_cache(rendition, false);
+        return;
+    }
+
+    if (keyframe) reset_gop_cache(rendition, true);
+    if (!rendition->gop_valid) return;
+
+    if (rendition->gop_bytes + pkt->size > max_bytes) {
+        reset_gop_cache(rendition, false);
+        return;
+    }
+
+    if (rendition->nb_gop == rendition->gop_size) {
+        int size = rendition->gop_size ? rendition->gop_size * 2 : 64;
+        AVFormatQrpcCachedPacket *gop = av_realloc_array(rendition->gop, size, sizeof(*gop));
+        if (!gop) {
+            reset_gop_cache(rendition, false);
+            return;
+        }
+        rendition->gop = gop;
+        rendition->gop_size = size;
+    }
+
+    AVPacket *cpkt = qrpc_packet_clone(pkt);
+    if (!cpkt) {
+        reset_gop_cache(rendition, false);
+        return;
+    }
+    rendition->gop[rendition->nb_gop].pkt = cpkt;
+    rendition->gop[rendition->nb_gop].time_base = time_base;
+    rendition->nb_gop ++;
+    rendition->gop_bytes += pkt->size;
+}
+
+void reset_gop_cache(AVFormatQrpcRendition *rendition, bool valid)
+{
+    for (int i = 0; i < rendition->nb_gop; i++) {
+        qrpc_packet_free(&rendition->gop[i].pkt);
+    }
+    rendition->nb_gop = 0;
+    rendition->gop_bytes = 0;
+    rendition->gop_valid = valid;
+}
+
+// queue the cached GOP for a joining member so it can start decoding right away,
+// returns false if there is nothing usable, the member then waits for the next keyframe
+bool burst_gop_cache(AVFormatQrpcRendition *rendition, AVFormatQrpcContextSubscriber *subscriber)
+{
+    if (!rendition->gop_valid || !rendition->nb_gop || rendition->nb_gop > subscriber->config.max_packets) return false;
+
+    pthread_mutex_lock(&subscriber->lock);
+    subscriber->wait_keyframe = false;
+    pthread_mutex_unlock(&subscriber->lock);
+    for (int i = 0; i < rendition->nb_gop; i++) {
+        enqueue_subscriber(rendition, subscriber, rendition->gop[i].pkt, rendition->gop[i].time_base, i == 0);
+    }
+    return true;
+}
+
+// apply the queue policy and append a reference of pkt, called by the rendition worker only
+// returns false if subscriber failed and should be unlinked
+bool enqueue_subscriber(AVFormatQrpcRendition *rendition, AVFormatQrpcContextSubscriber *subscriber, AVPacket *pkt, AVRational time_base, bool keyframe)
+{
+    const AVFormatQrpcSubscribeConfig *config = &subscriber->config;
+    int64_t now = av_gettime_relative();
+    bool ok = true;
+
+    qrpc_metrics_lock(&subscriber->lock, QRPC_STAGE_FANOUT_LOCK);
+    if (subscriber->closed) {
+        ok = !subscriber->failed;
+        goto end;
+    }
+    // taken over by another rendition since this worker looked
+    if (atomic_load(&subscriber->feeding) != rendition) goto end;
+
+    if (config->policy == QRPC_QUEUE_DISCONNECT && subscriber->nb_queue && config->max_lag_ms > 0 &&
+        now - subscriber->queue[subscriber->queue_head].enqueued > config->max_lag_ms * 1000LL) {
+        av_log(NULL, AV_LOG_WARNING, "Subscriber %" PRIu64 " lags more than %dms, disconnecting\n", subscriber->seq, config->max_lag_ms);
+        goto disconnect;
+    }
+
+    AVRational out_time_base = subscriber->sctx->streams[pkt->stream_index]->time_base;
+    int64_t dts = pkt->dts != AV_NOPTS_VALUE ? av_rescale_q(pkt->dts, time_base, out_time_base) : AV_NOPTS_VALUE;
+    int64_t *last_dts = &subscriber->last_dts[pkt->stream_index];
+    // around a switch of rungs the renditions may overlap, the muxer wants dts to only go forward
+    if (dts != AV_NOPTS_VALUE && *last_dts != AV_NOPTS_VALUE && dts < *last_dts && now < subscriber->dts_guard_until) {
+        subscriber->stats.dropped_packets ++;
+        goto end;
+    }
+
+    if (subscriber->wait_keyframe) {
+        if (!keyframe) {
+            subscriber->stats.dropped_packets ++;
             goto end;
         }
-        // delete one
-        while (sub) {
-            if (sub->seq == seq) {
-                if (!prev) {
-                    qrpcCtx->subscribers->first = qrpcCtx->subscribers->last = NULL;
-                    free_subscriber(sub);
-                } else {
-                    prev->next = sub->next;
-                    if (qrpcCtx->subscribers->last == sub) qrpcCtx->subscribers->last = prev;
-                    free_subscriber(sub);
-                }
-                qrpcCtx->subscribers->n --;
+        subscriber->wait_keyframe = false;
+    }
+
+    if (subscriber->nb_queue == config->max_packets) {
+        switch (config->policy) {
+        case QRPC_QUEUE_SKIP_TO_LIVE:
+            // throw away the backlog and resume from the newest keyframe
+            subscriber->stats.dropped_packets += subscriber->nb_queue;
+            subscriber->stats.skips ++;
+            while (subscriber->nb_queue) {
+                qrpc_packet_free(&subscriber->queue[subscriber->queue_head].pkt);
+                subscriber->queue_head = (subscriber->queue_head + 1) % config->max_packets;
+                subscriber->nb_queue --;
+            }
+            if (!keyframe && subscriber->rendition_has_video) {
+                subscriber->stats.dropped_packets ++;
+                subscriber->wait_keyframe = true;
                 goto end;
             }
-            prev = sub;
-            sub = sub->next;
+            break;
+        case QRPC_QUEUE_DISCONNECT:
+            av_log(NULL, AV_LOG_WARNING, "Subscriber %" PRIu64 " queue is full, disconnecting\n", subscriber->seq);
+            goto disconnect;
+        default:
+            // what is queued still decodes, drop the rest of this GOP
+            subscriber->stats.dropped_packets ++;
+            subscriber->wait_keyframe = subscriber->rendition_has_video;
+            goto end;
         }
     }
-end:    
-    if (!locked) {
-        pthread_mutex_unlock(&qrpcCtx->mutex);
+
+    AVPacket *opkt = qrpc_packet_clone(pkt);
+    if (!opkt) {
+        subscriber->stats.dropped_packets ++;
+        subscriber->wait_keyframe = subscriber->rendition_has_video;
+        goto end;
+    }
+    av_packet_rescale_ts(opkt, time_base, out_time_base);
+    if (dts != AV_NOPTS_VALUE) *last_dts = dts;
+    AVFormatQrpcQueueEntry *entry = &subscriber->queue[(subscriber->queue_head + subscriber->nb_queue) % config->max_packets];
+    entry->pkt = opkt;
+    entry->enqueued = now;
+    subscriber->nb_queue ++;
+    pthread_cond_signal(&subscriber->cond);
+end:
+    pthread_mutex_unlock(&subscriber->lock);
+    return ok;
+disconnect:
+    pthread_mutex_unlock(&subscriber->lock);
+    close_subscriber(subscriber, true);
+    return false;
+}
+
+// stop queueing for subscriber and wake up its deliverer, packets still queued are discarded
+void close_subscriber(AVFormatQrpcContextSubscriber *subscriber, bool failed)
+{
+    pthread_mutex_lock(&subscriber->lock);
+    if (!subscriber->closed) {
+        subscriber->closed = true;
+        subscriber->failed = failed;
+        pthread_cond_broadcast(&subscriber->cond);
+    }
+    pthread_mutex_unlock(&subscriber->lock);
+}
+
+bool rendition_config_equal(const AVFormatQrpcRenditionConfig *a, const AVFormatQrpcRenditionConfig *b)
+{
+    return !strcmp(a->fmt, b->fmt) && a->passthrough == b->passthrough &&
+        a->width == b->width && a->height == b->height && a->bit_rate == b->bit_rate &&
+        encoder_config_equal(&a->encoder, &b->encoder);
+}
+
+bool encoder_config_equal(const AVFormatQrpcEncoderConfig *a, const AVFormatQrpcEncoderConfig *b)
+{
+    return !strcmp(a->codec, b->codec) && !strcmp(a->preset, b->preset) && !strcmp(a->tune, b->tune) &&
+        a->bit_rate == b->bit_rate && a->max_rate == b->max_rate && a->buffer_size == b->buffer_size &&
+        a->gop_size == b->gop_size && a->threads == b->threads && a->slice_threads == b->slice_threads;
+}
+
+// caller must hold qrpcCtx->mutex
+AVFormatQrpcRendition* find_or_new_rendition(AVFormatContext *ifc, const AVFormatQrpcRenditionConfig *config, int *ret)
+{
+    AVFormatQrpcContext *qrpcCtx = ifc->opaque;
+    AVFormatQrpcRendition *rendition = qrpcCtx->renditions;
+    int encoded = 0;
+    while (rendition) {
+        if (rendition_config_equal(&rendition->config, config)) {
+            *ret = 0;
+            return rendition;
+        }
+        if (!rendition->config.passthrough) encoded++;
+        rendition = rendition->next;
+    }
+    // every encoded rendition takes at least an encoder thread, whatever the budget
+    int max_encoded = atomic_load(&max_encoded_renditions);
+    if (!config->passthrough && max_encoded > 0 && encoded >= max_encoded) {
+        *ret = AVERROR(EBUSY);
+        return NULL;
+    }
+
+    rendition = av_mallocz(sizeof(AVFormatQrpcRendition));
+    if (!rendition) {
+        *ret = AVERROR(ENOMEM);
+        return NULL;
+    }
+    if (pthread_mutex_init(&rendition->lock, NULL)) {
+        av_free(rendition);
+        *ret = AVERROR(ENOMEM);
+        return NULL;
+    }
+    rendition->config = *config;
+    rendition->qrpcCtx = qrpcCtx;
+    atomic_init(&rendition->refs, 1);
+    if (!(rendition->enc_frame = av_frame_alloc())) {
+        free_rendition(rendition);
+        *ret = AVERROR(ENOMEM);
+        return NULL;
+    }
+    if ((*ret = open_rendition_encoders(ifc, rendition)) < 0) {
+        free_rendition(rendition);
+        return NULL;
+    }
+
+    rendition->linked = true;
+    rendition->next = qrpcCtx->renditions;
+    qrpcCtx->renditions = rendition;
+    return rendition;
+}
+
+// caller must hold qrpcCtx->mutex
+void unlink_rendition(AVFormatQrpcContext *qrpcCtx, AVFormatQrpcRendition *rendition)
+{
+    AVFormatQrpcRendition **pp = &qrpcCtx->renditions;
+    while (*pp) {
+        if (*pp == rendition) {
+            *pp = rendition->next;
+            break;
+        }
+        pp = &(*pp)->next;
     }
+    rendition->linked = false;
+    unref_rendition(rendition);
+}
+
+void unref_rendition(AVFormatQrpcRendition *rendition)
+{
+    if (atomic_fetch_sub(&rendition->refs, 1) == 1) free_rendition(rendition);
+}
+
+void free_rendition(AVFormatQrpcRendition *rendition)
+{
+    if (rendition->enc_ctx) {
+        for (int i = 0; i < rendition->nb_streams; i++) {
+            if (rendition->enc_ctx[i]) avcodec_free_context(&rendition->enc_ctx[i]);
+        }
+        av_free(rendition->enc_ctx);
+    }
+    av_free(rendition->audio);
+    if (rendition->codecpar) {
+        for (int i = 0; i < rendition->nb_streams; i++) {
+            avcodec_parameters_free(&rendition->codecpar[i]);
+        }
+        av_free(rendition->codecpar);
+    }
+    for (int i = 0; i < rendition->nb_jobs; i++) {
+        unref_job(rendition->jobs[(rendition->jobs_head + i) % RENDITION_QUEUE_SIZE]);
+    }
+    pthread_mutex_destroy(&rendition->lock);
+    av_frame_free(&rendition->enc_frame);
+    reclaim_members(rendition);
+    for (int i = 0; i < atomic_load(&rendition->nb_member_chunks); i++) {
+        av_free(atomic_load(&rendition->member_chunks[i]));
+    }
+    av_free(rendition->free_slots);
+    reset_gop_cache(rendition, false);
+    av_free(rendition->gop);
+    av_free(rendition->in_time_base);
+    av_free(rendition->last_pts);
+    atomic_fetch_sub(&encoder_threads_used, rendition->enc_threads);
+    av_free(rendition);
+}
+
+AVFormatQrpcContextSubscriber* new_subscriber(AVFormatContext *oc, uint64_t seq, uintptr_t writer, const AVFormatQrpcSubscribeConfig *subscribe_config)
+{
+    AVFormatQrpcContextSubscriber *subscriber = av_mallocz(sizeof(AVFormatQrpcContextSubscriber));
+    if (!subscriber) return NULL;
+
+    subscriber->config = *subscribe_config;
+    if (subscriber->config.max_packets <= 0) subscriber->config.max_packets = SUBSCRIBER_QUEUE_SIZE;
+    subscriber->queue = av_mallocz_array(subscriber->config.max_packets, sizeof(*subscriber->queue));
+    if (!subscriber->queue) goto fail;
+    if (pthread_mutex_init(&subscriber->lock, NULL)) goto fail;
+    if (pthread_cond_init(&subscriber->cond, NULL)) {
+        pthread_mutex_destroy(&subscriber->lock);
+        goto fail;
+    }
+
+    subscriber->sctx = oc;
+    subscriber->seq = seq;
+    subscriber->writer = writer;
+    subscriber->last_pts = AV_NOPTS_VALUE;
+    subscriber->rendition = NULL;
+    subscriber->slot = -1;
+    atomic_init(&subscriber->refs, 1);
+    return subscriber;
+fail:
+    av_free(subscriber->queue);
+    av_free(subscriber);
+    return NULL;
+}
+
+// the reference of the caller is handed over to subscriber->rendition, O(1) unless a chunk of slots is added
+// caller must hold qrpcCtx->mutex
+int add_subscriber(AVFormatQrpcContext* qrpcCtx, AVFormatQrpcContextSubscriber *subscriber)
+{
+    AVFormatQrpcRendition *rendition = subscriber->rendition;
+    subscriber->rendition_has_video = rendition->has_video;
+    // a running rendition is mid GOP, start from its cached GOP or else its next keyframe
+    subscriber->wait_keyframe = atomic_load(&rendition->nb_members) > 0 && subscriber->rendition_has_video;
+    subscriber->burst = subscriber->wait_keyframe;
+    atomic_store(&subscriber->feeding, rendition);
+
+    int slot = add_member(rendition, subscriber);
+    if (slot < 0) return slot;
+    subscriber->slot = slot;
+    return 0;
+}
+
+// publish subscriber in a free slot of rendition, what the caller set up before is visible to the worker
+// returns the slot, caller must hold qrpcCtx->mutex
+int add_member(AVFormatQrpcRendition *rendition, AVFormatQrpcContextSubscriber *subscriber)
+{
+    int slot;
+    if (rendition->nb_free_slots) {
+        slot = rendition->free_slots[--rendition->nb_free_slots];
+    } else {
+        int nb_chunks = atomic_load(&rendition->nb_member_chunks);
+        if (nb_chunks == MAX_MEMBER_CHUNKS) return AVERROR(ENOSPC);
+        // room for every slot, so unlinking never has to allocate
+        int *free_slots = av_realloc_array(rendition->free_slots, (nb_chunks + 1) * MEMBER_CHUNK_SIZE, sizeof(int));
+        if (!free_slots) return AVERROR(ENOMEM);
+        rendition->free_slots = free_slots;
+        AVFormatQrpcMemberChunk *chunk = av_malloc(sizeof(AVFormatQrpcMemberChunk));
+        if (!chunk) return AVERROR(ENOMEM);
+        for (int i = 0; i < MEMBER_CHUNK_SIZE; i++) {
+            atomic_init(&chunk->slots[i], NULL);
+        }
+        atomic_store(&rendition->member_chunks[nb_chunks], chunk);
+        atomic_store(&rendition->nb_member_chunks, nb_chunks + 1);
+
+        slot = nb_chunks * MEMBER_CHUNK_SIZE;
+        // lowest slots are handed out first, keeping the worker's walk short
+        for (int i = MEMBER_CHUNK_SIZE - 1; i > 0; i--) {
+            rendition->free_slots[rendition->nb_free_slots++] = slot + i;
+        }
+    }
+
+    atomic_fetch_add(&rendition->nb_members, 1);
+    atomic_store(&rendition->member_chunks[slot / MEMBER_CHUNK_SIZE]->slots[slot % MEMBER_CHUNK_SIZE], subscriber);
+    return slot;
+}
+
+// remove subscriber from its rendition and any it is switching to in O(1) and drop those memberships,
+// empty renditions are left for the caller to unlink
+// caller must hold qrpcCtx->mutex
+void unlink_subscriber(AVFormatQrpcContext* qrpcCtx, AVFormatQrpcContextSubscriber *subscriber)
+{
+    close_subscriber(subscriber, false);
+    cancel_switch(subscriber);
+    release_member(subscriber->rendition, subscriber->slot, subscriber, false);
+    subscriber->rendition = NULL;
+    subscriber->slot = -1;
+}
+
+// clear the slot of subscriber in rendition and drop the reference of that membership
+// caller must hold qrpcCtx->mutex
+void release_member(AVFormatQrpcRendition *rendition, int slot, AVFormatQrpcContextSubscriber *subscriber, bool switched)
+{
+    atomic_store(&rendition->member_chunks[slot / MEMBER_CHUNK_SIZE]->slots[slot % MEMBER_CHUNK_SIZE], NULL);
+    rendition->free_slots[rendition->nb_free_slots++] = slot;
+    atomic_fetch_sub(&rendition->nb_members, 1);
+
+    // the slot is cleared before in_pass is read, so a pass that starts later can't see subscriber
+    if (!atomic_load(&rendition->in_pass)) {
+        unref_subscriber(subscriber);
+        return;
+    }
+
+    // a subscriber is unlinked once and on at most one switched_out list, so each list has its own link
+    _Atomic(AVFormatQrpcContextSubscriber *) *list = &rendition->retired;
+    if (switched) {
+        atomic_store(&subscriber->on_switched_out, true);
+        list = &rendition->switched_out;
+    }
+    AVFormatQrpcContextSubscriber *head = atomic_load(list);
+    do {
+        if (switched) subscriber->switched_next = head;
+        else subscriber->retired_next = head;
+    } while (!atomic_compare_exchange_weak(list, &head, subscriber));
+}
+
+void del_all_subscribers(AVFormatQrpcContext* qrpcCtx)
+{
+    pthread_mutex_lock(&qrpcCtx->mutex);
+    while (qrpcCtx->renditions) {
+        AVFormatQrpcRendition *rendition = qrpcCtx->renditions;
+        unlink_all_members(qrpcCtx, rendition);
+        unlink_rendition(qrpcCtx, rendition);
+    }
+    pthread_mutex_unlock(&qrpcCtx->mutex);
+}
+
+void unref_subscriber(AVFormatQrpcContextSubscriber* subscriber)
+{
+    if (atomic_fetch_sub(&subscriber->refs, 1) == 1) free_subscriber(subscriber);
 }
 
 void free_subscriber(AVFormatQrpcContextSubscriber* subscriber)
 {
-    for (int i = 0; i < subscriber->sctx->nb_streams; i++) {
-        if (subscriber->enc_ctx[i]) avcodec_free_context(&subscriber->enc_ctx[i]);
+    while (subscriber->nb_queue) {
+        qrpc_packet_free(&subscriber->queue[subscriber->queue_head].pkt);
+        subscriber->queue_head = (subscriber->queue_head + 1) % subscriber->config.max_packets;
+        subscriber->nb_queue --;
     }
+    av_free(subscriber->queue);
+    av_free(subscriber->last_dts);
+    pthread_cond_destroy(&subscriber->cond);
+    pthread_mutex_destroy(&subscriber->lock);
+
+    AVIOContext *pb = subscriber->sctx->pb;
     avformat_free_context(subscriber->sctx);
+    qrpc_avio_context_free(&pb);
     av_free(subscriber);
 }
 
 int write_subscriber_callback(void* subvoid, uint8_t *buf, int buf_size)
 {
     AVFormatQrpcContextSubscriber* subscriber = subvoid;
-    return write_packet_seq_callback(subscriber->sctx->opaque, subscriber->seq, buf, buf_size);
+    int64_t start = av_gettime_relative();
+    int ret = write_handle_callback(subscriber->writer, buf, buf_size);
+    int64_t write_us = av_gettime_relative() - start;
+    // how long the writer blocks is what rung selection measures the link by
+    subscriber->write_us += write_us;
+    subscriber->write_bytes += buf_size;
+    qrpc_callback_us += write_us;
+    qrpc_metrics_observe(QRPC_STAGE_WRITE, write_us);
+    if (ret < 0) qrpc_metrics_error(QRPC_STAGE_WRITE);
+    return ret;
 }
 
-int prepare_avformatcontext_for_output(AVFormatContext *ifc, AVFormatQrpcContextSubscriber *subscriber)
+int open_rendition_encoders(AVFormatContext *ifc, AVFormatQrpcRendition *rendition)
 {
-    AVFormatContext *ofc = subscriber->sctx;
-    subscriber->enc_ctx = av_mallocz_array(ofc->nb_streams, sizeof(AVCodecContext *));
-    if (!subscriber->enc_ctx) {
+    rendition->nb_streams = ifc->nb_streams;
+    rendition->enc_ctx = av_mallocz_array(ifc->nb_streams, sizeof(AVCodecContext *));
+    rendition->audio = av_mallocz_array(ifc->nb_streams, sizeof(AVFormatQrpcAudioEncoder *));
+    rendition->in_time_base = av_mallocz_array(ifc->nb_streams, sizeof(AVRational));
+    rendition->last_pts = av_malloc_array(ifc->nb_streams, sizeof(int64_t));
+    rendition->codecpar = av_mallocz_array(ifc->nb_streams, sizeof(AVCodecParameters *));
+    if (!rendition->enc_ctx || !rendition->audio || !rendition->in_time_base || !rendition->last_pts || !rendition->codecpar) {
         av_log(NULL, AV_LOG_ERROR, "Failed allocating AVCodecContext *\n");
         return AVERROR(ENOMEM);
     }
+
+    AVOutputFormat *ofmt = av_guess_format(rendition->config.fmt, NULL, NULL);
+    if (!ofmt) return AVERROR(EINVAL);
+
     int ret = 0;
     AVFormatQrpcContext *qrpcCtx = ifc->opaque;
     for (int i = 0; i < ifc->nb_streams; i++) {
-        AVStream *out_stream = avformat_new_stream(ofc, NULL);
-        if (!out_stream) {
-            av_log(NULL, AV_LOG_ERROR, "Failed allocating output stream\n");
-            return AVERROR_UNKNOWN;
-        }
-
-        AVStream *in_stream = ifc->streams[i];
         AVCodecContext *dec_ctx = qrpcCtx->dec_ctx[i];
+        rendition->in_time_base[i] = ifc->streams[i]->time_base;
+        rendition->last_pts[i] = AV_NOPTS_VALUE;
+        if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) rendition->has_video = true;
+
+        if (rendition->config.passthrough) {
+            if (!(rendition->codecpar[i] = avcodec_parameters_alloc())) return AVERROR(ENOMEM);
+            if ((ret = avcodec_parameters_copy(rendition->codecpar[i], ifc->streams[i]->codecpar)) < 0) return ret;
+            rendition->codecpar[i]->codec_tag = 0;
+            continue;
+        }
         
-        if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO
-                || dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
-            AVCodec *encoder = avcodec_find_encoder(dec_ctx->codec_id);
+        if (dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
+            AVFormatQrpcAudioEncoder *audio = find_or_new_audio_encoder(ifc, i, ofmt->flags & AVFMT_GLOBALHEADER, &ret);
+            if (!audio) return ret;
+            rendition->audio[i] = audio;
+            if (!(rendition->codecpar[i] = avcodec_parameters_alloc())) return AVERROR(ENOMEM);
+            if ((ret = avcodec_parameters_copy(rendition->codecpar[i], audio->codecpar)) < 0) return ret;
+            continue;
+        }
+
+        if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+            const char *codec = rendition->config.encoder.codec;
+            AVCodec *encoder = codec[0] ? avcodec_find_encoder_by_name(codec) : avcodec_find_encoder(dec_ctx->codec_id);
             if (!encoder) {
                 av_log(NULL, AV_LOG_FATAL, "Necessary encoder not found\n");
                 return AVERROR_INVALIDDATA;
@@ -483,44 +2764,225 @@ int prepare_avformatcontext_for_output(AVFormatContext *ifc, AVFormatQrpcContext
                 av_log(NULL, AV_LOG_FATAL, "Failed to allocate the encoder context\n");
                 return AVERROR(ENOMEM);
             }
-            if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
-                enc_ctx->height = dec_ctx->height;
-                enc_ctx->width = dec_ctx->width;
-                enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
-                /* take first format from list of supported formats */
-                if (encoder->pix_fmts)
-                    enc_ctx->pix_fmt = encoder->pix_fmts[0];
-                else
-                    enc_ctx->pix_fmt = dec_ctx->pix_fmt;
-                /* video time_base can be set to whatever is handy and supported by encoder */
-                enc_ctx->time_base = av_inv_q(dec_ctx->framerate);
-            } else {
-                enc_ctx->sample_rate = dec_ctx->sample_rate;
-                enc_ctx->channel_layout = dec_ctx->channel_layout;
-                enc_ctx->channels = av_get_channel_layout_nb_channels(enc_ctx->channel_layout);
-                /* take first format from list of supported formats */
-                enc_ctx->sample_fmt = encoder->sample_fmts[0];
-                enc_ctx->time_base = (AVRational){1, enc_ctx->sample_rate};
+            rendition->enc_ctx[i] = enc_ctx;
+            enc_ctx->height = dec_ctx->height;
+            enc_ctx->width = dec_ctx->width;
+            if (rendition->config.width > 0 || rendition->config.height > 0) {
+                int width = rendition->config.width, height = rendition->config.height;
+                fit_size(dec_ctx->width, dec_ctx->height, &width, &height);
+                if (width != dec_ctx->width || height != dec_ctx->height) {
+                    if (!(rendition->scaler = find_or_new_scaler(qrpcCtx, width, height))) return AVERROR(ENOMEM);
+                    enc_ctx->width = width;
+                    enc_ctx->height = height;
+                }
             }
-
-            if (ofc->oformat->flags & AVFMT_GLOBALHEADER)
+            enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
+            /* take first format from list of supported formats */
+            if (encoder->pix_fmts)
+                enc_ctx->pix_fmt = encoder->pix_fmts[0];
+            else
+                enc_ctx->pix_fmt = dec_ctx->pix_fmt;
+            /* video time_base can be set to whatever is handy and supported by encoder */
+            enc_ctx->time_base = av_inv_q(dec_ctx->framerate);
+
+            if (ofmt->flags & AVFMT_GLOBALHEADER)
                 enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
             
-             /* Third parameter can be used to pass settings to encoder */
-            ret = avcodec_open2(enc_ctx, encoder, NULL);
-            if (ret < 0) {
+            if ((ret = open_video_encoder(rendition, enc_ctx, encoder)) < 0) {
                 av_log(NULL, AV_LOG_ERROR, "Cannot open video encoder for stream #%u\n", i);
                 return ret;
             }
-            ret = avcodec_parameters_from_context(out_stream->codecpar, enc_ctx);
+            if (!(rendition->codecpar[i] = avcodec_parameters_alloc())) return AVERROR(ENOMEM);
+            ret = avcodec_parameters_from_context(rendition->codecpar[i], enc_ctx);
             if (ret < 0) {
-                av_log(NULL, AV_LOG_ERROR, "Failed to copy encoder parameters to output stream #%u\n", i);
+                av_log(NULL, AV_LOG_ERROR, "Failed to copy encoder parameters of stream #%u\n", i);
                 return ret;
             }
+        }
+    }
+
+    return 0;
+}
 
-            out_stream->time_base = enc_ctx->time_base;
-            subscriber->enc_ctx[i] = enc_ctx;
+// apply the rendition's encoder config to enc_ctx and open it
+int open_video_encoder(AVFormatQrpcRendition *rendition, AVCodecContext *enc_ctx, AVCodec *encoder)
+{
+    const AVFormatQrpcEncoderConfig *config = &rendition->config.encoder;
+    // a ladder rung has its own bit rate
+    int64_t bit_rate = rendition->config.bit_rate > 0 ? rendition->config.bit_rate : config->bit_rate;
+    if (bit_rate > 0) enc_ctx->bit_rate = bit_rate;
+    if (config->max_rate > 0) enc_ctx->rc_max_rate = config->max_rate;
+    if (config->buffer_size > 0) enc_ctx->rc_buffer_size = config->buffer_size;
+    if (config->gop_size > 0) enc_ctx->gop_size = config->gop_size;
+
+    rendition->enc_threads += enc_ctx->thread_count = acquire_encoder_threads(config->threads);
+    if (config->slice_threads) enc_ctx->thread_type = FF_THREAD_SLICE;
+
+    AVDictionary *opts = NULL;
+    if (config->preset[0]) av_dict_set(&opts, "preset", config->preset, 0);
+    if (config->tune[0]) av_dict_set(&opts, "tune", config->tune, 0);
+    int ret = avcodec_open2(enc_ctx, encoder, &opts);
+    // options the encoder doesn't have are left in opts
+    AVDictionaryEntry *e = NULL;
+    while ((e = av_dict_get(opts, "", e, AV_DICT_IGNORE_SUFFIX))) {
+        av_log(NULL, AV_LOG_WARNING, "Encoder %s ignored option %s=%s\n", encoder->name, e->key, e->value);
+    }
+    av_dict_free(&opts);
+    return ret;
+}
+
+// take up to want threads from the encoder thread budget, at least 1 so that every encoder can run
+int acquire_encoder_threads(int want)
+{
+    int budget = atomic_load(&encoder_thread_budget);
+    if (budget <= 0) budget = av_cpu_count();
+    if (want <= 0) want = DEFAULT_ENCODER_THREADS;
+
+    int used = atomic_load(&encoder_threads_used);
+    int grant;
+    do {
+        grant = FFMAX(1, FFMIN(want, budget - used));
+    } while (!atomic_compare_exchange_weak(&encoder_threads_used, &used, used + grant));
+    return grant;
+}
+
+// the shared encoder of audio stream idx for renditions with or without a global header, opened on first use
+// caller must hold qrpcCtx->mutex
+AVFormatQrpcAudioEncoder* find_or_new_audio_encoder(AVFormatContext *ifc, int idx, bool global_header, int *ret)
+{
+    AVFormatQrpcContext *qrpcCtx = ifc->opaque;
+    AVFormatQrpcAudioTask *task = find_or_new_audio_task(ifc, idx);
+    if (!task) {
+        *ret = AVERROR(ENOMEM);
+        return NULL;
+    }
+    AVFormatQrpcAudioEncoder **slot = &task->audio[global_header];
+    *ret = 0;
+    if (*slot) return *slot;
+
+    AVCodecContext *dec_ctx = qrpcCtx->dec_ctx[idx];
+    AVCodec *encoder = avcodec_find_encoder(dec_ctx->codec_id);
+    if (!encoder) {
+        av_log(NULL, AV_LOG_FATAL, "Necessary encoder not found\n");
+        *ret = AVERROR_INVALIDDATA;
+        return NULL;
+    }
+    AVFormatQrpcAudioEncoder *audio = av_mallocz(sizeof(AVFormatQrpcAudioEncoder));
+    if (!audio || !(audio->enc_ctx = avcodec_alloc_context3(encoder)) || !(audio->codecpar = avcodec_parameters_alloc()) ||
+        !(audio->resampled = av_frame_alloc()) || !(audio->frame = av_frame_alloc())) {
+        *ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    audio->next_pts = AV_NOPTS_VALUE;
+
+    // keep what the publisher sends where the encoder supports it, the rest is resampled
+    AVCodecContext *enc_ctx = audio->enc_ctx;
+    enc_ctx->sample_fmt = encoder->sample_fmts ? encoder->sample_fmts[0] : dec_ctx->sample_fmt;
+    for (const enum AVSampleFormat *f = encoder->sample_fmts; f && *f != AV_SAMPLE_FMT_NONE; f++) {
+        if (*f == dec_ctx->sample_fmt) enc_ctx->sample_fmt = *f;
+    }
+    enc_ctx->sample_rate = encoder->supported_samplerates ? encoder->supported_samplerates[0] : dec_ctx->sample_rate;
+    for (const int *r = encoder->supported_samplerates; r && *r; r++) {
+        if (*r == dec_ctx->sample_rate) enc_ctx->sample_rate = *r;
+    }
+    uint64_t layout = dec_ctx->channel_layout ? dec_ctx->channel_layout : av_get_default_channel_layout(dec_ctx->channels);
+    enc_ctx->channel_layout = encoder->channel_layouts ? encoder->channel_layouts[0] : layout;
+    for (const uint64_t *l = encoder->channel_layouts; l && *l; l++) {
+        if (*l == layout) enc_ctx->channel_layout = *l;
+    }
+    enc_ctx->channels = av_get_channel_layout_nb_channels(enc_ctx->channel_layout);
+    enc_ctx->time_base = (AVRational){1, enc_ctx->sample_rate};
+    if (dec_ctx->bit_rate > 0) enc_ctx->bit_rate = dec_ctx->bit_rate;
+    if (global_header) enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if ((*ret = avcodec_open2(enc_ctx, encoder, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open audio encoder for stream #%u\n", idx);
+        goto fail;
+    }
+    if ((*ret = avcodec_parameters_from_context(audio->codecpar, enc_ctx)) < 0) goto fail;
+    if (!(audio->fifo = av_audio_fifo_alloc(enc_ctx->sample_fmt, enc_ctx->channels, FFMAX(enc_ctx->frame_size, 1024)))) {
+        *ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    *slot = audio;
+    return audio;
+
+fail:
+    free_audio_encoder(&audio);
+    return NULL;
+}
+
+void free_audio_encoder(AVFormatQrpcAudioEncoder **paudio)
+{
+    AVFormatQrpcAudioEncoder *audio = *paudio;
+    if (!audio) return;
+
+    avcodec_free_context(&audio->enc_ctx);
+    avcodec_parameters_free(&audio->codecpar);
+    swr_free(&audio->swr);
+    if (audio->fifo) av_audio_fifo_free(audio->fifo);
+    av_frame_free(&audio->resampled);
+    av_frame_free(&audio->frame);
+    av_freep(paudio);
+}
+
+// the audio task of stream idx, created with its first encoder
+// caller must hold qrpcCtx->mutex
+AVFormatQrpcAudioTask* find_or_new_audio_task(AVFormatContext *ifc, int idx)
+{
+    AVFormatQrpcContext *qrpcCtx = ifc->opaque;
+    if (qrpcCtx->audio_tasks[idx]) return qrpcCtx->audio_tasks[idx];
+
+    AVFormatQrpcAudioTask *task = av_mallocz(sizeof(AVFormatQrpcAudioTask));
+    if (!task) return NULL;
+    if (pthread_mutex_init(&task->lock, NULL)) {
+        av_free(task);
+        return NULL;
+    }
+    task->qrpcCtx = qrpcCtx;
+    task->stream_index = idx;
+    task->time_base = ifc->streams[idx]->time_base;
+    qrpcCtx->audio_tasks[idx] = task;
+    return task;
+}
+
+// once no task is pending on the worker pool
+void free_audio_task(AVFormatQrpcAudioTask **ptask)
+{
+    AVFormatQrpcAudioTask *task = *ptask;
+    if (!task) return;
+
+    for (int i = 0; i < task->nb_jobs; i++) {
+        unref_job(task->jobs[(task->jobs_head + i) % RENDITION_QUEUE_SIZE]);
+    }
+    free_audio_encoder(&task->audio[0]);
+    free_audio_encoder(&task->audio[1]);
+    pthread_mutex_destroy(&task->lock);
+    av_freep(ptask);
+}
+
+int prepare_avformatcontext_for_output(AVFormatQrpcRendition *rendition, AVFormatQrpcContextSubscriber *subscriber)
+{
+    AVFormatContext *ofc = subscriber->sctx;
+    int ret = 0;
+    if (!(subscriber->last_dts = av_malloc_array(rendition->nb_streams, sizeof(int64_t)))) return AVERROR(ENOMEM);
+    for (int i = 0; i < rendition->nb_streams; i++) {
+        subscriber->last_dts[i] = AV_NOPTS_VALUE;
+        AVStream *out_stream = avformat_new_stream(ofc, NULL);
+        if (!out_stream) {
+            av_log(NULL, AV_LOG_ERROR, "Failed allocating output stream\n");
+            return AVERROR_UNKNOWN;
         }
+
+        if (!rendition->codecpar[i]) continue;
+
+        ret = avcodec_parameters_copy(out_stream->codecpar, rendition->codecpar[i]);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Failed to copy encoder parameters to output stream #%u\n", i);
+            return ret;
+        }
+        out_stream->time_base = rendition->enc_ctx[i] ? rendition->enc_ctx[i]->time_base : rendition->in_time_base[i];
     }
 
      /* init muxer, write output file header */
@@ -535,25 +2997,48 @@ int prepare_avformatcontext_for_output(AVFormatContext *ifc, AVFormatQrpcContext
 
 void AVFormat_Free(AVFormatContext* ctx)
 {
+    if (!ctx) return;
+
     AVFormatQrpcContext *qrpcCtx = ctx->opaque;
     free_qrpc_context(qrpcCtx);
-    avformat_free_context(ctx);
+    // custom IO is ours to free
+    AVIOContext *pb = ctx->pb;
+    avformat_close_input(&ctx);
+    qrpc_avio_context_free(&pb);
 }
 
 void free_qrpc_context(AVFormatQrpcContext *qrpcCtx)
 {
     if (qrpcCtx) {
         
-        del_subscriber(qrpcCtx, SEQ_ALL, false);
+        del_all_subscribers(qrpcCtx);
+
+        // rendition tasks still running and snapshot waiters use qrpcCtx
+        pthread_mutex_lock(&qrpcCtx->mutex);
+        qrpcCtx->closing = true;
+        pthread_cond_broadcast(&qrpcCtx->latest_cond);
+        while (atomic_load(&qrpcCtx->pending_tasks) || atomic_load(&qrpcCtx->snapshot_waiters)) {
+            pthread_cond_wait(&qrpcCtx->idle_cond, &qrpcCtx->mutex);
+        }
+        pthread_mutex_unlock(&qrpcCtx->mutex);
 
         if (qrpcCtx->dec_ctx) {
             for (int i = 0; i < qrpcCtx->nb_streams; i++) {
                 if (qrpcCtx->dec_ctx[i]) {
+                    if (qrpcCtx->decoding && qrpcCtx->decoding[i] && qrpcCtx->dec_ctx[i]->codec_type == AVMEDIA_TYPE_VIDEO)
+                        stop_video_decoder(qrpcCtx, i);
                     avcodec_free_context(&qrpcCtx->dec_ctx[i]);
                 }
             }
             av_free(qrpcCtx->dec_ctx);
         }
+        av_free(qrpcCtx->dec_threads);
+        if (qrpcCtx->audio_tasks) {
+            for (int i = 0; i < qrpcCtx->nb_streams; i++) {
+                free_audio_task(&qrpcCtx->audio_tasks[i]);
+            }
+            av_free(qrpcCtx->audio_tasks);
+        }
         if (qrpcCtx->latest) {
             for (int i = 0; i < qrpcCtx->nb_streams; i++) {
                 if (qrpcCtx->latest[i]) {
@@ -562,6 +3047,16 @@ void free_qrpc_context(AVFormatQrpcContext *qrpcCtx)
             }
             av_free(qrpcCtx->latest);
         }
+        av_free(qrpcCtx->latest_frame_generation);
+        av_frame_free(&qrpcCtx->latest_spare);
+        av_frame_free(&qrpcCtx->dec_frame);
+        av_free(qrpcCtx->decoding);
+        av_free(qrpcCtx->dispatch);
+        free_scalers(qrpcCtx);
+        pthread_cond_destroy(&qrpcCtx->idle_cond);
+        pthread_cond_destroy(&qrpcCtx->latest_cond);
+        pthread_mutex_destroy(&qrpcCtx->latest_lock);
+        pthread_mutex_destroy(&qrpcCtx->mutex);
         av_free(qrpcCtx);
     }
 }
@@ -570,7 +3065,7 @@ int GOAVERROR_EINVAL = AVERROR(EINVAL);
 int GOAVERROR_EOF = AVERROR_EOF;
 int GOAVERROR_EAGAIN = AVERROR(EAGAIN);
 
-int open_codec_context(int stream_idx, AVCodecContext **dec_ctx, AVFormatContext *fmt_ctx)
+int open_codec_context(int stream_idx, AVCodecContext **dec_ctx, AVFormatContext *fmt_ctx, int threads, int thread_type)
 {
     AVStream* st = fmt_ctx->streams[stream_idx];
     AVCodec *dec = avcodec_find_decoder(st->codecpar->codec_id);
@@ -593,9 +3088,14 @@ int open_codec_context(int stream_idx, AVCodecContext **dec_ctx, AVFormatContext
         goto end;
     }
 
+    if ((*dec_ctx)->codec_type == AVMEDIA_TYPE_VIDEO) {
+        (*dec_ctx)->thread_count = threads;
+        (*dec_ctx)->thread_type = thread_type;
+    }
+
     if ((ret = avcodec_open2(*dec_ctx, dec, NULL)) < 0) {
         fprintf(stderr, "Failed to open codec:%d\n", st->codecpar->codec_id);
-        return ret;
+        goto end;
     }
 
 end:
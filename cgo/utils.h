@@ -7,16 +7,173 @@
 typedef  AVFormatContext* AVFormatContextPtr;
 typedef AVPacket* AVPacketPtr;
 
+// what a subscriber's send queue does when it is full
+enum {
+    QRPC_QUEUE_DROP_GOP, // drop packets until the next keyframe
+    QRPC_QUEUE_SKIP_TO_LIVE, // discard the backlog and resume from the next keyframe
+    QRPC_QUEUE_DISCONNECT, // close the subscriber, also when lag exceeds max_lag_ms
+};
 
+// a rung of the adaptive bitrate ladder, rungs are ordered from the highest to the lowest
+typedef struct AVFormatQrpcRung {
+    int width; // <= 0 keeps the aspect ratio of the publisher, so does height
+    int height;
+    int64_t bit_rate; // <= 0 leaves it to the encoder
+} AVFormatQrpcRung;
 
-AVFormatContext* AVFormat_Open(const char *fmt, uintptr_t ioctx);
+#define QRPC_MAX_RUNGS 8
+// subscribe to the ladder and move between its rungs depending on how fast the subscriber is
+#define QRPC_RUNG_AUTO -1
+
+// AVFormat_DeliverSubscriber wants AVFormat_SwitchSubscriber to be called
+#define QRPC_DELIVER_SWITCH 1
+
+// encoder settings of the rendition a subscriber gets, zero values leave the encoder defaults
+typedef struct AVFormatQrpcEncoderConfig {
+    char codec[32]; // video encoder, eg libx264, empty for the publisher's codec
+    char preset[32]; // encoder private options, eg veryfast
+    char tune[32]; // eg zerolatency
+    int64_t bit_rate; // rungs of the ladder use their own if they have one
+    int64_t max_rate; // VBV
+    int buffer_size; // VBV, in bits
+    int gop_size; // frames between keyframes
+    int threads; // <= 0 asks for a default share of the encoder thread budget, see AVFormat_SetEncoderThreads
+    int slice_threads; // thread over slices instead of frames, which adds no delay
+} AVFormatQrpcEncoderConfig;
+
+typedef struct AVFormatQrpcSubscribeConfig {
+    int max_packets; // <= 0 for the default
+    int policy;
+    int max_lag_ms; // only for QRPC_QUEUE_DISCONNECT, <= 0 to disable
+    int flush_interval_ms; // hold muxed output up to this long to coalesce writes, 0 flushes after every batch
+    int marks; // tell the writer where video keyframes and flushes are, see mark_handle_callback
+    int rung; // 0 for the publisher's own resolution, n for the nth rung of the ladder or QRPC_RUNG_AUTO
+    AVFormatQrpcEncoderConfig encoder; // ignored when remuxing, which is when codec is empty and fmt is the publisher's
+} AVFormatQrpcSubscribeConfig;
+
+// codec parameters of an input stream, known up front so avformat_find_stream_info can be skipped
+// names are the ones ffmpeg uses, eg video/h264/yuv420p, empty or 0 for unknown
+typedef struct AVFormatQrpcStreamParams {
+    char type[16]; // av_get_media_type_string
+    char codec[32]; // avcodec_get_name
+    char format[32]; // pixel or sample format
+    int width;
+    int height;
+    int frame_rate_num;
+    int frame_rate_den;
+    int sample_rate;
+    int channels;
+    uint64_t channel_layout;
+    int64_t bit_rate;
+} AVFormatQrpcStreamParams;
+
+#define QRPC_MAX_STREAM_PARAMS 8
+
+// how a publisher is opened, zero values take defaults
+typedef struct AVFormatQrpcInputConfig {
+    int decoder_threads; // of the video decoder, <= 0 for a fair share of the budget, see AVFormat_SetDecoderThreads
+    int decoder_thread_type; // FF_THREAD_FRAME and/or FF_THREAD_SLICE, 0 for both
+    int64_t probesize; // bytes the demuxer may read to find the streams
+    int64_t analyze_duration_ms; // of input avformat_find_stream_info may analyze
+    // what the streams are, in the order the demuxer finds them, nb_streams 0 for avformat_find_stream_info
+    // to find out, which is still done when the demuxer finds streams that don't match
+    AVFormatQrpcStreamParams streams[QRPC_MAX_STREAM_PARAMS];
+    int nb_streams;
+    int64_t connect_time; // av_gettime when the publisher connected, startup latencies count from it, 0 for now
+} AVFormatQrpcInputConfig;
+
+typedef struct AVFormatQrpcIngestStats {
+    uint64_t decoded_frames; // video
+    int64_t decode_lag_ms; // how far video decoding is behind the wall clock, 0 while not decoding
+    int decoder_threads; // of the video decoders being fed
+    int64_t open_ms; // from connect until streams were known and subscribers could come
+    int64_t first_frame_ms; // from connect until the first video frame was decoded, 0 until then
+    int stream_info_skipped; // the configured stream params were used instead of avformat_find_stream_info
+} AVFormatQrpcIngestStats;
+
+// process wide counters of pooled objects, allocs stop growing once streaming is steady
+typedef struct AVFormatQrpcPoolStats {
+    uint64_t packet_allocs;
+    uint64_t packet_reuses;
+    uint64_t frame_allocs;
+    uint64_t frame_reuses;
+    uint64_t job_allocs;
+    uint64_t job_reuses;
+    uint64_t scaled_buffer_allocs; // video frames scaled for ladder rungs
+    uint64_t scaled_buffer_reuses;
+} AVFormatQrpcPoolStats;
+
+// latency histogram in microseconds, bucket i counts observations up to 1 << i
+// and the last one those above, buckets are not cumulative
+#define QRPC_HISTOGRAM_BUCKETS 22
+typedef struct AVFormatQrpcHistogram {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t buckets[QRPC_HISTOGRAM_BUCKETS];
+} AVFormatQrpcHistogram;
+
+// stages of the media pipeline that are timed process wide, see AVFormat_StageMetrics
+enum {
+    QRPC_STAGE_DEMUX, // av_read_frame, leaving out the wait for the publisher
+    QRPC_STAGE_DECODE, // a packet through a decoder
+    QRPC_STAGE_ENCODE, // a frame through the encoder of a rendition, leaving out the fan out to its members
+    QRPC_STAGE_MUX, // a packet through the muxer of a subscriber, leaving out its writes
+    QRPC_STAGE_WRITE, // a write of muxed output to the go writer of a subscriber
+    QRPC_STAGE_INGEST_LOCK, // waiting for the context mutex on ingest
+    QRPC_STAGE_FANOUT_LOCK, // waiting for the queue lock of a subscriber when a rendition writes to its members
+    QRPC_NB_STAGES
+};
+
+// a rendition of a publisher, see AVFormat_RenditionMetrics
+typedef struct AVFormatQrpcRenditionMetrics {
+    char fmt[32];
+    int passthrough;
+    int width; // 0 for the publisher's
+    int height;
+    int64_t bit_rate;
+    AVFormatQrpcEncoderConfig encoder; // codec empty for the publisher's codec
+    int members;
+    AVFormatQrpcHistogram encode; // empty for passthrough
+} AVFormatQrpcRenditionMetrics;
+
+typedef struct AVFormatQrpcSubscriberStats {
+    int queue_depth;
+    int64_t lag_ms; // age of the oldest queued packet
+    uint64_t delivered_packets;
+    uint64_t dropped_packets;
+    uint64_t skips; // times QRPC_QUEUE_SKIP_TO_LIVE discarded the backlog
+    uint64_t flushes; // writes to the subscriber, not counting the ones forced by a full AVIO buffer
+    int rung; // being delivered
+    uint64_t switches; // between rungs
+} AVFormatQrpcSubscriberStats;
+
+
+AVFormatContext* AVFormat_Open(const char *fmt, uintptr_t ioctx, const AVFormatQrpcInputConfig *config, int *ret);
 void AVFormat_Free(AVFormatContext*);
 
 int AVFormat_ReadFrame(AVFormatContext* ctx);
+void AVFormat_Rebind(AVFormatContext* ctx);
+void AVFormat_IngestStats(AVFormatContext* ctx, AVFormatQrpcIngestStats *stats);
+int AVFormat_StreamParams(AVFormatContext* ctx, AVFormatQrpcStreamParams *params, int max);
 
-int AVFormat_ReadLatestVideoFrame(AVFormatContext* ctx, const char *fmt, uint64_t seq);
-int AVFormat_SubcribeAVFrame(AVFormatContext* ctx, const char *fmt, uint64_t seq);
-void AVFormat_UnsubcribeAVFrame(AVFormatContext* ctx, uint64_t seq);
+void AVFormat_AddSnapshotWaiter(AVFormatContext* ctx);
+uint64_t AVFormat_WaitLatestVideoFrame(AVFormatContext* ctx);
+int AVFormat_ReadLatestVideoFrame(AVFormatContext* ctx, const char *fmt, uintptr_t writer, int width, int height, uint64_t *generation);
+int AVFormat_SubcribeAVFrame(AVFormatContext* ctx, const char *fmt, uint64_t seq, uintptr_t writer, const AVFormatQrpcSubscribeConfig *subscribe_config, void **handle);
+int AVFormat_DeliverSubscriber(void *handle, int timeout_ms);
+int AVFormat_SwitchSubscriber(AVFormatContext* ctx, void *handle);
+int AVFormat_SetLadder(AVFormatContext* ctx, const AVFormatQrpcRung *rungs, int nb_rungs);
+void AVFormat_SubscriberStats(void *handle, AVFormatQrpcSubscriberStats *stats);
+void AVFormat_SubscriberUnref(void *handle);
+void AVFormat_UnsubcribeAVFrame(AVFormatContext* ctx, void *handle);
+void AVFormat_SetGOPCacheSize(int bytes);
+void AVFormat_SetAVIOBufferSize(int ingest, int subscriber);
+void AVFormat_SetEncoderThreads(int budget);
+void AVFormat_SetMaxEncodedRenditions(int n);
+void AVFormat_SetDecoderThreads(int budget);
+void AVFormat_PoolStats(AVFormatQrpcPoolStats *stats);
+void AVFormat_StageMetrics(AVFormatQrpcHistogram *stages, uint64_t *errors);
+int AVFormat_RenditionMetrics(AVFormatContext* ctx, AVFormatQrpcRenditionMetrics *metrics, int max);
 
 
 extern int GOAVERROR_EINVAL;
@@ -0,0 +1,106 @@
+#include "workers.h"
+#include "libavutil/cpu.h"
+#include "libavutil/mem.h"
+#include "libavutil/log.h"
+#include "libavutil/error.h"
+#include <pthread.h>
+#include <stdbool.h>
+
+typedef struct QrpcTask {
+    qrpc_task_fn fn;
+    void *arg;
+} QrpcTask;
+
+// tasks is a ring buffer that only grows, so steady state submission doesn't allocate
+typedef struct QrpcWorkers {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    QrpcTask *tasks;
+    int head;
+    int n;
+    int size;
+    int nb_threads;
+    bool started;
+} QrpcWorkers;
+
+static QrpcWorkers workers = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+static pthread_once_t workers_once = PTHREAD_ONCE_INIT;
+
+static void *worker_loop(void *arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&workers.mutex);
+        while (!workers.n) {
+            pthread_cond_wait(&workers.cond, &workers.mutex);
+        }
+        QrpcTask task = workers.tasks[workers.head];
+        workers.head = (workers.head + 1) % workers.size;
+        workers.n --;
+        pthread_mutex_unlock(&workers.mutex);
+
+        task.fn(task.arg);
+    }
+
+    return NULL;
+}
+
+static void start_workers(void)
+{
+    int n = av_cpu_count();
+    if (n < 1) n = 1;
+
+    for (int i = 0; i < n; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_loop, NULL)) {
+            av_log(NULL, AV_LOG_ERROR, "Failed to start worker %d\n", i);
+            break;
+        }
+        pthread_detach(tid);
+        workers.nb_threads ++;
+    }
+    workers.started = workers.nb_threads > 0;
+}
+
+// caller must hold workers.mutex
+static int grow_tasks(void)
+{
+    int size = workers.size ? workers.size * 2 : 64;
+    QrpcTask *tasks = av_malloc_array(size, sizeof(QrpcTask));
+    if (!tasks) return AVERROR(ENOMEM);
+
+    for (int i = 0; i < workers.n; i++) {
+        tasks[i] = workers.tasks[(workers.head + i) % workers.size];
+    }
+    av_free(workers.tasks);
+    workers.tasks = tasks;
+    workers.head = 0;
+    workers.size = size;
+    return 0;
+}
+
+int qrpc_workers_submit(qrpc_task_fn fn, void *arg)
+{
+    pthread_once(&workers_once, start_workers);
+    if (!workers.started) return AVERROR(EAGAIN);
+
+    pthread_mutex_lock(&workers.mutex);
+    if (workers.n == workers.size) {
+        int ret = grow_tasks();
+        if (ret < 0) {
+            pthread_mutex_unlock(&workers.mutex);
+            return ret;
+        }
+    }
+    workers.tasks[(workers.head + workers.n) % workers.size] = (QrpcTask){fn, arg};
+    workers.n ++;
+    pthread_cond_signal(&workers.cond);
+    pthread_mutex_unlock(&workers.mutex);
+
+    return 0;
+}
+
+int qrpc_workers_count(void)
+{
+    pthread_once(&workers_once, start_workers);
+    return workers.nb_threads;
+}
@@ -0,0 +1,13 @@
+#ifndef CGO_WORKERS_H
+#define CGO_WORKERS_H
+
+typedef void (*qrpc_task_fn)(void *arg);
+
+// run fn(arg) on the process wide worker pool, which has one thread per core
+// tasks are started in submission order, returns <0 if the pool can't be started
+int qrpc_workers_submit(qrpc_task_fn fn, void *arg);
+
+// number of threads in the pool
+int qrpc_workers_count(void);
+
+#endif
@@ -0,0 +1,154 @@
+package cmd
+
+import (
+	"io"
+	"strconv"
+	"time"
+
+	"github.com/zhiqiangxu/avflow/cgo"
+	"github.com/zhiqiangxu/avflow/pkg/metrics"
+)
+
+const (
+	// streams with their own series, in order of id, the rest only count in the totals
+	maxMetricStreams = 100
+	// subscribers with their own series per stream, the oldest ones
+	maxMetricSubscribers = 20
+)
+
+var histogramBounds = func() []time.Duration {
+	bounds := make([]time.Duration, cgo.HistogramBuckets-1)
+	for i := range bounds {
+		bounds[i] = cgo.HistogramBound(i)
+	}
+	return bounds
+}()
+
+// WriteMetrics in the Prometheus text format, per stream and per subscriber series are capped
+// at maxMetricStreams and maxMetricSubscribers so a busy server doesn't blow up cardinality
+func (cmd *PlayCmd) WriteMetrics(out io.Writer) error {
+	w := metrics.NewWriter(out)
+
+	stages := cgo.ReadStageMetrics()
+	w.Family("avflow_stage_latency_seconds", "histogram", "Latency of each stage of the media pipeline.")
+	for _, s := range stages {
+		w.Histogram("avflow_stage_latency_seconds", metrics.Labels{"stage", s.Stage}, histogramBounds, s.Latency.Buckets[:], s.Latency.Count, s.Latency.Sum)
+	}
+	w.Family("avflow_stage_errors_total", "counter", "Errors of each stage of the media pipeline.")
+	for _, s := range stages {
+		w.Sample("avflow_stage_errors_total", metrics.Labels{"stage", s.Stage}, float64(s.Errors))
+	}
+
+	counts := cmd.StreamCounts()
+	w.Family("avflow_streams", "gauge", "Published streams by state.")
+	w.Sample("avflow_streams", metrics.Labels{"state", StreamStarting.String()}, float64(counts.Starting))
+	w.Sample("avflow_streams", metrics.Labels{"state", StreamLive.String()}, float64(counts.Live))
+	w.Sample("avflow_streams", metrics.Labels{"state", StreamDraining.String()}, float64(counts.Draining))
+
+	pools := cgo.ReadPoolStats()
+	w.Family("avflow_pool_allocs_total", "counter", "Objects pools had to allocate.")
+	w.Sample("avflow_pool_allocs_total", metrics.Labels{"pool", "packet"}, float64(pools.PacketAllocs))
+	w.Sample("avflow_pool_allocs_total", metrics.Labels{"pool", "frame"}, float64(pools.FrameAllocs))
+	w.Sample("avflow_pool_allocs_total", metrics.Labels{"pool", "job"}, float64(pools.JobAllocs))
+	w.Sample("avflow_pool_allocs_total", metrics.Labels{"pool", "scaled_buffer"}, float64(pools.ScaledBufferAllocs))
+	w.Family("avflow_pool_reuses_total", "counter", "Objects pools served from what was given back.")
+	w.Sample("avflow_pool_reuses_total", metrics.Labels{"pool", "packet"}, float64(pools.PacketReuses))
+	w.Sample("avflow_pool_reuses_total", metrics.Labels{"pool", "frame"}, float64(pools.FrameReuses))
+	w.Sample("avflow_pool_reuses_total", metrics.Labels{"pool", "job"}, float64(pools.JobReuses))
+	w.Sample("avflow_pool_reuses_total", metrics.Labels{"pool", "scaled_buffer"}, float64(pools.ScaledBufferReuses))
+
+	live := cmd.streams.liveStreams()
+	omittedStreams := 0
+	if len(live) > maxMetricStreams {
+		omittedStreams = len(live) - maxMetricStreams
+		live = live[:maxMetricStreams]
+	}
+	type streamMetrics struct {
+		id         string
+		ingest     cgo.IngestStats
+		renditions []cgo.RenditionMetrics
+		subs       []*cgo.Subscription
+		// the ones beyond maxMetricSubscribers are only counted
+		omitted int
+	}
+	all := make([]streamMetrics, len(live))
+	omittedSubs := 0
+	for i, s := range live {
+		all[i] = streamMetrics{id: s.id, ingest: s.fCtx.IngestStats(), renditions: s.fCtx.RenditionMetrics(), subs: s.fCtx.Subscriptions()}
+		if n := len(all[i].subs); n > maxMetricSubscribers {
+			all[i].omitted = n - maxMetricSubscribers
+			all[i].subs = all[i].subs[:maxMetricSubscribers]
+			omittedSubs += all[i].omitted
+		}
+	}
+
+	w.Family("avflow_metrics_omitted", "gauge", "Streams and subscribers left out of per stream and per subscriber series by the caps.")
+	w.Sample("avflow_metrics_omitted", metrics.Labels{"kind", "stream"}, float64(omittedStreams))
+	w.Sample("avflow_metrics_omitted", metrics.Labels{"kind", "subscriber"}, float64(omittedSubs))
+
+	w.Family("avflow_ingest_bytes_total", "counter", "Bytes a publisher sent.")
+	for _, m := range all {
+		w.Sample("avflow_ingest_bytes_total", metrics.Labels{"stream", m.id}, float64(m.ingest.Bytes))
+	}
+	w.Family("avflow_ingest_frames_total", "counter", "Qrpc frames a publisher sent.")
+	for _, m := range all {
+		w.Sample("avflow_ingest_frames_total", metrics.Labels{"stream", m.id}, float64(m.ingest.Frames))
+	}
+	w.Family("avflow_decoded_frames_total", "counter", "Video frames decoded of a publisher.")
+	for _, m := range all {
+		w.Sample("avflow_decoded_frames_total", metrics.Labels{"stream", m.id}, float64(m.ingest.DecodedFrames))
+	}
+	w.Family("avflow_decode_lag_seconds", "gauge", "How far video decoding of a publisher is behind the wall clock.")
+	for _, m := range all {
+		w.Sample("avflow_decode_lag_seconds", metrics.Labels{"stream", m.id}, m.ingest.DecodeLag.Seconds())
+	}
+	w.Family("avflow_subscribers", "gauge", "Subscribers of a publisher.")
+	for _, m := range all {
+		w.Sample("avflow_subscribers", metrics.Labels{"stream", m.id}, float64(len(m.subs)+m.omitted))
+	}
+
+	w.Family("avflow_rendition_members", "gauge", "Subscribers of a rendition.")
+	for _, m := range all {
+		for _, r := range m.renditions {
+			w.Sample("avflow_rendition_members", metrics.Labels{"stream", m.id, "rendition", r.Name}, float64(r.Members))
+		}
+	}
+	w.Family("avflow_rendition_encode_latency_seconds", "histogram", "Latency of encoding a frame for a rendition.")
+	for _, m := range all {
+		for _, r := range m.renditions {
+			if r.Encode.Count == 0 {
+				continue
+			}
+			w.Histogram("avflow_rendition_encode_latency_seconds", metrics.Labels{"stream", m.id, "rendition", r.Name},
+				histogramBounds, r.Encode.Buckets[:], r.Encode.Count, r.Encode.Sum)
+		}
+	}
+
+	subStats := make([][]cgo.SubscriberStats, len(all))
+	for i, m := range all {
+		subStats[i] = make([]cgo.SubscriberStats, len(m.subs))
+		for j, sub := range m.subs {
+			subStats[i][j] = sub.Stats()
+		}
+	}
+	subscriberFamily := func(name, typ, help string, value func(*cgo.SubscriberStats) float64) {
+		w.Family(name, typ, help)
+		for i, m := range all {
+			for j, sub := range m.subs {
+				w.Sample(name, metrics.Labels{"stream", m.id, "subscriber", strconv.FormatUint(sub.Seq(), 10)}, value(&subStats[i][j]))
+			}
+		}
+	}
+	subscriberFamily("avflow_subscriber_queue_depth", "gauge", "Packets queued for a subscriber.",
+		func(s *cgo.SubscriberStats) float64 { return float64(s.QueueDepth) })
+	subscriberFamily("avflow_subscriber_lag_seconds", "gauge", "Age of the oldest packet queued for a subscriber.",
+		func(s *cgo.SubscriberStats) float64 { return s.Lag.Seconds() })
+	subscriberFamily("avflow_subscriber_delivered_packets_total", "counter", "Packets delivered to a subscriber.",
+		func(s *cgo.SubscriberStats) float64 { return float64(s.DeliveredPackets) })
+	subscriberFamily("avflow_subscriber_dropped_packets_total", "counter", "Packets a subscriber's queue policy dropped.",
+		func(s *cgo.SubscriberStats) float64 { return float64(s.DroppedPackets) })
+	subscriberFamily("avflow_subscriber_rung", "gauge", "Ladder rung a subscriber gets.",
+		func(s *cgo.SubscriberStats) float64 { return float64(s.Rung) })
+
+	return w.Flush()
+}
@@ -5,73 +5,236 @@ import (
 	"errors"
 	"fmt"
 	"io"
-	"sync"
+	"sync/atomic"
+	"time"
 
 	"github.com/zhiqiangxu/avflow/cgo"
+	"github.com/zhiqiangxu/avflow/pkg/dvr"
+	"github.com/zhiqiangxu/avflow/pkg/hls"
 	w "github.com/zhiqiangxu/avflow/pkg/writer"
 	"github.com/zhiqiangxu/qrpc"
 )
 
 // PlayCmd for video
 type PlayCmd struct {
-	sync.RWMutex
-	fCtxMap map[string]*cgo.AVFormatQrpcContext
+	streams *registry
+	// time.Duration, atomic, see SetReconnectGrace
+	reconnectGrace int64
+	// nil unless recording, see SetDVR
+	dvr *dvr.Store
+	// nil unless relaying, see SetRelay
+	relay *RelayConfig
 }
 
 // PlayRequest is param for PlayCmd
 type PlayRequest struct {
 	Publish int    `json:"publish"`
 	URI     string `json:"uri"`
+	// Stream name, for publishers that publish several streams over one connection,
+	// it is played as /<connection id>/<stream>
+	Stream string `json:"stream"`
+	// Ladder of renditions offered to subscribers, for publishers
+	Ladder []cgo.Rung `json:"ladder"`
+	// Rung to play, see cgo.SubscribeOptions
+	Rung int `json:"rung"`
+	// Encoder to play with, nil for the publisher's codec, only its codec and bitrate are taken, see viewerEncoder
+	Encoder *cgo.EncoderConfig `json:"encoder"`
+	// Input options, for publishers
+	Input *cgo.InputOptions `json:"input"`
+	// ReuseStreams skips probing by taking the stream params of the last publish of the same id,
+	// unless Input declares them, for publishers
+	ReuseStreams bool `json:"reuse_streams"`
+	// Record the stream to the dvr store, for publishers
+	Record bool `json:"record"`
+	// TimeShiftMs plays the recording of the stream from that long before its newest keyframe, for players
+	TimeShiftMs int64 `json:"timeshift_ms"`
 }
 
 // NewPlayCmd creates PlayCmd
 func NewPlayCmd() *PlayCmd {
-	return &PlayCmd{fCtxMap: make(map[string]*cgo.AVFormatQrpcContext)}
+	return &PlayCmd{streams: newRegistry(), reconnectGrace: int64(defaultReconnectGrace)}
 }
 
+// StreamCounts of published streams per state
+func (cmd *PlayCmd) StreamCounts() StreamCounts {
+	return cmd.streams.Counts()
+}
+
+// SetReconnectGrace is how long the context of a publisher whose connection was lost is kept,
+// so a reconnect with the same id takes it over and subscribers only see a stall, 0 to disable.
+// It applies to publishers from then on.
+func (cmd *PlayCmd) SetReconnectGrace(d time.Duration) {
+	atomic.StoreInt64(&cmd.reconnectGrace, int64(d))
+}
+
+// SetDVR store publishers that ask for it are recorded to and time-shifted players play from,
+// must be called before serving
+func (cmd *PlayCmd) SetDVR(store *dvr.Store) {
+	cmd.dvr = store
+}
+
+const (
+	// a packager nobody requested from for this long is stopped
+	hlsIdleTimeout        = 30 * time.Second
+	defaultReconnectGrace = 3 * time.Second
+	// a reconnect can come in before the lost connection is noticed to be gone,
+	// how long it waits for the old context to be waiting for it
+	rebindTimeout = 2 * time.Second
+	// how long players wait for a stream that is starting
+	startingWait = 3 * time.Second
+	// send queue of the recording subscription
+	recordQueuePackets = 4096
+)
+
 var (
 	// ErrNotPlaying when requested id is not playing
 	ErrNotPlaying = errors.New("request id is not playing")
+	// ErrNoDVR when recording or time-shifted playback is requested without a dvr store
+	ErrNoDVR = errors.New("dvr not enabled")
+	// ErrEncoderNotAllowed when a viewer asks for a codec viewers can't have encoded
+	ErrEncoderNotAllowed = errors.New("encoder not allowed")
 )
 
-// ReadLatestVideoFrame latest video frame of some id
-func (cmd *PlayCmd) ReadLatestVideoFrame(id, fmt string, w io.Writer) error {
-	cmd.RLock()
-	fCtx := cmd.fCtxMap[id]
-	cmd.RUnlock()
-	if fCtx == nil {
-		return ErrNotPlaying
+// bitrates viewers can have encoded, in bits per second, what they ask for is snapped up to one of them
+var viewerBitrates = []int64{300000, 600000, 1200000, 2500000, 5000000}
+
+// viewerEncoder is what a viewer asking for e gets: the low latency profile of a codec viewers
+// may have at one of viewerBitrates, so viewers share a few renditions instead of making the
+// publisher run an encoder per config they come up with. An empty codec is the publisher's own.
+func viewerEncoder(e *cgo.EncoderConfig) (*cgo.EncoderConfig, error) {
+	if e == nil || e.Codec == "" {
+		return nil, nil
+	}
+	if e.Codec != "libx264" && e.Codec != "h264" {
+		return nil, ErrEncoderNotAllowed
 	}
 
-	return fCtx.ReadLatestVideoFrame(fmt, w)
+	bitrate := e.Bitrate
+	if bitrate > 0 {
+		bitrate = viewerBitrates[len(viewerBitrates)-1]
+		for _, b := range viewerBitrates {
+			if b >= e.Bitrate {
+				bitrate = b
+				break
+			}
+		}
+	}
+	return cgo.LowLatencyH264(bitrate), nil
 }
 
-// SubcribeAVFrame to id with fmt
-func (cmd *PlayCmd) SubcribeAVFrame(id, fmt string, w io.Writer) (*cgo.AVFormatQrpcContext, error) {
-	cmd.RLock()
-	fCtx := cmd.fCtxMap[id]
-	cmd.RUnlock()
-	if fCtx == nil {
-		return nil, ErrNotPlaying
+// ReadSnapshot latest video frame of some id, see cgo.AVFormatQrpcContext.ReadSnapshot
+func (cmd *PlayCmd) ReadSnapshot(id, fmt string, width, height int) (*cgo.Snapshot, error) {
+	s, err := cmd.lookup(id)
+	if err != nil {
+		return nil, err
 	}
 
-	return fCtx, fCtx.SubcribeAVFrame(fmt, w)
+	return s.fCtx.ReadSnapshot(fmt, width, height)
 }
 
-// UnsubcribeAVFrame w from id
-func (cmd *PlayCmd) UnsubcribeAVFrame(id string, w io.Writer) {
-	cmd.RLock()
-	fCtx := cmd.fCtxMap[id]
-	cmd.RUnlock()
-	if fCtx == nil {
-		return
+// SubcribeAVFrame to id with fmt for a viewer, opts.Encoder is limited to what viewerEncoder allows
+func (cmd *PlayCmd) SubcribeAVFrame(id, fmt string, w io.Writer, opts *cgo.SubscribeOptions) (*cgo.Subscription, error) {
+	if opts != nil && opts.Encoder != nil {
+		encoder, err := viewerEncoder(opts.Encoder)
+		if err != nil {
+			return nil, err
+		}
+		o := *opts
+		o.Encoder = encoder
+		opts = &o
+	}
+	s, err := cmd.lookup(id)
+	if err != nil {
+		return nil, err
+	}
+
+	return s.fCtx.SubcribeAVFrame(fmt, w, opts)
+}
+
+// HLS packager of id, the first call starts packaging it with a single
+// mpegts subscription shared by all HTTP viewers
+func (cmd *PlayCmd) HLS(id string) (*hls.Packager, error) {
+	s, err := cmd.lookup(id)
+	if err != nil {
+		return nil, err
+	}
+
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	if s.hls != nil {
+		return s.hls, nil
+	}
+	p := hls.NewPackager(hls.Config{})
+	sub, err := s.fCtx.SubcribeAVFrame("mpegts", p, nil)
+	if err != nil {
+		return nil, err
+	}
+	s.hls = p
+
+	go cmd.runHLS(s, p, sub)
+	return p, nil
+}
+
+// PlayRecording of id to w from shift before its newest keyframe until done, see dvr.Store.Play
+func (cmd *PlayCmd) PlayRecording(id string, shift time.Duration, w io.Writer, done <-chan struct{}) error {
+	if cmd.dvr == nil {
+		return ErrNoDVR
 	}
+	return cmd.dvr.Play(id, shift, w, done)
+}
 
-	fCtx.UnsubcribeAVFrame(w)
+// record the passthrough mpegts of a live stream, the recorder is closed with the subscription
+func (cmd *PlayCmd) record(id string, fCtx *cgo.AVFormatQrpcContext) error {
+	if cmd.dvr == nil {
+		return ErrNoDVR
+	}
+	rec, err := cmd.dvr.Record(id)
+	if err != nil {
+		return err
+	}
+	// the recorder only copies, a deep queue rides out scheduling hiccups rather than dropping
+	sub, err := fCtx.SubcribeAVFrame("mpegts", rec, &cgo.SubscribeOptions{MaxQueuePackets: recordQueuePackets})
+	if err != nil {
+		rec.Close()
+		return err
+	}
+	go func() {
+		<-sub.Done()
+		err := rec.Close()
+		fmt.Println("recording done", id, sub.Err(), err, rec.Stats())
+	}()
+	return nil
+}
+
+func (cmd *PlayCmd) runHLS(s *stream, p *hls.Packager, sub *cgo.Subscription) {
+	ticker := time.NewTicker(hlsIdleTimeout / 2)
+	defer ticker.Stop()
+
+loop:
+	for {
+		select {
+		case <-sub.Done():
+			break loop
+		case <-ticker.C:
+			if p.Idle() > hlsIdleTimeout {
+				sub.Close()
+				break loop
+			}
+		}
+	}
+
+	s.lock.Lock()
+	if s.hls == p {
+		s.hls = nil
+	}
+	s.lock.Unlock()
+	p.Close()
+	fmt.Println("hls done", s.id, sub.Err(), sub.Stats())
 }
 
 // ServeQRPC implements qrpc.Handler
 func (cmd *PlayCmd) ServeQRPC(writer qrpc.FrameWriter, frame *qrpc.RequestFrame) {
+	start := time.Now()
 	fmt.Println("PlayCmd start, payload =", string(frame.Payload))
 
 	ci := frame.ConnectionInfo()
@@ -104,15 +267,25 @@ func (cmd *PlayCmd) ServeQRPC(writer qrpc.FrameWriter, frame *qrpc.RequestFrame)
 		id := req.URI[1:len(req.URI)]
 		fmt.Println("id = ", id)
 
-		cmd.Lock()
-		fCtx := cmd.fCtxMap[id]
-		cmd.Unlock()
+		if req.TimeShiftMs > 0 {
+			cmd.playRecording(writer, frame, id, time.Duration(req.TimeShiftMs)*time.Millisecond)
+			return
+		}
+
+		encoder, err := viewerEncoder(req.Encoder)
+		if err != nil {
+			fmt.Println("viewerEncoder", err)
+			frame.Close()
+			return
+		}
 
-		if fCtx == nil {
+		s, err := cmd.lookup(id)
+		if err != nil {
 			fmt.Println("requested id not playing", id)
 			frame.Close()
 			return
 		}
+		fCtx := s.fCtx
 
 		writer.StartWrite(frame.RequestID, PlayResp, qrpc.StreamFlag)
 		writer.WriteBytes([]byte("OK"))
@@ -123,7 +296,7 @@ func (cmd *PlayCmd) ServeQRPC(writer qrpc.FrameWriter, frame *qrpc.RequestFrame)
 			return
 		}
 
-		err := fCtx.SubcribeAVFrame("mpegts", w.NewQrpcWriter(writer, frame, PlayResp))
+		sub, err := fCtx.SubcribeAVFrame("mpegts", w.NewQrpcWriter(writer, frame, PlayResp), &cgo.SubscribeOptions{Rung: req.Rung, Encoder: encoder})
 		if err != nil {
 			fmt.Println("SubcribeAVFrame", err)
 			frame.Close()
@@ -132,35 +305,33 @@ func (cmd *PlayCmd) ServeQRPC(writer qrpc.FrameWriter, frame *qrpc.RequestFrame)
 		fmt.Println("SubcribeAVFrame ok")
 		select {
 		case <-frame.Context().Done():
-		case <-fCtx.Done():
+			sub.Close()
+		case <-sub.Done():
 		}
 
-		fmt.Println("SubcribeAVFrame done")
+		fmt.Println("SubcribeAVFrame done", sub.Err(), sub.Stats())
 		frame.Close()
 		return
 	}
 
+	id := publisherID(sc.GetID(), req.Stream)
+	s, ok := cmd.streams.reserve(id)
+	if !ok {
+		if s.State() == StreamLive && cmd.rebind(writer, frame, id, s.fCtx) {
+			return
+		}
+		fmt.Println("publishing twice:", id, s.State())
+		refuseStream(writer, frame)
+		return
+	}
 	var fCtx *cgo.AVFormatQrpcContext
 	defer func() {
+		cmd.streams.drain(s)
 		if fCtx != nil {
 			// AVFormatQrpcContext must be freed last
 			fCtx.Free()
 		}
-	}()
-
-	cmd.Lock()
-	if _, ok := cmd.fCtxMap[sc.GetID()]; ok {
-		cmd.Unlock()
-		fmt.Println("publishing twice:", sc.GetID())
-		frame.Close()
-		return
-	}
-	cmd.fCtxMap[sc.GetID()] = nil
-	cmd.Unlock()
-	defer func() {
-		cmd.Lock()
-		delete(cmd.fCtxMap, sc.GetID())
-		cmd.Unlock()
+		cmd.streams.remove(s)
 	}()
 
 	writer.StartWrite(frame.RequestID, PlayResp, qrpc.StreamFlag)
@@ -168,24 +339,125 @@ func (cmd *PlayCmd) ServeQRPC(writer qrpc.FrameWriter, frame *qrpc.RequestFrame)
 	err = writer.EndWrite()
 	if err != nil {
 		fmt.Println("EndWrite", err)
-		frame.Close()
+		refuseStream(writer, frame)
 		return
 	}
 
-	fCtx = cgo.NewAVFormatQrpcContext("mpegts", frame.FrameCh())
+	opts := cgo.InputOptions{}
+	if req.Input != nil {
+		opts = *req.Input
+	}
+	opts.ConnectTime = start
+	if req.ReuseStreams && len(opts.Streams) == 0 {
+		opts.Streams = cmd.streams.getParams(id)
+	}
+	fCtx, err = cgo.NewAVFormatQrpcContext("mpegts", frame.FrameCh(), &opts)
+	if err != nil {
+		// never live, the deferred drain and remove free the id again
+		fmt.Println("publisher open", id, err)
+		refuseStream(writer, frame)
+		return
+	}
+	fCtx.SetReconnectGrace(time.Duration(atomic.LoadInt64(&cmd.reconnectGrace)))
+	if params := fCtx.StreamParams(); len(params) > 0 {
+		cmd.streams.setParams(id, params)
+	}
+	stats := fCtx.IngestStats()
+	fmt.Println("publisher open", id, stats.OpenLatency, "stream info skipped:", stats.StreamInfoSkipped)
+	if len(req.Ladder) > 0 {
+		err = fCtx.SetLadder(req.Ladder)
+		if err != nil {
+			fmt.Println("SetLadder", err)
+		}
+	}
 
-	cmd.Lock()
-	cmd.fCtxMap[sc.GetID()] = fCtx
-	cmd.Unlock()
+	cmd.streams.live(s, fCtx)
+	if req.Record {
+		if err := cmd.record(id, fCtx); err != nil {
+			fmt.Println("record", id, err)
+		}
+	}
 
 	for {
 		// fmt.Println("before ReadFrame")
 		err := fCtx.ReadFrame()
 		if err != nil {
-			fmt.Printf("ReadFrame return: %s", err.Error())
+			fmt.Printf("ReadFrame return: %s, ingest: %+v, pools: %+v\n", err.Error(), fCtx.IngestStats(), cgo.ReadPoolStats())
 			return
 		}
 		// fmt.Println("after ReadFrame")
 	}
 
 }
+
+// playRecording of id to a player, which also works once the publisher is gone
+func (cmd *PlayCmd) playRecording(writer qrpc.FrameWriter, frame *qrpc.RequestFrame, id string, shift time.Duration) {
+	if cmd.dvr == nil {
+		fmt.Println("timeshift without dvr", id)
+		frame.Close()
+		return
+	}
+
+	writer.StartWrite(frame.RequestID, PlayResp, qrpc.StreamFlag)
+	writer.WriteBytes([]byte("OK"))
+	err := writer.EndWrite()
+	if err != nil {
+		fmt.Println("EndWrite", err)
+		frame.Close()
+		return
+	}
+
+	err = cmd.PlayRecording(id, shift, w.NewQrpcWriter(writer, frame, PlayResp), frame.Context().Done())
+	fmt.Println("PlayRecording done", id, err)
+	frame.Close()
+}
+
+// rebind a reconnected publisher to the context of its lost connection, which keeps serving
+// subscribers, and feed it until the context stops reading, false if the context wasn't waiting
+func (cmd *PlayCmd) rebind(writer qrpc.FrameWriter, frame *qrpc.RequestFrame, id string, fCtx *cgo.AVFormatQrpcContext) bool {
+	deadline := time.Now().Add(rebindTimeout)
+	done, err := fCtx.Rebind(frame.FrameCh())
+	for err == cgo.ErrNotWaiting && time.Now().Before(deadline) {
+		time.Sleep(20 * time.Millisecond)
+		done, err = fCtx.Rebind(frame.FrameCh())
+	}
+	if err != nil {
+		return false
+	}
+	fmt.Println("publisher rebound", id)
+
+	writer.StartWrite(frame.RequestID, PlayResp, qrpc.StreamFlag)
+	writer.WriteBytes([]byte("OK"))
+	err = writer.EndWrite()
+	if err != nil {
+		// the context finds out once frameCh closes
+		fmt.Println("EndWrite", err)
+	}
+
+	select {
+	case <-done:
+	case <-fCtx.Done():
+	}
+	return true
+}
+
+// publisherID is what players and HTTP viewers ask for
+func publisherID(connID, stream string) string {
+	if stream == "" {
+		return connID
+	}
+	return connID + "/" + stream
+}
+
+// refuseStream resets a publish stream without closing the connection, which
+// may carry other streams, and discards what the publisher sends until it ends
+func refuseStream(writer qrpc.FrameWriter, frame *qrpc.RequestFrame) {
+	err := writer.ResetFrame(frame.RequestID, 0)
+	if err != nil {
+		fmt.Println("ResetFrame", err)
+		frame.Close()
+		return
+	}
+	for range frame.FrameCh() {
+	}
+}
@@ -0,0 +1,219 @@
+package cmd
+
+import (
+	"sort"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/zhiqiangxu/avflow/cgo"
+	"github.com/zhiqiangxu/avflow/pkg/hls"
+)
+
+// StreamState of a published stream
+type StreamState int32
+
+const (
+	// StreamStarting while the publisher's input is being opened
+	StreamStarting StreamState = iota
+	// StreamLive while it can be played
+	StreamLive
+	// StreamDraining once the publisher is gone and the stream is being torn down
+	StreamDraining
+	numStreamStates
+)
+
+func (s StreamState) String() string {
+	switch s {
+	case StreamStarting:
+		return "starting"
+	case StreamLive:
+		return "live"
+	case StreamDraining:
+		return "draining"
+	}
+	return "unknown"
+}
+
+// StreamCounts of a registry per state
+type StreamCounts struct {
+	Starting int
+	Live     int
+	Draining int
+}
+
+const registryShards = 64
+
+// stream is a registry entry, only its publisher changes its state
+type stream struct {
+	id    string
+	state int32 // StreamState, atomic
+	// set before ready is closed, nil if the publisher failed to start
+	fCtx *cgo.AVFormatQrpcContext
+	// closed once the stream is no longer starting
+	ready chan struct{}
+	// unix nano a viewer last looked it up, atomic, see PlayCmd.lookup
+	used int64
+
+	// guards hls
+	lock sync.Mutex
+	hls  *hls.Packager
+}
+
+// State of the stream
+func (s *stream) State() StreamState {
+	return StreamState(atomic.LoadInt32(&s.state))
+}
+
+type registryShard struct {
+	sync.RWMutex
+	streams map[string]*stream
+	// stream params each publisher had last time, for ReuseStreams
+	params map[string][]cgo.StreamParams
+}
+
+// registry of published streams, sharded by id so lookups of different
+// streams don't contend and lookups of the same one only take a read lock
+type registry struct {
+	shards [registryShards]registryShard
+	counts [numStreamStates]int64 // atomic
+}
+
+func newRegistry() *registry {
+	r := &registry{}
+	for i := range r.shards {
+		r.shards[i].streams = make(map[string]*stream)
+		r.shards[i].params = make(map[string][]cgo.StreamParams)
+	}
+	return r
+}
+
+// fnv-1a, without the allocation of hash/fnv
+func (r *registry) shard(id string) *registryShard {
+	h := uint32(2166136261)
+	for i := 0; i < len(id); i++ {
+		h ^= uint32(id[i])
+		h *= 16777619
+	}
+	return &r.shards[h%registryShards]
+}
+
+// reserve id for a publisher, in StreamStarting, or return the stream already there,
+// one that is draining is replaced rather than making the publisher wait for its teardown
+func (r *registry) reserve(id string) (*stream, bool) {
+	sh := r.shard(id)
+	sh.Lock()
+	defer sh.Unlock()
+	if s := sh.streams[id]; s != nil && s.State() != StreamDraining {
+		return s, false
+	}
+	s := &stream{id: id, state: int32(StreamStarting), ready: make(chan struct{})}
+	sh.streams[id] = s
+	atomic.AddInt64(&r.counts[StreamStarting], 1)
+	return s, true
+}
+
+func (r *registry) setState(s *stream, state StreamState) {
+	old := StreamState(atomic.SwapInt32(&s.state, int32(state)))
+	if old == state {
+		return
+	}
+	atomic.AddInt64(&r.counts[old], -1)
+	atomic.AddInt64(&r.counts[state], 1)
+	if old == StreamStarting {
+		close(s.ready)
+	}
+}
+
+// live makes a starting stream playable
+func (r *registry) live(s *stream, fCtx *cgo.AVFormatQrpcContext) {
+	s.fCtx = fCtx
+	r.setState(s, StreamLive)
+}
+
+// drain stops new players from finding the stream
+func (r *registry) drain(s *stream) {
+	r.setState(s, StreamDraining)
+}
+
+// remove the stream, draining it first if that wasn't done
+func (r *registry) remove(s *stream) {
+	r.drain(s)
+	sh := r.shard(s.id)
+	sh.Lock()
+	if sh.streams[s.id] == s {
+		delete(sh.streams, s.id)
+	}
+	sh.Unlock()
+	atomic.AddInt64(&r.counts[StreamDraining], -1)
+}
+
+// get the stream of id, whatever its state
+func (r *registry) get(id string) *stream {
+	sh := r.shard(id)
+	sh.RLock()
+	s := sh.streams[id]
+	sh.RUnlock()
+	return s
+}
+
+// lookup the live stream of id, waiting up to wait for one that is starting
+func (r *registry) lookup(id string, wait time.Duration) (*stream, error) {
+	s := r.get(id)
+	if s == nil {
+		return nil, ErrNotPlaying
+	}
+	if s.State() == StreamStarting {
+		timer := time.NewTimer(wait)
+		select {
+		case <-s.ready:
+		case <-timer.C:
+		}
+		timer.Stop()
+	}
+	if s.State() != StreamLive || s.fCtx == nil {
+		return nil, ErrNotPlaying
+	}
+	return s, nil
+}
+
+// live streams, sorted by id
+func (r *registry) liveStreams() []*stream {
+	var live []*stream
+	for i := range r.shards {
+		sh := &r.shards[i]
+		sh.RLock()
+		for _, s := range sh.streams {
+			if s.State() == StreamLive && s.fCtx != nil {
+				live = append(live, s)
+			}
+		}
+		sh.RUnlock()
+	}
+	sort.Slice(live, func(i, j int) bool { return live[i].id < live[j].id })
+	return live
+}
+
+func (r *registry) setParams(id string, params []cgo.StreamParams) {
+	sh := r.shard(id)
+	sh.Lock()
+	sh.params[id] = params
+	sh.Unlock()
+}
+
+func (r *registry) getParams(id string) []cgo.StreamParams {
+	sh := r.shard(id)
+	sh.RLock()
+	params := sh.params[id]
+	sh.RUnlock()
+	return params
+}
+
+// Counts of streams per state
+func (r *registry) Counts() StreamCounts {
+	return StreamCounts{
+		Starting: int(atomic.LoadInt64(&r.counts[StreamStarting])),
+		Live:     int(atomic.LoadInt64(&r.counts[StreamLive])),
+		Draining: int(atomic.LoadInt64(&r.counts[StreamDraining])),
+	}
+}
@@ -0,0 +1,158 @@
+package cmd
+
+import (
+	"fmt"
+	"sync"
+	"testing"
+	"time"
+
+	"github.com/zhiqiangxu/avflow/cgo"
+)
+
+// the registry only hands contexts out, a zero one stands in for an opened publisher
+func testContext() *cgo.AVFormatQrpcContext {
+	return &cgo.AVFormatQrpcContext{}
+}
+
+func checkCounts(t *testing.T, r *registry, want StreamCounts) {
+	t.Helper()
+	if got := r.Counts(); got != want {
+		t.Fatalf("counts %+v, want %+v", got, want)
+	}
+}
+
+func TestLookupWaitsForLive(t *testing.T) {
+	r := newRegistry()
+	s, ok := r.reserve("a")
+	if !ok {
+		t.Fatal("reserve of a new id")
+	}
+	const startup = 50 * time.Millisecond
+	go func() {
+		time.Sleep(startup)
+		r.live(s, testContext())
+	}()
+
+	start := time.Now()
+	found, err := r.lookup("a", time.Second)
+	if err != nil || found != s {
+		t.Fatalf("lookup of a starting stream: %v", err)
+	}
+	if d := time.Since(start); d < startup {
+		t.Fatalf("lookup returned after %v, before the stream was live", d)
+	}
+	if _, err := r.lookup("b", time.Second); err != ErrNotPlaying {
+		t.Fatalf("lookup of an unknown id: %v", err)
+	}
+}
+
+func TestLookupTimesOut(t *testing.T) {
+	r := newRegistry()
+	s, _ := r.reserve("a")
+
+	const wait = 50 * time.Millisecond
+	start := time.Now()
+	if _, err := r.lookup("a", wait); err != ErrNotPlaying {
+		t.Fatalf("lookup of a stream that stays starting: %v", err)
+	}
+	if d := time.Since(start); d < wait {
+		t.Fatalf("lookup gave up after %v", d)
+	}
+
+	// a publisher failing to start wakes up lookups right away
+	go func() {
+		time.Sleep(wait)
+		r.remove(s)
+	}()
+	start = time.Now()
+	if _, err := r.lookup("a", time.Second); err != ErrNotPlaying {
+		t.Fatalf("lookup of a stream that failed to start: %v", err)
+	}
+	if d := time.Since(start); d > time.Second/2 {
+		t.Fatalf("lookup of a stream that failed to start took %v", d)
+	}
+}
+
+func TestCountsFollowStates(t *testing.T) {
+	r := newRegistry()
+	s, _ := r.reserve("a")
+	checkCounts(t, r, StreamCounts{Starting: 1})
+	if again, ok := r.reserve("a"); ok || again != s {
+		t.Fatal("reserve of a starting id made a new stream")
+	}
+	checkCounts(t, r, StreamCounts{Starting: 1})
+	r.live(s, testContext())
+	checkCounts(t, r, StreamCounts{Live: 1})
+	r.drain(s)
+	checkCounts(t, r, StreamCounts{Draining: 1})
+	r.remove(s)
+	checkCounts(t, r, StreamCounts{})
+
+	// remove drains a live stream itself
+	s, _ = r.reserve("a")
+	r.live(s, testContext())
+	r.remove(s)
+	checkCounts(t, r, StreamCounts{})
+	if r.get("a") != nil {
+		t.Fatal("removed stream still registered")
+	}
+}
+
+func TestReserveReplacesDraining(t *testing.T) {
+	r := newRegistry()
+	old, _ := r.reserve("a")
+	r.live(old, testContext())
+	r.drain(old)
+
+	s, ok := r.reserve("a")
+	if !ok || s == old {
+		t.Fatal("draining stream not replaced")
+	}
+	checkCounts(t, r, StreamCounts{Starting: 1, Draining: 1})
+
+	// the old publisher's teardown finishes after the new one took over
+	r.remove(old)
+	if r.get("a") != s {
+		t.Fatal("removing the old stream removed its replacement")
+	}
+	checkCounts(t, r, StreamCounts{Starting: 1})
+	r.live(s, testContext())
+	if found, err := r.lookup("a", 0); err != nil || found != s {
+		t.Fatalf("lookup of the replacement: %v", err)
+	}
+	r.remove(s)
+	checkCounts(t, r, StreamCounts{})
+}
+
+// publishers come and go on a few ids at once, replacing each other's draining streams
+func TestCountsUnderChurn(t *testing.T) {
+	r := newRegistry()
+	var wg sync.WaitGroup
+	for i := 0; i < 32; i++ {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			for j := 0; j < 200; j++ {
+				s, ok := r.reserve(fmt.Sprint(i % 4))
+				if !ok {
+					continue
+				}
+				if j%3 != 0 {
+					r.live(s, testContext())
+				}
+				r.lookup(s.id, 0)
+				if j%2 == 0 {
+					r.drain(s)
+				}
+				r.remove(s)
+			}
+		}(i)
+	}
+	wg.Wait()
+	checkCounts(t, r, StreamCounts{})
+	for i := 0; i < 4; i++ {
+		if s := r.get(fmt.Sprint(i)); s != nil {
+			t.Fatalf("stream %s left in state %v", s.id, s.State())
+		}
+	}
+}
@@ -0,0 +1,197 @@
+package cmd
+
+import (
+	"context"
+	"encoding/json"
+	"errors"
+	"fmt"
+	"sync/atomic"
+	"time"
+
+	"github.com/zhiqiangxu/avflow/cgo"
+	"github.com/zhiqiangxu/qrpc"
+)
+
+// RelayConfig makes a PlayCmd the edge of an upstream avflow, see SetRelay
+type RelayConfig struct {
+	// Upstream qrpc address
+	Upstream string
+	// ID the edge authenticates as, suffixed with the stream since the upstream
+	// closes the older of two connections with the same id
+	ID   string
+	Pass string
+	// IdleTimeout a pulled stream without local viewers is stopped after, 0 for default
+	IdleTimeout time.Duration
+}
+
+const (
+	defaultRelayIdleTimeout = 10 * time.Second
+	relayDialTimeout        = 5 * time.Second
+	// for the upstream to answer auth and play
+	relayResponseTimeout = 10 * time.Second
+	// how long players wait for a stream pulled on their behalf, which connects and probes first
+	relayWait = relayDialTimeout + relayResponseTimeout
+)
+
+var (
+	// ErrRelayRefused when the upstream doesn't answer OK
+	ErrRelayRefused = errors.New("relay upstream refused")
+)
+
+// SetRelay pulls streams that aren't published locally from an upstream avflow, over its qrpc play,
+// and publishes them locally while they have viewers, one upstream connection per stream.
+// Must be called before serving.
+func (cmd *PlayCmd) SetRelay(config RelayConfig) {
+	if config.IdleTimeout <= 0 {
+		config.IdleTimeout = defaultRelayIdleTimeout
+	}
+	cmd.relay = &config
+}
+
+// lookup the live stream of id for a viewer, pulling it from upstream when relaying
+func (cmd *PlayCmd) lookup(id string) (*stream, error) {
+	s, err := cmd.streams.lookup(id, startingWait)
+	if err == ErrNotPlaying && cmd.relay != nil {
+		// whoever reserves the id pulls it, the others wait for it like for any starting stream
+		if r, ok := cmd.streams.reserve(id); ok {
+			go cmd.pull(r)
+		}
+		s, err = cmd.streams.lookup(id, relayWait)
+	}
+	if err == nil {
+		s.touch()
+	}
+	return s, err
+}
+
+// pull the stream from upstream and publish it locally until it has been idle for IdleTimeout,
+// or upstream ends it
+func (cmd *PlayCmd) pull(s *stream) {
+	start := time.Now()
+	var fCtx *cgo.AVFormatQrpcContext
+	defer func() {
+		cmd.streams.drain(s)
+		if fCtx != nil {
+			// AVFormatQrpcContext must be freed last
+			fCtx.Free()
+		}
+		cmd.streams.remove(s)
+	}()
+
+	conn, frame, err := cmd.dialUpstream(s.id)
+	if err != nil {
+		fmt.Println("relay", s.id, err)
+		return
+	}
+	// closed before the context is freed, which ends ReadFrame first
+	defer conn.Close()
+
+	// what upstream sends is the mpegts of its publisher's own codec, so nothing is re-encoded,
+	// and the params of the last pull skip probing
+	opts := cgo.InputOptions{ConnectTime: start, Streams: cmd.streams.getParams(s.id)}
+	fCtx, err = cgo.NewAVFormatQrpcContext("mpegts", frame.FrameCh(), &opts)
+	if err != nil {
+		// lookups waiting for it wake up once it drains and find nothing to play
+		fmt.Println("relay open", s.id, err)
+		return
+	}
+	if params := fCtx.StreamParams(); len(params) > 0 {
+		cmd.streams.setParams(s.id, params)
+	}
+	stats := fCtx.IngestStats()
+	fmt.Println("relay open", s.id, stats.OpenLatency, "stream info skipped:", stats.StreamInfoSkipped)
+
+	s.touch()
+	cmd.streams.live(s, fCtx)
+
+	stop := make(chan struct{})
+	defer close(stop)
+	go cmd.stopIdle(s, fCtx, conn, stop)
+
+	for {
+		err := fCtx.ReadFrame()
+		if err != nil {
+			fmt.Printf("relay ReadFrame return: %s, ingest: %+v\n", err.Error(), fCtx.IngestStats())
+			return
+		}
+	}
+}
+
+// stopIdle closes the upstream connection once the stream has no subscriptions and no viewer
+// looked it up for IdleTimeout, snapshots and HLS subscribe or look up, so they count too
+func (cmd *PlayCmd) stopIdle(s *stream, fCtx *cgo.AVFormatQrpcContext, conn *qrpc.Connection, stop <-chan struct{}) {
+	ticker := time.NewTicker(cmd.relay.IdleTimeout / 2)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-stop:
+			return
+		case <-ticker.C:
+			if len(fCtx.Subscriptions()) > 0 {
+				s.touch()
+				continue
+			}
+			if s.idle() > cmd.relay.IdleTimeout {
+				fmt.Println("relay idle", s.id)
+				conn.Close()
+				return
+			}
+		}
+	}
+}
+
+// dialUpstream connects and plays id, returning the response frame the stream follows
+func (cmd *PlayCmd) dialUpstream(id string) (*qrpc.Connection, *qrpc.Frame, error) {
+	conn, err := qrpc.NewConnection(cmd.relay.Upstream, qrpc.ConnectionConfig{DialTimeout: relayDialTimeout}, nil)
+	if err != nil {
+		return nil, nil, err
+	}
+
+	payload, _ := json.Marshal(AuthRequest{ID: cmd.relay.ID + "/" + id, Pass: cmd.relay.Pass})
+	_, resp, err := conn.Request(Auth, 0, payload)
+	if err == nil {
+		_, err = expectOK(resp)
+	}
+	if err != nil {
+		conn.Close()
+		return nil, nil, fmt.Errorf("auth: %v", err)
+	}
+
+	payload, _ = json.Marshal(PlayRequest{URI: "/" + id})
+	_, resp, err = conn.StreamRequest(Play, 0, payload)
+	var frame *qrpc.Frame
+	if err == nil {
+		frame, err = expectOK(resp)
+	}
+	if err == nil && frame.Stream == nil {
+		err = fmt.Errorf("response isn't streamed")
+	}
+	if err != nil {
+		conn.Close()
+		return nil, nil, fmt.Errorf("play: %v", err)
+	}
+	return conn, frame, nil
+}
+
+func expectOK(resp qrpc.Response) (*qrpc.Frame, error) {
+	ctx, cancel := context.WithTimeout(context.Background(), relayResponseTimeout)
+	defer cancel()
+	frame, err := resp.GetFrameWithContext(ctx)
+	if err != nil {
+		return nil, err
+	}
+	if string(frame.Payload) != "OK" {
+		return nil, ErrRelayRefused
+	}
+	return frame, nil
+}
+
+// touch the stream for a viewer
+func (s *stream) touch() {
+	atomic.StoreInt64(&s.used, time.Now().UnixNano())
+}
+
+// idle since a viewer last touched the stream
+func (s *stream) idle() time.Duration {
+	return time.Duration(time.Now().UnixNano() - atomic.LoadInt64(&s.used))
+}
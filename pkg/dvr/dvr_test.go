@@ -0,0 +1,122 @@
+package dvr
+
+import (
+	"bytes"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"testing"
+	"time"
+)
+
+func newTestStore(t *testing.T, config Config) *Store {
+	dir, err := ioutil.TempDir("", "dvr")
+	if err != nil {
+		t.Fatal(err)
+	}
+	config.Dir = dir
+	s, err := NewStore(config)
+	if err != nil {
+		t.Fatal(err)
+	}
+	return s
+}
+
+// record 50 frames of 20ms, a keyframe every 5, returns what was written from frame from on
+func recordFrames(t *testing.T, s *Store, id string, from int) []byte {
+	r, err := s.Record(id)
+	if err != nil {
+		t.Fatal(err)
+	}
+	var want []byte
+	for i := 0; i < 50; i++ {
+		pts := time.Duration(i) * 20 * time.Millisecond
+		r.Mark(pts, i%5 == 0)
+		b := bytes.Repeat([]byte{byte(i)}, 1000)
+		if _, err := r.Write(b); err != nil {
+			t.Fatal(err)
+		}
+		if i >= from {
+			want = append(want, b...)
+		}
+	}
+	if err := r.Close(); err != nil {
+		t.Fatal(err)
+	}
+	return want
+}
+
+func TestRecordPlayShifted(t *testing.T) {
+	s := newTestStore(t, Config{SegmentDuration: 200 * time.Millisecond})
+	defer os.RemoveAll(s.config.Dir)
+	defer s.Close()
+
+	// the newest keyframe is frame 45 at 900ms, 400ms before it is frame 25
+	want := recordFrames(t, s, "a/b", 25)
+
+	var out bytes.Buffer
+	start := time.Now()
+	if err := s.Play("a/b", 400*time.Millisecond, &out, nil); err != nil {
+		t.Fatal(err)
+	}
+	if !bytes.Equal(out.Bytes(), want) {
+		t.Fatalf("played %d bytes, want %d", out.Len(), len(want))
+	}
+	// played in real time, the last keyframe interval has no end to be paced over
+	if d := time.Since(start); d < 300*time.Millisecond {
+		t.Fatalf("played in %v", d)
+	}
+}
+
+func TestSweepExpiresFinishedSessions(t *testing.T) {
+	s := newTestStore(t, Config{SegmentDuration: 200 * time.Millisecond, Retention: time.Hour})
+	defer os.RemoveAll(s.config.Dir)
+	defer s.Close()
+
+	recordFrames(t, s, "gone", 0)
+	recordFrames(t, s, "tail", 0)
+	recording, err := s.Record("live")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer recording.Close()
+
+	old := time.Now().Add(-2 * time.Hour)
+	age := func(id string, files func(name string) bool) {
+		dir, err := s.latest(id)
+		if err != nil {
+			t.Fatal(err)
+		}
+		infos, _ := ioutil.ReadDir(dir)
+		for _, info := range infos {
+			if files(info.Name()) {
+				os.Chtimes(filepath.Join(dir, info.Name()), old, old)
+			}
+		}
+	}
+	all := func(string) bool { return true }
+	// a stream that never publishes again expires entirely
+	age("gone", all)
+	// the head of a session goes, its tail is still within retention
+	age("tail", func(name string) bool { return name == segmentName(0) })
+	age("live", all)
+
+	s.sweep(time.Now())
+
+	if _, err := os.Stat(s.streamDir("gone")); !os.IsNotExist(err) {
+		t.Fatalf("expired stream left: %v", err)
+	}
+	dir, err := s.latest("tail")
+	if err != nil {
+		t.Fatal(err)
+	}
+	if _, err := os.Stat(filepath.Join(dir, segmentName(0))); !os.IsNotExist(err) {
+		t.Fatalf("expired segment left: %v", err)
+	}
+	if _, err := os.Stat(filepath.Join(dir, segmentName(1))); err != nil {
+		t.Fatal(err)
+	}
+	if _, err := s.latest("live"); err != nil {
+		t.Fatalf("session being recorded expired: %v", err)
+	}
+}
@@ -0,0 +1,257 @@
+package dvr
+
+import (
+	"io"
+	"os"
+	"path/filepath"
+	"sort"
+	"sync"
+	"syscall"
+	"time"
+)
+
+const (
+	// how often a player following a recording looks for new keyframes
+	pollInterval = 100 * time.Millisecond
+	// what a player writes at once, whole mpegts packets
+	writeSize = 348 * 188
+)
+
+// Play the latest recording of id to w in real time, starting at the keyframe shift before
+// its newest one, and following the recording while it goes on. It returns once the recording
+// ended and was played, w failed, or done is closed.
+// The recorded mpegts is written as it is rather than through a subscription, the player has
+// w to itself, so a slow w only holds up its own replay and there is no queue to police.
+func (s *Store) Play(id string, shift time.Duration, w io.Writer, done <-chan struct{}) error {
+	dir, err := s.latest(id)
+	if err != nil {
+		return err
+	}
+	index, err := os.Open(filepath.Join(dir, indexName))
+	if err != nil {
+		return ErrNoRecording
+	}
+	defer index.Close()
+
+	p := &player{store: s, dir: dir, index: index, w: w, done: done}
+	return p.play(shift)
+}
+
+type player struct {
+	store *Store
+	dir   string
+	index *os.File
+	w     io.Writer
+	done  <-chan struct{}
+
+	records []indexRecord
+	ended   bool
+	partial []byte // of a record not completely written yet
+
+	// wall clock basePTS is played at
+	base    time.Time
+	basePTS time.Duration
+}
+
+// poll appends the records written since the last poll
+func (p *player) poll() error {
+	var buf [64 * indexRecordSize]byte
+	for !p.ended {
+		n, err := p.index.Read(buf[:])
+		if n == 0 {
+			if err == io.EOF {
+				err = nil
+			}
+			return err
+		}
+		p.partial = append(p.partial, buf[:n]...)
+		for len(p.partial) >= indexRecordSize && !p.ended {
+			var r indexRecord
+			r.get(p.partial)
+			p.partial = p.partial[indexRecordSize:]
+			if r.segment == endSegment {
+				p.ended = true
+				break
+			}
+			p.records = append(p.records, r)
+		}
+		p.partial = append([]byte(nil), p.partial...)
+	}
+	return nil
+}
+
+// wait a poll interval, false if done
+func (p *player) wait() bool {
+	select {
+	case <-p.done:
+		return false
+	case <-time.After(pollInterval):
+		return true
+	}
+}
+
+func (p *player) play(shift time.Duration) error {
+	for {
+		if err := p.poll(); err != nil {
+			return err
+		}
+		if len(p.records) > 0 {
+			break
+		}
+		if p.ended {
+			return ErrNoRecording
+		}
+		if !p.wait() {
+			return nil
+		}
+	}
+
+	// the last keyframe at or before the newest one minus shift
+	target := p.records[len(p.records)-1].pts - shift
+	i := sort.Search(len(p.records), func(i int) bool { return p.records[i].pts > target }) - 1
+	if i < 0 {
+		i = 0
+	}
+
+	for {
+		// a chunk is known to be complete once the record after it is written
+		for i+1 >= len(p.records) && !p.ended {
+			if !p.wait() {
+				return nil
+			}
+			if err := p.poll(); err != nil {
+				return err
+			}
+		}
+		if i >= len(p.records) {
+			return nil
+		}
+
+		var next *indexRecord
+		if i+1 < len(p.records) {
+			next = &p.records[i+1]
+		}
+		if err := p.playChunk(&p.records[i], next); err != nil {
+			return err
+		}
+		select {
+		case <-p.done:
+			return nil
+		default:
+		}
+		i++
+	}
+}
+
+// playChunk writes what a record points to up to the next record, or the end of its segment,
+// paced over the time until the next keyframe
+func (p *player) playChunk(r, next *indexRecord) error {
+	m, err := p.store.maps.acquire(filepath.Join(p.dir, segmentName(r.segment)))
+	if err != nil {
+		// expired
+		return nil
+	}
+	defer p.store.maps.release(m)
+
+	end := len(m.data)
+	if next != nil && next.segment == r.segment && int(next.offset) <= end {
+		end = int(next.offset)
+	}
+	if int(r.offset) >= end {
+		return nil
+	}
+	data := m.data[r.offset:end]
+
+	if p.base.IsZero() || r.pts < p.basePTS {
+		// started, or the recording restarted its timestamps
+		p.base, p.basePTS = time.Now(), r.pts
+	}
+	var duration time.Duration
+	if next != nil && next.pts > r.pts {
+		duration = next.pts - r.pts
+	}
+	start := p.base.Add(r.pts - p.basePTS)
+	for off := 0; off < len(data); off += writeSize {
+		at := start.Add(time.Duration(int64(duration) * int64(off) / int64(len(data))))
+		if d := time.Until(at); d > 0 {
+			select {
+			case <-p.done:
+				return nil
+			case <-time.After(d):
+			}
+		}
+		piece := data[off:]
+		if len(piece) > writeSize {
+			piece = piece[:writeSize]
+		}
+		if _, err := p.w.Write(piece); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// mapping of a segment, read only, shared by the players of the segment
+type mapping struct {
+	path string
+	data []byte
+	refs int
+}
+
+// mapCache shares mappings of segments among concurrent players,
+// a segment still being recorded is mapped again once it grew
+type mapCache struct {
+	lock sync.Mutex
+	maps map[string]*mapping
+}
+
+func newMapCache() *mapCache {
+	return &mapCache{maps: make(map[string]*mapping)}
+}
+
+// acquire a mapping of all of path, release it when done
+func (c *mapCache) acquire(path string) (*mapping, error) {
+	f, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+	info, err := f.Stat()
+	if err != nil {
+		return nil, err
+	}
+	size := int(info.Size())
+
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	if m := c.maps[path]; m != nil && len(m.data) >= size {
+		m.refs++
+		return m, nil
+	}
+	if size == 0 {
+		return &mapping{path: path, refs: 1}, nil
+	}
+	data, err := syscall.Mmap(int(f.Fd()), 0, size, syscall.PROT_READ, syscall.MAP_SHARED)
+	if err != nil {
+		return nil, err
+	}
+	// players of an older, shorter mapping keep it until they release it
+	m := &mapping{path: path, data: data, refs: 1}
+	c.maps[path] = m
+	return m, nil
+}
+
+func (c *mapCache) release(m *mapping) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	m.refs--
+	if m.refs > 0 {
+		return
+	}
+	if c.maps[m.path] == m {
+		delete(c.maps, m.path)
+	}
+	if m.data != nil {
+		syscall.Munmap(m.data)
+	}
+}
@@ -0,0 +1,314 @@
+package dvr
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"os"
+	"path/filepath"
+	"sync"
+	"time"
+)
+
+var (
+	// ErrClosed when the recorder has stopped
+	ErrClosed = errors.New("dvr recorder closed")
+)
+
+const (
+	indexName = "index"
+	// an index record is the segment, the offset in it and the pts in microseconds of a keyframe, little endian
+	indexRecordSize = 16
+	// segment of the record a finished recording ends with
+	endSegment = ^uint32(0)
+	// the writer wakes up once this much is pending, or at a keyframe
+	writeChunk = 1 << 20
+	// pending output beyond this is dropped until a keyframe, the disk can't keep up
+	maxPending = 64 << 20
+)
+
+type eventKind int
+
+const (
+	eventSegment eventKind = iota // start segment
+	eventIndex                    // append record to the index
+)
+
+type event struct {
+	at     int // offset in pending.data it comes before
+	kind   eventKind
+	record indexRecord
+}
+
+type indexRecord struct {
+	segment uint32
+	offset  uint32
+	pts     time.Duration
+}
+
+func (r *indexRecord) put(b []byte) {
+	binary.LittleEndian.PutUint32(b, r.segment)
+	binary.LittleEndian.PutUint32(b[4:], r.offset)
+	binary.LittleEndian.PutUint64(b[8:], uint64(r.pts/time.Microsecond))
+}
+
+func (r *indexRecord) get(b []byte) {
+	r.segment = binary.LittleEndian.Uint32(b)
+	r.offset = binary.LittleEndian.Uint32(b[4:])
+	r.pts = time.Duration(binary.LittleEndian.Uint64(b[8:])) * time.Microsecond
+}
+
+// output handed from the subscription to the writer goroutine
+type pending struct {
+	data   []byte
+	events []event
+}
+
+// RecorderStats of a Recorder
+type RecorderStats struct {
+	Segments uint32
+	// Bytes written to segments
+	Bytes uint64
+	// DroppedBytes while the disk couldn't keep up
+	DroppedBytes uint64
+}
+
+// Recorder writes an mpegts subscription into segments cut at keyframes, with an index of the keyframes.
+// It implements io.Writer and cgo.Marker, so it can be passed to SubcribeAVFrame directly,
+// and only copies what it gets, the disk is written by its own goroutine.
+type Recorder struct {
+	dir    string
+	config Config
+
+	lock     sync.Mutex
+	pending  pending
+	started  bool // a keyframe started the first segment
+	dropping bool // until the next keyframe
+	closed   bool
+	seg      uint32 // current segment
+	segStart time.Duration
+	segSize  int64 // of the current segment, written or pending
+	stats    RecorderStats
+
+	wake chan struct{} // has room for one
+	done chan struct{}
+	err  error // of the writer, valid after done
+	// called once the writer is done
+	onDone func()
+}
+
+func newRecorder(dir string, config Config, onDone func()) (*Recorder, error) {
+	if err := os.MkdirAll(dir, 0755); err != nil {
+		return nil, err
+	}
+	index, err := os.OpenFile(filepath.Join(dir, indexName), os.O_WRONLY|os.O_CREATE|os.O_APPEND, 0644)
+	if err != nil {
+		return nil, err
+	}
+	r := &Recorder{dir: dir, config: config, wake: make(chan struct{}, 1), done: make(chan struct{}), onDone: onDone}
+	go r.run(index)
+	return r, nil
+}
+
+// Write implements io.Writer, output before the first keyframe is dropped
+func (r *Recorder) Write(b []byte) (int, error) {
+	r.lock.Lock()
+	defer r.lock.Unlock()
+
+	if r.closed {
+		return 0, ErrClosed
+	}
+	if !r.started || r.dropping {
+		if r.started {
+			r.stats.DroppedBytes += uint64(len(b))
+		}
+		return len(b), nil
+	}
+	if len(r.pending.data) >= maxPending {
+		r.dropping = true
+		r.stats.DroppedBytes += uint64(len(b))
+		return len(b), nil
+	}
+	r.pending.data = append(r.pending.data, b...)
+	r.segSize += int64(len(b))
+	if len(r.pending.data) >= writeChunk {
+		r.signal()
+	}
+	return len(b), nil
+}
+
+// Mark implements cgo.Marker, segments are cut at the first keyframe past SegmentDuration,
+// which mpegts subscriptions precede with PAT and PMT, so each keyframe can be played from
+func (r *Recorder) Mark(pts time.Duration, keyframe bool) {
+	if !keyframe {
+		return
+	}
+	r.lock.Lock()
+	defer r.lock.Unlock()
+
+	if r.closed {
+		return
+	}
+	if r.dropping {
+		if len(r.pending.data) >= maxPending/2 {
+			return
+		}
+		// what was dropped leaves a hole, start over in a new segment
+		r.dropping = false
+		r.startSegment(pts)
+	}
+	// offsets must fit the index, segments are far smaller in practice
+	if !r.started || pts-r.segStart >= r.config.SegmentDuration || pts < r.segStart || r.segSize >= 1<<31 {
+		r.startSegment(pts)
+	}
+	r.pending.events = append(r.pending.events, event{at: len(r.pending.data), kind: eventIndex,
+		record: indexRecord{segment: r.seg, offset: uint32(r.segSize), pts: pts}})
+	r.signal()
+}
+
+// caller holds lock
+func (r *Recorder) startSegment(pts time.Duration) {
+	if r.started {
+		r.seg++
+	}
+	r.started = true
+	r.segStart = pts
+	r.segSize = 0
+	r.stats.Segments++
+	r.pending.events = append(r.pending.events, event{at: len(r.pending.data), kind: eventSegment, record: indexRecord{segment: r.seg, pts: pts}})
+}
+
+// caller holds lock
+func (r *Recorder) signal() {
+	select {
+	case r.wake <- struct{}{}:
+	default:
+	}
+}
+
+// Close ends the recording once what is pending is written
+func (r *Recorder) Close() error {
+	r.lock.Lock()
+	if !r.closed {
+		r.closed = true
+		r.signal()
+	}
+	r.lock.Unlock()
+
+	<-r.done
+	return r.err
+}
+
+// Stats of the recording so far
+func (r *Recorder) Stats() RecorderStats {
+	r.lock.Lock()
+	defer r.lock.Unlock()
+	return r.stats
+}
+
+func segmentName(seg uint32) string {
+	return fmt.Sprintf("%08d.ts", seg)
+}
+
+// run writes pending output in large sequential writes, the index after the data it points to,
+// so a reader of the index only ever finds complete data
+func (r *Recorder) run(index *os.File) {
+	defer close(r.done)
+	defer r.onDone()
+
+	var (
+		f        *os.File
+		spare    pending
+		indexBuf []byte
+		err      error
+		// start pts of the segments still on disk, for retention
+		segments []indexRecord
+	)
+	fail := func(e error) {
+		if err == nil {
+			err = e
+			fmt.Println("dvr", r.dir, e)
+		}
+	}
+	write := func(b []byte) {
+		if f == nil || len(b) == 0 || err != nil {
+			return
+		}
+		if _, e := f.Write(b); e != nil {
+			fail(e)
+			return
+		}
+		r.lock.Lock()
+		r.stats.Bytes += uint64(len(b))
+		r.lock.Unlock()
+	}
+
+	for {
+		<-r.wake
+		r.lock.Lock()
+		batch := r.pending
+		r.pending = spare
+		closed := r.closed
+		r.lock.Unlock()
+
+		pos := 0
+		for _, ev := range batch.events {
+			write(batch.data[pos:ev.at])
+			pos = ev.at
+			switch ev.kind {
+			case eventSegment:
+				if f != nil {
+					f.Close()
+				}
+				f, _ = os.OpenFile(filepath.Join(r.dir, segmentName(ev.record.segment)), os.O_WRONLY|os.O_CREATE|os.O_TRUNC, 0644)
+				if f == nil {
+					fail(fmt.Errorf("can't create segment %d", ev.record.segment))
+				}
+				segments = r.expire(segments, ev.record)
+			case eventIndex:
+				var b [indexRecordSize]byte
+				ev.record.put(b[:])
+				indexBuf = append(indexBuf, b[:]...)
+			}
+		}
+		write(batch.data[pos:])
+		if closed {
+			end := indexRecord{segment: endSegment}
+			var b [indexRecordSize]byte
+			end.put(b[:])
+			indexBuf = append(indexBuf, b[:]...)
+		}
+		if len(indexBuf) > 0 && err == nil {
+			if _, e := index.Write(indexBuf); e != nil {
+				fail(e)
+			}
+		}
+		indexBuf = indexBuf[:0]
+		spare = pending{data: batch.data[:0], events: batch.events[:0]}
+
+		if closed {
+			if f != nil {
+				f.Close()
+			}
+			index.Close()
+			r.err = err
+			return
+		}
+	}
+}
+
+// expire segments older than Retention before the one starting, returns the ones left
+func (r *Recorder) expire(segments []indexRecord, start indexRecord) []indexRecord {
+	segments = append(segments, start)
+	if r.config.Retention <= 0 {
+		return segments
+	}
+	newest := segments[len(segments)-1].pts
+	n := 0
+	// a segment goes once the one after it is older than Retention too
+	for n+1 < len(segments) && newest-segments[n+1].pts > r.config.Retention {
+		os.Remove(filepath.Join(r.dir, segmentName(segments[n].segment)))
+		n++
+	}
+	return append(segments[:0], segments[n:]...)
+}
@@ -0,0 +1,186 @@
+package dvr
+
+import (
+	"errors"
+	"fmt"
+	"io/ioutil"
+	"net/url"
+	"os"
+	"path/filepath"
+	"sort"
+	"strconv"
+	"sync"
+	"time"
+)
+
+// Config for Store, zero fields take defaults
+type Config struct {
+	// Dir recordings are kept in, a directory per stream and a session per publish under it
+	Dir string
+	// SegmentDuration a segment is cut at the first keyframe after it
+	SegmentDuration time.Duration
+	// Retention of segments and sessions, 0 to keep everything
+	Retention time.Duration
+}
+
+const (
+	defaultSegmentDuration = 10 * time.Second
+	// how often finished sessions are expired at most, Retention/2 if it is shorter
+	maxSweepInterval = time.Minute
+)
+
+var (
+	// ErrNoRecording when a stream was never recorded, or its recordings expired
+	ErrNoRecording = errors.New("dvr recording not found")
+)
+
+// Store of recordings on disk, shared by the recorders of all streams and their players
+type Store struct {
+	config Config
+	maps   *mapCache
+	// guards recording, the session dirs of recorders not closed yet
+	lock      sync.Mutex
+	recording map[string]bool
+	stopOnce  sync.Once
+	stop      chan struct{}
+}
+
+// NewStore creates a Store, which expires recordings older than Retention in the background
+// until it is closed, whether their streams are published again or not
+func NewStore(config Config) (*Store, error) {
+	if config.SegmentDuration <= 0 {
+		config.SegmentDuration = defaultSegmentDuration
+	}
+	if err := os.MkdirAll(config.Dir, 0755); err != nil {
+		return nil, err
+	}
+	s := &Store{config: config, maps: newMapCache(), recording: make(map[string]bool), stop: make(chan struct{})}
+	if config.Retention > 0 {
+		go s.sweepLoop()
+	}
+	return s, nil
+}
+
+// Close stops expiring recordings, recorders and players keep working
+func (s *Store) Close() {
+	s.stopOnce.Do(func() { close(s.stop) })
+}
+
+// ids can contain /, see publisherID
+func (s *Store) streamDir(id string) string {
+	return filepath.Join(s.config.Dir, url.PathEscape(id))
+}
+
+// Record a new session of id, its segments older than Retention are expired while it is recorded
+func (s *Store) Record(id string) (*Recorder, error) {
+	dir := filepath.Join(s.streamDir(id), fmt.Sprintf("%019d", time.Now().UnixNano()))
+	s.lock.Lock()
+	s.recording[dir] = true
+	s.lock.Unlock()
+	done := func() {
+		s.lock.Lock()
+		delete(s.recording, dir)
+		s.lock.Unlock()
+	}
+
+	r, err := newRecorder(dir, s.config, done)
+	if err != nil {
+		done()
+		return nil, err
+	}
+	return r, nil
+}
+
+func (s *Store) sweepLoop() {
+	interval := s.config.Retention / 2
+	if interval > maxSweepInterval {
+		interval = maxSweepInterval
+	}
+	ticker := time.NewTicker(interval)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-s.stop:
+			return
+		case now := <-ticker.C:
+			s.sweep(now)
+		}
+	}
+}
+
+// sweep expires the finished sessions of every stream, sessions being recorded expire their own segments
+func (s *Store) sweep(now time.Time) {
+	infos, err := ioutil.ReadDir(s.config.Dir)
+	if err != nil {
+		return
+	}
+	for _, info := range infos {
+		if !info.IsDir() {
+			continue
+		}
+		dir := filepath.Join(s.config.Dir, info.Name())
+		sessions, _ := s.sessions(dir)
+		for _, session := range sessions {
+			s.lock.Lock()
+			recording := s.recording[session.dir]
+			s.lock.Unlock()
+			if !recording {
+				s.expireSession(session.dir, now)
+			}
+		}
+		// only goes once every session did
+		os.Remove(dir)
+	}
+}
+
+// expireSession removes the segments last written more than Retention ago,
+// and the session once its index was too, which is written last
+func (s *Store) expireSession(dir string, now time.Time) {
+	infos, err := ioutil.ReadDir(dir)
+	if err != nil {
+		return
+	}
+	left := 0
+	for _, info := range infos {
+		if now.Sub(info.ModTime()) <= s.config.Retention {
+			left++
+		} else if info.Name() != indexName {
+			os.Remove(filepath.Join(dir, info.Name()))
+		}
+	}
+	if left == 0 {
+		os.RemoveAll(dir)
+	}
+}
+
+type session struct {
+	dir   string
+	start time.Time
+}
+
+// sessions of a stream dir, oldest first
+func (s *Store) sessions(dir string) ([]session, error) {
+	infos, err := ioutil.ReadDir(dir)
+	if err != nil {
+		return nil, err
+	}
+	var sessions []session
+	for _, info := range infos {
+		nano, err := strconv.ParseInt(info.Name(), 10, 64)
+		if err != nil || !info.IsDir() {
+			continue
+		}
+		sessions = append(sessions, session{dir: filepath.Join(dir, info.Name()), start: time.Unix(0, nano)})
+	}
+	sort.Slice(sessions, func(i, j int) bool { return sessions[i].start.Before(sessions[j].start) })
+	return sessions, nil
+}
+
+// latest session of id
+func (s *Store) latest(id string) (string, error) {
+	sessions, err := s.sessions(s.streamDir(id))
+	if err != nil || len(sessions) == 0 {
+		return "", ErrNoRecording
+	}
+	return sessions[len(sessions)-1].dir, nil
+}
@@ -0,0 +1,98 @@
+package hls
+
+import (
+	"fmt"
+	"net/http"
+	"strconv"
+	"strings"
+)
+
+const (
+	playlistName = "index.m3u8"
+)
+
+// Serve the playlist or a segment or part named name to w
+//
+// index.m3u8 supports blocking reload through _HLS_msn and _HLS_part,
+// {msn}.ts is a segment and {msn}.{part}.ts a part.
+func (p *Packager) Serve(w http.ResponseWriter, r *http.Request, name string) {
+	if name == playlistName {
+		p.servePlaylist(w, r)
+		return
+	}
+
+	if !strings.HasSuffix(name, ".ts") {
+		http.NotFound(w, r)
+		return
+	}
+	fields := strings.Split(strings.TrimSuffix(name, ".ts"), ".")
+	msn, err := strconv.ParseUint(fields[0], 10, 64)
+	if err != nil || len(fields) > 2 {
+		http.NotFound(w, r)
+		return
+	}
+
+	var data []byte
+	if len(fields) == 1 {
+		data, err = p.Segment(msn)
+	} else {
+		var i int
+		i, err = strconv.Atoi(fields[1])
+		if err != nil || i < 0 {
+			http.NotFound(w, r)
+			return
+		}
+		data, err = p.Part(msn, i)
+	}
+	if err != nil {
+		http.Error(w, err.Error(), http.StatusNotFound)
+		return
+	}
+
+	// segments and parts never change once complete
+	w.Header().Set("Cache-Control", fmt.Sprintf("public, max-age=%d", int(p.MaxAge().Seconds())))
+	w.Header().Set("Content-Type", "video/mp2t")
+	w.Header().Set("Content-Length", strconv.Itoa(len(data)))
+	w.Write(data)
+}
+
+func (p *Packager) servePlaylist(w http.ResponseWriter, r *http.Request) {
+	query := r.URL.Query()
+	msn := int64(-1)
+	part := -1
+	if v := query.Get("_HLS_msn"); v != "" {
+		n, err := strconv.ParseUint(v, 10, 63)
+		if err != nil {
+			http.Error(w, "bad _HLS_msn", http.StatusBadRequest)
+			return
+		}
+		msn = int64(n)
+		if v := query.Get("_HLS_part"); v != "" {
+			part, err = strconv.Atoi(v)
+			if err != nil || part < 0 {
+				http.Error(w, "bad _HLS_part", http.StatusBadRequest)
+				return
+			}
+		}
+	}
+
+	playlist, err := p.Playlist(msn, part)
+	if err != nil {
+		if msn >= 0 && err == ErrNotFound {
+			http.Error(w, err.Error(), http.StatusBadRequest)
+			return
+		}
+		http.Error(w, err.Error(), http.StatusNotFound)
+		return
+	}
+
+	if msn >= 0 {
+		// a blocking reload url names a single playlist version
+		w.Header().Set("Cache-Control", fmt.Sprintf("public, max-age=%d", int(p.config.TargetDuration.Seconds())))
+	} else {
+		w.Header().Set("Cache-Control", "no-cache")
+	}
+	w.Header().Set("Content-Type", "application/vnd.apple.mpegurl")
+	w.Header().Set("Content-Length", strconv.Itoa(len(playlist)))
+	w.Write([]byte(playlist))
+}
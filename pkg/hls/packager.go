@@ -0,0 +1,364 @@
+package hls
+
+import (
+	"errors"
+	"fmt"
+	"math"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Config for Packager, zero fields take defaults
+type Config struct {
+	// MaxSegments kept in the playlist and in memory
+	MaxSegments int
+	// TargetDuration a segment is cut at the first keyframe after it
+	TargetDuration time.Duration
+	// PartTarget for low-latency parts, cut at the first flush after it
+	PartTarget time.Duration
+}
+
+const (
+	defaultMaxSegments    = 6
+	defaultTargetDuration = 2 * time.Second
+	defaultPartTarget     = 500 * time.Millisecond
+)
+
+var (
+	// ErrClosed when the packager has stopped
+	ErrClosed = errors.New("hls packager closed")
+	// ErrNotFound when a segment or part is not or no longer in the ring
+	ErrNotFound = errors.New("hls segment not found")
+)
+
+type part struct {
+	// [off, end) of segment.data
+	off, end    int
+	duration    time.Duration
+	independent bool
+}
+
+type segment struct {
+	msn      uint64
+	start    time.Duration
+	duration time.Duration
+	// only ever appended, so slices handed out stay valid
+	data  []byte
+	parts []part
+}
+
+// Packager cuts an mpegts subscription into segments and parts kept in memory,
+// one Packager serves any number of HTTP viewers.
+// It implements io.Writer and cgo.Marker, so it can be passed to SubcribeAVFrame directly.
+type Packager struct {
+	config Config
+
+	lock     sync.Mutex
+	segments []*segment // complete ones, oldest first
+	cur      *segment   // nil until the first keyframe
+	nextMSN  uint64
+	partOff  int
+	partPTS  time.Duration
+	partKey  bool
+	maxDur   time.Duration
+	closed   bool
+	changed  chan struct{} // closed and replaced whenever a part completes
+	accessed int64         // unix nano of the last request, atomic
+}
+
+// NewPackager creates a Packager
+func NewPackager(config Config) *Packager {
+	if config.MaxSegments <= 0 {
+		config.MaxSegments = defaultMaxSegments
+	}
+	if config.TargetDuration <= 0 {
+		config.TargetDuration = defaultTargetDuration
+	}
+	if config.PartTarget <= 0 {
+		config.PartTarget = defaultPartTarget
+	}
+	p := &Packager{config: config, changed: make(chan struct{})}
+	p.touch()
+	return p
+}
+
+// Write implements io.Writer, output before the first keyframe is dropped
+func (p *Packager) Write(b []byte) (int, error) {
+	p.lock.Lock()
+	defer p.lock.Unlock()
+
+	if p.closed {
+		return 0, ErrClosed
+	}
+	if p.cur != nil {
+		p.cur.data = append(p.cur.data, b...)
+	}
+	return len(b), nil
+}
+
+// Mark implements cgo.Marker
+func (p *Packager) Mark(pts time.Duration, keyframe bool) {
+	p.lock.Lock()
+	defer p.lock.Unlock()
+
+	if p.closed {
+		return
+	}
+
+	if keyframe {
+		switch {
+		case p.cur == nil:
+			p.startSegment(pts)
+		case pts-p.cur.start >= p.config.TargetDuration || pts < p.cur.start:
+			p.endPart(pts)
+			p.endSegment(pts)
+			p.startSegment(pts)
+		default:
+			p.endPart(pts)
+			p.partKey = true
+		}
+		return
+	}
+
+	if p.cur != nil && pts-p.partPTS >= p.config.PartTarget {
+		p.endPart(pts)
+	}
+}
+
+// Close stops packaging and wakes up blocked requests
+func (p *Packager) Close() {
+	p.lock.Lock()
+	defer p.lock.Unlock()
+
+	if p.closed {
+		return
+	}
+	if p.cur != nil {
+		// whatever follows the last part is incomplete
+		p.endSegment(p.partPTS)
+	}
+	p.closed = true
+	p.notify()
+}
+
+// Idle reports how long since the last request
+func (p *Packager) Idle() time.Duration {
+	return time.Duration(time.Now().UnixNano() - atomic.LoadInt64(&p.accessed))
+}
+
+func (p *Packager) touch() {
+	atomic.StoreInt64(&p.accessed, time.Now().UnixNano())
+}
+
+func (p *Packager) startSegment(pts time.Duration) {
+	p.cur = &segment{msn: p.nextMSN, start: pts}
+	p.nextMSN++
+	p.partOff = 0
+	p.partPTS = pts
+	p.partKey = true
+}
+
+func (p *Packager) endPart(pts time.Duration) {
+	if len(p.cur.data) == p.partOff {
+		return
+	}
+	d := pts - p.partPTS
+	if d < 0 {
+		d = 0
+	}
+	p.cur.parts = append(p.cur.parts, part{off: p.partOff, end: len(p.cur.data), duration: d, independent: p.partKey})
+	p.partOff = len(p.cur.data)
+	p.partPTS = pts
+	p.partKey = false
+	p.notify()
+}
+
+func (p *Packager) endSegment(pts time.Duration) {
+	s := p.cur
+	p.cur = nil
+	if len(s.parts) == 0 {
+		// nothing was written, reuse its msn
+		p.nextMSN--
+		return
+	}
+	s.duration = pts - s.start
+	if s.duration < 0 {
+		s.duration = 0
+		for _, pt := range s.parts {
+			s.duration += pt.duration
+		}
+	}
+	if s.duration > p.maxDur {
+		p.maxDur = s.duration
+	}
+	p.segments = append(p.segments, s)
+	if len(p.segments) > p.config.MaxSegments {
+		copy(p.segments, p.segments[1:])
+		p.segments[len(p.segments)-1] = nil
+		p.segments = p.segments[:len(p.segments)-1]
+	}
+	p.notify()
+}
+
+// caller holds lock
+func (p *Packager) notify() {
+	close(p.changed)
+	p.changed = make(chan struct{})
+}
+
+// has reports whether part of msn is complete, part < 0 for the whole segment
+func (p *Packager) has(msn uint64, part int) bool {
+	if p.cur != nil && p.cur.msn == msn {
+		return part >= 0 && part < len(p.cur.parts)
+	}
+	n := len(p.segments)
+	return n > 0 && msn <= p.segments[n-1].msn
+}
+
+// wait until part of msn is complete, or timeout
+func (p *Packager) wait(msn uint64, part int, timeout time.Duration) error {
+	timer := time.NewTimer(timeout)
+	defer timer.Stop()
+
+	p.lock.Lock()
+	for !p.has(msn, part) {
+		if p.closed {
+			p.lock.Unlock()
+			return ErrClosed
+		}
+		changed := p.changed
+		p.lock.Unlock()
+		select {
+		case <-changed:
+		case <-timer.C:
+			return ErrNotFound
+		}
+		p.lock.Lock()
+	}
+	p.lock.Unlock()
+	return nil
+}
+
+func (p *Packager) find(msn uint64) *segment {
+	if p.cur != nil && p.cur.msn == msn {
+		return p.cur
+	}
+	for _, s := range p.segments {
+		if s.msn == msn {
+			return s
+		}
+	}
+	return nil
+}
+
+// Segment returns a complete segment
+func (p *Packager) Segment(msn uint64) ([]byte, error) {
+	p.touch()
+	p.lock.Lock()
+	defer p.lock.Unlock()
+
+	s := p.find(msn)
+	if s == nil || s == p.cur {
+		return nil, ErrNotFound
+	}
+	return s.data, nil
+}
+
+// Part returns a part, blocking for a while if it is the next one to complete
+func (p *Packager) Part(msn uint64, i int) ([]byte, error) {
+	p.touch()
+	if err := p.wait(msn, i, p.blockTimeout()); err != nil {
+		return nil, err
+	}
+
+	p.lock.Lock()
+	defer p.lock.Unlock()
+
+	s := p.find(msn)
+	if s == nil || i >= len(s.parts) {
+		return nil, ErrNotFound
+	}
+	pt := s.parts[i]
+	return s.data[pt.off:pt.end:pt.end], nil
+}
+
+func (p *Packager) blockTimeout() time.Duration {
+	return 3 * p.config.TargetDuration
+}
+
+// Playlist renders the media playlist, if msn >= 0 it is a blocking reload that
+// returns once part of msn is complete, part < 0 waits for the whole segment
+func (p *Packager) Playlist(msn int64, part int) (string, error) {
+	p.touch()
+	if msn >= 0 {
+		p.lock.Lock()
+		// too far ahead to ever be satisfied in time
+		tooFar := uint64(msn) > p.nextMSN+1
+		p.lock.Unlock()
+		if tooFar {
+			return "", ErrNotFound
+		}
+		// the current playlist is still the answer when this times out or the packager closes
+		p.wait(uint64(msn), part, p.blockTimeout())
+	}
+
+	p.lock.Lock()
+	defer p.lock.Unlock()
+
+	if len(p.segments) == 0 && (p.cur == nil || len(p.cur.parts) == 0) {
+		return "", ErrNotFound
+	}
+
+	target := p.maxDur
+	if target < p.config.TargetDuration {
+		target = p.config.TargetDuration
+	}
+	partTarget := p.config.PartTarget.Seconds()
+
+	var b strings.Builder
+	b.WriteString("#EXTM3U\n#EXT-X-VERSION:6\n")
+	fmt.Fprintf(&b, "#EXT-X-TARGETDURATION:%d\n", int(math.Ceil(target.Seconds())))
+	fmt.Fprintf(&b, "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n", 3*partTarget)
+	fmt.Fprintf(&b, "#EXT-X-PART-INF:PART-TARGET=%.3f\n", partTarget)
+	first := p.nextMSN - 1
+	if len(p.segments) > 0 {
+		first = p.segments[0].msn
+	}
+	fmt.Fprintf(&b, "#EXT-X-MEDIA-SEQUENCE:%d\n", first)
+
+	// parts only for the last few segments, older ones are listed whole
+	withParts := len(p.segments) - 2
+	for i, s := range p.segments {
+		if i >= withParts {
+			writeParts(&b, s)
+		}
+		fmt.Fprintf(&b, "#EXTINF:%.3f,\n%d.ts\n", s.duration.Seconds(), s.msn)
+	}
+	if p.cur != nil {
+		writeParts(&b, p.cur)
+		if !p.closed {
+			fmt.Fprintf(&b, "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"%d.%d.ts\"\n", p.cur.msn, len(p.cur.parts))
+		}
+	}
+	if p.closed {
+		b.WriteString("#EXT-X-ENDLIST\n")
+	}
+	return b.String(), nil
+}
+
+func writeParts(b *strings.Builder, s *segment) {
+	for i, pt := range s.parts {
+		fmt.Fprintf(b, "#EXT-X-PART:DURATION=%.3f,URI=\"%d.%d.ts\"", pt.duration.Seconds(), s.msn, i)
+		if pt.independent {
+			b.WriteString(",INDEPENDENT=YES")
+		}
+		b.WriteString("\n")
+	}
+}
+
+// MaxAge for segments and parts, which never change while they are in the ring
+func (p *Packager) MaxAge() time.Duration {
+	return time.Duration(p.config.MaxSegments) * p.config.TargetDuration
+}
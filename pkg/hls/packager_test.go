@@ -0,0 +1,280 @@
+package hls
+
+import (
+	"bytes"
+	"net/http"
+	"net/http/httptest"
+	"strings"
+	"testing"
+	"time"
+)
+
+// frames are 100ms apart with a keyframe every second, so segments are 1s with 5 parts of 200ms
+var testConfig = Config{MaxSegments: 10, TargetDuration: time.Second, PartTarget: 200 * time.Millisecond}
+
+func frameData(i int) []byte {
+	return bytes.Repeat([]byte{byte(i)}, 100)
+}
+
+// feed frames [from, to) the way a subscription does, mark then write
+func feed(t *testing.T, p *Packager, from, to int) {
+	for i := from; i < to; i++ {
+		p.Mark(time.Duration(i)*100*time.Millisecond, i%10 == 0)
+		if _, err := p.Write(frameData(i)); err != nil {
+			t.Fatal(err)
+		}
+	}
+}
+
+func framesData(from, to int) []byte {
+	var b []byte
+	for i := from; i < to; i++ {
+		b = append(b, frameData(i)...)
+	}
+	return b
+}
+
+func playlist(t *testing.T, p *Packager) string {
+	pl, err := p.Playlist(-1, -1)
+	if err != nil {
+		t.Fatal(err)
+	}
+	return pl
+}
+
+func TestCutSegmentsAndParts(t *testing.T) {
+	p := NewPackager(testConfig)
+	// nothing before the first keyframe is kept
+	p.Write([]byte("garbage"))
+	if _, err := p.Playlist(-1, -1); err != ErrNotFound {
+		t.Fatalf("playlist before the first keyframe: %v", err)
+	}
+	feed(t, p, 0, 25)
+
+	for msn := 0; msn < 2; msn++ {
+		data, err := p.Segment(uint64(msn))
+		if err != nil {
+			t.Fatal(err)
+		}
+		if want := framesData(msn*10, msn*10+10); !bytes.Equal(data, want) {
+			t.Fatalf("segment %d has %d bytes, want %d", msn, len(data), len(want))
+		}
+		for i := 0; i < 5; i++ {
+			data, err := p.Part(uint64(msn), i)
+			if err != nil {
+				t.Fatal(err)
+			}
+			if want := framesData(msn*10+2*i, msn*10+2*i+2); !bytes.Equal(data, want) {
+				t.Fatalf("part %d.%d has %d bytes, want %d", msn, i, len(data), len(want))
+			}
+		}
+	}
+	// the current segment has frames 20-23 in two parts, 24 is still open
+	if _, err := p.Segment(2); err != ErrNotFound {
+		t.Fatalf("incomplete segment: %v", err)
+	}
+	if data, err := p.Part(2, 1); err != nil || !bytes.Equal(data, framesData(22, 24)) {
+		t.Fatalf("part 2.1: %d bytes, %v", len(data), err)
+	}
+
+	pl := playlist(t, p)
+	for _, want := range []string{
+		"#EXT-X-MEDIA-SEQUENCE:0\n",
+		"#EXT-X-TARGETDURATION:1\n",
+		"#EXT-X-PART:DURATION=0.200,URI=\"0.0.ts\",INDEPENDENT=YES\n",
+		"#EXT-X-PART:DURATION=0.200,URI=\"0.1.ts\"\n",
+		"#EXTINF:1.000,\n0.ts\n",
+		"#EXTINF:1.000,\n1.ts\n",
+		"#EXT-X-PART:DURATION=0.200,URI=\"2.1.ts\"\n",
+		"#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"2.2.ts\"\n",
+	} {
+		if !strings.Contains(pl, want) {
+			t.Fatalf("playlist lacks %q:\n%s", want, pl)
+		}
+	}
+	if strings.Contains(pl, "ENDLIST") {
+		t.Fatalf("open playlist ended:\n%s", pl)
+	}
+}
+
+func TestEmptySegmentReusesMSN(t *testing.T) {
+	p := NewPackager(testConfig)
+	p.Mark(0, true)
+	p.Write(frameData(0))
+	// a segment without any output in between is dropped
+	p.Mark(time.Second, true)
+	p.Mark(2*time.Second, true)
+	p.Write(frameData(1))
+	p.Mark(3*time.Second, true)
+
+	if data, err := p.Segment(1); err != nil || !bytes.Equal(data, frameData(1)) {
+		t.Fatalf("segment 1: %d bytes, %v", len(data), err)
+	}
+	pl := playlist(t, p)
+	if !strings.Contains(pl, "#EXTINF:1.000,\n1.ts\n") || strings.Contains(pl, "2.ts") {
+		t.Fatalf("empty segment listed:\n%s", pl)
+	}
+	if !strings.Contains(pl, "PRELOAD-HINT:TYPE=PART,URI=\"2.0.ts\"") {
+		t.Fatalf("current segment doesn't follow on:\n%s", pl)
+	}
+}
+
+func TestRingEviction(t *testing.T) {
+	config := testConfig
+	config.MaxSegments = 3
+	p := NewPackager(config)
+	// segments 0-4 complete, 5 current
+	feed(t, p, 0, 51)
+
+	for msn := uint64(0); msn < 2; msn++ {
+		if _, err := p.Segment(msn); err != ErrNotFound {
+			t.Fatalf("evicted segment %d: %v", msn, err)
+		}
+		if _, err := p.Part(msn, 0); err != ErrNotFound {
+			t.Fatalf("part of evicted segment %d: %v", msn, err)
+		}
+	}
+	for msn := uint64(2); msn < 5; msn++ {
+		if _, err := p.Segment(msn); err != nil {
+			t.Fatalf("segment %d: %v", msn, err)
+		}
+	}
+	pl := playlist(t, p)
+	if !strings.Contains(pl, "#EXT-X-MEDIA-SEQUENCE:2\n") || strings.Contains(pl, "\n1.ts") {
+		t.Fatalf("evicted segments listed:\n%s", pl)
+	}
+	// older segments are listed without parts
+	if strings.Contains(pl, "URI=\"2.0.ts\"") || !strings.Contains(pl, "URI=\"3.0.ts\"") {
+		t.Fatalf("parts listed for the wrong segments:\n%s", pl)
+	}
+}
+
+func TestBlockingPart(t *testing.T) {
+	p := NewPackager(testConfig)
+	feed(t, p, 0, 3)
+
+	type result struct {
+		data []byte
+		err  error
+	}
+	part := make(chan result, 1)
+	pl := make(chan result, 1)
+	go func() {
+		data, err := p.Part(0, 1)
+		part <- result{data, err}
+	}()
+	go func() {
+		s, err := p.Playlist(0, 1)
+		pl <- result{[]byte(s), err}
+	}()
+
+	time.Sleep(50 * time.Millisecond)
+	select {
+	case <-part:
+		t.Fatal("part returned before it was complete")
+	case <-pl:
+		t.Fatal("playlist returned before the part was complete")
+	default:
+	}
+	// frame 4 completes part 1 with frames 2 and 3
+	feed(t, p, 3, 5)
+
+	r := <-part
+	if r.err != nil || !bytes.Equal(r.data, framesData(2, 4)) {
+		t.Fatalf("blocked part: %d bytes, %v", len(r.data), r.err)
+	}
+	r = <-pl
+	if r.err != nil || !strings.Contains(string(r.data), "URI=\"0.1.ts\"") {
+		t.Fatalf("blocked playlist: %v\n%s", r.err, r.data)
+	}
+}
+
+func TestBlockingTimeout(t *testing.T) {
+	config := testConfig
+	config.TargetDuration = 100 * time.Millisecond
+	p := NewPackager(config)
+	feed(t, p, 0, 3)
+	timeout := p.blockTimeout()
+
+	start := time.Now()
+	if _, err := p.Part(0, 1); err != ErrNotFound {
+		t.Fatalf("part that never completes: %v", err)
+	}
+	if d := time.Since(start); d < timeout {
+		t.Fatalf("part gave up after %v", d)
+	}
+
+	// a reload that times out answers with the playlist as it is
+	start = time.Now()
+	pl, err := p.Playlist(0, 1)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if d := time.Since(start); d < timeout {
+		t.Fatalf("playlist gave up after %v", d)
+	}
+	if strings.Contains(pl, "#EXT-X-PART:DURATION=0.200,URI=\"0.1.ts\"") || !strings.Contains(pl, "URI=\"0.0.ts\"") {
+		t.Fatalf("timed out playlist:\n%s", pl)
+	}
+}
+
+func TestPlaylistTooFar(t *testing.T) {
+	p := NewPackager(testConfig)
+	// segment 0 complete, 1 current
+	feed(t, p, 0, 13)
+
+	get := func(query string) *httptest.ResponseRecorder {
+		w := httptest.NewRecorder()
+		p.Serve(w, httptest.NewRequest(http.MethodGet, "/"+playlistName+query, nil), playlistName)
+		return w
+	}
+	// the next segment after the current one may still complete in time
+	if w := get("?_HLS_msn=1&_HLS_part=0"); w.Code != http.StatusOK {
+		t.Fatalf("reachable msn: %d", w.Code)
+	}
+	start := time.Now()
+	if w := get("?_HLS_msn=4"); w.Code != http.StatusBadRequest {
+		t.Fatalf("msn too far ahead: %d", w.Code)
+	}
+	if d := time.Since(start); d > p.blockTimeout()/2 {
+		t.Fatalf("msn too far ahead blocked for %v", d)
+	}
+	if w := get("?_HLS_msn=x"); w.Code != http.StatusBadRequest {
+		t.Fatalf("bad msn: %d", w.Code)
+	}
+}
+
+func TestCloseEndsPlaylist(t *testing.T) {
+	p := NewPackager(testConfig)
+	feed(t, p, 0, 15)
+
+	// close makes the current segment 1 the last one, 2 never comes
+	blocked := make(chan error, 1)
+	go func() {
+		_, err := p.Part(2, 0)
+		blocked <- err
+	}()
+	time.Sleep(50 * time.Millisecond)
+	p.Close()
+
+	select {
+	case err := <-blocked:
+		if err != ErrClosed {
+			t.Fatalf("blocked part on close: %v", err)
+		}
+	case <-time.After(time.Second):
+		t.Fatal("close didn't wake up a blocked part")
+	}
+
+	// the current segment becomes the last one, frame 14 included though it never completed a part
+	if data, err := p.Segment(1); err != nil || !bytes.Equal(data, framesData(10, 15)) {
+		t.Fatalf("last segment: %d bytes, %v", len(data), err)
+	}
+	pl := playlist(t, p)
+	if !strings.HasSuffix(pl, "1.ts\n#EXT-X-ENDLIST\n") || strings.Contains(pl, "PRELOAD-HINT") {
+		t.Fatalf("closed playlist:\n%s", pl)
+	}
+	if _, err := p.Write(frameData(15)); err != ErrClosed {
+		t.Fatalf("write after close: %v", err)
+	}
+}
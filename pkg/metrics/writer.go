@@ -0,0 +1,79 @@
+package metrics
+
+import (
+	"bufio"
+	"io"
+	"strconv"
+	"strings"
+	"time"
+)
+
+// Writer writes metrics in the Prometheus text format, the samples of a family
+// must follow its Family call
+type Writer struct {
+	w *bufio.Writer
+}
+
+// NewWriter creates a Writer, Flush it when done
+func NewWriter(w io.Writer) *Writer {
+	return &Writer{w: bufio.NewWriter(w)}
+}
+
+// Labels are name, value pairs
+type Labels []string
+
+// Family starts the family name of type typ, counter, gauge or histogram
+func (w *Writer) Family(name, typ, help string) {
+	w.w.WriteString("# HELP " + name + " " + help + "\n")
+	w.w.WriteString("# TYPE " + name + " " + typ + "\n")
+}
+
+// Sample of name with labels
+func (w *Writer) Sample(name string, labels Labels, value float64) {
+	w.w.WriteString(name)
+	w.labels(labels, "", "")
+	w.w.WriteByte(' ')
+	w.w.WriteString(strconv.FormatFloat(value, 'g', -1, 64))
+	w.w.WriteByte('\n')
+}
+
+// Histogram of durations in seconds, buckets are not cumulative, bucket i counts the ones
+// up to bounds[i] and the last bucket, which has no bound, the ones above
+func (w *Writer) Histogram(name string, labels Labels, bounds []time.Duration, buckets []uint64, count uint64, sum time.Duration) {
+	var cumulative uint64
+	for i, n := range buckets {
+		cumulative += n
+		le := "+Inf"
+		if i < len(bounds) && i < len(buckets)-1 {
+			le = strconv.FormatFloat(bounds[i].Seconds(), 'g', -1, 64)
+		}
+		w.w.WriteString(name + "_bucket")
+		w.labels(labels, "le", le)
+		w.w.WriteString(" " + strconv.FormatUint(cumulative, 10) + "\n")
+	}
+	w.Sample(name+"_sum", labels, sum.Seconds())
+	w.Sample(name+"_count", labels, float64(count))
+}
+
+func (w *Writer) labels(labels Labels, extraName, extraValue string) {
+	if len(labels) == 0 && extraName == "" {
+		return
+	}
+	w.w.WriteByte('{')
+	sep := ""
+	for i := 0; i+1 < len(labels); i += 2 {
+		w.w.WriteString(sep + labels[i] + `="` + escaper.Replace(labels[i+1]) + `"`)
+		sep = ","
+	}
+	if extraName != "" {
+		w.w.WriteString(sep + extraName + `="` + extraValue + `"`)
+	}
+	w.w.WriteByte('}')
+}
+
+var escaper = strings.NewReplacer(`\`, `\\`, `"`, `\"`, "\n", `\n`)
+
+// Flush what was written
+func (w *Writer) Flush() error {
+	return w.w.Flush()
+}
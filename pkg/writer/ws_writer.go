@@ -1,12 +1,10 @@
 package writer
 
 import (
-	"fmt"
-
 	"github.com/gorilla/websocket"
 )
 
-// WSWriter wraps *websocket.Conn into io.Writer
+// WSWriter wraps *websocket.Conn into io.Writer, each Write is sent as one binary message
 type WSWriter struct {
 	c *websocket.Conn
 }
@@ -18,8 +16,10 @@ func NewWSWriter(c *websocket.Conn) *WSWriter {
 
 // Write implements io.Writer
 func (w *WSWriter) Write(bytes []byte) (int, error) {
-	fmt.Println("WSWriter called", len(bytes))
 	err := w.c.WriteMessage(websocket.BinaryMessage, bytes)
+	if err != nil {
+		return 0, err
+	}
 
-	return len(bytes), err
+	return len(bytes), nil
 }
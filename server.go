@@ -1,38 +1,77 @@
 package main
 
 import (
-	"bytes"
+	"flag"
 	"fmt"
 	"net/http"
 	_ "net/http/pprof"
 	"os"
 	"strconv"
+	"strings"
+	"time"
 
 	"github.com/gorilla/websocket"
+	"github.com/zhiqiangxu/avflow/cgo"
 	"github.com/zhiqiangxu/avflow/cmd"
+	"github.com/zhiqiangxu/avflow/pkg/dvr"
 	"github.com/zhiqiangxu/avflow/pkg/writer"
 	"github.com/zhiqiangxu/qrpc"
 )
 
 func main() {
+	var (
+		qrpcAddr    string
+		httpAddr    string
+		dvrConfig   dvr.Config
+		relayConfig cmd.RelayConfig
+		// renditions each publisher encodes at once
+		maxRenditions int
+	)
+	flag.StringVar(&qrpcAddr, "qrpc", "0.0.0.0:8888", "qrpc address")
+	flag.StringVar(&httpAddr, "http", "0.0.0.0:8080", "http address")
+	flag.StringVar(&dvrConfig.Dir, "dvr", "", "directory publishers asking to be recorded are recorded to, empty to disable")
+	flag.DurationVar(&dvrConfig.Retention, "dvr-retention", 24*time.Hour, "how long recordings are kept, 0 to keep them")
+	flag.StringVar(&relayConfig.Upstream, "relay", "", "qrpc address of an upstream avflow to pull streams not published here from, while they have viewers")
+	flag.StringVar(&relayConfig.ID, "relay-id", "", "id to authenticate to the upstream as, defaults to one of this host and process")
+	flag.StringVar(&relayConfig.Pass, "relay-pass", "", "pass to authenticate to the upstream with")
+	flag.IntVar(&maxRenditions, "max-renditions", 12, "renditions each publisher encodes at once, ladder rungs included, 0 for no limit")
+	flag.Parse()
+
+	cgo.SetMaxEncodedRenditions(maxRenditions)
+
 	handler := qrpc.NewServeMux()
 	playCmd := cmd.NewPlayCmd()
+	if dvrConfig.Dir != "" {
+		store, err := dvr.NewStore(dvrConfig)
+		if err != nil {
+			fmt.Println("dvr", err)
+			os.Exit(1)
+		}
+		playCmd.SetDVR(store)
+	}
+	if relayConfig.Upstream != "" {
+		if relayConfig.ID == "" {
+			host, _ := os.Hostname()
+			relayConfig.ID = fmt.Sprintf("relay-%s-%d", host, os.Getpid())
+		}
+		playCmd.SetRelay(relayConfig)
+	}
 
-	go startHTTP(playCmd)
+	go startHTTP(playCmd, httpAddr)
 
 	handler.Handle(cmd.Auth, cmd.NewAuthCmd())
 	handler.Handle(cmd.Play, playCmd)
 
 	bindings := []qrpc.ServerBinding{
-		qrpc.ServerBinding{Addr: "0.0.0.0:8888", Handler: handler, DefaultReadTimeout: 10 /*second*/}}
+		qrpc.ServerBinding{Addr: qrpcAddr, Handler: handler, DefaultReadTimeout: 10 /*second*/}}
 
 	qserver := qrpc.NewServer(bindings)
 	qserver.ListenAndServe()
 
 }
 
-func startHTTP(playCmd *cmd.PlayCmd) {
-	srv := &http.Server{Addr: "0.0.0.0:8080"}
+func startHTTP(playCmd *cmd.PlayCmd, addr string) {
+	srv := &http.Server{Addr: addr}
 	http.HandleFunc("/watch", func(w http.ResponseWriter, r *http.Request) {
 
 		who := r.URL.Query().Get("who")
@@ -40,16 +79,49 @@ func startHTTP(playCmd *cmd.PlayCmd) {
 			w.Write([]byte("please specify who"))
 			return
 		}
-		buf := &bytes.Buffer{}
-		err := playCmd.ReadLatestVideoFrame(who, "mjpeg", buf)
+		// optional thumbnail size, a missing one keeps the aspect ratio
+		width, _ := strconv.Atoi(r.URL.Query().Get("width"))
+		height, _ := strconv.Atoi(r.URL.Query().Get("height"))
+		snapshot, err := playCmd.ReadSnapshot(who, "mjpeg", width, height)
 		if err != nil {
 			w.Write([]byte(err.Error()))
 			return
 		}
 
+		w.Header().Set("ETag", snapshot.ETag)
+		w.Header().Set("Cache-Control", "no-cache")
+		if r.Header.Get("If-None-Match") == snapshot.ETag {
+			w.WriteHeader(http.StatusNotModified)
+			return
+		}
 		w.Header().Add("Content-Type", "image/jpeg")
-		w.Header().Add("Content-Length", strconv.Itoa(len(buf.Bytes())))
-		w.Write(buf.Bytes())
+		w.Header().Add("Content-Length", strconv.Itoa(len(snapshot.Data)))
+		w.Write(snapshot.Data)
+	})
+
+	// /hls/{who}/index.m3u8, segments and parts are relative to it
+	http.HandleFunc("/hls/", func(w http.ResponseWriter, r *http.Request) {
+		path := strings.TrimPrefix(r.URL.Path, "/hls/")
+		idx := strings.LastIndex(path, "/")
+		if idx <= 0 {
+			http.NotFound(w, r)
+			return
+		}
+
+		p, err := playCmd.HLS(path[:idx])
+		if err != nil {
+			http.Error(w, err.Error(), http.StatusNotFound)
+			return
+		}
+		p.Serve(w, r, path[idx+1:])
+	})
+
+	// Prometheus text format, per stream and per subscriber series are capped
+	http.HandleFunc("/metrics", func(w http.ResponseWriter, r *http.Request) {
+		w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+		if err := playCmd.WriteMetrics(w); err != nil {
+			fmt.Println("WriteMetrics", err)
+		}
 	})
 
 	http.HandleFunc("/static/", func(w http.ResponseWriter, r *http.Request) {
@@ -77,7 +149,38 @@ func startHTTP(playCmd *cmd.PlayCmd) {
 			return
 		}
 
-		fCtx, err := playCmd.SubcribeAVFrame(who, "mpegts", writer.NewWSWriter(c))
+		// timeshift plays the recording from that long ago, like 30s
+		if shift, _ := time.ParseDuration(r.URL.Query().Get("timeshift")); shift > 0 {
+			done := make(chan struct{})
+			go func() {
+				// the viewer closing is only noticed by reading
+				for {
+					if _, _, err := c.NextReader(); err != nil {
+						close(done)
+						return
+					}
+				}
+			}()
+			err = playCmd.PlayRecording(who, shift, writer.NewWSWriter(c), done)
+			fmt.Println("PlayRecording done", who, err)
+			c.Close()
+			return
+		}
+
+		// rung of the publisher's ladder, or auto to follow the viewer's throughput
+		opts := &cgo.SubscribeOptions{}
+		if rung := r.URL.Query().Get("rung"); rung == "auto" {
+			opts.Rung = cgo.RungAuto
+		} else {
+			opts.Rung, _ = strconv.Atoi(rung)
+		}
+		// codec=h264 serves low latency H.264 at an optional bitrate, in bits per second,
+		// snapped to one of the bitrates viewers share
+		if r.URL.Query().Get("codec") == "h264" {
+			bitrate, _ := strconv.ParseInt(r.URL.Query().Get("bitrate"), 10, 64)
+			opts.Encoder = cgo.LowLatencyH264(bitrate)
+		}
+		sub, err := playCmd.SubcribeAVFrame(who, "mpegts", writer.NewWSWriter(c), opts)
 		if err != nil {
 			fmt.Println("SubcribeAVFrame", err)
 			c.Close()
@@ -86,11 +189,11 @@ func startHTTP(playCmd *cmd.PlayCmd) {
 
 		select {
 		case <-r.Context().Done():
-			playCmd.UnsubcribeAVFrame(who, w)
-		case <-fCtx.Done():
+			sub.Close()
+		case <-sub.Done():
 		}
 
-		fmt.Println("SubcribeAVFrame done")
+		fmt.Println("SubcribeAVFrame done", sub.Err(), sub.Stats())
 		c.Close()
 	})
 	fmt.Println(srv.ListenAndServe())
@@ -2,35 +2,68 @@
 #include "libavutil/avassert.h"
 #include "libavutil/parseutils.h"
 #include "libavutil/opt.h"
+#include "libavutil/thread.h"
 #include "libavutil/time.h"
 
 #include "internal.h"
 #include "network.h"
 #include "os_support.h"
 #include "url.h"
-#if HAVE_POLL_H
-#include <poll.h>
-#endif
+#include <stdatomic.h>
 #include <stdbool.h>
 
 #include "qrpcpkt.h"
 
+typedef struct QrpcConnection QrpcConnection;
+
 typedef struct QrpcContext {
     const AVClass *class;
-    URLContext*   stream;
-    char*       payload;
-    int         payload_len;
-    int         offset;
+    URLContext*   stream; // of conn for publishers
+    QrpcConnection *conn; // publishers only
+    uint64_t    stream_id; // of the play request and the frames that follow
+    bool        acked; // the server said OK to the play request, publishers only
+    int         error; // the server refused the play request, publishers only
+    struct QrpcContext *next; // in conn->streams
+    int         payload_left; // of the packet being read, still on the socket
+    int         write_buffer_size;
     char        *id;
     char        *pass;
     char        *uri;
+    char        *name; // of the published stream, empty for the only one of a connection
     bool        publish;
+    bool        record; // ask the server to record the stream, publishers only
+    int64_t     timeshift_ms; // play the recording from that long ago, players only
+    QrpcBufferPool pool; // payloads read
 } QrpcContext;
 
+// publishers of one process with the same server and credentials share a connection,
+// each publishes on a stream of its own, so only the first one pays for connecting and authenticating
+struct QrpcConnection {
+    char        key[1024];
+    URLContext  *stream;
+    // the connection is unusable, written with lock held, read without when looking for a connection to join
+    atomic_int  error;
+    AVMutex     lock; // serializes frames written and responses read, guards everything below
+    QrpcContext *streams;
+    uint64_t    next_stream_id;
+    QrpcBufferPool pool; // responses
+    // the response being read, responses are read as they arrive without waiting for the rest
+    uint8_t     resp_hdr[QRPC_HEADER_SIZE];
+    int         resp_hdr_len;
+    QrpcPacket  resp; // payload allocated once the header is complete
+    int         resp_payload_read;
+    int         refs; // guarded by connections_lock
+    QrpcConnection *next; // guarded by connections_lock
+};
+
+static AVMutex connections_lock = AV_MUTEX_INITIALIZER;
+static QrpcConnection *connections;
+
 #define OFFSET(x) offsetof(QrpcContext, x)
 #define D AV_OPT_FLAG_DECODING_PARAM
 #define E AV_OPT_FLAG_ENCODING_PARAM
 static const AVOption options[] = {
+    { "write_buffer_size", "Coalesce writes up to this many bytes into one qrpc frame, 0 for the avio default", OFFSET(write_buffer_size), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, INT_MAX - 16, E },
     { NULL }
 };
 
@@ -45,16 +78,21 @@ static const AVClass qrpc_class = {
 
 static int qrpc_read_packet(QrpcContext *qctx, QrpcPacket *pkt)
 {
-    return ff_qrpc_packet_read(qctx->stream, pkt);
+    return ff_qrpc_packet_read(qctx->stream, &qctx->pool, pkt);
 }
 
-static int qrpc_send_packet(QrpcContext *qctx, QrpcPacket *pkt) 
+static int qrpc_send_packet(URLContext *stream, QrpcPacket *pkt) 
 {
-    int ret = ff_qrpc_packet_write(qctx->stream, pkt);
+    int ret = ff_qrpc_packet_write(stream, pkt);
     ff_qrpc_packet_destroy(pkt);
     return ret;
 }
 
+static bool is_ok(const QrpcPacket *pkt)
+{
+    return pkt->payload_len == 2 && pkt->payload[0] == 'O' && pkt->payload[1] == 'K';
+}
+
 static const char *json_escape_str(AVBPrint *dst, const char *src)
 {
     static const char json_escape[] = {'"', '\\', '\b', '\f', '\n', '\r', '\t', 0};
@@ -75,63 +113,312 @@ static const char *json_escape_str(AVBPrint *dst, const char *src)
     return dst->str;
 }
 
-/* return non zero if error */
-static int qrpc_open(URLContext *s, const char *uri, int flags)
+static int send_auth(URLContext *stream, const char *id, const char *pass)
 {
-    int port;
-    QrpcContext *qctx = s->priv_data;
-    qctx->payload = qctx->id = qctx->pass = NULL;
-    qctx->payload_len = qctx->offset = 0;
-    
-    const char *p;
-    char buf[1024];
+    QrpcPacket pkt;
     int ret;
-    char hostname[1024],proto[10], path[256];
+    if ((ret = ff_qrpc_packet_create(&pkt, NULL, QRPC_STREAM_AUTH, QRPC_CMD_AUTH, 0)) < 0)
+        return ret;
 
-    av_url_split(proto, sizeof(proto), NULL, 0, hostname, sizeof(hostname),
-        &port, path, sizeof(path), uri);
-    if (strcmp(proto, "qrpc"))
-        return AVERROR(EINVAL);
-    if (port <= 0 || port >= 65536) {
-        av_log(s, AV_LOG_ERROR, "Port missing in uri\n");
-        return AVERROR(EINVAL);
+    AVBPrint bp;
+    av_bprint_init(&bp, 1, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&bp,"{\"id\":\"");
+    json_escape_str(&bp, id);
+    av_bprintf(&bp,"\",\"pass\":\"");
+    json_escape_str(&bp, pass);
+    av_bprintf(&bp,"\"}");
+
+    char* json;
+    av_bprint_finalize(&bp, &json);
+    pkt.payload = json;
+    pkt.payload_len = bp.len;
+
+    return qrpc_send_packet(stream, &pkt);
+}
+
+static int send_play(URLContext *stream, QrpcContext *qctx)
+{
+    QrpcPacket pkt;
+    int ret;
+    if ((ret = ff_qrpc_packet_create(&pkt, NULL, qctx->stream_id, QRPC_CMD_PLAY, 0)) < 0)
+        return ret;
+    pkt.flags = QRPC_FLAG_STREAM;
+
+    AVBPrint bp;
+    av_bprint_init(&bp, 1, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&bp,"{\"publish\":%d", qctx->publish ? 1 : 0);
+    if (!qctx->publish) {
+        av_bprintf(&bp,",\"uri\":\"");
+        json_escape_str(&bp, qctx->uri);
+        av_bprintf(&bp,"\"");
+        if (qctx->timeshift_ms > 0)
+            av_bprintf(&bp,",\"timeshift_ms\":%"PRId64, qctx->timeshift_ms);
+    } else {
+        if (qctx->name[0]) {
+            av_bprintf(&bp,",\"stream\":\"");
+            json_escape_str(&bp, qctx->name);
+            av_bprintf(&bp,"\"");
+        }
+        if (qctx->record)
+            av_bprintf(&bp,",\"record\":true");
     }
-    p = strchr(uri, '?');
-    if (p) {
-        if (av_find_info_tag(buf, sizeof(buf), "id", p)) {
-            qctx->id = av_malloc(strlen(buf) + 1);
-            av_strlcpy(qctx->id, buf, strlen(buf) + 1);
-        } else {
-            av_log(s, AV_LOG_ERROR, "id missing in uri\n");
-            return AVERROR(EINVAL);
+    av_bprintf(&bp,"}");
+
+    char* json;
+    av_bprint_finalize(&bp, &json);
+    pkt.payload = json;
+    pkt.payload_len = bp.len;
+
+    return qrpc_send_packet(stream, &pkt);
+}
+
+// conn->stream waits with the interrupt callback and timeout of the publisher h using it,
+// which stays interruptible although the connection outlives it, caller holds conn->lock
+static void borrow_stream(QrpcConnection *conn, URLContext *h)
+{
+    conn->stream->interrupt_callback = h->interrupt_callback;
+    conn->stream->rw_timeout = h->rw_timeout;
+}
+
+static void return_stream(QrpcConnection *conn)
+{
+    conn->stream->interrupt_callback = (AVIOInterruptCB){ NULL, NULL };
+    conn->stream->rw_timeout = 0;
+}
+
+static void handle_response(QrpcConnection *conn, const QrpcPacket *pkt)
+{
+    if (pkt->stream_id == QRPC_STREAM_AUTH) {
+        if (!is_ok(pkt))
+            atomic_store(&conn->error, AVERROR(EACCES));
+        return;
+    }
+    for (QrpcContext *qctx = conn->streams; qctx; qctx = qctx->next) {
+        if (qctx->stream_id != pkt->stream_id)
+            continue;
+        // anything but the OK to the play request means the server gave up on the stream
+        if (!qctx->acked && is_ok(pkt) && !(pkt->flags & QRPC_FLAG_STREAM_RST))
+            qctx->acked = true;
+        else
+            qctx->error = AVERROR(ECONNREFUSED);
+        break;
+    }
+}
+
+// read what is available of a response, > 0 once it is complete, 0 if more has to arrive first
+static int read_response(QrpcConnection *conn)
+{
+    int ret;
+    while (conn->resp_hdr_len < QRPC_HEADER_SIZE) {
+        ret = ffurl_read(conn->stream, conn->resp_hdr + conn->resp_hdr_len, QRPC_HEADER_SIZE - conn->resp_hdr_len);
+        if (ret == AVERROR(EAGAIN))
+            return 0;
+        if (ret <= 0)
+            return ret ? ret : AVERROR_EOF;
+        conn->resp_hdr_len += ret;
+        if (conn->resp_hdr_len < QRPC_HEADER_SIZE)
+            continue;
+
+        QrpcPacket hdr;
+        if ((ret = ff_qrpc_packet_parse_header(conn->resp_hdr, &hdr)) < 0 ||
+            (ret = ff_qrpc_packet_create(&conn->resp, &conn->pool, hdr.stream_id, hdr.cmd, hdr.payload_len)) < 0)
+            return ret;
+        conn->resp.flags = hdr.flags;
+        conn->resp_payload_read = 0;
+    }
+
+    while (conn->resp_payload_read < conn->resp.payload_len) {
+        ret = ffurl_read(conn->stream, conn->resp.payload + conn->resp_payload_read,
+                         conn->resp.payload_len - conn->resp_payload_read);
+        if (ret == AVERROR(EAGAIN))
+            return 0;
+        if (ret <= 0)
+            return ret ? ret : AVERROR_EOF;
+        conn->resp_payload_read += ret;
+    }
+    return 1;
+}
+
+// handle the responses that already arrived on conn without blocking, a partial one is kept
+// for the next call, caller holds conn->lock
+static void poll_responses(QrpcConnection *conn)
+{
+    conn->stream->flags |= AVIO_FLAG_NONBLOCK;
+    while (!atomic_load(&conn->error)) {
+        int ret = read_response(conn);
+        if (ret < 0)
+            atomic_store(&conn->error, ret);
+        if (ret <= 0)
+            break;
+        handle_response(conn, &conn->resp);
+        ff_qrpc_packet_destroy(&conn->resp);
+        conn->resp_hdr_len = 0;
+    }
+    conn->stream->flags &= ~AVIO_FLAG_NONBLOCK;
+}
+
+static QrpcConnection *connect_publisher(URLContext *s, QrpcContext *qctx, const char *hostname, int port, int *ret)
+{
+    char buf[1024];
+    QrpcConnection *conn = av_mallocz(sizeof(QrpcConnection));
+    if (!conn) {
+        *ret = AVERROR(ENOMEM);
+        return NULL;
+    }
+    ff_mutex_init(&conn->lock, NULL);
+    atomic_init(&conn->error, 0);
+    conn->next_stream_id = QRPC_STREAM_PLAY;
+
+    ff_url_join(buf, sizeof(buf), "tcp", NULL, hostname, port, NULL);
+    // the interrupt callback belongs to whichever publisher came first and may go away before the connection,
+    // it is only used until the connection is set up, see borrow_stream
+    if ((*ret = ffurl_open_whitelist(&conn->stream, buf, AVIO_FLAG_READ_WRITE,
+                                     &s->interrupt_callback, NULL,
+                                     s->protocol_whitelist, s->protocol_blacklist, s)) < 0) {
+        av_log(s , AV_LOG_ERROR, "Cannot open connection %s\n", buf);
+        goto fail;
+    }
+    // the server authenticates before it looks at any play request, no need to wait for it
+    borrow_stream(conn, s);
+    *ret = send_auth(conn->stream, qctx->id, qctx->pass);
+    return_stream(conn);
+    if (*ret < 0)
+        goto fail;
+    return conn;
+
+fail:
+    ffurl_closep(&conn->stream);
+    ff_mutex_destroy(&conn->lock);
+    av_free(conn);
+    return NULL;
+}
+
+static void free_connection(QrpcConnection *conn)
+{
+    ffurl_closep(&conn->stream);
+    ff_qrpc_packet_destroy(&conn->resp);
+    ff_qrpc_buffer_pool_uninit(&conn->pool);
+    ff_mutex_destroy(&conn->lock);
+    av_free(conn);
+}
+
+// a usable connection for key with a reference taken, caller holds connections_lock
+static QrpcConnection *join_connection(const char *key)
+{
+    for (QrpcConnection *conn = connections; conn; conn = conn->next) {
+        // a stale error only fails the new stream on its first write
+        if (!strcmp(conn->key, key) && !atomic_load(&conn->error)) {
+            conn->refs++;
+            return conn;
         }
-        if (av_find_info_tag(buf, sizeof(buf), "pass", p)) {
-            qctx->pass = av_malloc(strlen(buf) + 1);
-            av_strlcpy(qctx->pass, buf, strlen(buf) + 1);
-        } else {
-            av_log(s, AV_LOG_ERROR, "pass missing in uri\n");
-            return AVERROR(EINVAL);
+    }
+    return NULL;
+}
+
+// join or open the connection of this server and credentials and start a stream on it
+static int open_publisher(URLContext *s, QrpcContext *qctx, const char *hostname, int port)
+{
+    char key[1024];
+    int ret = 0;
+    snprintf(key, sizeof(key), "%s:%d?id=%s&pass=%s", hostname, port, qctx->id, qctx->pass);
+
+    ff_mutex_lock(&connections_lock);
+    QrpcConnection *conn = join_connection(key);
+    ff_mutex_unlock(&connections_lock);
+
+    if (!conn) {
+        // connecting takes a round trip or more, publishers to other servers don't wait for it
+        QrpcConnection *fresh = connect_publisher(s, qctx, hostname, port, &ret);
+        if (!fresh)
+            return ret;
+        av_strlcpy(fresh->key, key, sizeof(fresh->key));
+
+        ff_mutex_lock(&connections_lock);
+        // another publisher may have connected to the same server meanwhile, only one connection is kept
+        if (!(conn = join_connection(key))) {
+            conn = fresh;
+            fresh = NULL;
+            conn->refs = 1;
+            conn->next = connections;
+            connections = conn;
         }
-        if (av_find_info_tag(buf, sizeof(buf), "mode", p)) {
-            qctx->publish = !strcmp(buf, "publish");
-        } else {
-            av_log(s, AV_LOG_ERROR, "mode missing in uri\n");
-            return AVERROR(EINVAL);
+        ff_mutex_unlock(&connections_lock);
+        if (fresh)
+            free_connection(fresh);
+    }
+
+    qctx->conn = conn;
+    qctx->stream = conn->stream;
+
+    ff_mutex_lock(&conn->lock);
+    qctx->stream_id = conn->next_stream_id;
+    conn->next_stream_id += 2;
+    qctx->next = conn->streams;
+    conn->streams = qctx;
+    // frames can follow right away, the OK is picked up by a later write
+    borrow_stream(conn, s);
+    if ((ret = send_play(conn->stream, qctx)) < 0)
+        atomic_store(&conn->error, ret);
+    return_stream(conn);
+    ff_mutex_unlock(&conn->lock);
+
+    return ret;
+}
+
+// end the stream of the publisher h and drop its reference of the connection
+static void close_publisher(URLContext *h)
+{
+    QrpcContext *qctx = h->priv_data;
+    QrpcConnection *conn = qctx->conn;
+    if (!conn)
+        return;
+
+    ff_mutex_lock(&conn->lock);
+    if (!atomic_load(&conn->error)) {
+        QrpcPacket pkt = {
+            .stream_id = qctx->stream_id,
+            .cmd       = QRPC_CMD_PLAY,
+            .flags     = QRPC_FLAG_STREAM | QRPC_FLAG_STREAM_END,
+        };
+        borrow_stream(conn, h);
+        int ret = ff_qrpc_packet_write(conn->stream, &pkt);
+        return_stream(conn);
+        if (ret < 0)
+            atomic_store(&conn->error, ret);
+    }
+    for (QrpcContext **p = &conn->streams; *p; p = &(*p)->next) {
+        if (*p == qctx) {
+            *p = qctx->next;
+            break;
         }
-        if (!qctx->publish) {
-            p = strchr(path, '?');
-            if (p == path) {
-                av_log(s, AV_LOG_ERROR, "uri missing for non-publisher\n");
-                return AVERROR(EINVAL);
+    }
+    ff_mutex_unlock(&conn->lock);
+
+    ff_mutex_lock(&connections_lock);
+    bool last = !--conn->refs;
+    if (last) {
+        for (QrpcConnection **p = &connections; *p; p = &(*p)->next) {
+            if (*p == conn) {
+                *p = conn->next;
+                break;
             }
-            qctx->uri = av_malloc(p - path + 1);
-            av_strlcpy(qctx->uri, path, p - path + 1);
         }
     }
-    
+    ff_mutex_unlock(&connections_lock);
 
-    ff_url_join(buf, sizeof(buf), "tcp", NULL, hostname, port, NULL);
+    if (last)
+        free_connection(conn);
+    qctx->conn = NULL;
+    qctx->stream = NULL;
+}
+
+// a player gets a connection of its own, auth and play are sent back to back before either answer is read
+static int open_player(URLContext *s, QrpcContext *qctx, const char *hostname, int port)
+{
+    char buf[1024];
+    int ret;
 
+    ff_url_join(buf, sizeof(buf), "tcp", NULL, hostname, port, NULL);
     if ((ret = ffurl_open_whitelist(&qctx->stream, buf, AVIO_FLAG_READ_WRITE,
                                     &s->interrupt_callback, NULL,
                                     s->protocol_whitelist, s->protocol_blacklist, s)) < 0) {
@@ -139,147 +426,186 @@ static int qrpc_open(URLContext *s, const char *uri, int flags)
         return ret;
     }
 
-    QrpcPacket pkt;
-    if ((ret = ff_qrpc_packet_create(&pkt, QRPC_STREAM_AUTH, QRPC_CMD_AUTH, 0)) < 0)
+    qctx->stream_id = QRPC_STREAM_PLAY;
+    if ((ret = send_auth(qctx->stream, qctx->id, qctx->pass)) < 0 ||
+        (ret = send_play(qctx->stream, qctx)) < 0)
         return ret;
 
-    {
-        AVBPrint bp;
-        av_bprint_init(&bp, 1, AV_BPRINT_SIZE_UNLIMITED);
-        av_bprintf(&bp,"{\"id\":\"");
-        json_escape_str(&bp, qctx->id);
-        av_bprintf(&bp,"\",\"pass\":\"");
-        json_escape_str(&bp, qctx->pass);
-        av_bprintf(&bp,"\"}");
-        
-        char* json;
-        av_bprint_finalize(&bp, &json);
-        pkt.payload = json;
-        pkt.payload_len = bp.len;
+    // the server answers auth before it handles play
+    QrpcPacket pkt;
+    for (int i = 0; i < 2; i++) {
+        if ((ret = qrpc_read_packet(qctx, &pkt)) < 0)
+            return ret;
+        if (!is_ok(&pkt))
+            ret = AVERROR_INVALIDDATA;
+        ff_qrpc_packet_destroy(&pkt);
+        if (ret < 0)
+            return ret;
     }
-    
+    return 0;
+}
 
-    if ((ret = qrpc_send_packet(qctx, &pkt)) < 0)
-        return ret;
+static int qrpc_close(URLContext *h);
 
-    if ((ret = qrpc_read_packet(qctx, &pkt)) < 0)
-        return ret;
-    
-    if (!(pkt.payload_len == 2 && pkt.payload[0] == 'O' && pkt.payload[1] == 'K'))
-        ret = AVERROR_INVALIDDATA;
+/* return non zero if error */
+static int qrpc_open(URLContext *s, const char *uri, int flags)
+{
+    int port;
+    QrpcContext *qctx = s->priv_data;
+    qctx->id = qctx->pass = NULL;
+    qctx->payload_left = 0;
+    // avio sizes its buffer after this, so each write it flushes becomes a single frame
+    if (qctx->write_buffer_size)
+        s->max_packet_size = qctx->write_buffer_size;
     
-    printf("qrpc_open:ret = %d, len = %d\n", ret, pkt.payload_len);
-    ff_qrpc_packet_destroy(&pkt);
-
-    if ((ret = ff_qrpc_packet_create(&pkt, QRPC_STREAM_PLAY, QRPC_CMD_PLAY, 0)) < 0)
-        return ret;
+    const char *p;
+    char buf[1024];
+    char hostname[1024],proto[10], path[256];
 
-    
-    {
-        AVBPrint bp;
-        av_bprint_init(&bp, 1, AV_BPRINT_SIZE_UNLIMITED);
-        av_bprintf(&bp,"{\"publish\":%d", qctx->publish ? 1 : 0);
-        if (!qctx->publish) {
-            av_bprintf(&bp,",\"uri\":\"");
-            json_escape_str(&bp, qctx->uri);
-            av_bprintf(&bp,"\"");
-        }
-        av_bprintf(&bp,"}");
-        
-        char* json;
-        av_bprint_finalize(&bp, &json);
-        pkt.payload = json;
-        pkt.payload_len = bp.len;
+    av_url_split(proto, sizeof(proto), NULL, 0, hostname, sizeof(hostname),
+        &port, path, sizeof(path), uri);
+    if (strcmp(proto, "qrpc"))
+        return AVERROR(EINVAL);
+    if (port <= 0 || port >= 65536) {
+        av_log(s, AV_LOG_ERROR, "Port missing in uri\n");
+        return AVERROR(EINVAL);
     }
-
-    if ((ret = qrpc_send_packet(qctx, &pkt)) < 0)
-        return ret;
-
-    if ((ret = qrpc_read_packet(qctx, &pkt)) < 0)
+    p = strchr(uri, '?');
+    if (!p) {
+        av_log(s, AV_LOG_ERROR, "id, pass and mode missing in uri\n");
+        return AVERROR(EINVAL);
+    }
+    if (av_find_info_tag(buf, sizeof(buf), "id", p)) {
+        qctx->id = av_strdup(buf);
+    } else {
+        av_log(s, AV_LOG_ERROR, "id missing in uri\n");
+        return AVERROR(EINVAL);
+    }
+    if (av_find_info_tag(buf, sizeof(buf), "pass", p)) {
+        qctx->pass = av_strdup(buf);
+    } else {
+        av_log(s, AV_LOG_ERROR, "pass missing in uri\n");
+        return AVERROR(EINVAL);
+    }
+    if (av_find_info_tag(buf, sizeof(buf), "mode", p)) {
+        qctx->publish = !strcmp(buf, "publish");
+    } else {
+        av_log(s, AV_LOG_ERROR, "mode missing in uri\n");
+        return AVERROR(EINVAL);
+    }
+    // optional, record=1 for publishers, timeshift=<ms> for players
+    if (av_find_info_tag(buf, sizeof(buf), "record", p))
+        qctx->record = atoi(buf) != 0;
+    if (av_find_info_tag(buf, sizeof(buf), "timeshift", p))
+        qctx->timeshift_ms = strtoll(buf, NULL, 10);
+    if (!qctx->id || !qctx->pass)
+        return AVERROR(ENOMEM);
+
+    // path is what comes after the port, up to the query
+    p = strchr(path, '?');
+    int path_len = p ? p - path : strlen(path);
+    if (!qctx->publish) {
+        if (!path_len) {
+            av_log(s, AV_LOG_ERROR, "uri missing for non-publisher\n");
+            return AVERROR(EINVAL);
+        }
+        if (!(qctx->uri = av_strndup(path, path_len)))
+            return AVERROR(ENOMEM);
+        int ret = open_player(s, qctx, hostname, port);
+        // url_close is only called for protocols that opened
+        if (ret < 0)
+            qrpc_close(s);
         return ret;
-    
-    if (!(pkt.payload_len == 2 && pkt.payload[0] == 'O' && pkt.payload[1] == 'K'))
-        ret = AVERROR_INVALIDDATA;
-
-    ff_qrpc_packet_destroy(&pkt);    
+    }
 
+    // qrpc://host:port/name?... publishes stream name, several names can share a connection
+    const char *name = path;
+    while (path_len && *name == '/') {
+        name++;
+        path_len--;
+    }
+    if (!(qctx->name = av_strndup(name, path_len)))
+        return AVERROR(ENOMEM);
+    int ret = open_publisher(s, qctx, hostname, port);
+    if (ret < 0)
+        qrpc_close(s);
     return ret;
 }
 
 
+// payloads are read straight into buf, a payload larger than buf is returned over several calls
 static int qrpc_read(URLContext *h, uint8_t *buf, int size)
 {
     QrpcContext *qctx = h->priv_data;
     int ret;
 
-    QrpcPacket pkt;
-    int offset = 0;
-    while (true) {
-
-        int remain = size - offset;
-
-        if (qctx->payload) {
-            int last_remain = qctx->payload_len - qctx->offset;
-            if (last_remain <= remain) {
-                memcpy(buf+offset, qctx->payload+qctx->offset, last_remain);
-                offset += last_remain;
-                av_free(qctx->payload);
-                qctx->payload = NULL;
-                qctx->payload_len = qctx->offset = 0;
-            } else {
-                memcpy(buf+offset, qctx->payload+qctx->offset, remain);
-                offset += remain;
-                qctx->offset += remain;
-            }
-
-            if (offset == size) return size;
+    // responses on a shared connection are consumed by writes
+    if (qctx->conn)
+        return AVERROR(ENOSYS);
 
-            remain = size - offset;
-        }
-
-        ret = qrpc_read_packet(qctx, &pkt);
-        if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "qrpc_read_packet error:%d\n", ret);
+    while (!qctx->payload_left) {
+        QrpcPacket pkt;
+        if ((ret = ff_qrpc_packet_read_header(qctx->stream, &pkt)) < 0) {
+            av_log(h, AV_LOG_ERROR, "qrpc_read_packet error:%d\n", ret);
             return ret;
         }
-        
-        if (pkt.payload_len <= remain) {
-            memcpy(buf+offset, pkt.payload, pkt.payload_len);
-            offset += pkt.payload_len;
-            ff_qrpc_packet_destroy(&pkt);
-        } else {
-            memcpy(buf+offset, pkt.payload, remain);
-            offset += remain;
-            qctx->payload = pkt.payload;
-            qctx->payload_len = pkt.payload_len;
-            qctx->offset = remain;
-            pkt.payload = NULL;
-        }
-
-        if (offset == size) return size;
+        qctx->payload_left = pkt.payload_len;
     }
-    
+
+    ret = ffurl_read(qctx->stream, buf, FFMIN(size, qctx->payload_left));
+    if (ret > 0)
+        qctx->payload_left -= ret;
+    return ret == 0 ? AVERROR_EOF : ret;
 }
 
 static int qrpc_write(URLContext *h, const uint8_t *buf, int size)
 {
     QrpcContext *qctx = h->priv_data;
-    QrpcPacket pkt;
-    int ret;
-    if ((ret = ff_qrpc_packet_create(&pkt, QRPC_STREAM_PLAY, QRPC_CMD_PLAY, size)) < 0)
-        return ret;
+    // buf is only read, no need to copy it into a payload of our own
+    QrpcPacket pkt = {
+        .stream_id   = qctx->stream_id,
+        .cmd         = QRPC_CMD_PLAY,
+        .flags       = QRPC_FLAG_STREAM,
+        .payload     = (char *)buf,
+        .payload_len = size,
+    };
+    QrpcConnection *conn = qctx->conn;
+    if (!conn) {
+        int ret = ff_qrpc_packet_write(qctx->stream, &pkt);
+        return ret < 0 ? ret : size;
+    }
 
-    memcpy(pkt.payload, buf, size);
-    return qrpc_send_packet(qctx, &pkt);
+    ff_mutex_lock(&conn->lock);
+    // a stalled server holds up this publisher only as long as it lets itself be held up
+    borrow_stream(conn, h);
+    poll_responses(conn);
+    int ret = atomic_load(&conn->error);
+    if (!ret)
+        ret = qctx->error;
+    // a frame cut short leaves the connection out of sync for every stream on it
+    if (!ret && (ret = ff_qrpc_packet_write(conn->stream, &pkt)) < 0)
+        atomic_store(&conn->error, ret);
+    return_stream(conn);
+    ff_mutex_unlock(&conn->lock);
+    return ret < 0 ? ret : size;
 }
 
 static int qrpc_close(URLContext *h)
 {
     QrpcContext *qctx = h->priv_data;
-    if (qctx->id) av_free(qctx->id);
-    if (qctx->pass) av_free(qctx->pass);
-
-    return ffurl_close(qctx->stream);
+    av_freep(&qctx->id);
+    av_freep(&qctx->pass);
+    av_freep(&qctx->uri);
+    av_freep(&qctx->name);
+    av_log(h, AV_LOG_VERBOSE, "payload buffers: %"PRIu64" allocated, %"PRIu64" reused\n",
+           qctx->pool.allocs, qctx->pool.reuses);
+    ff_qrpc_buffer_pool_uninit(&qctx->pool);
+
+    if (qctx->conn) {
+        close_publisher(h);
+        return 0;
+    }
+    return ffurl_closep(&qctx->stream);
 }
 
 
@@ -2,19 +2,67 @@
 #include "libavutil/avstring.h"
 #include "libavutil/intfloat.h"
 #include "avformat.h"
+#include "network.h"
+#if !defined(_WIN32)
+#include <sys/uio.h>
+#endif
 
 #include "qrpcpkt.h"
 
-int ff_qrpc_packet_create(QrpcPacket* pkt, QrpcStream stream_id, QrpcCmd cmd, int payload_len) 
+// size class of size, QRPC_BUFFER_CLASSES if it is too large to be pooled
+static int buffer_class(int size)
 {
+    int c = 0;
+    while (c < QRPC_BUFFER_CLASSES && (1 << (c + QRPC_BUFFER_MIN_SHIFT)) < size)
+        c++;
+    return c;
+}
+
+char *ff_qrpc_buffer_get(QrpcBufferPool *pool, int size)
+{
+    int c = buffer_class(size);
+    if (c == QRPC_BUFFER_CLASSES)
+        return av_malloc(size);
+
+    if (pool->nb_free[c]) {
+        pool->reuses++;
+        return pool->free[c][--pool->nb_free[c]];
+    }
+    pool->allocs++;
+    return av_malloc(1 << (c + QRPC_BUFFER_MIN_SHIFT));
+}
+
+void ff_qrpc_buffer_put(QrpcBufferPool *pool, char *buf, int size)
+{
+    int c = buffer_class(size);
+    if (c < QRPC_BUFFER_CLASSES && pool->nb_free[c] < QRPC_BUFFERS_PER_CLASS) {
+        pool->free[c][pool->nb_free[c]++] = buf;
+        return;
+    }
+    av_free(buf);
+}
+
+void ff_qrpc_buffer_pool_uninit(QrpcBufferPool *pool)
+{
+    for (int c = 0; c < QRPC_BUFFER_CLASSES; c++) {
+        while (pool->nb_free[c])
+            av_freep(&pool->free[c][--pool->nb_free[c]]);
+    }
+}
+
+int ff_qrpc_packet_create(QrpcPacket* pkt, QrpcBufferPool *pool, uint64_t stream_id, QrpcCmd cmd, int payload_len) 
+{
+    pkt->payload = NULL;
+    pkt->pool = pool;
     if (payload_len) {
-        pkt->payload = av_realloc(NULL, payload_len);
+        pkt->payload = pool ? ff_qrpc_buffer_get(pool, payload_len) : av_malloc(payload_len);
         if (!pkt->payload)
             return AVERROR(ENOMEM);
     }
 
     pkt->stream_id = stream_id;
     pkt->cmd = cmd;
+    pkt->flags = 0;
     pkt->payload_len = payload_len;
 
 
@@ -25,50 +73,119 @@ void ff_qrpc_packet_destroy(QrpcPacket *pkt)
 {
     if (!pkt)
         return;
-    av_freep(&pkt->payload);
+    if (pkt->pool && pkt->payload)
+        ff_qrpc_buffer_put(pkt->pool, pkt->payload, pkt->payload_len);
+    else
+        av_free(pkt->payload);
+    pkt->payload = NULL;
     pkt->payload_len = 0;
 }
 
+#if !defined(_WIN32)
+// write both buffers to the socket under h, in a single syscall unless the socket is full
+static int write_vectored(URLContext *h, const uint8_t *hdr, int hdr_len, const uint8_t *payload, int payload_len)
+{
+    int fd = ffurl_get_file_handle(h);
+    if (fd < 0)
+        return AVERROR(ENOSYS);
+
+    struct iovec iov[2] = {
+        { .iov_base = (void *)hdr,     .iov_len = hdr_len },
+        { .iov_base = (void *)payload, .iov_len = payload_len },
+    };
+    struct iovec *v = iov;
+    int iovcnt = payload_len ? 2 : 1;
+    while (iovcnt) {
+        int ret = ff_network_wait_fd_timeout(fd, 1, h->rw_timeout, &h->interrupt_callback);
+        if (ret)
+            return ret;
+        ssize_t n = writev(fd, v, iovcnt);
+        if (n < 0) {
+            ret = ff_neterrno();
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR(EINTR))
+                continue;
+            return ret;
+        }
+        while (iovcnt && (size_t)n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            v->iov_base = (uint8_t *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return 0;
+}
+#endif
+
 int ff_qrpc_packet_write(URLContext *h, QrpcPacket *pkt)
 {
-    uint8_t pkt_hdr[16], *p = pkt_hdr;
+    uint8_t pkt_hdr[QRPC_HEADER_SIZE], *p = pkt_hdr;
     int ret;
 
     unsigned int size = 12 + pkt->payload_len;
 
     bytestream_put_be32(&p, size);
     bytestream_put_be64(&p, pkt->stream_id);
-    unsigned int cmdflags = pkt->cmd;
-    if (pkt->stream_id == QRPC_STREAM_PLAY) {
-        cmdflags |= 1 << 24;
-    }
+    unsigned int cmdflags = pkt->cmd | (unsigned int)pkt->flags << 24;
     bytestream_put_be32(&p, cmdflags);
 
-    if ((ret = ffurl_write(h, pkt_hdr, sizeof(pkt_hdr))) < 0)
+#if !defined(_WIN32)
+    // header and payload leave in one segment, so Nagle never holds back the payload
+    ret = write_vectored(h, pkt_hdr, sizeof(pkt_hdr), pkt->payload, pkt->payload_len);
+    if (ret != AVERROR(ENOSYS))
         return ret;
+#endif
 
-    return ffurl_write(h, pkt->payload, pkt->payload_len);
-    
+    if ((ret = ffurl_write(h, pkt_hdr, sizeof(pkt_hdr))) < 0)
+        return ret;
+    if (pkt->payload_len && (ret = ffurl_write(h, pkt->payload, pkt->payload_len)) < 0)
+        return ret;
+    return 0;
 }
 
-int ff_qrpc_packet_read(URLContext *h, QrpcPacket *pkt)
+int ff_qrpc_packet_read_header(URLContext *h, QrpcPacket *pkt)
 {
-    uint8_t pkt_hdr[16];
-    const uint8_t *p = pkt_hdr;
+    uint8_t pkt_hdr[QRPC_HEADER_SIZE];
     int ret;
 
     if ((ret = ffurl_read_complete(h, pkt_hdr, sizeof(pkt_hdr))) != sizeof(pkt_hdr))
-        return ret;
-    
+        return ret < 0 ? ret : AVERROR_EOF;
+    return ff_qrpc_packet_parse_header(pkt_hdr, pkt);
+}
+
+int ff_qrpc_packet_parse_header(const uint8_t *hdr, QrpcPacket *pkt)
+{
+    const uint8_t *p = hdr;
     unsigned int size = bytestream_get_be32(&p);
-    if (size < 12) {
+    if (size < 12 || size - 12 > INT_MAX) {
         return AVERROR_INVALIDDATA;
     }
-    uint64_t stream_id = bytestream_get_be64(&p);
-    unsigned int cmd = bytestream_get_be32(&p) & 0xffffff;
-    
-    int payload_len = size-12;
-    if ((ret = ff_qrpc_packet_create(pkt, stream_id, cmd, payload_len)) < 0)
+    pkt->stream_id = bytestream_get_be64(&p);
+    unsigned int cmdflags = bytestream_get_be32(&p);
+    pkt->cmd = cmdflags & 0xffffff;
+    pkt->flags = cmdflags >> 24;
+    pkt->payload = NULL;
+    pkt->payload_len = size - 12;
+    pkt->pool = NULL;
+
+    return 0;
+}
+
+int ff_qrpc_packet_read(URLContext *h, QrpcBufferPool *pool, QrpcPacket *pkt)
+{
+    int ret;
+
+    if ((ret = ff_qrpc_packet_read_header(h, pkt)) < 0)
+        return ret;
+
+    uint64_t stream_id = pkt->stream_id;
+    QrpcCmd cmd = pkt->cmd;
+    int flags = pkt->flags;
+    int payload_len = pkt->payload_len;
+    if ((ret = ff_qrpc_packet_create(pkt, pool, stream_id, cmd, payload_len)) < 0)
         return ret;
 
     if (ffurl_read_complete(h, pkt->payload, payload_len) != payload_len) {
@@ -78,6 +195,7 @@ int ff_qrpc_packet_read(URLContext *h, QrpcPacket *pkt)
 
     pkt->stream_id = stream_id;
     pkt->cmd = cmd;
+    pkt->flags = flags;
     pkt->payload_len = payload_len;
 
     return 0;
@@ -6,28 +6,68 @@
 #include "url.h"
 
 
+// stream ids of a connection, further play streams take the odd ids after QRPC_STREAM_PLAY
 typedef enum QrpcStream {
     QRPC_STREAM_AUTH  =  1,
     QRPC_STREAM_PLAY  =  3,
 } QrpcStream;
 
+// size, stream id and cmdflags, big endian
+#define QRPC_HEADER_SIZE        16
+
+// frame flags, the top byte of cmdflags
+#define QRPC_FLAG_STREAM        1
+#define QRPC_FLAG_STREAM_END    2
+#define QRPC_FLAG_STREAM_RST    4
+
 typedef enum QrpcCmd {
     QRPC_CMD_AUTH   =  1,
     QRPC_CMD_PLAY   =  3,
 } QrpcCmd;
 
+// payloads are pooled in power of two size classes from 1 << QRPC_BUFFER_MIN_SHIFT,
+// larger ones are allocated and freed every time
+#define QRPC_BUFFER_MIN_SHIFT   8
+#define QRPC_BUFFER_CLASSES     16
+#define QRPC_BUFFERS_PER_CLASS  4
+
+// payload buffers of one connection, not thread safe
+typedef struct QrpcBufferPool {
+    char        *free[QRPC_BUFFER_CLASSES][QRPC_BUFFERS_PER_CLASS];
+    int         nb_free[QRPC_BUFFER_CLASSES];
+    uint64_t    allocs; // buffers that had to be allocated
+    uint64_t    reuses;
+} QrpcBufferPool;
+
 typedef struct QrpcPacket {
-    QrpcStream    stream_id;
+    uint64_t    stream_id;
 	QrpcCmd     cmd;
+    int         flags; // QRPC_FLAG_*
 	char*       payload;
     int         payload_len;
+    QrpcBufferPool *pool; // payload goes back to it, NULL if payload was av_malloc'ed
 } QrpcPacket;
 
-int ff_qrpc_packet_create(QrpcPacket* pkt, QrpcStream stream_id, QrpcCmd cmd, int size);
+char *ff_qrpc_buffer_get(QrpcBufferPool *pool, int size);
+
+// size must be what buf was got with
+void ff_qrpc_buffer_put(QrpcBufferPool *pool, char *buf, int size);
+
+void ff_qrpc_buffer_pool_uninit(QrpcBufferPool *pool);
+
+// pool can be NULL
+int ff_qrpc_packet_create(QrpcPacket* pkt, QrpcBufferPool *pool, uint64_t stream_id, QrpcCmd cmd, int size);
 
 void ff_qrpc_packet_destroy(QrpcPacket *pkt);
 
+// returns 0 once header and payload are written
 int ff_qrpc_packet_write(URLContext *h, QrpcPacket *p);
 
-int ff_qrpc_packet_read(URLContext *h, QrpcPacket *p);
+// the payload is left unread, p->payload is NULL and p->payload_len is how much of it follows
+int ff_qrpc_packet_read_header(URLContext *h, QrpcPacket *p);
+
+// like ff_qrpc_packet_read_header, for a header of QRPC_HEADER_SIZE bytes read by the caller
+int ff_qrpc_packet_parse_header(const uint8_t *hdr, QrpcPacket *p);
+
+int ff_qrpc_packet_read(URLContext *h, QrpcBufferPool *pool, QrpcPacket *p);
 #endif
\ No newline at end of file
@@ -0,0 +1,129 @@
+package main
+
+import (
+	"bytes"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"os/exec"
+	"path/filepath"
+)
+
+// accessUnit is one H.264 frame in annex b, starting with its access unit delimiter
+type accessUnit struct {
+	data     []byte
+	audLen   int // the timestamp SEI goes right after it
+	keyframe bool
+}
+
+// clipConfig of the generated test pattern, the same config always yields the same clip
+type clipConfig struct {
+	ffmpeg  string
+	width   int
+	height  int
+	fps     int
+	seconds int
+	bitrate int
+}
+
+// generateClip encodes a test pattern into an annex b file under dir, deterministic
+// since it uses a single encoder thread and no B-frames, which also keeps pts == dts
+func generateClip(c clipConfig, dir string) (string, error) {
+	path := filepath.Join(dir, fmt.Sprintf("testsrc2_%dx%d_%d_%ds_%dk.h264", c.width, c.height, c.fps, c.seconds, c.bitrate/1000))
+	if _, err := os.Stat(path); err == nil {
+		return path, nil
+	}
+
+	args := []string{"-hide_banner", "-loglevel", "error", "-y",
+		"-f", "lavfi", "-i", fmt.Sprintf("testsrc2=size=%dx%d:rate=%d", c.width, c.height, c.fps),
+		"-t", fmt.Sprint(c.seconds),
+		"-c:v", "libx264", "-preset", "veryfast", "-tune", "zerolatency", "-threads", "1",
+		"-g", fmt.Sprint(c.fps), "-bf", "0", "-pix_fmt", "yuv420p",
+		"-b:v", fmt.Sprint(c.bitrate), "-maxrate", fmt.Sprint(c.bitrate), "-bufsize", fmt.Sprint(c.bitrate),
+		"-bsf:v", "h264_metadata=aud=insert",
+		"-f", "h264", path + ".tmp"}
+	cmd := exec.Command(c.ffmpeg, args...)
+	cmd.Stdout = os.Stdout
+	cmd.Stderr = os.Stderr
+	if err := cmd.Run(); err != nil {
+		return "", fmt.Errorf("%s: %v", c.ffmpeg, err)
+	}
+	return path, os.Rename(path+".tmp", path)
+}
+
+// loadClip splits an annex b file into access units, it must have access unit delimiters
+func loadClip(path string) ([]accessUnit, error) {
+	data, err := ioutil.ReadFile(path)
+	if err != nil {
+		return nil, err
+	}
+
+	var aus []accessUnit
+	forEachNAL(data, func(start, end int) {
+		nal := data[start:end]
+		if len(nal) <= nalHeaderOffset(nal) {
+			return
+		}
+		if nal[nalHeaderOffset(nal)]&0x1f == nalAUD {
+			aus = append(aus, accessUnit{audLen: len(nal)})
+		}
+		if len(aus) == 0 {
+			return
+		}
+		cur := &aus[len(aus)-1]
+		if nal[nalHeaderOffset(nal)]&0x1f == nalIDR {
+			cur.keyframe = true
+		}
+		cur.data = append(cur.data, nal...)
+	})
+	if len(aus) == 0 {
+		return nil, fmt.Errorf("%s: no access unit delimiters", path)
+	}
+	if !aus[0].keyframe {
+		return nil, fmt.Errorf("%s: doesn't start with a keyframe", path)
+	}
+	return aus, nil
+}
+
+const (
+	nalIDR = 5
+	nalSEI = 6
+	nalAUD = 9
+)
+
+var startCode = []byte{0, 0, 1}
+
+// forEachNAL calls f with the bounds of every NAL unit of b, start codes included
+func forEachNAL(b []byte, f func(start, end int)) {
+	start := bytes.Index(b, startCode)
+	if start < 0 {
+		return
+	}
+	if start > 0 && b[start-1] == 0 {
+		start--
+	}
+	for start < len(b) {
+		payload := start + 3
+		if b[start+2] == 0 {
+			payload++
+		}
+		next := bytes.Index(b[payload:], startCode)
+		end := len(b)
+		if next >= 0 {
+			end = payload + next
+			if b[end-1] == 0 {
+				end--
+			}
+		}
+		f(start, end)
+		start = end
+	}
+}
+
+// nalHeaderOffset skips the start code of a NAL unit
+func nalHeaderOffset(nal []byte) int {
+	if nal[2] == 1 {
+		return 3
+	}
+	return 4
+}
@@ -0,0 +1,334 @@
+// avbench loads a local avflow server with synthetic publishers and viewers
+// and reports ingest fps, glass-to-glass latency, server cpu per viewer, rss and drops.
+//
+// Publishers push a generated test pattern over qrpc, each frame carrying its sequence
+// number and the wall clock it was sent at in a SEI, which viewers read back from the
+// mpegts they get, so latency is only measured for renditions that pass the publisher's
+// H.264 through; snapshot viewers measure response time instead.
+//
+// With -edge-qrpc and -edge-http viewers play from an edge relaying the server instead,
+// and the run fails unless every kind of viewer got frames through it.
+package main
+
+import (
+	"context"
+	"encoding/json"
+	"flag"
+	"fmt"
+	"io/ioutil"
+	"net"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Config of a run, part of the report so a baseline records what it measured
+type Config struct {
+	Publishers      int     `json:"publishers"`
+	QrpcViewers     int     `json:"qrpc_viewers"` // per publisher, as are the other viewers
+	WSViewers       int     `json:"ws_viewers"`
+	SnapshotViewers int     `json:"snapshot_viewers"`
+	SnapshotEvery   float64 `json:"snapshot_every_sec"`
+	DurationSec     float64 `json:"duration_sec"`
+	WarmupSec       float64 `json:"warmup_sec"`
+	Clip            string  `json:"clip"`
+	Width           int     `json:"width"`
+	Height          int     `json:"height"`
+	FPS             int     `json:"fps"`
+	Bitrate         int     `json:"bitrate"`
+	Reproducible    bool    `json:"reproducible"`
+	Edge            bool    `json:"edge"` // viewers played from an edge
+}
+
+// what -reproducible pins, so runs on different machines or days compare
+var reproducible = Config{Width: 640, Height: 360, FPS: 25, Bitrate: 1000000}
+
+const (
+	clipSeconds = 10
+	// between viewer starts in reproducible mode
+	staggerDelay = 10 * time.Millisecond
+	// for publishers to go live before viewers start
+	settleDelay = 2 * time.Second
+)
+
+func main() {
+	var (
+		c             Config
+		qrpcAddr      string
+		httpAddr      string
+		ffmpeg        string
+		cacheDir      string
+		server        string
+		edge          string
+		edgeQrpc      string
+		edgeHTTP      string
+		pid           int
+		jsonOut       string
+		baselinePath  string
+		tolerance     float64
+		duration      time.Duration
+		warmup        time.Duration
+		snapshotEvery time.Duration
+	)
+	flag.IntVar(&c.Publishers, "publishers", 1, "number of publishers")
+	flag.IntVar(&c.QrpcViewers, "qrpc-viewers", 1, "qrpc viewers per publisher")
+	flag.IntVar(&c.WSViewers, "ws-viewers", 1, "/watch_mpegts websocket viewers per publisher")
+	flag.IntVar(&c.SnapshotViewers, "snapshot-viewers", 0, "/watch snapshot viewers per publisher")
+	flag.DurationVar(&snapshotEvery, "snapshot-every", time.Second, "snapshot interval of a snapshot viewer")
+	flag.DurationVar(&duration, "duration", 30*time.Second, "measured duration")
+	flag.DurationVar(&warmup, "warmup", 5*time.Second, "duration before measuring, samples are discarded")
+	flag.StringVar(&c.Clip, "clip", "", "annex b H.264 with access unit delimiters to publish, instead of a generated test pattern")
+	flag.IntVar(&c.Width, "width", reproducible.Width, "test pattern width")
+	flag.IntVar(&c.Height, "height", reproducible.Height, "test pattern height")
+	flag.IntVar(&c.FPS, "fps", reproducible.FPS, "frame rate")
+	flag.IntVar(&c.Bitrate, "bitrate", reproducible.Bitrate, "test pattern bitrate")
+	flag.BoolVar(&c.Reproducible, "reproducible", false, "pin the test pattern, start viewers in a fixed order and write -json, for release gating")
+	flag.StringVar(&qrpcAddr, "qrpc", "127.0.0.1:8888", "qrpc address of the server")
+	flag.StringVar(&httpAddr, "http", "127.0.0.1:8080", "http address of the server")
+	flag.StringVar(&ffmpeg, "ffmpeg", "third_party/ffmpeg/build/bin/ffmpeg", "ffmpeg with libx264, to generate the test pattern")
+	flag.StringVar(&cacheDir, "cache", filepath.Join(os.TempDir(), "avbench"), "where generated test patterns are kept")
+	flag.StringVar(&server, "server", "", "server command to start, and measure, for the run")
+	flag.StringVar(&edge, "edge", "", "edge server command to start, and measure instead of the server, for the run")
+	flag.StringVar(&edgeQrpc, "edge-qrpc", "", "qrpc address of an edge relaying the server, viewers play from it")
+	flag.StringVar(&edgeHTTP, "edge-http", "", "http address of the edge")
+	flag.IntVar(&pid, "pid", 0, "pid of a running server to measure")
+	flag.StringVar(&jsonOut, "json", "", "write the report as json to this file")
+	flag.StringVar(&baselinePath, "baseline", "", "json report to compare with, exits 1 on a regression")
+	flag.Float64Var(&tolerance, "tolerance", 0.2, "relative regression allowed against -baseline")
+	flag.Parse()
+
+	if c.Reproducible {
+		c.Clip, c.Width, c.Height, c.FPS, c.Bitrate = "", reproducible.Width, reproducible.Height, reproducible.FPS, reproducible.Bitrate
+		if jsonOut == "" {
+			jsonOut = "avbench.json"
+		}
+	}
+	c.SnapshotEvery, c.DurationSec, c.WarmupSec = snapshotEvery.Seconds(), duration.Seconds(), warmup.Seconds()
+	if c.Publishers <= 0 || c.FPS <= 0 || duration <= 0 {
+		fatalf("publishers, fps and duration must be positive")
+	}
+	c.Edge = edgeQrpc != "" || edgeHTTP != ""
+	if c.Edge && (edgeQrpc == "" || edgeHTTP == "") || edge != "" && !c.Edge {
+		fatalf("an edge needs both -edge-qrpc and -edge-http")
+	}
+	viewQrpc, viewHTTP := qrpcAddr, httpAddr
+	if c.Edge {
+		viewQrpc, viewHTTP = edgeQrpc, edgeHTTP
+	}
+
+	path := c.Clip
+	if path == "" {
+		if err := os.MkdirAll(cacheDir, 0755); err != nil {
+			fatalf("%v", err)
+		}
+		var err error
+		path, err = generateClip(clipConfig{ffmpeg: ffmpeg, width: c.Width, height: c.Height, fps: c.FPS, seconds: clipSeconds, bitrate: c.Bitrate}, cacheDir)
+		if err != nil {
+			fatalf("generate clip: %v", err)
+		}
+	}
+	clip, err := loadClip(path)
+	if err != nil {
+		fatalf("%v", err)
+	}
+
+	var srv, edgeSrv *exec.Cmd
+	if server != "" {
+		srv = startServer("server", server, qrpcAddr)
+		pid = srv.Process.Pid
+	}
+	if edge != "" {
+		// what viewers load
+		edgeSrv = startServer("edge", edge, edgeQrpc)
+		pid = edgeSrv.Process.Pid
+	}
+
+	report := run(c, clip, qrpcAddr, viewQrpc, viewHTTP, pid, duration, warmup, snapshotEvery)
+	for _, cmd := range []*exec.Cmd{edgeSrv, srv} {
+		if cmd != nil {
+			cmd.Process.Kill()
+			cmd.Wait()
+		}
+	}
+	report.print()
+
+	if jsonOut != "" {
+		data, _ := json.MarshalIndent(report, "", "  ")
+		if err := ioutil.WriteFile(jsonOut, append(data, '\n'), 0644); err != nil {
+			fatalf("%v", err)
+		}
+	}
+	if baselinePath != "" {
+		data, err := ioutil.ReadFile(baselinePath)
+		if err != nil {
+			fatalf("%v", err)
+		}
+		var baseline Report
+		if err := json.Unmarshal(data, &baseline); err != nil {
+			fatalf("%s: %v", baselinePath, err)
+		}
+		if found := report.regressions(&baseline, tolerance); len(found) > 0 {
+			fmt.Println("regressions against", baselinePath)
+			for _, r := range found {
+				fmt.Println("  " + r)
+			}
+			os.Exit(1)
+		}
+		fmt.Println("no regressions against", baselinePath)
+	}
+	if c.Edge {
+		if kinds := report.starved(); len(kinds) > 0 {
+			fmt.Println("no frames through the edge for", strings.Join(kinds, ", "), "viewers")
+			os.Exit(1)
+		}
+		fmt.Println("frames through the edge for all viewers")
+	}
+}
+
+// startServer runs command and waits for it to listen on addr, exits on failure
+func startServer(name, command, addr string) *exec.Cmd {
+	args := strings.Fields(command)
+	cmd := exec.Command(args[0], args[1:]...)
+	cmd.Stdout, cmd.Stderr = ioutil.Discard, os.Stderr
+	if err := cmd.Start(); err != nil {
+		fatalf("start %s: %v", name, err)
+	}
+	if err := waitListening(addr, 10*time.Second); err != nil {
+		cmd.Process.Kill()
+		fatalf("%s: %v", name, err)
+	}
+	return cmd
+}
+
+// run publishes to qrpcAddr, viewers play from viewQrpc and viewHTTP, which are an edge's with -edge
+func run(c Config, clip []accessUnit, qrpcAddr, viewQrpc, viewHTTP string, pid int, duration, warmup, snapshotEvery time.Duration) *Report {
+	ctx, cancel := context.WithCancel(context.Background())
+	var wg sync.WaitGroup
+
+	publishers := make([]*publisher, c.Publishers)
+	for i := range publishers {
+		p := &publisher{addr: qrpcAddr, id: fmt.Sprintf("avbench-p%d", i), clip: clip, fps: c.FPS}
+		publishers[i] = p
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			if err := p.run(ctx); err != nil {
+				fmt.Fprintln(os.Stderr, err)
+			}
+		}()
+	}
+	time.Sleep(settleDelay)
+
+	counts := map[string]int{viewerQrpc: c.QrpcViewers, viewerWS: c.WSViewers, viewerSnapshot: c.SnapshotViewers}
+	stats := make(map[string]*viewerStats)
+	total := 0
+	// round robin over publishers and kinds, so a partial start still loads all of them evenly
+	for i := 0; ; i++ {
+		started := false
+		for _, kind := range viewerKinds {
+			if stats[kind] == nil {
+				stats[kind] = &viewerStats{}
+			}
+			if i >= counts[kind] {
+				continue
+			}
+			started = true
+			for _, p := range publishers {
+				v := &viewer{kind: kind, id: fmt.Sprintf("avbench-v%d-%s%d", total, kind, i), who: p.id,
+					qrpc: viewQrpc, http: viewHTTP, every: snapshotEvery, stats: stats[kind]}
+				total++
+				wg.Add(1)
+				go func() {
+					defer wg.Done()
+					v.run(ctx)
+				}()
+				if c.Reproducible {
+					time.Sleep(staggerDelay)
+				}
+			}
+		}
+		if !started {
+			break
+		}
+	}
+
+	time.Sleep(warmup)
+	var proc *process
+	done := make(chan struct{})
+	if pid > 0 {
+		proc = newProcess(pid)
+		if err := proc.start(); err != nil {
+			fmt.Fprintln(os.Stderr, err)
+			proc = nil
+		} else {
+			go proc.sample(done)
+		}
+	}
+	framesStart := int64(0)
+	for _, p := range publishers {
+		framesStart += atomic.LoadInt64(&p.frames)
+	}
+	start := time.Now()
+	atomic.StoreInt32(&recording, 1)
+
+	time.Sleep(duration)
+
+	atomic.StoreInt32(&recording, 0)
+	window := time.Since(start)
+	frames := -framesStart
+	for _, p := range publishers {
+		frames += atomic.LoadInt64(&p.frames)
+	}
+	report := &Report{
+		Config:     c,
+		WindowSec:  window.Seconds(),
+		Publishers: c.Publishers,
+		// as sent, a server that can't keep up slows the publishers down through backpressure
+		IngestFPS: float64(frames) / window.Seconds() / float64(c.Publishers),
+		Viewers:   make(map[string]ViewerReport),
+	}
+	for _, kind := range viewerKinds {
+		report.Viewers[kind] = stats[kind].report(counts[kind]*c.Publishers, window)
+		if err := stats[kind].lastError(); err != nil {
+			fmt.Fprintln(os.Stderr, "last error:", err)
+		}
+	}
+	if proc != nil {
+		close(done)
+		if usage, err := proc.usage(); err == nil {
+			report.CPUPercent = usage
+			if total > 0 {
+				report.CPUPerViewerPercent = usage / float64(total)
+			}
+		}
+		report.MaxRSSMB = float64(atomic.LoadInt64(&proc.maxRSS)) / 1024
+	}
+
+	cancel()
+	wg.Wait()
+	return report
+}
+
+func waitListening(addr string, timeout time.Duration) error {
+	deadline := time.Now().Add(timeout)
+	for {
+		conn, err := net.DialTimeout("tcp", addr, time.Second)
+		if err == nil {
+			conn.Close()
+			return nil
+		}
+		if time.Now().After(deadline) {
+			return err
+		}
+		time.Sleep(100 * time.Millisecond)
+	}
+}
+
+func fatalf(format string, args ...interface{}) {
+	fmt.Fprintf(os.Stderr, "avbench: "+format+"\n", args...)
+	os.Exit(1)
+}
@@ -0,0 +1,119 @@
+package main
+
+import (
+	"context"
+	"encoding/json"
+	"fmt"
+	"sync/atomic"
+	"time"
+
+	"github.com/zhiqiangxu/qrpc"
+)
+
+// cmds of the server, see cmd/cmd.go, which isn't imported so the harness doesn't link ffmpeg
+const (
+	cmdAuth qrpc.Cmd = 1
+	cmdPlay qrpc.Cmd = 3
+)
+
+// publisher pushes the clip over qrpc in real time, looping it, every frame
+// stamped with its sequence number and the wall clock it was sent at
+type publisher struct {
+	addr string
+	id   string
+	clip []accessUnit
+	fps  int
+
+	// atomic
+	frames int64
+	bytes  int64
+}
+
+// dial a qrpc connection and authenticate it as id
+func dial(addr, id string) (*qrpc.Connection, error) {
+	conn, err := qrpc.NewConnection(addr, qrpc.ConnectionConfig{DialTimeout: 5 * time.Second, WriteTimeout: 10}, nil)
+	if err != nil {
+		return nil, err
+	}
+	payload, _ := json.Marshal(map[string]string{"id": id, "pass": "avbench"})
+	_, resp, err := conn.Request(cmdAuth, 0, payload)
+	if err == nil {
+		err = expectOK(resp)
+	}
+	if err != nil {
+		conn.Close()
+		return nil, fmt.Errorf("auth %s: %v", id, err)
+	}
+	return conn, nil
+}
+
+func expectOK(resp qrpc.Response) error {
+	_, err := expectOKFrame(resp)
+	return err
+}
+
+func expectOKFrame(resp qrpc.Response) (*qrpc.Frame, error) {
+	ctx, cancel := context.WithTimeout(context.Background(), 10*time.Second)
+	defer cancel()
+	frame, err := resp.GetFrameWithContext(ctx)
+	if err != nil {
+		return nil, err
+	}
+	if string(frame.Payload) != "OK" {
+		return nil, fmt.Errorf("refused: %q", frame.Payload)
+	}
+	return frame, nil
+}
+
+// run until ctx is done
+func (p *publisher) run(ctx context.Context) error {
+	conn, err := dial(p.addr, p.id)
+	if err != nil {
+		return err
+	}
+	defer conn.Close()
+
+	payload, _ := json.Marshal(map[string]int{"publish": 1})
+	sw, resp, err := conn.StreamRequest(cmdPlay, 0, payload)
+	if err == nil {
+		err = expectOK(resp)
+	}
+	if err != nil {
+		return fmt.Errorf("publish %s: %v", p.id, err)
+	}
+
+	mux := newTSMuxer()
+	interval := time.Second / time.Duration(p.fps)
+	start := time.Now()
+	var au []byte
+	for n := 0; ; n++ {
+		// an absolute schedule, so a late frame doesn't delay the ones after it
+		if wait := time.Until(start.Add(time.Duration(n) * interval)); wait > 0 {
+			select {
+			case <-ctx.Done():
+				sw.StartWrite(cmdPlay)
+				return sw.EndWrite(true)
+			case <-time.After(wait):
+			}
+		} else if ctx.Err() != nil {
+			sw.StartWrite(cmdPlay)
+			return sw.EndWrite(true)
+		}
+
+		src := &p.clip[n%len(p.clip)]
+		au = append(au[:0], src.data[:src.audLen]...)
+		au = appendTimestampSEI(au, uint64(n), time.Now().UnixNano())
+		au = append(au, src.data[src.audLen:]...)
+		// start past pcrDelay so pcr is never negative
+		pts := 2*90000 + int64(n)*90000/int64(p.fps)
+		ts := mux.mux(au, pts, src.keyframe)
+
+		sw.StartWrite(cmdPlay)
+		sw.WriteBytes(ts)
+		if err := sw.EndWrite(false); err != nil {
+			return fmt.Errorf("publish %s: %v", p.id, err)
+		}
+		atomic.AddInt64(&p.frames, 1)
+		atomic.AddInt64(&p.bytes, int64(len(ts)))
+	}
+}
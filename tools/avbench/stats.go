@@ -0,0 +1,263 @@
+package main
+
+import (
+	"bufio"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// recording is set once the warmup is over, samples before are discarded, atomic
+var recording int32
+
+func isRecording() bool {
+	return atomic.LoadInt32(&recording) != 0
+}
+
+// viewerStats are shared by the viewers of a kind
+type viewerStats struct {
+	sync.Mutex
+	latencies []time.Duration
+	frames    int64
+	drops     int64
+	errors    int64
+	lastErr   error
+}
+
+func (s *viewerStats) snapshot(latency time.Duration) {
+	if !isRecording() {
+		return
+	}
+	s.Lock()
+	s.frames++
+	s.latencies = append(s.latencies, latency)
+	s.Unlock()
+}
+
+func (s *viewerStats) error(err error) {
+	s.Lock()
+	s.lastErr = err
+	if isRecording() {
+		s.errors++
+	}
+	s.Unlock()
+}
+
+func (s *viewerStats) lastError() error {
+	s.Lock()
+	defer s.Unlock()
+	return s.lastErr
+}
+
+// frame returns the callback of a demuxer, counting gaps in the sequence numbers it sees as drops
+func (s *viewerStats) frame() func(seq uint64, nanos int64) {
+	next := int64(-1)
+	return func(seq uint64, nanos int64) {
+		latency := time.Duration(time.Now().UnixNano() - nanos)
+		gap := int64(0)
+		if next >= 0 && int64(seq) > next {
+			gap = int64(seq) - next
+		}
+		next = int64(seq) + 1
+		if !isRecording() {
+			return
+		}
+		s.Lock()
+		s.frames++
+		s.drops += gap
+		s.latencies = append(s.latencies, latency)
+		s.Unlock()
+	}
+}
+
+// process is sampled through /proc, linux only
+type process struct {
+	pid int
+	// clock ticks, see sysconf(_SC_CLK_TCK), 100 on every linux the harness runs on
+	hz float64
+
+	cpuStart  float64
+	timeStart time.Time
+	maxRSS    int64 // kB, atomic
+}
+
+func newProcess(pid int) *process {
+	return &process{pid: pid, hz: 100}
+}
+
+// cpu seconds used so far, utime + stime
+func (p *process) cpu() (float64, error) {
+	data, err := ioutil.ReadFile(fmt.Sprintf("/proc/%d/stat", p.pid))
+	if err != nil {
+		return 0, err
+	}
+	// comm may contain spaces, fields are counted from its closing paren
+	s := string(data)
+	fields := strings.Fields(s[strings.LastIndexByte(s, ')')+1:])
+	if len(fields) < 13 {
+		return 0, fmt.Errorf("/proc/%d/stat: too short", p.pid)
+	}
+	utime, _ := strconv.ParseFloat(fields[11], 64)
+	stime, _ := strconv.ParseFloat(fields[12], 64)
+	return (utime + stime) / p.hz, nil
+}
+
+// rss in kB
+func (p *process) rss() (int64, error) {
+	f, err := os.Open(fmt.Sprintf("/proc/%d/status", p.pid))
+	if err != nil {
+		return 0, err
+	}
+	defer f.Close()
+	scanner := bufio.NewScanner(f)
+	for scanner.Scan() {
+		if fields := strings.Fields(scanner.Text()); len(fields) >= 2 && fields[0] == "VmRSS:" {
+			return strconv.ParseInt(fields[1], 10, 64)
+		}
+	}
+	return 0, fmt.Errorf("/proc/%d/status: no VmRSS", p.pid)
+}
+
+func (p *process) start() error {
+	cpu, err := p.cpu()
+	p.cpuStart, p.timeStart = cpu, time.Now()
+	return err
+}
+
+// sample rss until done
+func (p *process) sample(done <-chan struct{}) {
+	ticker := time.NewTicker(200 * time.Millisecond)
+	defer ticker.Stop()
+	for {
+		if rss, err := p.rss(); err == nil && rss > atomic.LoadInt64(&p.maxRSS) {
+			atomic.StoreInt64(&p.maxRSS, rss)
+		}
+		select {
+		case <-done:
+			return
+		case <-ticker.C:
+		}
+	}
+}
+
+// usage since start, in percent of a core
+func (p *process) usage() (float64, error) {
+	cpu, err := p.cpu()
+	if err != nil {
+		return 0, err
+	}
+	return 100 * (cpu - p.cpuStart) / time.Since(p.timeStart).Seconds(), nil
+}
+
+// percentile of sorted latencies, in ms
+func percentile(sorted []time.Duration, q float64) float64 {
+	if len(sorted) == 0 {
+		return 0
+	}
+	i := int(q * float64(len(sorted)-1))
+	return float64(sorted[i]) / float64(time.Millisecond)
+}
+
+// ViewerReport of the viewers of a kind
+type ViewerReport struct {
+	Viewers int     `json:"viewers"`
+	FPS     float64 `json:"fps"` // per viewer, snapshots per second for snapshot viewers
+	P50Ms   float64 `json:"p50_ms"`
+	P95Ms   float64 `json:"p95_ms"`
+	P99Ms   float64 `json:"p99_ms"`
+	MaxMs   float64 `json:"max_ms"`
+	Drops   int64   `json:"drops"`
+	Errors  int64   `json:"errors"`
+}
+
+func (s *viewerStats) report(viewers int, window time.Duration) ViewerReport {
+	s.Lock()
+	defer s.Unlock()
+	sorted := append([]time.Duration(nil), s.latencies...)
+	sort.Slice(sorted, func(i, j int) bool { return sorted[i] < sorted[j] })
+	r := ViewerReport{Viewers: viewers, P50Ms: percentile(sorted, 0.5), P95Ms: percentile(sorted, 0.95),
+		P99Ms: percentile(sorted, 0.99), MaxMs: percentile(sorted, 1), Drops: s.drops, Errors: s.errors}
+	if viewers > 0 {
+		r.FPS = float64(s.frames) / window.Seconds() / float64(viewers)
+	}
+	return r
+}
+
+// Report of a run, what -json writes and -baseline reads
+type Report struct {
+	Config     Config                  `json:"config"`
+	WindowSec  float64                 `json:"window_sec"`
+	Publishers int                     `json:"publishers"`
+	IngestFPS  float64                 `json:"ingest_fps"` // per publisher
+	Viewers    map[string]ViewerReport `json:"viewers"`
+	// of the server, 0 without -pid or -server
+	CPUPercent          float64 `json:"cpu_percent"`
+	CPUPerViewerPercent float64 `json:"cpu_per_viewer_percent"`
+	MaxRSSMB            float64 `json:"max_rss_mb"`
+}
+
+func (r *Report) print() {
+	fmt.Printf("window %.1fs, %d publishers at %.2f fps\n", r.WindowSec, r.Publishers, r.IngestFPS)
+	for _, kind := range viewerKinds {
+		v, ok := r.Viewers[kind]
+		if !ok || v.Viewers == 0 {
+			continue
+		}
+		fmt.Printf("%-8s %4d viewers %6.2f fps  latency p50 %7.1fms p95 %7.1fms p99 %7.1fms max %7.1fms  drops %d errors %d\n",
+			kind, v.Viewers, v.FPS, v.P50Ms, v.P95Ms, v.P99Ms, v.MaxMs, v.Drops, v.Errors)
+	}
+	if r.MaxRSSMB > 0 {
+		fmt.Printf("server cpu %.1f%%, %.2f%% per viewer, max rss %.1fMB\n", r.CPUPercent, r.CPUPerViewerPercent, r.MaxRSSMB)
+	}
+}
+
+// starved kinds of viewers, which had viewers but got no frames
+func (r *Report) starved() []string {
+	var kinds []string
+	for _, kind := range viewerKinds {
+		if v := r.Viewers[kind]; v.Viewers > 0 && v.FPS == 0 {
+			kinds = append(kinds, kind)
+		}
+	}
+	return kinds
+}
+
+// regressions of r against baseline, tolerance is relative, latencies also get an
+// absolute slack of a frame interval so a fast baseline doesn't fail on jitter
+func (r *Report) regressions(baseline *Report, tolerance float64) []string {
+	var found []string
+	worse := func(what string, got, base, slack float64) {
+		if got > base*(1+tolerance)+slack {
+			found = append(found, fmt.Sprintf("%s: %.2f, baseline %.2f", what, got, base))
+		}
+	}
+
+	if r.IngestFPS < baseline.IngestFPS*(1-tolerance) {
+		found = append(found, fmt.Sprintf("ingest fps: %.2f, baseline %.2f", r.IngestFPS, baseline.IngestFPS))
+	}
+	frameMs := 1000 / float64(r.Config.FPS)
+	for _, kind := range viewerKinds {
+		v, base := r.Viewers[kind], baseline.Viewers[kind]
+		if v.Viewers == 0 || base.Viewers == 0 {
+			continue
+		}
+		if v.FPS < base.FPS*(1-tolerance) {
+			found = append(found, fmt.Sprintf("%s fps: %.2f, baseline %.2f", kind, v.FPS, base.FPS))
+		}
+		worse(kind+" p50 ms", v.P50Ms, base.P50Ms, frameMs)
+		worse(kind+" p99 ms", v.P99Ms, base.P99Ms, frameMs)
+		worse(kind+" drops", float64(v.Drops), float64(base.Drops), 0)
+		worse(kind+" errors", float64(v.Errors), float64(base.Errors), 0)
+	}
+	if baseline.MaxRSSMB > 0 && r.MaxRSSMB > 0 {
+		worse("cpu per viewer %", r.CPUPerViewerPercent, baseline.CPUPerViewerPercent, 0)
+		worse("max rss MB", r.MaxRSSMB, baseline.MaxRSSMB, 0)
+	}
+	return found
+}
@@ -0,0 +1,149 @@
+package main
+
+// tsDemuxer finds the timestamp SEI of every video frame in an mpegts byte stream,
+// whatever the server's muxer chose for PIDs and packetization
+type tsDemuxer struct {
+	// partial ts packet left over from the last write
+	partial  []byte
+	pmtPID   int
+	videoPID int
+	pes      []byte
+	// the timestamp SEI of pes was found
+	found bool
+	// called for every timestamp SEI found
+	onFrame func(seq uint64, nanos int64)
+}
+
+// how far into a frame the timestamp SEI is looked for before it is complete,
+// transcoded renditions don't carry it
+const seiSearchLimit = 2048
+
+func newTSDemuxer(onFrame func(seq uint64, nanos int64)) *tsDemuxer {
+	return &tsDemuxer{pmtPID: -1, videoPID: -1, onFrame: onFrame}
+}
+
+// Write implements io.Writer
+func (d *tsDemuxer) Write(b []byte) (int, error) {
+	n := len(b)
+	if len(d.partial) > 0 {
+		need := tsPacketSize - len(d.partial)
+		if len(b) < need {
+			d.partial = append(d.partial, b...)
+			return n, nil
+		}
+		d.partial = append(d.partial, b[:need]...)
+		d.packet(d.partial)
+		d.partial = d.partial[:0]
+		b = b[need:]
+	}
+	for len(b) >= tsPacketSize {
+		if b[0] != 0x47 {
+			// lost sync, look for the next packet
+			b = b[1:]
+			continue
+		}
+		d.packet(b[:tsPacketSize])
+		b = b[tsPacketSize:]
+	}
+	d.partial = append(d.partial, b...)
+	return n, nil
+}
+
+func (d *tsDemuxer) packet(pkt []byte) {
+	if pkt[0] != 0x47 {
+		return
+	}
+	pusi := pkt[1]&0x40 != 0
+	pid := int(pkt[1]&0x1f)<<8 | int(pkt[2])
+	p := 4
+	if pkt[3]&0x20 != 0 {
+		p += 1 + int(pkt[4])
+	}
+	if pkt[3]&0x10 == 0 || p >= tsPacketSize {
+		return
+	}
+	payload := pkt[p:]
+
+	switch {
+	case pid == patPID && pusi:
+		d.parsePAT(payload)
+	case pid == d.pmtPID && pusi:
+		d.parsePMT(payload)
+	case pid == d.videoPID:
+		if pusi {
+			d.flushPES()
+		}
+		d.pes = append(d.pes, payload...)
+		// the SEI leads the frame, it needn't wait for the next one to start
+		if !d.found && len(d.pes) <= seiSearchLimit {
+			d.parsePES(false)
+		}
+	}
+}
+
+// section of payload that starts one, nil if it is cut short
+func section(payload []byte) []byte {
+	p := 1 + int(payload[0])
+	if p+3 > len(payload) {
+		return nil
+	}
+	s := payload[p:]
+	n := 3 + (int(s[1]&0x0f)<<8 | int(s[2]))
+	if n > len(s) || n < 12 {
+		return nil
+	}
+	return s[:n-4]
+}
+
+func (d *tsDemuxer) parsePAT(payload []byte) {
+	s := section(payload)
+	if s == nil || s[0] != 0 {
+		return
+	}
+	for p := 8; p+4 <= len(s); p += 4 {
+		if program := int(s[p])<<8 | int(s[p+1]); program != 0 {
+			d.pmtPID = int(s[p+2]&0x1f)<<8 | int(s[p+3])
+			return
+		}
+	}
+}
+
+func (d *tsDemuxer) parsePMT(payload []byte) {
+	s := section(payload)
+	if s == nil || s[0] != 2 {
+		return
+	}
+	p := 12 + (int(s[10]&0x0f)<<8 | int(s[11]))
+	for p+5 <= len(s) {
+		streamType := s[p]
+		pid := int(s[p+1]&0x1f)<<8 | int(s[p+2])
+		if streamType == 0x1b {
+			d.videoPID = pid
+			return
+		}
+		p += 5 + (int(s[p+3]&0x0f)<<8 | int(s[p+4]))
+	}
+}
+
+func (d *tsDemuxer) flushPES() {
+	if !d.found {
+		d.parsePES(true)
+	}
+	d.pes = d.pes[:0]
+	d.found = false
+}
+
+func (d *tsDemuxer) parsePES(complete bool) {
+	pes := d.pes
+	if len(pes) < 9 || pes[0] != 0 || pes[1] != 0 || pes[2] != 1 {
+		return
+	}
+	p := 9 + int(pes[8])
+	if p >= len(pes) {
+		return
+	}
+	if seq, nanos, ok := parseTimestampSEI(pes[p:], complete); ok {
+		d.found = true
+		d.onFrame(seq, nanos)
+	}
+}
@@ -0,0 +1,254 @@
+package main
+
+import (
+	"encoding/binary"
+)
+
+// the timestamp SEI, a user_data_unregistered SEI message carrying the
+// frame's sequence number and the wall clock it was published at
+var seiUUID = [16]byte{'a', 'v', 'b', 'e', 'n', 'c', 'h', '-', 't', 'i', 'm', 'e', 's', 't', 'a', 'm'}
+
+const (
+	seiUserDataUnregistered = 5
+	seiPayloadSize          = 16 + 8 + 8
+)
+
+// appendTimestampSEI as a NAL unit, with emulation prevention
+func appendTimestampSEI(b []byte, seq uint64, nanos int64) []byte {
+	var payload [seiPayloadSize]byte
+	copy(payload[:], seiUUID[:])
+	binary.BigEndian.PutUint64(payload[16:], seq)
+	binary.BigEndian.PutUint64(payload[24:], uint64(nanos))
+
+	rbsp := make([]byte, 0, 3+seiPayloadSize)
+	rbsp = append(rbsp, seiUserDataUnregistered, seiPayloadSize)
+	rbsp = append(rbsp, payload[:]...)
+	rbsp = append(rbsp, 0x80) // rbsp_trailing_bits
+
+	b = append(b, 0, 0, 0, 1, nalSEI)
+	zeros := 0
+	for _, c := range rbsp {
+		if zeros == 2 && c <= 3 {
+			b = append(b, 3)
+			zeros = 0
+		}
+		b = append(b, c)
+		if c == 0 {
+			zeros++
+		} else {
+			zeros = 0
+		}
+	}
+	return b
+}
+
+// parseTimestampSEI finds the timestamp SEI in the NAL units of an access unit,
+// the last NAL unit is skipped unless complete as more of it may follow
+func parseTimestampSEI(au []byte, complete bool) (seq uint64, nanos int64, ok bool) {
+	forEachNAL(au, func(start, end int) {
+		if ok || (end == len(au) && !complete) {
+			return
+		}
+		nal := au[start:end]
+		h := nalHeaderOffset(nal)
+		if len(nal) <= h || nal[h]&0x1f != nalSEI {
+			return
+		}
+		rbsp := unescapeRBSP(nal[h+1:])
+		// a single message, both the type and the size fit in a byte
+		if len(rbsp) < 2+seiPayloadSize || rbsp[0] != seiUserDataUnregistered || rbsp[1] != seiPayloadSize {
+			return
+		}
+		payload := rbsp[2:]
+		var uuid [16]byte
+		copy(uuid[:], payload)
+		if uuid != seiUUID {
+			return
+		}
+		seq = binary.BigEndian.Uint64(payload[16:])
+		nanos = int64(binary.BigEndian.Uint64(payload[24:]))
+		ok = true
+	})
+	return
+}
+
+func unescapeRBSP(b []byte) []byte {
+	out := make([]byte, 0, len(b))
+	zeros := 0
+	for _, c := range b {
+		if zeros == 2 && c == 3 {
+			zeros = 0
+			continue
+		}
+		out = append(out, c)
+		if c == 0 {
+			zeros++
+		} else {
+			zeros = 0
+		}
+	}
+	return out
+}
+
+const (
+	tsPacketSize = 188
+	patPID       = 0
+	pmtPID       = 0x1000
+	videoPID     = 0x100
+	// pcr runs this far ahead of pts, like ffmpeg's default muxdelay
+	pcrDelay = 90000 * 7 / 10
+)
+
+// tsMuxer writes a single H.264 stream as mpegts, one access unit at a time
+type tsMuxer struct {
+	cc  map[uint16]byte
+	buf []byte
+}
+
+func newTSMuxer() *tsMuxer {
+	return &tsMuxer{cc: make(map[uint16]byte)}
+}
+
+// mux an access unit with pts in 90kHz, the returned slice is reused by the next call
+func (m *tsMuxer) mux(au []byte, pts int64, keyframe bool) []byte {
+	m.buf = m.buf[:0]
+	if keyframe {
+		// tables before every keyframe, so viewers can start there
+		m.writeSection(patPID, m.pat())
+		m.writeSection(pmtPID, m.pmt())
+	}
+
+	pes := make([]byte, 0, 14+len(au))
+	pes = append(pes, 0, 0, 1, 0xe0, 0, 0, 0x80, 0x80, 5)
+	pes = appendTimestamp(pes, 2, pts)
+	pes = append(pes, au...)
+	m.writePackets(videoPID, pes, pts-pcrDelay, keyframe)
+	return m.buf
+}
+
+func appendTimestamp(b []byte, marker byte, ts int64) []byte {
+	return append(b,
+		marker<<4|byte(ts>>29)&0x0e|1,
+		byte(ts>>22),
+		byte(ts>>14)|1,
+		byte(ts>>7),
+		byte(ts<<1)|1)
+}
+
+func (m *tsMuxer) pat() []byte {
+	s := []byte{0, 0xb0, 0, 0, 1, 0xc1, 0, 0, 0, 1, 0xe0 | pmtPID>>8, pmtPID & 0xff}
+	return finishSection(s)
+}
+
+func (m *tsMuxer) pmt() []byte {
+	s := []byte{2, 0xb0, 0, 0, 1, 0xc1, 0, 0,
+		0xe0 | videoPID>>8, videoPID & 0xff, // PCR PID
+		0xf0, 0,
+		0x1b, 0xe0 | videoPID>>8, videoPID & 0xff, 0xf0, 0}
+	return finishSection(s)
+}
+
+// finishSection fills in section_length and appends the CRC
+func finishSection(s []byte) []byte {
+	n := len(s) - 3 + 4
+	s[1] |= byte(n >> 8)
+	s[2] = byte(n)
+	crc := crc32MPEG2(s)
+	return append(s, byte(crc>>24), byte(crc>>16), byte(crc>>8), byte(crc))
+}
+
+func (m *tsMuxer) writeSection(pid uint16, section []byte) {
+	// pointer_field, then stuffing
+	payload := append([]byte{0}, section...)
+	m.writePackets(pid, payload, -1, false)
+}
+
+// writePackets splits payload into ts packets, the first one starting the unit and carrying pcr if >= 0,
+// sections are stuffed with 0xff and PES with an adaptation field
+func (m *tsMuxer) writePackets(pid uint16, payload []byte, pcr int64, keyframe bool) {
+	first := true
+	for first || len(payload) > 0 {
+		var pkt [tsPacketSize]byte
+		pkt[0] = 0x47
+		pkt[1] = byte(pid >> 8)
+		if first {
+			pkt[1] |= 0x40
+		}
+		pkt[2] = byte(pid)
+		cc := m.cc[pid]
+		m.cc[pid] = (cc + 1) & 0xf
+
+		var af []byte
+		if first && pcr >= 0 {
+			flags := byte(0x10)
+			if keyframe {
+				flags |= 0x40 // random_access_indicator
+			}
+			af = []byte{flags, byte(pcr >> 25), byte(pcr >> 17), byte(pcr >> 9), byte(pcr >> 1), byte(pcr<<7) | 0x7e, 0}
+		}
+		room := tsPacketSize - 4
+		if af != nil {
+			room -= 1 + len(af)
+		}
+		n := len(payload)
+		section := pid == patPID || pid == pmtPID
+		if n < room && !section {
+			// stuff the adaptation field so the payload ends the packet
+			if af == nil {
+				af = []byte{}
+				room--
+				if room > n {
+					af = append(af, 0)
+					room--
+				}
+			}
+			for room > n {
+				af = append(af, 0xff)
+				room--
+			}
+		}
+		if n > room {
+			n = room
+		}
+
+		p := 4
+		if af != nil {
+			pkt[3] = 0x30 | cc
+			pkt[4] = byte(len(af))
+			copy(pkt[5:], af)
+			p = 5 + len(af)
+		} else {
+			pkt[3] = 0x10 | cc
+		}
+		copy(pkt[p:], payload[:n])
+		for i := p + n; i < tsPacketSize; i++ {
+			pkt[i] = 0xff
+		}
+		payload = payload[n:]
+		m.buf = append(m.buf, pkt[:]...)
+		first = false
+	}
+}
+
+var crcTable = func() (t [256]uint32) {
+	for i := range t {
+		c := uint32(i) << 24
+		for j := 0; j < 8; j++ {
+			if c&0x80000000 != 0 {
+				c = c<<1 ^ 0x04c11db7
+			} else {
+				c <<= 1
+			}
+		}
+		t[i] = c
+	}
+	return
+}()
+
+func crc32MPEG2(b []byte) uint32 {
+	crc := uint32(0xffffffff)
+	for _, c := range b {
+		crc = crc<<8 ^ crcTable[byte(crc>>24)^c]
+	}
+	return crc
+}
@@ -0,0 +1,153 @@
+package main
+
+import (
+	"context"
+	"encoding/json"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"net/http"
+	"net/url"
+	"time"
+
+	"github.com/gorilla/websocket"
+)
+
+// kinds of viewers
+const (
+	viewerQrpc     = "qrpc"
+	viewerWS       = "ws"
+	viewerSnapshot = "snapshot"
+)
+
+var viewerKinds = []string{viewerQrpc, viewerWS, viewerSnapshot}
+
+// viewer plays one published stream until ctx is done, reconnecting after errors
+type viewer struct {
+	kind  string
+	id    string // its own auth id, for qrpc
+	who   string // the publisher it plays
+	qrpc  string
+	http  string
+	every time.Duration // snapshot interval
+	stats *viewerStats
+}
+
+func (v *viewer) run(ctx context.Context) {
+	for ctx.Err() == nil {
+		var err error
+		switch v.kind {
+		case viewerQrpc:
+			err = v.playQrpc(ctx)
+		case viewerWS:
+			err = v.playWS(ctx)
+		case viewerSnapshot:
+			err = v.poll(ctx)
+		}
+		if ctx.Err() != nil {
+			return
+		}
+		v.stats.error(fmt.Errorf("%s viewer of %s: %v", v.kind, v.who, err))
+		select {
+		case <-ctx.Done():
+		case <-time.After(time.Second):
+		}
+	}
+}
+
+func (v *viewer) playQrpc(ctx context.Context) error {
+	conn, err := dial(v.qrpc, v.id)
+	if err != nil {
+		return err
+	}
+	defer conn.Close()
+
+	payload, _ := json.Marshal(map[string]string{"uri": "/" + v.who})
+	_, resp, err := conn.StreamRequest(cmdPlay, 0, payload)
+	if err != nil {
+		return err
+	}
+	frame, err := expectOKFrame(resp)
+	if err != nil {
+		return err
+	}
+	if frame.Stream == nil {
+		return fmt.Errorf("response isn't streamed")
+	}
+
+	demux := newTSDemuxer(v.stats.frame())
+	for {
+		select {
+		case <-ctx.Done():
+			return nil
+		case f, ok := <-frame.FrameCh():
+			if !ok {
+				return io.ErrUnexpectedEOF
+			}
+			demux.Write(f.Payload)
+		}
+	}
+}
+
+func (v *viewer) playWS(ctx context.Context) error {
+	u := url.URL{Scheme: "ws", Host: v.http, Path: "/watch_mpegts", RawQuery: url.Values{"who": {v.who}}.Encode()}
+	c, _, err := websocket.DefaultDialer.Dial(u.String(), nil)
+	if err != nil {
+		return err
+	}
+	stop := make(chan struct{})
+	defer close(stop)
+	go func() {
+		// unblocks ReadMessage
+		select {
+		case <-ctx.Done():
+		case <-stop:
+		}
+		c.Close()
+	}()
+
+	demux := newTSDemuxer(v.stats.frame())
+	for {
+		_, data, err := c.ReadMessage()
+		if err != nil {
+			if ctx.Err() != nil {
+				return nil
+			}
+			return err
+		}
+		demux.Write(data)
+	}
+}
+
+// poll snapshots every interval, the latency of a snapshot is its response time
+// since the jpeg carries no timestamp
+func (v *viewer) poll(ctx context.Context) error {
+	u := url.URL{Scheme: "http", Host: v.http, Path: "/watch", RawQuery: url.Values{"who": {v.who}}.Encode()}
+	client := &http.Client{Timeout: 10 * time.Second}
+	ticker := time.NewTicker(v.every)
+	defer ticker.Stop()
+	for {
+		start := time.Now()
+		resp, err := client.Get(u.String())
+		if err != nil {
+			return err
+		}
+		_, err = io.Copy(ioutil.Discard, resp.Body)
+		resp.Body.Close()
+		if err != nil {
+			return err
+		}
+		// errors are reported as text with a 200
+		if ct := resp.Header.Get("Content-Type"); resp.StatusCode != http.StatusOK || ct != "image/jpeg" {
+			v.stats.error(fmt.Errorf("snapshot of %s: %s %q", v.who, resp.Status, ct))
+		} else {
+			v.stats.snapshot(time.Since(start))
+		}
+
+		select {
+		case <-ctx.Done():
+			return nil
+		case <-ticker.C:
+		}
+	}
+}